@@ -11,6 +11,7 @@
 
 #include "dyn_array.h"
 #include "block_store.h"
+#include "consts.h"
 
 // components of FS
 typedef struct inode inode_t;
@@ -27,8 +28,58 @@ typedef enum { FS_SEEK_SET, FS_SEEK_CUR, FS_SEEK_END } seek_t;
 
 typedef enum { FS_REGULAR, FS_DIRECTORY } file_t;
 
+// Options for fs_format_opts/fs_mount_opts, OR them together
+typedef enum {
+    FS_OPT_NONE     = 0,
+    // Batch multi-block fs_read/fs_write transfers through io_uring
+    //   (or a thread pool where io_uring is unavailable)
+    FS_OPT_ASYNC_IO = 1 << 0,
+    // Back the volume mapping with huge pages where available to cut TLB
+    //   misses on random access, falls back to normal pages otherwise
+    FS_OPT_HUGEPAGES = 1 << 1,
+    // Run fs_check (with repair) on the image before mounting it
+    FS_OPT_CHECK = 1 << 2,
+    // Verify every block read against its CRC32C, reads of corrupt blocks fail
+    //   Images without checksums (see FS_OPT_CSUM) get them on their first
+    //   verifying mount
+    FS_OPT_VERIFY = 1 << 3,
+    // Verify only metadata: the inode table and free block map at mount and
+    //   pointer and directory blocks when read
+    FS_OPT_VERIFY_META = 1 << 4,
+    // Store identical data blocks once: blocks written while this is set are
+    //   looked up by content hash and shared (reference counted), a shared
+    //   block is copied when one of its files changes it
+    FS_OPT_DEDUP = 1 << 5,
+    // Track the blocks changed since the last fs_export_delta, the volume
+    //   keeps tracking them from then on, whatever the options
+    FS_OPT_TRACK_DIRTY = 1 << 6,
+    // Keep a CRC32C for every block without verifying reads, so a later
+    //   verifying mount or fs_check can tell corrupt blocks; every write pays
+    //   for the checksum, so volumes only keep them when asked to (this or
+    //   any of the verify and dedup options); an image that has them keeps
+    //   them current from then on, whatever the options
+    FS_OPT_CSUM = 1 << 7,
+    // Format a 32 GiB volume with 32-bit block pointers instead of a 64 MiB
+    //   one with 16-bit pointers (see consts.h), mounts tell the two apart by
+    //   the volume's size, so this is ignored there
+    FS_OPT_WIDE = 1 << 8,
+} fs_opt_t;
+
+// Flags for fs_open_flags, OR them together
+typedef enum {
+    FS_O_NONE   = 0,
+    // Every write lands at the end of the file as it is at that moment, so
+    //   several descriptors can append to one file without clobbering each
+    //   other; reads still use the descriptor's cursor
+    //   Unless the volume keeps checksums or shared blocks, an append only
+    //   holds the FS lock while it reserves its range, and copies its data
+    //   alongside other appenders; a reader may see a reserved range before
+    //   its data lands
+    FS_O_APPEND = 1 << 0,
+} fs_open_flag_t;
+
 #define FS_FNAME_MAX (32) // INCLUDING null terminator
-#define FS_MAX_OPEN_FILES 256
+#define FS_MAX_OPEN_FILES 256 // Default limit, see fs_set_max_open_files
 
 typedef struct {
     // You can add more if you want
@@ -37,6 +88,89 @@ typedef struct {
     file_t type;
 } file_record_t;
 
+// A file's metadata, see fs_stat
+typedef struct {
+    file_t type;
+    // Size in bytes
+    size_t size;
+    // Directory entries naming the file (the inode's link count), a file with
+    //   none doesn't exist
+    //   There are no hard links, and directories report 1 like file systems
+    //   that don't count their subdirectories, the root included
+    size_t nlink;
+    // Data blocks the file holds on the volume
+    size_t blocks;
+    uint32_t inum;
+} fs_stat_t;
+
+// A volume's capacity, see fs_statvfs
+typedef struct {
+    // Data blocks the volume holds, and how many of them are free
+    size_t blocks, free_blocks;
+    // Inodes the table can grow to, and how many of them are free
+    size_t inodes, free_inodes;
+} fs_statvfs_t;
+
+// The progress of an fs_defrag pass
+typedef struct {
+    // The inode the next call picks up at, 0 when a pass starts or is done
+    uint32_t next_inum;
+    // How fragmented the pass's files were when it started, and once it is
+    //   done (until then, when it started): the fraction of pairs of
+    //   consecutive data blocks in a file that are apart on the volume, 0 if
+    //   every file is contiguous
+    double score_before, score_after;
+    // Files and blocks moved so far in the pass
+    size_t files_moved, blocks_moved;
+    // The pass's files in inode order, found by its first call and freed once
+    //   it is done or by fs_defrag_cancel
+    size_t *inums;
+    size_t n_inums;
+} fs_defrag_t;
+
+// Flags for fs_walk, OR them together
+typedef enum {
+    FS_WALK_NONE = 0,
+    // Visit the root of the walk too, before anything under it
+    FS_WALK_ROOT = 1 << 0,
+    // Fill in each file's metadata, see fs_walk_entry_t
+    FS_WALK_STAT = 1 << 1,
+} fs_walk_flag_t;
+
+// A file visited by fs_walk
+typedef struct {
+    // Absolute path of the file
+    const char *path;
+    // The file's name, the tail of path ("" for "/")
+    const char *name;
+    file_t type;
+    uint32_t inum;
+    // Directories between the root of the walk and the file, 0 for the root
+    size_t depth;
+    // The file's metadata with FS_WALK_STAT, NULL without
+    const fs_stat_t *stat;
+} fs_walk_entry_t;
+
+// An open directory stream, see fs_opendir
+//   It lives wherever the caller puts it (usually the stack), so listing a
+//   directory does no heap allocations
+typedef struct {
+    FS_t *fs;
+    // The in-use entries not returned yet, one bit per entry slot
+    uint32_t pending;
+    // The directory's entry block, as it was when the stream was opened
+    uint8_t entries[BLOCK_SIZE_BYTES];
+} fs_dir_t;
+
+// A directory held open for the *at calls, see fs_opendir_handle
+//   Relative paths given with it are looked up from the directory, so deep
+//   trees cost one lookup per path component below it rather than from the
+//   root; absolute paths still start at the root. It only names the
+//   directory's inode, so it needs no closing
+typedef struct {
+    uint32_t inum;
+} fs_dirhandle_t;
+
 ///
 /// Formats (and mounts) an FS file for use
 /// \param fname The file to format
@@ -51,6 +185,50 @@ FS_t *fs_format(const char *path);
 ///
 FS_t *fs_mount(const char *path);
 
+///
+/// Formats (and mounts) an FS file for use with the given options
+/// \param fname The file to format
+/// \param opts OR'd fs_opt_t values
+/// \return Mounted FS object, NULL on error
+///
+FS_t *fs_format_opts(const char *path, int opts);
+
+///
+/// Mounts an FS object with the given options
+/// \param fname The file to mount
+/// \param opts OR'd fs_opt_t values
+/// \return Mounted FS object, NULL on error
+///
+FS_t *fs_mount_opts(const char *path, int opts);
+
+///
+/// Formats (and mounts) an FS striped across several files: the volume's
+///   blocks go to the files chunk_blocks at a time in turn, so a large
+///   fs_read/fs_write is split across them and moved by the block I/O
+///   engine's workers in parallel (as with FS_OPT_ASYNC_IO, which striped
+///   volumes always use). FS_OPT_HUGEPAGES is ignored
+/// \param paths The files to format, in stripe order
+/// \param n_paths The number of files, a power of two from 2 to 8
+/// \param chunk_blocks Blocks per chunk, a power of two of at least a page
+///   (at least 2048 on wide pointer volumes, see FS_OPT_WIDE), 0 for the
+///   default (64, 4096 on wide pointer volumes)
+/// \param opts OR'd fs_opt_t values
+/// \return Mounted FS object, NULL on error
+///
+FS_t *fs_format_striped(const char *const *paths, size_t n_paths, size_t chunk_blocks, int opts);
+
+///
+/// Mounts an FS made by fs_format_striped, the chunk size is read from its
+///   files. fs_check, fs_apply_delta and FS_OPT_CHECK take single file
+///   volumes only; fs_serialize saves a striped volume as a single file image
+/// \param paths The files, in the order they were formatted in
+/// \param n_paths The number of files
+/// \param opts OR'd fs_opt_t values
+/// \return Mounted FS object, NULL on error or if the files are not the
+///   stripes of one volume in that order
+///
+FS_t *fs_mount_striped(const char *const *paths, size_t n_paths, int opts);
+
 ///
 /// Unmounts the given object and frees all related resources
 /// \param fs The FS object to unmount
@@ -58,6 +236,68 @@ FS_t *fs_mount(const char *path);
 ///
 int fs_unmount(FS_t *fs);
 
+///
+/// Starts tracing calls to a file, for fs_replay (see fs_trace.h)
+///   fs_create, fs_open(_flags), fs_close, fs_seek, fs_read, fs_write,
+///   fs_copy_file_range, fs_flush, fs_stat and fs_get_dir are traced with
+///   their arguments, result and latency, from whichever thread makes them. Don't start or stop a
+///   trace while other threads are calling in
+/// \param fs The FS to trace
+/// \param path The trace file to create
+/// \return 0 on success, < 0 on error or if a trace is already running
+///
+int fs_trace_start(FS_t *fs, const char *path);
+
+///
+/// Stops tracing and closes the trace file, fs_unmount does this too
+/// \param fs The FS being traced
+/// \return 0 on success, < 0 on error or if no trace is running
+///
+int fs_trace_stop(FS_t *fs);
+
+///
+/// Saves an image of the FS holding only its allocated blocks, so it grows
+///   with the used space rather than the size of the volume. Buffered
+///   descriptors are flushed into it first
+/// \param fs The FS to save
+/// \param image The image file to write (truncated if it exists)
+/// \return The size of the image in bytes, < 0 on error
+///
+ssize_t fs_serialize(FS_t *fs, const char *image);
+
+///
+/// Restores an image saved by fs_serialize into a new FS file and mounts it
+/// \param image The image file to read
+/// \param path The FS file to create (truncated if it exists)
+/// \param opts OR'd fs_opt_t values to mount with
+/// \return Mounted FS object, NULL on error or if the image is corrupt
+///
+FS_t *fs_deserialize(const char *image, const char *path, int opts);
+
+///
+/// Saves the blocks changed since the last delta, for incremental backups,
+///   and starts tracking changes afresh. Buffered descriptors are flushed
+///   into it first. The first delta after tracking starts on a volume in use
+///   holds all of it
+/// \param fs The FS, formatted or mounted with FS_OPT_TRACK_DIRTY at some point
+/// \param delta The delta file to write (truncated if it exists)
+/// \return The size of the delta in bytes, < 0 on error or if the FS doesn't
+///   track changes
+///
+ssize_t fs_export_delta(FS_t *fs, const char *delta);
+
+///
+/// Applies a delta saved by fs_export_delta to a copy of the FS that isn't
+///   mounted. Deltas go on in the order they were saved, over a copy made
+///   when tracking started (fs_format, fs_serialize) or from an image made by
+///   fs_serialize. fs_serialize images apply too, replacing the whole FS
+/// \param delta The delta file to read
+/// \param path The FS file to update
+/// \return 0 on success, < 0 on error or if the delta is corrupt (the FS is
+///   left as it was then)
+///
+int fs_apply_delta(const char *delta, const char *path);
+
 ///
 /// Creates a new file at the specified location
 ///   Directories along the path that do not exist are not created
@@ -68,6 +308,43 @@ int fs_unmount(FS_t *fs);
 ///
 int fs_create(FS_t *fs, const char *path, file_t type);
 
+///
+/// Creates a number of files in one directory
+///   The directory is looked up, read and written once for the whole batch,
+///   and the new inodes are allocated together. Either every file is created
+///   or, if any name is bad, taken or there is no room, none are
+/// \param fs The FS containing the directory
+/// \param parent Absolute path to the directory
+/// \param names The names of the files to create, without any '/'
+/// \param types The type of each file to create (regular/directory)
+/// \param n The number of files to create
+/// \return 0 on success, < 0 on failure
+///
+int fs_create_many(FS_t *fs, const char *parent, const char *const *names, const file_t *types, size_t n);
+
+///
+/// Creates a new file relative to a held directory
+/// \param fs The FS containing the file
+/// \param dir The directory relative paths start from
+/// \param path Path to the file to create, relative to dir or absolute
+/// \param type Type of file to create (regular/directory)
+/// \return 0 on success, < 0 on failure
+///
+int fs_createat(FS_t *fs, const fs_dirhandle_t *dir, const char *path, file_t type);
+
+///
+/// Turns transparent compression on or off for a regular file
+///   The file's data is split into clusters of FS_CLUSTER_BLOCKS blocks, each
+///   stored LZ compressed, so compressible files take fewer blocks; reads only
+///   decompress the clusters they touch
+///   Only empty files can be switched
+/// \param fs The FS containing the file
+/// \param path Absolute path to the file
+/// \param compressed Whether the file should be compressed
+/// \return 0 on success, < 0 on failure
+///
+int fs_set_compressed(FS_t *fs, const char *path, bool compressed);
+
 ///
 /// Opens the specified file for use
 ///   R/W position is set to the beginning of the file (BOF)
@@ -78,14 +355,72 @@ int fs_create(FS_t *fs, const char *path, file_t type);
 ///
 int fs_open(FS_t *fs, const char *path);
 
+///
+/// Opens the specified file for use with the given flags
+///   The descriptor calls (fs_open, fs_open_flags, fs_close, fs_seek, fs_read,
+///   fs_write, fs_copy_file_range, fs_mmap, fs_set_buffered and fs_flush) are
+///   serialized internally, so threads can share one FS through them; each
+///   write is applied whole
+/// \param fs The FS containing the file
+/// \param path path to the requested file
+/// \param flags OR'd fs_open_flag_t values
+/// \return file descriptor to the requested file, < 0 on error
+///
+int fs_open_flags(FS_t *fs, const char *path, int flags);
+
+///
+/// Opens a file relative to a held directory, see fs_open_flags
+/// \param fs The FS containing the file
+/// \param dir The directory relative paths start from
+/// \param path Path to the file, relative to dir or absolute
+/// \param flags OR'd fs_open_flag_t values
+/// \return file descriptor to the requested file, < 0 on error
+///
+int fs_openat(FS_t *fs, const fs_dirhandle_t *dir, const char *path, int flags);
+
 ///
 /// Closes the given file descriptor
+///   Buffered data is written out first (see fs_set_buffered)
 /// \param fs The FS containing the file
 /// \param fd The file to close
-/// \return 0 on success, < 0 on failure
+/// \return 0 on success, < 0 on failure (the descriptor is closed even if
+///   its buffered data couldn't be written)
 ///
 int fs_close(FS_t *fs, int fd);
 
+///
+/// Turns write buffering on or off for a descriptor
+///   A buffered descriptor gathers small writes that follow on from each other
+///   in a block sized buffer, written out when it fills up to a block
+///   boundary and on a larger write, seek, read, close or fs_flush, so many
+///   small appends cost one block write
+///   Other descriptors don't see the buffered data until it is written out
+/// \param fs The FS containing the file
+/// \param fd The descriptor
+/// \param buffered Whether the descriptor should buffer, turning it off
+///   flushes the buffer
+/// \return 0 on success, < 0 on failure
+///
+int fs_set_buffered(FS_t *fs, int fd, bool buffered);
+
+///
+/// Writes out the data a buffered descriptor has gathered
+/// \param fs The FS containing the file
+/// \param fd The descriptor
+/// \return 0 on success, < 0 on failure (the data is dropped)
+///
+int fs_flush(FS_t *fs, int fd);
+
+///
+/// Sets how many files can be open at once
+///   The descriptor table grows on demand up to this limit, opening and
+///   closing a file are O(1)
+/// \param fs The FS
+/// \param max The new limit, at least the size the table has grown to
+/// \return 0 on success, < 0 on failure
+///
+int fs_set_max_open_files(FS_t *fs, size_t max);
+
 ///
 /// Moves the R/W position of the given descriptor to the given location
 ///   Files cannot be seeked past EOF or before BOF (beginning of file)
@@ -123,6 +458,51 @@ ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte);
 ///
 ssize_t fs_write(FS_t *fs, int fd, const void *src, size_t nbyte);
 
+///
+/// Copies a range of one file to another (or the same) file without passing
+///   the data through the caller, like copy_file_range(2)
+///   Blocks are copied inside the volume, and when both offsets are block
+///   aligned on a volume with block sharing (FS_OPT_DEDUP) whole blocks are
+///   shared copy on write instead
+///   The R/W positions of the descriptors are left unchanged
+/// \param fs The FS containing the files
+/// \param fd_in The file to copy from
+/// \param off_in The offset to copy from, the range is clipped at its EOF
+/// \param fd_out The file to copy to
+/// \param off_out The offset to copy to, at most the file's size
+/// \param len The number of bytes to copy
+/// \return number of bytes copied (< len IFF source EOF or out of space),
+///   < 0 on error or if the ranges overlap within one file
+///
+ssize_t fs_copy_file_range(FS_t *fs, int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len);
+
+///
+/// Exposes a range of a file as read only memory, for scans that would
+///   rather not copy the data out
+///   A range whose blocks are contiguous on the volume is returned as a
+///   direct pointer into the volume's mapping; otherwise the blocks are
+///   gathered into a private view, remapping page aligned runs of the volume
+///   and copying the rest (and decompressing compressed files)
+///   Views are only valid until the file is next written or removed;
+///   fs_defrag leaves files with views out where they are
+/// \param fs The FS containing the file
+/// \param fd The file to map
+/// \param offset The offset of the range
+/// \param len The length of the range, it is clipped at EOF
+/// \param ptr Set to the start of the view, NULL if the range is empty
+/// \return the length of the view, < 0 on error
+///
+ssize_t fs_mmap(FS_t *fs, int fd, off_t offset, size_t len, const void **ptr);
+
+///
+/// Releases a view returned by fs_mmap, letting fs_defrag move the file again
+/// \param fs The FS the view was taken from
+/// \param ptr The start of the view
+/// \param len The length of the view, as returned by fs_mmap
+/// \return 0 on success, < 0 on failure
+///
+int fs_munmap(FS_t *fs, const void *ptr, size_t len);
+
 ///
 /// Deletes the specified file and closes all open descriptors to the file
 ///   Directories can only be removed when empty
@@ -141,6 +521,173 @@ int fs_remove(FS_t *fs, const char *path);
 ///
 dyn_array_t *fs_get_dir(FS_t *fs, const char *path);
 
+///
+/// Lists a directory relative to a held directory, see fs_get_dir
+/// \param fs The FS containing the file
+/// \param dir The directory relative paths start from
+/// \param path Path to the directory to inspect, relative to dir ("" for dir
+///   itself) or absolute
+/// \return dyn_array of file records, NULL on error
+///
+dyn_array_t *fs_get_dirat(FS_t *fs, const fs_dirhandle_t *dir, const char *path);
+
+///
+/// Opens a stream over the files in a directory, without allocating
+///   The stream sees the directory as it was when it was opened
+/// \param fs The FS containing the directory
+/// \param path Absolute path to the directory to inspect
+/// \param dir The stream to open, caller owned
+/// \return 0 on success, < 0 on error
+///
+int fs_opendir(FS_t *fs, const char *path, fs_dir_t *dir);
+
+///
+/// Reads the next file in a directory stream
+/// \param dir The stream, from fs_opendir
+/// \param record Set to the file's record
+/// \return 1 if a record was read, 0 at the end of the directory, < 0 on error
+///
+int fs_readdir(fs_dir_t *dir, file_record_t *record);
+
+///
+/// Closes a directory stream
+/// \param dir The stream, from fs_opendir
+/// \return 0 on success, < 0 on error
+///
+int fs_closedir(fs_dir_t *dir);
+
+///
+/// Holds a directory for the *at calls
+/// \param fs The FS containing the directory
+/// \param path Absolute path to the directory
+/// \param dir Set to the handle
+/// \return 0 on success, < 0 on error or if path is not a directory
+///
+int fs_opendir_handle(FS_t *fs, const char *path, fs_dirhandle_t *dir);
+
+///
+/// Holds a directory named relative to another held directory
+/// \param fs The FS containing the directories
+/// \param dir The directory relative paths start from
+/// \param path Path to the directory, relative to dir or absolute
+/// \param sub Set to the handle, may be dir
+/// \return 0 on success, < 0 on error or if path is not a directory
+///
+int fs_opendir_handleat(FS_t *fs, const fs_dirhandle_t *dir, const char *path, fs_dirhandle_t *sub);
+
+///
+/// Calls a function on every file in a directory, without allocating
+/// \param fs The FS containing the directory
+/// \param path Absolute path to the directory to inspect
+/// \param fn Called with each file's record and arg, returning non-zero stops
+///   the walk
+/// \param arg Passed through to fn
+/// \return 0 once every file was visited, fn's non-zero return if it stopped
+///   the walk, < 0 on error
+///
+int fs_dir_for_each(
+    FS_t *fs,
+    const char *path,
+    int (*fn)(const file_record_t *record, void *arg),
+    void *arg
+);
+
+///
+/// Looks up a file's metadata without opening it
+/// \param fs The FS containing the file
+/// \param path Absolute path to the file
+/// \param st Set to the file's metadata
+/// \return 0 on success, < 0 on error or if the file doesn't exist
+///
+int fs_stat(FS_t *fs, const char *path, fs_stat_t *st);
+
+///
+/// Looks up a file's metadata relative to a held directory
+/// \param fs The FS containing the file
+/// \param dir The directory relative paths start from
+/// \param path Path to the file, relative to dir ("" for dir itself) or
+///   absolute
+/// \param st Set to the file's metadata, all zeros if it doesn't exist
+/// \return 0 on success, < 0 on error or if the file doesn't exist
+///
+int fs_statat(FS_t *fs, const fs_dirhandle_t *dir, const char *path, fs_stat_t *st);
+
+///
+/// Looks up the metadata of many files without opening them
+///   Each directory is resolved once for a run of paths inside it, so paths
+///   sorted by directory cost one lookup per file
+/// \param fs The FS containing the files
+/// \param paths Absolute paths to the files
+/// \param n The number of paths
+/// \param out Set to each file's metadata, all zeros (nlink 0) for the files
+///   that don't exist
+/// \return the number of files found, < 0 on error
+///
+ssize_t fs_stat_many(FS_t *fs, const char *const *paths, size_t n, fs_stat_t *out);
+
+///
+/// Looks up how much room is left on a volume
+/// \param fs The FS
+/// \param st Set to the volume's capacity
+/// \return 0 on success, < 0 on error
+///
+int fs_statvfs(FS_t *fs, fs_statvfs_t *st);
+
+///
+/// Visits every file under a directory
+///   Directories are walked by inode number, nothing is looked up by path,
+///   and subdirectories are shared out to a pool of threads that steal work
+///   from each other. A directory is visited before the files in it, but
+///   otherwise files are visited in no particular order and fn may be called
+///   from several threads at once. The tree must not change during the walk
+/// \param fs The FS containing the directory
+/// \param root Absolute path to the directory to walk
+/// \param fn Called with each file and arg, returning non-zero stops the walk
+/// \param arg Passed through to fn
+/// \param flags OR'd fs_walk_flag_t values
+/// \param n_threads Threads to walk with, counting the caller; 0 for one per
+///   CPU. At most FS_WALK_MAX_THREADS are used
+/// \return 0 once every file was visited, fn's non-zero return if it stopped
+///   the walk, < 0 on error
+///
+int fs_walk(
+    FS_t *fs,
+    const char *root,
+    int (*fn)(const fs_walk_entry_t *entry, void *arg),
+    void *arg,
+    int flags,
+    size_t n_threads
+);
+
+///
+/// Moves files' blocks into contiguous runs, a slice of a pass at a time so it
+///   can share the FS with other calls: each file is moved under the lock
+///   descriptor calls take, and a call stops once it has moved budget blocks.
+///   A moved file gets its pointer blocks followed by its data blocks in one
+///   run; blocks it shares with other files (FS_OPT_DEDUP) stay put, blocks
+///   it could share move and stay shareable, and files with no free run long
+///   enough, open with FS_O_APPEND or with views from fs_mmap not yet released
+///   by fs_munmap are left as they are. Descriptors stay valid
+/// \param fs The FS containing the files
+/// \param path Absolute path to a file, or a directory for every file under
+///   it, NULL for every file in the FS
+/// \param budget Blocks to move before returning, the file that crosses it is
+///   finished first; 0 for no limit
+/// \param pass The pass, zeroed before its first call and passed to each call
+///   after with the same path. The first call finds the files, so files
+///   created later are left to the next pass
+/// \return 1 if the pass has more to do, 0 once it is done, < 0 on error (the
+///   pass can go on past the file that failed)
+///
+int fs_defrag(FS_t *fs, const char *path, size_t budget, fs_defrag_t *pass);
+
+///
+/// Ends an fs_defrag pass that won't be finished, freeing its files
+///   The counts and scores it reached are kept
+/// \param pass The pass, ready to start a new pass after
+///
+void fs_defrag_cancel(fs_defrag_t *pass);
+
 /// Moves the file from one location to the other
 ///   Moving files does not affect open descriptors
 /// \param fs The FS containing the file
@@ -159,4 +706,20 @@ int fs_move(FS_t *fs, const char *src, const char *dst);
 ///
 int fs_link(FS_t *fs, const char *src, const char *dst);
 
+///
+/// Verifies the consistency of an unmounted FS file, optionally repairing it
+///   Every reachable file's direct, indirect and double indirect pointers are
+///   walked (in parallel) to count the claims on every block, which are then
+///   compared against the reference counts of shared blocks, the free block
+///   map and the inode map
+///   Repair frees unreachable inodes and leaked blocks, marks used blocks as
+///   allocated, fixes reference counts, drops dangling directory entries,
+///   truncates files at their first bad block pointer and fixes link counts
+///   and directory sizes
+/// \param path The FS file to check, must not be mounted
+/// \param repair Whether to fix the problems found
+/// \return The number of problems found, < 0 on error
+///
+int fs_check(const char *path, bool repair);
+
 #endif
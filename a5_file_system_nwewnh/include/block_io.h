@@ -0,0 +1,84 @@
+#ifndef BLOCK_IO_H__
+#define BLOCK_IO_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A batched block I/O engine for a block store file, or for the files a
+//  block store is striped across
+// Batches are submitted through io_uring when the kernel allows it, and are
+//  spread across a small pool of pread/pwrite threads otherwise
+typedef struct block_io block_io_t;
+
+#define BLOCK_IO_MAX_FILES 8
+
+typedef enum { BLOCK_IO_READ, BLOCK_IO_WRITE } block_io_op_t;
+
+typedef enum {
+    BLOCK_IO_DEFAULT  = 0,
+    BLOCK_IO_NO_URING = 1 << 0, // Always use the thread pool
+} block_io_flags_t;
+
+// One block-sized transfer in a batch
+typedef struct {
+    block_io_op_t op;
+    size_t block_id;
+    void *buffer;
+} block_io_req_t;
+
+///
+/// Creates an I/O engine for an open block store file
+/// \param fd The file descriptor of the block store file (not owned)
+/// \param queue_depth The maximum number of transfers in flight at once
+/// \param flags Engine options (see block_io_flags_t)
+/// \return Pointer to the new engine, NULL on error
+///
+block_io_t *block_io_create(const int fd, const size_t queue_depth, const int flags);
+
+///
+/// Creates an I/O engine for a block store striped across several files
+///  Chunk c (chunk_blocks blocks starting at block c * chunk_blocks) is chunk
+///  c / n_fds of file c % n_fds, so the transfers of a large batch are spread
+///  over all the files and the thread pool grows with their number
+/// \param fds The file descriptors of the files, in stripe order (not owned)
+/// \param n_fds The number of files, at most BLOCK_IO_MAX_FILES
+/// \param chunk_blocks Blocks per chunk
+/// \param queue_depth The maximum number of transfers in flight at once
+/// \param flags Engine options (see block_io_flags_t)
+/// \return Pointer to the new engine, NULL on error
+///
+block_io_t *block_io_create_striped(const int *const fds, const size_t n_fds, const size_t chunk_blocks,
+                                    const size_t queue_depth, const int flags);
+
+///
+/// Destroys the I/O engine and joins its workers
+/// \param bio The engine
+///
+void block_io_destroy(block_io_t *const bio);
+
+///
+/// Submits a batch of block transfers and waits for all of them to complete
+///  Transfers in a batch may complete in any order
+/// \param bio The engine
+/// \param reqs The transfers to perform
+/// \param n The number of transfers in reqs
+/// \return Number of transfers that completed successfully
+///
+size_t block_io_submit(block_io_t *const bio, const block_io_req_t *const reqs, const size_t n);
+
+///
+/// Reports whether the engine is backed by io_uring
+/// \param bio The engine
+/// \return true if batches go through io_uring, false if through the thread pool
+///
+bool block_io_is_uring(const block_io_t *const bio);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -15,6 +15,35 @@ extern "C" {
 // This enforces a black box device, but it can be restricting
 typedef struct block_store block_store_t;
 
+// Options for block_store_create_opts/block_store_open_opts
+typedef enum {
+    BS_OPT_NONE     = 0,
+    // Move data blocks with pread/pwrite and batch them through the
+    //  block I/O engine instead of copying through the mapping
+    BS_OPT_ASYNC_IO = 1 << 0,
+    // Map the device with MAP_HUGETLB or MADV_HUGEPAGE where available,
+    //  silently falling back to normal pages
+    BS_OPT_HUGEPAGES = 1 << 1,
+    // Keep a CRC32C of every block in a table past the end of the device,
+    //  adding one to a device that has none
+    //  Devices that have a table keep it up to date whatever the options
+    BS_OPT_CSUM = 1 << 2,
+    // Verify every block read against its checksum, implies BS_OPT_CSUM
+    BS_OPT_VERIFY = 1 << 3,
+    // Index the contents of blocks written with block_store_write_shared so
+    //  identical blocks share storage (reference counted), implies BS_OPT_CSUM
+    BS_OPT_DEDUP = 1 << 4,
+    // Track the data blocks changed since the last block_store_export_delta
+    //  in a table past the end of the device, adding one to a device that
+    //  has none (every block starts dirty then, unless the device is new)
+    //  Devices that have a table keep it up to date whatever the options
+    BS_OPT_DIRTY = 1 << 5,
+    // Create a device of BLOCK_STORE_WIDE_NUM_BLOCKS blocks rather than
+    //  BLOCK_STORE_NUM_BLOCKS, ignored when opening (the size of the files
+    //  tells them apart)
+    BS_OPT_WIDE = 1 << 6,
+} block_store_opt_t;
+
 ///
 /// This creates a new BS device, ready to go
 /// \return Pointer to a new block storage device, NULL on error
@@ -37,6 +66,51 @@ block_store_t *block_store_create(const char *const fname);
 /////
 block_store_t *block_store_open(const char *const fname);
 
+///
+/// Creates a new back_store file with the given options (see block_store_opt_t)
+/// \param fname the file to create
+/// \param opts OR'd block_store_opt_t values
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_create_opts(const char *const fname, const int opts);
+
+///
+/// Opens the specified back_store file with the given options (see block_store_opt_t)
+/// \param fname the file to open
+/// \param opts OR'd block_store_opt_t values
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_open_opts(const char *const fname, const int opts);
+
+///
+/// Creates a new back_store striped across several files: chunks of
+///  chunk_blocks blocks go to the files in turn, so large batches of
+///  transfers are spread over all of them (striped devices always move data
+///  blocks through the block I/O engine, as with BS_OPT_ASYNC_IO)
+///  Each file holds its share of the chunks and a header naming its place in
+///  the device; the first also holds the tables. Huge pages aren't used
+/// \param fnames the files to create, in stripe order
+/// \param n the number of files, a power of two from 2 to BLOCK_STORE_MAX_STRIPES
+/// \param chunk_blocks blocks per chunk, a power of two spanning whole pages,
+///  large enough for the device to have at most 16384 chunks, 0 for
+///  BLOCK_STORE_STRIPE_CHUNK_BLOCKS (BLOCK_STORE_WIDE_STRIPE_CHUNK_BLOCKS
+///  with BS_OPT_WIDE)
+/// \param opts OR'd block_store_opt_t values
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_create_striped(const char *const *const fnames, const size_t n, const size_t chunk_blocks, const int opts);
+
+///
+/// Opens a back_store made by block_store_create_striped, taking the chunk
+///  size from its files
+/// \param fnames the files, in the order they were created in
+/// \param n the number of files
+/// \param opts OR'd block_store_opt_t values
+/// \return a pointer to the new object, NULL on error or if the files are
+///  not the stripes of one device in that order
+///
+block_store_t *block_store_open_striped(const char *const *const fnames, const size_t n, const int opts);
+
 ///
 /// Destroys the provided block storage device
 /// This is an idempotent operation, so there is no return value
@@ -51,6 +125,25 @@ void block_store_destroy(block_store_t *const bs);
 ///
 size_t block_store_allocate(block_store_t *const bs);
 
+///
+/// Allocates a contiguous run of blocks, the first free run long enough
+/// \param bs BS device
+/// \param n Number of blocks to allocate
+/// \return The first block of the run, SIZE_MAX on error or if there is no
+///  free run long enough (nothing is allocated)
+///
+size_t block_store_allocate_contiguous(block_store_t *const bs, const size_t n);
+
+///
+/// Allocates a batch of blocks, as one contiguous run if there is a free run
+///  long enough (first fit), one by one otherwise
+/// \param bs BS device
+/// \param n Number of blocks to allocate
+/// \param block_ids Set to the ids of the n blocks, in order
+/// \return n on success, 0 on error (nothing is allocated)
+///
+size_t block_store_allocate_run(block_store_t *const bs, const size_t n, size_t *const block_ids);
+
 ///
 /// Attempts to allocate the requested block id
 /// \param bs the block store object
@@ -60,7 +153,15 @@ size_t block_store_allocate(block_store_t *const bs);
 bool block_store_request(block_store_t *const bs, const size_t block_id);
 
 ///
-/// Frees the specified block
+/// Tests whether the specified block is marked as in use
+/// \param bs BS device
+/// \param block_id The block to test
+/// \return true if the block is in use, false if it is free or on error
+///
+bool block_store_test(const block_store_t *const bs, const size_t block_id);
+
+///
+/// Frees the specified block, or drops a reference to it if it is shared
 /// \param bs BS device
 /// \param block_id The block to free
 ///
@@ -87,6 +188,14 @@ size_t block_store_get_free_blocks(const block_store_t *const bs);
 ///
 size_t block_store_get_total_blocks();
 
+///
+/// Returns the number of user-addressable blocks of a device, which is
+///  block_store_get_total_blocks() unless it was created with BS_OPT_WIDE
+/// \param bs BS device
+/// \return Total blocks, 0 on error
+///
+size_t block_store_get_avail_blocks(const block_store_t *const bs);
+
 ///
 /// Reads data from the specified block and writes it to the designated buffer
 /// \param bs BS device
@@ -106,20 +215,97 @@ size_t block_store_read(const block_store_t *const bs, const size_t block_id, vo
 size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
 ///
-/// Imports BS device from the given file
-/// \param filename The file to load
+/// Reads a batch of blocks into the designated buffers
+///  With BS_OPT_ASYNC_IO the whole batch is in flight at once
+/// \param bs BS device
+/// \param block_ids Source block ids
+/// \param buffers Data buffers to write to, one per block
+/// \param n Number of blocks in the batch
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_read_many(const block_store_t *const bs, const size_t *const block_ids, void *const *const buffers, const size_t n);
+
+///
+/// Writes a batch of blocks from the designated buffers
+///  With BS_OPT_ASYNC_IO the whole batch is in flight at once
+/// \param bs BS device
+/// \param block_ids Destination block ids
+/// \param buffers Data buffers to read from, one per block
+/// \param n Number of blocks in the batch
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_write_many(block_store_t *const bs, const size_t *const block_ids, const void *const *const buffers, const size_t n);
+
+///
+/// Writes part of a block in place, leaving the rest of it as it is
+///  On a device without checksum and reference tables (see BS_OPT_CSUM and
+///  BS_OPT_DEDUP), writes to disjoint blocks or disjoint ranges of one block
+///  may run on several threads at once, as may block_store_write_many
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param offset Where in the block the data goes
+/// \param buffer Data buffer to read from
+/// \param len Number of bytes to write, offset + len at most BLOCK_SIZE_BYTES
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_write_range(block_store_t *const bs, const size_t block_id, const size_t offset, const void *buffer, const size_t len);
+
+///
+/// Writes a data block that may share its storage with identical blocks
+///  With BS_OPT_DEDUP, an identical shareable block in use gains a reference
+///  and is returned instead, leaving block_id untouched (and allocated)
+///  Otherwise buffer is written to block_id, which becomes shareable
+///  Shared blocks are freed when block_store_release drops their last reference,
+///  they must never be overwritten in place
+/// \param bs BS device
+/// \param block_id Destination block id, must not be shared
+/// \param buffer Data buffer to read from
+/// \return The id of the block holding the data, SIZE_MAX on error
+///
+size_t block_store_write_shared(block_store_t *const bs, const size_t block_id, const void *buffer);
+
+///
+/// Imports a BS device from an image made by block_store_serialize
+///  The device is created from scratch, with only the image's blocks written
+/// \param filename The image to load
+/// \param device The device file to create (truncated if it exists)
+/// \param opts OR'd block_store_opt_t values to open the device with
 /// \return Pointer to new BS device, NULL on error
 ///
-block_store_t *block_store_deserialize(const char *const filename);
+block_store_t *block_store_deserialize(const char *const filename, const char *const device, const int opts);
 
 ///
-/// Writes the entirety of the BS device to file, overwriting it if it exists
+/// Writes the allocated blocks of the BS device to an image, overwriting it if
+///  it exists: the free block map, then run length headed runs of allocated
+///  blocks (with their reference counts, if the device keeps them)
+///  The image grows with the used space rather than the size of the device
 /// \param bs BS device
 /// \param filename The file to write to
 /// \return Number of bytes written, 0 on error
 ///
 size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+///
+/// Writes the allocated blocks changed since the last delta to a delta image,
+///  overwriting it if it exists, and starts tracking changes afresh
+///  Applied in order, deltas bring a copy of the device up to date
+/// \param bs BS device that tracks dirty blocks (see BS_OPT_DIRTY)
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error or if the device doesn't track
+///  dirty blocks
+///
+size_t block_store_export_delta(block_store_t *const bs, const char *const filename);
+
+///
+/// Applies a delta made by block_store_export_delta (or a full image made by
+///  block_store_serialize) to a device that isn't open
+///  The delta is checked first, a corrupt one leaves the device as it was
+/// \param filename The delta to load
+/// \param device The device file
+/// \return true on success, false on error or if the delta is corrupt
+///
+bool block_store_apply_delta(const char *const filename, const char *const device);
+
 
 //////////////////////////////////////////////////////////////////////
 /// some added library functions for this specific implementation  ///
@@ -134,6 +320,43 @@ block_store_t *block_store_fd_create();
 // return a pointer to the Data of a storage device, NULL on error
 uint8_t * block_store_Data_location(block_store_t *const bs);
 
+// build a private read only view of a list of blocks laid out back to back, mapping page aligned
+// runs straight from the device's file and copying the rest, NULL on error
+const uint8_t * block_store_map_view(const block_store_t *const bs, const size_t *const block_ids, const size_t n);
+
+// release a view built by block_store_map_view over n blocks
+void block_store_unmap_view(const uint8_t *const view, const size_t n);
+
+// whether the device mapping is set up for huge pages (see BS_OPT_HUGEPAGES)
+bool block_store_huge_pages(const block_store_t *const bs);
+
+// recompute the checksum of a block changed in place through block_store_Data_location and
+// mark it dirty (see BS_OPT_DIRTY), true if the device has no checksum table, false on error
+bool block_store_csum_refresh(block_store_t *const bs, const size_t block_id);
+
+// check a block against its checksum, true if it matches or the device has no checksum table
+bool block_store_verify(const block_store_t *const bs, const size_t block_id);
+
+// the number of references to a shared block beyond the first, 0 if it is not shared
+size_t block_store_refs(const block_store_t *const bs, const size_t block_id);
+
+// whether a block is in the content index (see BS_OPT_DEDUP), so identical writes may share it
+bool block_store_shareable(const block_store_t *const bs, const size_t block_id);
+
+// make a block in use shareable as if block_store_write_shared had written it, for a moved block's copy
+// false if the device has no reference table (see BS_OPT_DEDUP), the block is free or on error
+bool block_store_share(block_store_t *const bs, const size_t block_id);
+
+// set the number of references to a block beyond the first, for repairs
+// false if the device has no reference table (see BS_OPT_DEDUP) and refs > 0
+bool block_store_set_refs(block_store_t *const bs, const size_t block_id, const size_t refs);
+
+// whether the device keeps a checksum table (see BS_OPT_CSUM)
+bool block_store_has_csums(const block_store_t *const bs);
+
+// whether the device keeps a reference table, so blocks can be shared (see BS_OPT_DEDUP)
+bool block_store_has_refs(const block_store_t *const bs);
+
 // destroy the blockstore for inode table
 void block_store_inode_destroy(block_store_t *const bs);
 
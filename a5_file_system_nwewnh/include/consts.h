@@ -1,23 +1,53 @@
 #ifndef CONSTS_H__
 #define CONSTS_H__
 
+// Volumes come in two formats, picked by fs_format (FS_OPT_WIDE) and told
+//  apart by their size when mounted:
+//  - 16-bit block pointers and 64 MiB volumes, the default, pointer blocks
+//    hold the most pointers
+//  - 32-bit block pointers and 32 GiB volumes, with a matching larger FBM
+//    (BLOCK_STORE_WIDE_*)
 #define BLOCK_STORE_NUM_BLOCKS 65536 // 2^16
 #define BLOCK_STORE_AVAIL_BLOCKS 65528 // Last 8 blocks consumed by the FBM
+#define BLOCK_STORE_WIDE_NUM_BLOCKS ((size_t) 1 << 25)
+#define BLOCK_STORE_WIDE_AVAIL_BLOCKS (BLOCK_STORE_WIDE_NUM_BLOCKS - BLOCK_STORE_WIDE_NUM_BLOCKS / BLOCK_SIZE_BITS)
 #define BLOCK_SIZE_BYTES 1024 // 2^10
 #define BLOCK_SIZE_BITS (8 * BLOCK_SIZE_BYTES)
 #define BLOCK_STORE_NUM_BYTES (BLOCK_STORE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
+#define BLOCK_STORE_WIDE_NUM_BYTES (BLOCK_STORE_WIDE_NUM_BLOCKS * BLOCK_SIZE_BYTES)
 
-#define NUM_INODES 256
+#define NUM_INODES 4096 // Upper bound, the inode table grows as files are created
+#define FS_INODES_PER_BLOCK 16
+#define FS_INODE_BLOCKS (NUM_INODES / FS_INODES_PER_BLOCK) // Slots in the inode map
+#define FS_FIXED_INODE_BLOCKS 16 // Inode table blocks laid down by fs_format
+#define FS_META_BLOCKS 17 // Inode map block + the fixed inode table blocks
+#define FS_FREE_INUM_CACHE 64 // Free inode numbers kept ready for fs_create
+#define FS_CHECK_MAX_THREADS 8
+#define FS_WALK_MAX_THREADS 8
 #define NUM_FDS 256
+#define FS_FD_TABLE_MIN 16 // Descriptor slots allocated when the first file is opened
 
-#define DIR_ENTRIES_PER_BLOCK 31
+#define BLOCK_STORE_IO_QUEUE_DEPTH 64 // Blocks in flight per engine submission
+#define BLOCK_STORE_MAX_STRIPES 8 // Backing files of a striped device, at most
+#define BLOCK_STORE_STRIPE_CHUNK_BLOCKS 64 // Default blocks per stripe chunk
+#define BLOCK_STORE_WIDE_STRIPE_CHUNK_BLOCKS 4096 // The same on wide devices
+#define FS_IO_BATCH_BLOCKS 64 // Blocks per fs_read/fs_write batch
+
+#define FS_CLUSTER_BLOCKS 16 // Blocks per compression unit of a compressed file
+#define FS_CLUSTER_BYTES (FS_CLUSTER_BLOCKS * BLOCK_SIZE_BYTES)
+
+#define DIR_ENTRIES_PER_BLOCK 28
 #define BLOCK_PTRS_PER_BLOCK 512
+#define BLOCK_PTRS_PER_WIDE_BLOCK 256
 
 #define INUM_OK(inum) ((inum) < NUM_INODES)
+#define FS_DATA_BLOCK_OK(block_num, avail_blocks) ((block_num) >= FS_META_BLOCKS && (block_num) < (avail_blocks))
 #define PATH_OK(path) ((path) != NULL && (path)[0] == '/' && strlen(path) > 0)
 #define FD_OK(fd) (0 <= (fd) && (fd) < NUM_FDS)
 #define WHENCE_OK(whence) ((whence)==FS_SEEK_SET || (whence)==FS_SEEK_CUR || (whence)==FS_SEEK_END)
 
+// Where a file's data blocks are on 16-bit volumes, wide ones have
+//  BLOCK_PTRS_PER_WIDE_BLOCK pointers per pointer block instead
 #define FD_DIRECT_N_PTRS 6
 #define FD_INDIRECT_N_PTRS BLOCK_PTRS_PER_BLOCK
 #define FD_DOUBLE_INDIRECT_N_PTRS (BLOCK_PTRS_PER_BLOCK * BLOCK_PTRS_PER_BLOCK)
@@ -0,0 +1,33 @@
+#ifndef CRC32C_H__
+#define CRC32C_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+///
+/// Computes the CRC32C (Castagnoli) of a buffer
+///  Uses the SSE4.2 crc32 instruction when the CPU has it, a table driven
+///  software version otherwise; both give the same result
+/// \param crc The CRC of the preceding data, 0 to start a new one
+/// \param buf The data
+/// \param len The number of bytes in buf
+/// \return The CRC of the preceding data followed by buf
+///
+uint32_t crc32c(uint32_t crc, const void *const buf, const size_t len);
+
+///
+/// Reports whether crc32c runs on the SSE4.2 instruction
+/// \return true if the hardware path is in use
+///
+bool crc32c_hw(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef FS_TRACE_H__
+#define FS_TRACE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Binary traces of FS.h calls, written by fs_trace_start and read by fs_replay
+//
+// A trace is a header (FS_TRACE_MAGIC, FS_TRACE_VERSION) followed by one
+// fs_trace_rec_t per call, each followed by the path_len bytes of the call's
+// path (no terminator). Everything is in host byte order
+
+#define FS_TRACE_MAGIC 0x52543541u // "A5TR"
+#define FS_TRACE_VERSION 2
+#define FS_TRACE_PATH_MAX 4096 // Longer paths are cut short in the trace
+
+// The traced calls
+typedef enum {
+    FS_TRACE_CREATE = 1, // path, arg: file_t
+    FS_TRACE_OPEN,       // path, arg: fs_open_flag_t, ret: the descriptor
+    FS_TRACE_CLOSE,      // fd
+    FS_TRACE_SEEK,       // fd, offset, arg: seek_t, ret: the new position
+    FS_TRACE_READ,       // fd, offset: the cursor, size, ret: bytes read
+    FS_TRACE_WRITE,      // fd, offset: the cursor, size, ret: bytes written
+    FS_TRACE_FLUSH,      // fd
+    FS_TRACE_STAT,       // path
+    FS_TRACE_GET_DIR,    // path, ret: the number of entries
+    FS_TRACE_COPY_RANGE, // fd, offset: the source's; fd_out, offset_out: the
+                         //   destination's; size, ret: bytes copied
+    FS_TRACE_N_OPS,
+} fs_trace_op_t;
+
+// A traced call, 56 bytes
+typedef struct {
+    // When the call started, in nanoseconds since the trace started
+    uint64_t start_ns;
+    int64_t offset;
+    // The second file's offset, for calls with two files (see fs_trace_op_t)
+    int64_t offset_out;
+    uint64_t size;
+    // How long the call took
+    uint32_t latency_ns;
+    // What the call returned, clamped to 32 bits
+    int32_t ret;
+    int32_t fd;
+    // The second file's descriptor, for calls with two files
+    int32_t fd_out;
+    uint8_t op;
+    // The call's small argument, see fs_trace_op_t
+    uint8_t arg;
+    uint16_t path_len;
+    // Zero
+    uint32_t reserved;
+} fs_trace_rec_t;
+
+typedef struct fs_trace fs_trace_t;
+
+///
+/// Creates a trace file and writes its header
+/// \param path The file to create (truncated if it exists)
+/// \return The trace, NULL on error
+///
+fs_trace_t *fs_trace_create(const char *path);
+
+///
+/// Opens a trace file for reading and checks its header
+/// \param path The file to open
+/// \return The trace, NULL on error or if it is not a trace
+///
+fs_trace_t *fs_trace_load(const char *path);
+
+///
+/// Appends a call to a trace, safe to call from several threads
+/// \param trace A trace from fs_trace_create
+/// \param rec The call, start_ns is taken as an fs_trace_clock reading and
+///   made relative to the start of the trace, path_len is set from path
+/// \param path The call's path, NULL if it has none
+/// \return Whether the call was written
+///
+bool fs_trace_append(fs_trace_t *trace, const fs_trace_rec_t *rec, const char *path);
+
+///
+/// Reads the next call from a trace
+/// \param trace A trace from fs_trace_load
+/// \param rec Set to the call
+/// \param path Set to the call's path, null terminated, FS_TRACE_PATH_MAX + 1
+///   bytes
+/// \return 1 if a call was read, 0 at the end of the trace, < 0 on error
+///
+int fs_trace_next(fs_trace_t *trace, fs_trace_rec_t *rec, char *path);
+
+///
+/// Flushes (when writing) and closes a trace
+/// \param trace The trace
+/// \return 0 on success, < 0 if buffered calls could not be written
+///
+int fs_trace_close(fs_trace_t *trace);
+
+///
+/// Reads the clock traces are timed with
+/// \return Monotonic nanoseconds
+///
+uint64_t fs_trace_clock(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
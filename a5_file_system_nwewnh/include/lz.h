@@ -0,0 +1,38 @@
+#ifndef LZ_H__
+#define LZ_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// A small, dependency free LZ77 codec (LZ4-style byte-aligned sequences)
+// Made for compressing file system clusters, so it favors speed over ratio
+
+///
+/// Compresses a buffer
+/// \param src The data to compress
+/// \param src_len The number of bytes in src (must be < 2^32)
+/// \param dst The buffer for the compressed data
+/// \param dst_cap The size of dst
+/// \return Number of compressed bytes in dst, 0 if the result does not fit in dst_cap
+///
+size_t lz_compress(const void *const src, const size_t src_len, void *const dst, const size_t dst_cap);
+
+///
+/// Decompresses a buffer produced by lz_compress
+///  Corrupt input is detected and never read or written out of bounds
+/// \param src The compressed data
+/// \param src_len The number of bytes in src
+/// \param dst The buffer for the decompressed data
+/// \param dst_cap The size of dst
+/// \return Number of decompressed bytes in dst, SIZE_MAX if src is corrupt or does not fit
+///
+size_t lz_decompress(const void *const src, const size_t src_len, void *const dst, const size_t dst_cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,8 +1,15 @@
+#define _DEFAULT_SOURCE
+
 #include <fcntl.h>
+#include <limits.h>
 #include <libgen.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
+#include <unistd.h>
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -11,6 +18,8 @@
 #include "block_store.h"
 #include "consts.h"
 #include "dyn_array.h"
+#include "fs_trace.h"
+#include "lz.h"
 
 struct inode {
 
@@ -18,15 +27,22 @@ struct inode {
     //   .data_direct) are in-use
     uint32_t dir_entry_map;
 
+    // OR'd inodeFlags_t values
+    uint8_t flags;
+
     // For alignment only
-    char _alignment1[18];
+    char _alignment1[1];
+
+    // The high halves of the block pointers on wide volumes, one per slot
+    //   (see _inode_ptr), unused on 16-bit volumes
+    uint16_t data_high[FD_DIRECT_N_PTRS + 2];
 
     // A character denoting the file type:
     //   - 'r' for a regular file
     //   - 'd' for a directory
     char file_type;
 
-    // The inode number of the file, in the range of [0,256)
+    // The inode number of the file, in the range of [0,NUM_INODES)
     size_t inum;
 
     // The size of the file in bytes
@@ -56,7 +72,7 @@ struct inode {
 struct fileDescriptor {
 
     // The inode number of the fd
-    uint8_t inum;
+    uint32_t inum;
 
     // Whether the cursor is currently in a direct, indirect, or double
     //   indirect block
@@ -64,8 +80,9 @@ struct fileDescriptor {
 
     // The index of the block in which the cursor points (see .usage)
     // If usage is direct, locate_order is in the range of [0,6)
-    // If usage is indirect, locate_order is in the range of [0,512)
-    // If usage is double indirect, locate_order is in the range of [0,512**2)
+    // If usage is indirect, locate_order is in the range of [0,ptrs_per_block)
+    // If usage is double indirect, locate_order is in the range of [0,ptrs_per_block**2)
+    //   (see FS.ptrs_per_block)
     uint32_t locate_order;
 
     // The byte offset in the block (see .locate_order) of the cursor
@@ -75,6 +92,7 @@ struct fileDescriptor {
 };
 
 const size_t INODE_SIZE = sizeof(struct inode);
+_Static_assert(sizeof(struct inode) * FS_INODES_PER_BLOCK == BLOCK_SIZE_BYTES, "inodes must tile a block");
 const size_t FD_SIZE = sizeof(struct fileDescriptor);
 
 typedef enum {
@@ -83,29 +101,136 @@ typedef enum {
     FD_DOUBLE_INDIRECT = 1 << 2,
 } fileDescriptorUsage_t;
 
+typedef enum {
+    // The file's data is stored in LZ compressed clusters of
+    //   FS_CLUSTER_BLOCKS blocks, see _cluster_store
+    INODE_COMPRESSED = 1 << 0,
+} inodeFlags_t;
+
 struct directoryFile {
     char filename[32];
-    uint8_t inum;
+    uint32_t inum;
 };
 
+/**
+ * The inode map, which fills the first block of the volume
+ *   Inode inum lives in slot inum % FS_INODES_PER_BLOCK of inode block
+ *   inum / FS_INODES_PER_BLOCK. The first FS_FIXED_INODE_BLOCKS inode blocks
+ *   are always blocks 1-16, the rest are allocated as the table grows
+ *   The in-use masks of the fixed blocks overlay the inode bitmap of older
+ *   images, so those mount as they are
+ */
+typedef struct {
+    // Per inode block: bit i is set if the block's ith inode is in use
+    uint16_t used[FS_INODE_BLOCKS];
+    // Per inode block: its block number, 0 if it is not allocated
+    //   Wide volumes keep their inode blocks below block 65536 to fit
+    uint16_t blocks[FS_INODE_BLOCKS];
+} inodeMap_t;
+
+/**
+ * A slot in the descriptor table, open descriptors are used in place
+ */
+typedef struct {
+    fileDescriptor_t fd;
+    // Whether the slot holds an open descriptor
+    bool open;
+    // While the slot is free: the next free slot, -1 if it is the last one
+    int next_free;
+    // A block sized buffer gathering small writes (see fs_set_buffered), NULL
+    //   if the descriptor writes straight through
+    uint8_t *wbuf;
+    // The file offset of the buffered data and its length, the buffer never
+    //   crosses a block boundary
+    size_t wbuf_start, wbuf_len;
+    // Whether writes land at the end of the file (FS_O_APPEND)
+    bool append;
+} fdSlot_t;
+
+/**
+ * A view from fs_mmap onto a file's blocks that hasn't been released yet
+ */
+typedef struct {
+    const void *ptr;
+    size_t len;
+    size_t inum;
+} fsView_t;
+
 struct FS {
     block_store_t *BlockStore_whole;
-    block_store_t *BlockStore_inode;
-    block_store_t *BlockStore_fd;
+    // Whether block pointers are 32-bit (FS_OPT_WIDE), which the size of the
+    //   block store tells
+    bool wide;
+    // Pointers per pointer block, BLOCK_PTRS_PER_BLOCK or
+    //   BLOCK_PTRS_PER_WIDE_BLOCK
+    size_t ptrs_per_block;
+    // Blocks in the block store and those before its FBM, data blocks are
+    //   below avail_blocks
+    size_t n_blocks, avail_blocks;
+    // The descriptor table, grown by doubling up to max_fds slots
+    fdSlot_t *fds;
+    size_t n_fds, max_fds;
+    // The first free slot, -1 if there is none, the rest of the free slots
+    //   are linked through fdSlot_t.next_free
+    int fd_free;
+    // The inode map, changed in place through the mapping
+    inodeMap_t *inode_map;
+    // Free inode numbers ready to hand out, refilled from the inode map
+    uint32_t free_inums[FS_FREE_INUM_CACHE];
+    size_t n_free_inums;
+    // The inode block at which the next refill starts looking
+    size_t refill_cursor;
+    // Whether pointer and directory blocks are verified when read
+    //   (FS_OPT_VERIFY_META)
+    bool verify_meta;
+    // Whether data blocks are written through the block store's content
+    //   index so identical blocks are shared (FS_OPT_DEDUP)
+    bool dedup;
+    // Whether data blocks read straight from the mapping are verified first
+    //   (FS_OPT_VERIFY)
+    bool verify;
+    // Serializes the descriptor calls so threads can share the FS, each public
+    //   call takes it around a _locked twin that does the work; recursive
+    //   since flushing a buffered descriptor goes through fs_write
+    //   Appends let go of it before copying their data, see fs_write
+    pthread_mutex_t lock;
+    // The views onto files' blocks still out, so fs_defrag leaves their files
+    //   where they are; grown by doubling
+    fsView_t *views;
+    size_t n_views, max_views;
+    // Where calls are traced while fs_trace_start is in effect, NULL otherwise
+    fs_trace_t *trace;
+    // How deep in this FS's calls each thread is, see _trace_begin
+    pthread_key_t trace_depth;
 };
 
 typedef uint8_t block_t[BLOCK_SIZE_BYTES];
-typedef uint16_t ind_block_t[BLOCK_PTRS_PER_BLOCK];
+// A pointer block, read and written through _ptr_get and _ptr_set
+typedef union {
+    uint16_t narrow[BLOCK_PTRS_PER_BLOCK];
+    uint32_t wide[BLOCK_PTRS_PER_WIDE_BLOCK];
+} ind_block_t;
 
 #define MIN(a, b) ((a) <= (b) ? (a) : (b))
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 
 #define _BS_READ_OK(fs, block_num, dest) (block_store_read((fs)->BlockStore_whole, (block_num), (dest)) == BLOCK_SIZE_BYTES)
 #define _BS_WRITE_OK(fs, block_num, src) (block_store_write((fs)->BlockStore_whole, (block_num), (src)) == BLOCK_SIZE_BYTES)
-#define _BS_INODE_READ_OK(fs, inum, dest) (block_store_inode_read((fs)->BlockStore_inode, (inum), (dest)) == INODE_SIZE)
-#define _BS_INODE_WRITE_OK(fs, inum, src) (block_store_inode_write((fs)->BlockStore_inode, (inum), (src)) == INODE_SIZE)
-#define _BS_FD_READ_OK(fs, fd_index, dest) (block_store_fd_read((fs)->BlockStore_fd, (fd_index), (dest)) == FD_SIZE)
-#define _BS_FD_WRITE_OK(fs, fd_index, src) (block_store_fd_write((fs)->BlockStore_fd, (fd_index), (src)) == FD_SIZE)
+// For pointer and directory blocks, which FS_OPT_VERIFY_META checks when read
+#define _BS_META_READ_OK(fs, block_num, dest) (_BS_READ_OK(fs, block_num, dest) \
+    && (!(fs)->verify_meta || block_store_verify((fs)->BlockStore_whole, (block_num))))
+// The inode map and table are changed in place through the mapping, so their
+// checksums are refreshed by hand
+#define _INODE_MAP_BLOCK 0
+#define _BS_INODE_WRITE_OK(fs, inum, src) _inode_write((fs), (inum), (src))
+#define _TRACE_RET(ret) ((int32_t)MAX(MIN((int64_t)(ret), INT32_MAX), INT32_MIN))
+// The FD_* limits past the direct blocks, which depend on the pointer width
+#define _INDIRECT_MAX_PTRS(fs) (FD_DIRECT_MAX_PTRS + (fs)->ptrs_per_block)
+#define _DOUBLE_INDIRECT_MAX_PTRS(fs) (_INDIRECT_MAX_PTRS(fs) + (fs)->ptrs_per_block * (fs)->ptrs_per_block)
+#define _DATA_BLOCK_OK(fs, block_num) FS_DATA_BLOCK_OK(block_num, (fs)->avail_blocks)
+// Inode pointer slots, see _inode_ptr
+#define _SLOT_INDIRECT FD_DIRECT_N_PTRS
+#define _SLOT_DOUBLE_INDIRECT (FD_DIRECT_N_PTRS + 1)
 
 
 
@@ -186,32 +311,112 @@ err1:
 
 
 /**
- * Split a path into its components (delimiter: '/')
- * \param path The path to split
- * \return A dynamic array containing the path components
+ * Get a block pointer of an inode
+ * \param fs The file system
+ * \param inode The inode
+ * \param slot The pointer, a direct block index, _SLOT_INDIRECT or
+ *   _SLOT_DOUBLE_INDIRECT
+ * \return The block number, 0 if there is none
  */
-static dyn_array_t *_split_path(const char *path) {
-    if (!PATH_OK(path))
-        return NULL;
+static size_t _inode_ptr(const FS_t *fs, const inode_t *inode, size_t slot) {
+    size_t low = slot < FD_DIRECT_N_PTRS ? inode->data_direct[slot]
+        : slot == _SLOT_INDIRECT ? *inode->data_indirect : inode->data_double_indirect;
+    return fs->wide ? low | (size_t)inode->data_high[slot] << 16 : low;
+}
 
-    char *copy = strdup(path);
-    if (copy == NULL)
-        return NULL;
 
-    dyn_array_t *components = dyn_array_create(8, FS_FNAME_MAX, NULL);
-    if (components == NULL) {
-        free(copy);
-        return NULL;
-    }
 
-    char *tok, *saveptr, *str = copy;
-    while ((tok = strtok_r(str, "/", &saveptr)) != NULL) {
-        dyn_array_push_back(components, tok);
-        str = NULL;
-    }
+/**
+ * Set a block pointer of an inode, in memory only
+ * \param fs The file system
+ * \param inode The inode
+ * \param slot The pointer, see _inode_ptr
+ * \param block_num The block number, 0 for none
+ */
+static void _inode_set_ptr(const FS_t *fs, inode_t *inode, size_t slot, size_t block_num) {
+    if (slot < FD_DIRECT_N_PTRS)
+        inode->data_direct[slot] = block_num;
+    else if (slot == _SLOT_INDIRECT)
+        *inode->data_indirect = block_num;
+    else
+        inode->data_double_indirect = block_num;
+    if (fs->wide)
+        inode->data_high[slot] = block_num >> 16;
+}
 
-    free(copy);
-    return components;
+
+
+/**
+ * Get a block number from a pointer block
+ * \param fs The file system
+ * \param block The pointer block
+ * \param index The index of the pointer, below fs->ptrs_per_block
+ * \return The block number, 0 if there is none
+ */
+static size_t _ptr_get(const FS_t *fs, const ind_block_t *block, size_t index) {
+    return fs->wide ? block->wide[index] : block->narrow[index];
+}
+
+
+
+/**
+ * Set a block number in a pointer block
+ * \param fs The file system
+ * \param block The pointer block
+ * \param index The index of the pointer, below fs->ptrs_per_block
+ * \param block_num The block number, 0 for none
+ */
+static void _ptr_set(const FS_t *fs, ind_block_t *block, size_t index, size_t block_num) {
+    if (fs->wide)
+        block->wide[index] = block_num;
+    else
+        block->narrow[index] = block_num;
+}
+
+
+
+/**
+ * Get the block number of an inode block
+ * \param fs The file system
+ * \param inode_block The index of the inode block in the inode table
+ * \return The block number, 0 if the inode block is not allocated (or its
+ *   block number is bad)
+ */
+static size_t _inode_block_num(const FS_t *fs, size_t inode_block) {
+    if (inode_block < FS_FIXED_INODE_BLOCKS)
+        return 1 + inode_block;
+    size_t block_num = fs->inode_map->blocks[inode_block];
+    return _DATA_BLOCK_OK(fs, block_num) ? block_num : 0;
+}
+
+
+
+/**
+ * Check whether an inode is in use
+ * \param fs The file system
+ * \param inum The inode number
+ * \return Whether inum is in use
+ */
+static bool _inode_in_use(const FS_t *fs, size_t inum) {
+    if (!INUM_OK(inum))
+        return false;
+    return fs->inode_map->used[inum / FS_INODES_PER_BLOCK] & (1u << inum % FS_INODES_PER_BLOCK);
+}
+
+
+
+/**
+ * Find an inode in the mapping
+ * \param fs The file system
+ * \param inum The inode number
+ * \return The inode, NULL if its inode block is not allocated
+ */
+static inode_t *_inode_at(const FS_t *fs, size_t inum) {
+    size_t block_num = _inode_block_num(fs, inum / FS_INODES_PER_BLOCK);
+    if (block_num == 0)
+        return NULL;
+    inode_t *table = (inode_t*)(block_store_Data_location(fs->BlockStore_whole) + block_num*BLOCK_SIZE_BYTES);
+    return table + inum % FS_INODES_PER_BLOCK;
 }
 
 
@@ -226,9 +431,159 @@ static dyn_array_t *_split_path(const char *path) {
 static bool _inode_read(FS_t *fs, size_t inum, inode_t *dest) {
     if (fs == NULL || !INUM_OK(inum) || dest == NULL)
         return false;
-    if (!block_store_sub_test(fs->BlockStore_inode, inum))
+    if (!_inode_in_use(fs, inum))
+        return false;
+    inode_t *inode = _inode_at(fs, inum);
+    if (inode == NULL)
+        return false;
+    memcpy(dest, inode, sizeof(inode_t));
+    return true;
+}
+
+
+
+/**
+ * Store an inode and refresh the checksum of its inode block
+ * \param fs The file system to which to write
+ * \param inum The number of the inode to store
+ * \param src The inode
+ * \return Whether the write was successful
+ */
+static bool _inode_write(FS_t *fs, size_t inum, const inode_t *src) {
+    if (fs == NULL || !INUM_OK(inum) || src == NULL)
+        return false;
+    inode_t *inode = _inode_at(fs, inum);
+    if (inode == NULL)
+        return false;
+    memcpy(inode, src, sizeof(inode_t));
+    return block_store_csum_refresh(fs->BlockStore_whole, _inode_block_num(fs, inum / FS_INODES_PER_BLOCK));
+}
+
+
+
+/**
+ * Mark an inode as in use or free in the inode map
+ * \param fs The file system
+ * \param inum The inode number
+ * \param used Whether the inode is in use
+ */
+static void _inode_set_used(FS_t *fs, size_t inum, bool used) {
+    uint16_t bit = 1u << inum % FS_INODES_PER_BLOCK;
+    if (used)
+        fs->inode_map->used[inum / FS_INODES_PER_BLOCK] |= bit;
+    else
+        fs->inode_map->used[inum / FS_INODES_PER_BLOCK] &= ~bit;
+    block_store_csum_refresh(fs->BlockStore_whole, _INODE_MAP_BLOCK);
+}
+
+
+
+/**
+ * Refill the free inode cache from the inode map, growing the inode table by
+ *   a block if every allocated inode block is full
+ *   Refills scan a bounded number of masks, so allocation stays O(1) amortized
+ * \param fs The file system
+ * \return Whether any free inodes were found
+ */
+static bool _inode_refill(FS_t *fs) {
+    inodeMap_t *map = fs->inode_map;
+
+    for (size_t n=0; n<FS_INODE_BLOCKS && fs->n_free_inums < FS_FREE_INUM_CACHE; n++) {
+        size_t inode_block = fs->refill_cursor;
+        if (_inode_block_num(fs, inode_block) == 0 || map->used[inode_block] == UINT16_MAX) {
+            fs->refill_cursor = (inode_block + 1) % FS_INODE_BLOCKS;
+            continue;
+        }
+        // Highest first, so the cache hands out the lowest numbers first
+        for (int slot=FS_INODES_PER_BLOCK-1; slot>=0; slot--) {
+            if (!(map->used[inode_block] & (1u << slot)))
+                fs->free_inums[fs->n_free_inums++] = inode_block*FS_INODES_PER_BLOCK + slot;
+        }
+        fs->refill_cursor = (inode_block + 1) % FS_INODE_BLOCKS;
+        break;
+    }
+    if (fs->n_free_inums > 0)
+        return true;
+
+    // Every allocated inode block is full, so add one
+    size_t inode_block = FS_FIXED_INODE_BLOCKS;
+    while (inode_block < FS_INODE_BLOCKS && map->blocks[inode_block] != 0)
+        inode_block++;
+    if (inode_block == FS_INODE_BLOCKS)
+        return false;
+
+    size_t block_num = block_store_allocate(fs->BlockStore_whole);
+    if (block_num == SIZE_MAX)
+        return false;
+    block_t zero = {0};
+    // The map holds 16-bit block numbers, which wide volumes can outgrow
+    if (block_num > UINT16_MAX || !_BS_WRITE_OK(fs, block_num, zero)) {
+        block_store_release(fs->BlockStore_whole, block_num);
         return false;
-    return _BS_INODE_READ_OK(fs, inum, dest);
+    }
+    map->blocks[inode_block] = block_num;
+    map->used[inode_block] = 0;
+    block_store_csum_refresh(fs->BlockStore_whole, _INODE_MAP_BLOCK);
+
+    for (int slot=FS_INODES_PER_BLOCK-1; slot>=0; slot--)
+        fs->free_inums[fs->n_free_inums++] = inode_block*FS_INODES_PER_BLOCK + slot;
+    fs->refill_cursor = inode_block;
+    return true;
+}
+
+
+
+/**
+ * Free an inode, keeping its number in the free inode cache if there is room
+ * \param fs The file system
+ * \param inum The inode number
+ */
+static void _inode_free(FS_t *fs, size_t inum) {
+    _inode_set_used(fs, inum, false);
+    if (fs->n_free_inums < FS_FREE_INUM_CACHE)
+        fs->free_inums[fs->n_free_inums++] = inum;
+}
+
+
+
+/**
+ * Allocate a number of inodes
+ *   The inode map's checksum is refreshed once for the lot
+ * \param fs The file system
+ * \param n The number of inodes to allocate
+ * \param inums Where to put the new inode numbers
+ * \return Whether all n were allocated, none are if not
+ */
+static bool _inode_alloc_many(FS_t *fs, size_t n, size_t *inums) {
+    size_t n_got = 0;
+    while (n_got < n) {
+        if (fs->n_free_inums == 0 && !_inode_refill(fs))
+            break;
+        size_t inum = fs->free_inums[--fs->n_free_inums];
+        if (_inode_in_use(fs, inum))
+            continue; // Stale
+        fs->inode_map->used[inum / FS_INODES_PER_BLOCK] |= 1u << inum % FS_INODES_PER_BLOCK;
+        inums[n_got++] = inum;
+    }
+    block_store_csum_refresh(fs->BlockStore_whole, _INODE_MAP_BLOCK);
+
+    if (n_got == n)
+        return true;
+    while (n_got > 0)
+        _inode_free(fs, inums[--n_got]);
+    return false;
+}
+
+
+
+/**
+ * Allocate an inode
+ * \param fs The file system
+ * \return The new inode number, SIZE_MAX if there are none left
+ */
+static size_t _inode_alloc(FS_t *fs) {
+    size_t inum;
+    return _inode_alloc_many(fs, 1, &inum) ? inum : SIZE_MAX;
 }
 
 
@@ -250,7 +605,7 @@ static int _inode_dir_load(
     if (fs == NULL || inode == NULL || block == NULL || map == NULL)
         return -1;
 
-    size_t block_num = inode->data_direct[0];
+    size_t block_num = _inode_ptr(fs, inode, 0);
 
     if (inode->file_type != 'd')
         return -1;
@@ -261,7 +616,7 @@ static int _inode_dir_load(
         return -1;
 
     // Load the directory entries block
-    if (!_BS_READ_OK(fs, block_num, block)) {
+    if (!_BS_META_READ_OK(fs, block_num, block)) {
         bitmap_destroy(*map);
         *map = NULL;
         return -1;
@@ -290,7 +645,8 @@ static int _inode_find_child(
     int child_inum = -1;
     for (size_t i=0; i<DIR_ENTRIES_PER_BLOCK; i++) {
         directoryFile_t *entry = (directoryFile_t*)entries + i;
-        if (strncmp(entry->filename, child, FS_FNAME_MAX) == 0) {
+        // Free entries may hold anything, the names of removed files included
+        if (bitmap_test(map, i) && strncmp(entry->filename, child, FS_FNAME_MAX) == 0) {
             child_inum = entry->inum;
             break;
         }
@@ -301,89 +657,223 @@ static int _inode_find_child(
 
 
 
+/**
+ * Find a child file in a directory's loaded entry block
+ * \param entry_map The directory's map of in-use entries
+ * \param block The directory's entry block
+ * \param child The name of the child file, need not be null terminated
+ * \param len The length of child
+ * \return The inode number of the child if found, -1 if not found
+ */
+static int _dir_entries_find(uint32_t entry_map, const block_t block, const char *child, size_t len) {
+    for (size_t i=0; i<DIR_ENTRIES_PER_BLOCK; i++) {
+        if (!(entry_map & (1u << i)))
+            continue;
+        const directoryFile_t *entry = (const directoryFile_t*)block + i;
+        if (strncmp(entry->filename, child, len) == 0 && entry->filename[len] == '\0')
+            return entry->inum;
+    }
+
+    return -1;
+}
+
+
+
 /**
  * Find a child file in an inode
+ *   Only the in-use entries are searched, nothing is allocated
  * \param fs The file system in which to search
  * \param parent_inum The inode number to search
- * \param child The name of the child file for which to search
+ * \param child The name of the child file for which to search, need not be
+ *   null terminated
+ * \param len The length of child
  * \return The inode number of the child if found, -1 if not found or error
  */
-static int _inum_find_child(FS_t *fs, size_t parent_inum, const char *child) {
-    if (fs == NULL || !INUM_OK(parent_inum) || child == NULL)
+static int _inum_find_child(FS_t *fs, size_t parent_inum, const char *child, size_t len) {
+    if (fs == NULL || !INUM_OK(parent_inum) || child == NULL || len >= FS_FNAME_MAX)
         return -1;
 
     inode_t parent_inode;
-    if (!_inode_read(fs, parent_inum, &parent_inode))
+    if (!_inode_read(fs, parent_inum, &parent_inode) || parent_inode.file_type != 'd')
+        return -1;
+    if (parent_inode.dir_entry_map == 0)
         return -1;
 
-    bitmap_t *map = NULL;
     block_t block;
-    if (_inode_dir_load(fs, &parent_inode, block, &map) < 0)
+    if (!_BS_META_READ_OK(fs, _inode_ptr(fs, &parent_inode, 0), block))
         return -1;
 
-    int child_inum = _inode_find_child(&block, map, child);
-    bitmap_destroy(map);
-    return child_inum;
+    return _dir_entries_find(parent_inode.dir_entry_map, block, child, len);
 }
 
 
 
 /**
- * Get the inode number of a path
+ * Get the inode number of the start of a path relative to a directory
+ *   The path is walked in place, one component at a time
  * \param fs The file system from which to search
+ * \param dir_inum The directory a relative path starts from, absolute paths
+ *   start from the root whatever it is
  * \param path The path of the target file
- * \return The inode number of path
+ * \param path_len How much of path to walk
+ * \return The inode number of the first path_len characters of path
 */
-static int _get_inum(FS_t *fs, const char *path) {
-    if (fs == NULL || !PATH_OK(path))
+static int _get_inum_at(FS_t *fs, size_t dir_inum, const char *path, size_t path_len) {
+    if (fs == NULL || path == NULL || !INUM_OK(dir_inum))
         return -1;
 
-    dyn_array_t *path_components = _split_path(path);
-    size_t n_components = dyn_array_size(path_components);
-
-    int component_inum = 0;
-    for (size_t i=0; i<n_components; i++) {
-        char *component_name = dyn_array_at(path_components, i);
-        component_inum = _inum_find_child(fs, component_inum, component_name);
-        if (component_inum < 0) {
-            dyn_array_destroy(path_components);
-            return -1;
+    int component_inum = path[0] == '/' ? 0 : (int)dir_inum;
+    const char *component = path, *end = path + path_len;
+    while (component < end) {
+        if (*component == '/') {
+            component++;
+            continue;
         }
+        size_t len = MIN(strcspn(component, "/"), (size_t)(end - component));
+        component_inum = _inum_find_child(fs, component_inum, component, len);
+        if (component_inum < 0)
+            return -1;
+        component += len;
     }
 
-    dyn_array_destroy(path_components);
     return component_inum;
 }
 
 
 
 /**
- * Load a file descriptor
- * \param fs The file system from which to load
- * \param fd_index The index of the file descriptor to load
- * \param dest The buffer for the file descriptor
- * \return Whether the read was successful
+ * Get the inode number of the start of a path
+ * \param fs The file system from which to search
+ * \param path The path of the target file
+ * \param path_len How much of path to walk
+ * \return The inode number of the first path_len characters of path
+*/
+static int _get_inum_n(FS_t *fs, const char *path, size_t path_len) {
+    if (!PATH_OK(path))
+        return -1;
+    return _get_inum_at(fs, 0, path, path_len);
+}
+
+
+
+/**
+ * Get the inode number of a path
+ * \param fs The file system from which to search
+ * \param path The path of the target file
+ * \return The inode number of path
+*/
+static int _get_inum(FS_t *fs, const char *path) {
+    return path == NULL ? -1 : _get_inum_n(fs, path, strlen(path));
+}
+
+
+
+/**
+ * Look up an open file descriptor
+ * \param fs The file system
+ * \param fd_index The index of the file descriptor
+ * \return The file descriptor, in place in the table, NULL if it is not open
+ *   Only valid until the next descriptor is opened
+ */
+static fileDescriptor_t *_fd_get(FS_t *fs, int fd_index) {
+    if (fs == NULL || fd_index < 0 || (size_t)fd_index >= fs->n_fds)
+        return NULL;
+    if (!fs->fds[fd_index].open)
+        return NULL;
+    return &fs->fds[fd_index].fd;
+}
+
+
+
+/**
+ * Check whether a file is open for appending, appends copy into the file's
+ *   blocks without the FS lock (see fs_write)
+ * \param fs The file system
+ * \param inum The file's inode number
+ * \return Whether a descriptor open on the file has FS_O_APPEND
+ */
+static bool _fd_appending(const FS_t *fs, size_t inum) {
+    for (size_t i=0; i<fs->n_fds; i++)
+        if (fs->fds[i].open && fs->fds[i].append && fs->fds[i].fd.inum == inum)
+            return true;
+    return false;
+}
+
+
+
+/**
+ * Double the descriptor table, up to its limit
+ * \param fs The file system
+ * \return Whether the table grew
  */
-static bool _fd_read(FS_t *fs, int fd_index, fileDescriptor_t *dest) {
-    if (fs == NULL || !FD_OK(fd_index) || dest == NULL)
+static bool _fd_table_grow(FS_t *fs) {
+    if (fs->n_fds >= fs->max_fds)
         return false;
-    if (!block_store_sub_test(fs->BlockStore_fd, fd_index))
+
+    size_t n_fds = MIN(MAX(fs->n_fds * 2, FS_FD_TABLE_MIN), fs->max_fds);
+    fdSlot_t *fds = realloc(fs->fds, n_fds * sizeof(fdSlot_t));
+    if (fds == NULL)
         return false;
-    return _BS_FD_READ_OK(fs, fd_index, dest);
+
+    // The free list is empty, so the new slots make up all of it, lowest first
+    for (size_t i=fs->n_fds; i<n_fds; i++) {
+        fds[i].open = false;
+        fds[i].next_free = i + 1 < n_fds ? (int)(i + 1) : -1;
+    }
+    fs->fd_free = fs->n_fds;
+    fs->fds = fds;
+    fs->n_fds = n_fds;
+    return true;
+}
+
+
+
+/**
+ * Take a slot off the descriptor table's free list, growing the table if the
+ *   list is empty
+ * \param fs The file system
+ * \return The index of the slot, -1 if the table is full
+ */
+static int _fd_alloc(FS_t *fs) {
+    if (fs->fd_free < 0 && !_fd_table_grow(fs))
+        return -1;
+
+    int fd_index = fs->fd_free;
+    fs->fd_free = fs->fds[fd_index].next_free;
+    fs->fds[fd_index].open = true;
+    fs->fds[fd_index].wbuf = NULL;
+    fs->fds[fd_index].wbuf_start = 0;
+    fs->fds[fd_index].wbuf_len = 0;
+    fs->fds[fd_index].append = false;
+    return fd_index;
+}
+
+
+
+/**
+ * Put a descriptor's slot back on the free list
+ * \param fs The file system
+ * \param fd_index The index of an open descriptor
+ */
+static void _fd_release(FS_t *fs, int fd_index) {
+    fs->fds[fd_index].open = false;
+    fs->fds[fd_index].next_free = fs->fd_free;
+    fs->fd_free = fd_index;
 }
 
 
 
 /**
  * Calculate the data block index in a file of a file descriptor cursor
+ * \param fs The file system of the file
  * \param fd An open file descriptor for the file
  * \return The data block index
  */
-static size_t _fd_cursor_get_block_index(fileDescriptor_t *fd) {
+static size_t _fd_cursor_get_block_index(const FS_t *fs, fileDescriptor_t *fd) {
     size_t block_index = 0;
 
     switch (fd->usage) {
-        case FD_DOUBLE_INDIRECT: block_index += FD_INDIRECT_N_PTRS; NO_BREAK;
+        case FD_DOUBLE_INDIRECT: block_index += fs->ptrs_per_block; NO_BREAK;
         case FD_INDIRECT:        block_index += FD_DIRECT_N_PTRS;   NO_BREAK;
         case FD_DIRECT:          block_index += fd->locate_order;   break;
         default:                 return SIZE_MAX;
@@ -396,31 +886,33 @@ static size_t _fd_cursor_get_block_index(fileDescriptor_t *fd) {
 
 /**
  * Calculate the offset (from BOF) of a file descriptor cursor
+ * \param fs The file system of the file
  * \param fd An open file descriptor for the file
  * \return The calculated offset
  */
-static size_t _fd_cursor_get(fileDescriptor_t *fd) {
-    return _fd_cursor_get_block_index(fd)*BLOCK_SIZE_BYTES + fd->locate_offset;
+static size_t _fd_cursor_get(const FS_t *fs, fileDescriptor_t *fd) {
+    return _fd_cursor_get_block_index(fs, fd)*BLOCK_SIZE_BYTES + fd->locate_offset;
 }
 
 
 
 /**
  * Set a file descriptor cursor to an offset (from BOF)
+ * \param fs The file system of the file
  * \param fd An open file descriptor for the file
  * \param offset The offset
  * \return Whether the offset was valid and the cursor was set successfully
  */
-static bool _fd_cursor_set(fileDescriptor_t *fd, size_t offset) {
+static bool _fd_cursor_set(const FS_t *fs, fileDescriptor_t *fd, size_t offset) {
     if (fd == NULL)
         return false;
 
     fileDescriptorUsage_t usage;
     if (offset < FD_DIRECT_MAX_OFF)
         usage = FD_DIRECT;
-    else if (offset < FD_INDIRECT_MAX_OFF)
+    else if (offset < _INDIRECT_MAX_PTRS(fs)*BLOCK_SIZE_BYTES)
         usage = FD_INDIRECT;
-    else if (offset < FD_DOUBLE_INDIRECT_MAX_OFF)
+    else if (offset < _DOUBLE_INDIRECT_MAX_PTRS(fs)*BLOCK_SIZE_BYTES)
         usage = FD_DOUBLE_INDIRECT;
     else
         return false;
@@ -431,7 +923,7 @@ static bool _fd_cursor_set(fileDescriptor_t *fd, size_t offset) {
 
     switch (usage) {
         case FD_DOUBLE_INDIRECT:
-            fd->locate_order -= FD_INDIRECT_N_PTRS;  NO_BREAK;
+            fd->locate_order -= fs->ptrs_per_block;  NO_BREAK;
         case FD_INDIRECT:
             fd->locate_order -= FD_DIRECT_N_PTRS;    NO_BREAK;
         default:
@@ -444,15 +936,76 @@ static bool _fd_cursor_set(fileDescriptor_t *fd, size_t offset) {
 
 
 /**
- * Determine if a file descriptor cursor points in a data block of the file
- * \param inode The inode of the file
- * \param fd An open file descriptor for the file
- * \return Whether the file owns the block in which fd's cursor points
+ * Write out the data a buffered descriptor has gathered
+ *   The data goes through fs_write with the buffer detached, starting at the
+ *   offset it was buffered for, which leaves the cursor just after it, or at
+ *   the end of the file for an append descriptor
+ * \param fs The file system
+ * \param fd_index The index of an open descriptor
+ * \return Whether all of the data was written, it is dropped either way
  */
-static bool _cursor_in_owned_block(inode_t *inode, fileDescriptor_t *fd) {
-    size_t cursor_block_index = _fd_cursor_get_block_index(fd);
-    size_t n_file_blocks = ceil((double)inode->file_size / BLOCK_SIZE_BYTES);
-    return cursor_block_index < n_file_blocks;
+static bool _fd_flush(FS_t *fs, int fd_index) {
+    fdSlot_t *slot = &fs->fds[fd_index];
+    if (slot->wbuf == NULL || slot->wbuf_len == 0)
+        return true;
+
+    uint8_t *wbuf = slot->wbuf;
+    slot->wbuf = NULL;
+    bool ok = (slot->append || _fd_cursor_set(fs, &slot->fd, slot->wbuf_start))
+        && fs_write(fs, fd_index, wbuf, slot->wbuf_len) == (ssize_t)slot->wbuf_len;
+    slot->wbuf = wbuf;
+    slot->wbuf_len = 0;
+    return ok;
+}
+
+
+
+/**
+ * Gather a small write in a buffered descriptor's buffer
+ *   Only writes that carry on where the buffered data ends are gathered, the
+ *   buffer is flushed when it reaches a block boundary so every flush after
+ *   the first in a run writes one whole block
+ *   Append descriptors gather whole writes until the next doesn't fit
+ * \param fs The file system
+ * \param fd_index The index of an open buffered descriptor
+ * \param src The data to write
+ * \param nbyte The number of bytes to write
+ * \return The number of bytes taken, -1 if a flush failed
+ */
+static ssize_t _fd_buffer_write(FS_t *fs, int fd_index, const void *src, size_t nbyte) {
+    fdSlot_t *slot = &fs->fds[fd_index];
+
+    // Appends are placed when flushed, a write is never split across two
+    //   flushes so other appenders can't land in the middle of it
+    if (slot->append) {
+        if (slot->wbuf_len + nbyte > BLOCK_SIZE_BYTES && !_fd_flush(fs, fd_index))
+            return -1;
+        memcpy(slot->wbuf + slot->wbuf_len, src, nbyte);
+        slot->wbuf_len += nbyte;
+        return nbyte;
+    }
+
+    size_t cursor = _fd_cursor_get(fs, &slot->fd);
+    if (slot->wbuf_len > 0 && cursor != slot->wbuf_start + slot->wbuf_len && !_fd_flush(fs, fd_index))
+        return -1;
+
+    size_t done = 0;
+    while (done < nbyte) {
+        if (slot->wbuf_len == 0)
+            slot->wbuf_start = cursor;
+        size_t room = BLOCK_SIZE_BYTES - slot->wbuf_start % BLOCK_SIZE_BYTES - slot->wbuf_len;
+        size_t n = MIN(room, nbyte - done);
+        memcpy(slot->wbuf + slot->wbuf_len, (const uint8_t*)src + done, n);
+        slot->wbuf_len += n;
+        done += n;
+        cursor += n;
+        if (!_fd_cursor_set(fs, &slot->fd, cursor))
+            return -1;
+        if (n == room && !_fd_flush(fs, fd_index))
+            return -1;
+    }
+
+    return nbyte;
 }
 
 
@@ -461,10 +1014,12 @@ static bool _cursor_in_owned_block(inode_t *inode, fileDescriptor_t *fd) {
  * Allocate and add a new data block to a file
  * \param fs The file system from which to allocate
  * \param inode The file to which to add the new data block
+ * \param index The index of the new data block in the file, must be the first
+ *   index the file does not own yet
  * \return The block number of the new data block if successful, -1 if there is
  *   an error allocating or adding the block, -2 if fs is out of space
  */
-static ssize_t _inode_add_owned_block(FS_t *fs, inode_t *inode) {
+static ssize_t _inode_add_owned_block(FS_t *fs, inode_t *inode, size_t index) {
     if (fs == NULL || inode == NULL)
         goto err1;
 
@@ -478,59 +1033,61 @@ static ssize_t _inode_add_owned_block(FS_t *fs, inode_t *inode) {
         goto err2_no_space;
 
     ind_block_t ind_block1, ind_block2;
-    size_t index = ceil((double)inode->file_size / BLOCK_SIZE_BYTES);
 
     if (index < FD_DIRECT_MAX_PTRS) {
-        inode->data_direct[index] = new_ptr;
+        _inode_set_ptr(fs, inode, index, new_ptr);
         if (!_BS_INODE_WRITE_OK(fs, inode->inum, inode))
             goto err2;
     }
 
-    else if (index < FD_INDIRECT_MAX_PTRS) {
+    else if (index < _INDIRECT_MAX_PTRS(fs)) {
         index -= FD_DIRECT_MAX_PTRS;
         if (index == 0) {
             if ((new_ind_ptr = block_store_allocate(bs_whole)) == SIZE_MAX)
                 goto err2_no_space;
-            *inode->data_indirect = new_ind_ptr;
+            _inode_set_ptr(fs, inode, _SLOT_INDIRECT, new_ind_ptr);
             if (!_BS_INODE_WRITE_OK(fs, inode->inum, inode))
                 goto err2;
         }
 
-        if (!_BS_READ_OK(fs, *inode->data_indirect, ind_block1))
+        size_t ind_ptr = _inode_ptr(fs, inode, _SLOT_INDIRECT);
+        if (!_BS_META_READ_OK(fs, ind_ptr, &ind_block1))
             goto err2;
-        ind_block1[index] = new_ptr;
-        if (!_BS_WRITE_OK(fs, *inode->data_indirect, ind_block1))
+        _ptr_set(fs, &ind_block1, index, new_ptr);
+        if (!_BS_WRITE_OK(fs, ind_ptr, &ind_block1))
             goto err2;
     }
 
-    else if (index < FD_DOUBLE_INDIRECT_MAX_PTRS) {
-        index -= FD_INDIRECT_MAX_PTRS;
+    else if (index < _DOUBLE_INDIRECT_MAX_PTRS(fs)) {
+        index -= _INDIRECT_MAX_PTRS(fs);
         if (index == 0) {
             if ((new_db_ind_ptr = block_store_allocate(bs_whole)) == SIZE_MAX)
                 goto err2_no_space;
-            inode->data_double_indirect = new_db_ind_ptr;
+            _inode_set_ptr(fs, inode, _SLOT_DOUBLE_INDIRECT, new_db_ind_ptr);
             if (!_BS_INODE_WRITE_OK(fs, inode->inum, inode))
                 goto err2;
         }
 
-        if (!_BS_READ_OK(fs, inode->data_double_indirect, ind_block1))
+        size_t db_ind_ptr = _inode_ptr(fs, inode, _SLOT_DOUBLE_INDIRECT);
+        if (!_BS_META_READ_OK(fs, db_ind_ptr, &ind_block1))
             goto err2;
 
-        size_t ind_index1 = index / BLOCK_PTRS_PER_BLOCK;
-        size_t ind_index2 = index % BLOCK_PTRS_PER_BLOCK;
+        size_t ind_index1 = index / fs->ptrs_per_block;
+        size_t ind_index2 = index % fs->ptrs_per_block;
 
         if (ind_index2 == 0) {
             if ((new_ind_ptr = block_store_allocate(bs_whole)) == SIZE_MAX)
                 goto err2_no_space;
-            ind_block1[ind_index1] = new_ind_ptr;
-            if (!_BS_WRITE_OK(fs, inode->data_double_indirect, ind_block1))
+            _ptr_set(fs, &ind_block1, ind_index1, new_ind_ptr);
+            if (!_BS_WRITE_OK(fs, db_ind_ptr, &ind_block1))
                 goto err2;
         }
 
-        if (!_BS_READ_OK(fs, ind_block1[ind_index1], ind_block2))
+        size_t ind_ptr = _ptr_get(fs, &ind_block1, ind_index1);
+        if (!_BS_META_READ_OK(fs, ind_ptr, &ind_block2))
             goto err2;
-        ind_block2[ind_index2] = new_ptr;
-        if (!_BS_WRITE_OK(fs, ind_block1[ind_index1], ind_block2))
+        _ptr_set(fs, &ind_block2, ind_index2, new_ptr);
+        if (!_BS_WRITE_OK(fs, ind_ptr, &ind_block2))
             goto err2;
     }
 
@@ -558,120 +1115,575 @@ err1:
 
 
 /**
- * Load the data block in which a file descriptor cursor points
+ * Count the data blocks owned by a file
+ * \param inode The inode of the file
+ * \return The number of data blocks
+ */
+static size_t _inode_n_blocks(const inode_t *inode) {
+    if (inode->file_type == 'd')
+        return inode->file_size > 0 ? 1 : 0;
+    return (inode->file_size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+}
+
+
+
+/**
+ * Resolve the block numbers of a run of consecutive data blocks in a file
+ *   Each pointer block along the run is loaded only once
  * \param fs The file system from which to read
  * \param inode The inode of the file
- * \param fd An open file descriptor for the file
- * \param dest A buffer for the data block
- * \return Whether the read was successful
+ * \param first The index of the first data block of the run in the file
+ * \param n The number of data blocks in the run
+ * \param block_nums A buffer for the n block numbers
+ * \return Whether every block number was resolved
  */
-static bool _fd_data_block_read(
+static bool _inode_block_nums(
     FS_t *fs,
     inode_t *inode,
-    fileDescriptor_t *fd,
-    void *dest
+    size_t first,
+    size_t n,
+    size_t *block_nums
 ) {
-    if (fs == NULL || inode == NULL || fd == NULL || dest == NULL)
+    if (fs == NULL || inode == NULL || block_nums == NULL)
         return false;
 
-    uint16_t *ind_block = dest;
+    ind_block_t ind_block, db_ind_block;
+    size_t ind_block_num = SIZE_MAX; // The pointer block loaded in ind_block
+    bool db_ind_loaded = false;
 
-    if (fd->usage == FD_DIRECT) {
-        uint32_t block_num = fd->locate_order;
-        return _BS_READ_OK(fs, inode->data_direct[block_num], dest);
-    }
+    for (size_t i=0; i<n; i++) {
+        size_t index = first + i;
+        size_t ptr_block_num;
 
-    else if (fd->usage == FD_INDIRECT) {
-        if (!_BS_READ_OK(fs, *inode->data_indirect, ind_block))
-            return false;
-        return _BS_READ_OK(fs, ind_block[fd->locate_order], dest);
-    }
+        if (index < FD_DIRECT_MAX_PTRS) {
+            block_nums[i] = _inode_ptr(fs, inode, index);
+            continue;
+        }
 
-    else if (fd->usage == FD_DOUBLE_INDIRECT) {
-        if (!_BS_READ_OK(fs, inode->data_double_indirect, ind_block))
-            return false;
-        size_t ind_index = fd->locate_order / BLOCK_PTRS_PER_BLOCK;
-        if (!_BS_READ_OK(fs, ind_block[ind_index], ind_block))
+        else if (index < _INDIRECT_MAX_PTRS(fs)) {
+            index -= FD_DIRECT_MAX_PTRS;
+            ptr_block_num = _inode_ptr(fs, inode, _SLOT_INDIRECT);
+        }
+
+        else if (index < _DOUBLE_INDIRECT_MAX_PTRS(fs)) {
+            index -= _INDIRECT_MAX_PTRS(fs);
+            if (!db_ind_loaded) {
+                if (!_BS_META_READ_OK(fs, _inode_ptr(fs, inode, _SLOT_DOUBLE_INDIRECT), &db_ind_block))
+                    return false;
+                db_ind_loaded = true;
+            }
+            ptr_block_num = _ptr_get(fs, &db_ind_block, index / fs->ptrs_per_block);
+            index %= fs->ptrs_per_block;
+        }
+
+        else {
             return false;
-        uint16_t db_ind_index = fd->locate_order % BLOCK_PTRS_PER_BLOCK;
-        return _BS_READ_OK(fs, ind_block[db_ind_index], dest);
+        }
+
+        if (ptr_block_num != ind_block_num) {
+            if (!_BS_META_READ_OK(fs, ptr_block_num, &ind_block))
+                return false;
+            ind_block_num = ptr_block_num;
+        }
+        block_nums[i] = _ptr_get(fs, &ind_block, index);
     }
 
-    // Catch invalid fd usage and any fallthrough
-    return false;
+    return true;
 }
 
 
 
 /**
- * Write the data block in which a file descriptor cursor points
- * \param fs The file system in which to write
- * \param inode The inode of the file
- * \param fd An open file descriptor for the file
- * \param src The block to write
- * \return Whether the write was successful
+ * Make sure a pointer block exists, allocating a zeroed one if it does not
+ * \param fs The file system from which to allocate
+ * \param ptr The pointer to the pointer block, 0 if there is none yet
+ * \return 0 if successful, -1 if there is an error, -2 if fs is out of space
  */
-static bool _fd_data_block_write(
-    FS_t *fs,
-    inode_t *inode,
-    fileDescriptor_t *fd,
-    const void *src
-) {
-    if (fs == NULL || inode == NULL || fd == NULL || src == NULL)
-        return false;
+static int _ptr_block_ensure(FS_t *fs, size_t *ptr) {
+    if (*ptr != 0)
+        return 0;
 
-    ind_block_t ind_block;
+    size_t block_num = block_store_allocate(fs->BlockStore_whole);
+    if (block_num == SIZE_MAX)
+        return -2;
 
-    if (fd->usage == FD_DIRECT) {
-        uint32_t block_num = fd->locate_order;
-        return _BS_WRITE_OK(fs, inode->data_direct[block_num], src);
+    block_t zero = {0};
+    if (!_BS_WRITE_OK(fs, block_num, zero)) {
+        block_store_release(fs->BlockStore_whole, block_num);
+        return -1;
     }
 
-    else if (fd->usage == FD_INDIRECT) {
-        if (!_BS_READ_OK(fs, *inode->data_indirect, ind_block))
-            return -1;
-        return _BS_WRITE_OK(fs, ind_block[fd->locate_order], src);
-    }
+    *ptr = block_num;
+    return 0;
+}
 
-    else if (fd->usage == FD_DOUBLE_INDIRECT) {
-        if (!_BS_READ_OK(fs, inode->data_double_indirect, ind_block))
-            return -1;
-        size_t ind_index = fd->locate_order / BLOCK_PTRS_PER_BLOCK;
-        if (!_BS_READ_OK(fs, ind_block[ind_index], ind_block))
-            return -1;
-        uint16_t db_ind_index = fd->locate_order % BLOCK_PTRS_PER_BLOCK;
-        return _BS_WRITE_OK(fs, ind_block[db_ind_index], src);
+
+
+/**
+ * Set the block number at any data block index of a file, creating the
+ *   pointer blocks along the way
+ *   New pointer blocks are zeroed so the indices that are never set read as 0
+ *   (no block), the inode itself is only updated in memory
+ * \param fs The file system to which to write
+ * \param inode The inode of the file
+ * \param index The index of the data block in the file
+ * \param block_num The block number to store, 0 for none
+ * \return 0 if successful, -1 if there is an error, -2 if fs is out of space
+ */
+static int _inode_set_block_num(FS_t *fs, inode_t *inode, size_t index, size_t block_num) {
+    ind_block_t ind_block;
+    size_t ptr_block_num;
+    int ret;
+
+    if (index < FD_DIRECT_MAX_PTRS) {
+        _inode_set_ptr(fs, inode, index, block_num);
+        return 0;
     }
 
-    // Catch invalid fd usage and any fallthrough
-    return false;
+    else if (index < _INDIRECT_MAX_PTRS(fs)) {
+        index -= FD_DIRECT_MAX_PTRS;
+        ptr_block_num = _inode_ptr(fs, inode, _SLOT_INDIRECT);
+        if ((ret = _ptr_block_ensure(fs, &ptr_block_num)) < 0)
+            return ret;
+        _inode_set_ptr(fs, inode, _SLOT_INDIRECT, ptr_block_num);
+    }
+
+    else if (index < _DOUBLE_INDIRECT_MAX_PTRS(fs)) {
+        index -= _INDIRECT_MAX_PTRS(fs);
+        size_t db_ind_ptr = _inode_ptr(fs, inode, _SLOT_DOUBLE_INDIRECT);
+        if ((ret = _ptr_block_ensure(fs, &db_ind_ptr)) < 0)
+            return ret;
+        _inode_set_ptr(fs, inode, _SLOT_DOUBLE_INDIRECT, db_ind_ptr);
+        if (!_BS_META_READ_OK(fs, db_ind_ptr, &ind_block))
+            return -1;
+        ptr_block_num = _ptr_get(fs, &ind_block, index / fs->ptrs_per_block);
+        if (ptr_block_num == 0) {
+            if ((ret = _ptr_block_ensure(fs, &ptr_block_num)) < 0)
+                return ret;
+            _ptr_set(fs, &ind_block, index / fs->ptrs_per_block, ptr_block_num);
+            if (!_BS_WRITE_OK(fs, db_ind_ptr, &ind_block))
+                return -1;
+        }
+        index %= fs->ptrs_per_block;
+    }
+
+    else {
+        return -1;
+    }
+
+    if (!_BS_META_READ_OK(fs, ptr_block_num, &ind_block))
+        return -1;
+    _ptr_set(fs, &ind_block, index, block_num);
+    if (!_BS_WRITE_OK(fs, ptr_block_num, &ind_block))
+        return -1;
+
+    return 0;
+}
+
+
+
+/**
+ * Give a file its own copy of a data block it shares with other files before
+ *   the block is changed, the inode is written back if it changes
+ *   The old block keeps its contents for the other files, so it can still be
+ *   read from after this
+ * \param fs The file system from which to allocate
+ * \param inode The inode of the file
+ * \param index The index of the data block in the file
+ * \param block_num The block number at index
+ * \return The block number of the private block (block_num itself if it was
+ *   not shared), -1 if there is an error, -2 if fs is out of space
+ */
+static ssize_t _inode_unshare_block(FS_t *fs, inode_t *inode, size_t index, size_t block_num) {
+    block_store_t *bs_whole = fs->BlockStore_whole;
+    if (block_store_refs(bs_whole, block_num) == 0)
+        return block_num;
+
+    size_t copy = block_store_allocate(bs_whole);
+    if (copy == SIZE_MAX)
+        return -2;
+
+    int ret = _inode_set_block_num(fs, inode, index, copy);
+    if (ret < 0 || !_BS_INODE_WRITE_OK(fs, inode->inum, inode)) {
+        block_store_release(bs_whole, copy);
+        return ret < 0 ? ret : -1;
+    }
+    block_store_release(bs_whole, block_num); // Drops this file's reference
+    return copy;
+}
+
+
+
+/**
+ * Load and decompress one cluster of a compressed file
+ * \param fs The file system from which to read
+ * \param inode The inode of the file
+ * \param cluster The index of the cluster in the file
+ * \param data A buffer of FS_CLUSTER_BYTES for the cluster's data
+ * \return The number of bytes in the cluster (0 if it is past EOF), SIZE_MAX if
+ *   there is an error or the cluster is corrupt
+ */
+static size_t _cluster_load(FS_t *fs, inode_t *inode, size_t cluster, uint8_t *data) {
+    size_t start = cluster * FS_CLUSTER_BYTES;
+    if (start >= inode->file_size)
+        return 0;
+    size_t len = MIN(FS_CLUSTER_BYTES, inode->file_size - start);
+    size_t n_slots = (len + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+
+    size_t block_nums[FS_CLUSTER_BLOCKS];
+    if (!_inode_block_nums(fs, inode, cluster * FS_CLUSTER_BLOCKS, n_slots, block_nums))
+        return SIZE_MAX;
+    size_t n_stored = 0;
+    while (n_stored < n_slots && block_nums[n_stored] != 0)
+        n_stored++;
+    if (n_stored == 0)
+        return SIZE_MAX;
+
+    // A cluster that uses all of its slots is stored as is
+    uint8_t packed[FS_CLUSTER_BYTES];
+    uint8_t *dst = n_stored == n_slots ? data : packed;
+    void *block_bufs[FS_CLUSTER_BLOCKS];
+    for (size_t i=0; i<n_stored; i++)
+        block_bufs[i] = dst + i*BLOCK_SIZE_BYTES;
+    if (block_store_read_many(fs->BlockStore_whole, block_nums, block_bufs, n_stored)
+            != n_stored*BLOCK_SIZE_BYTES)
+        return SIZE_MAX;
+    if (dst == data)
+        return len;
+
+    uint32_t packed_len;
+    memcpy(&packed_len, packed, sizeof(packed_len));
+    if (packed_len > n_stored*BLOCK_SIZE_BYTES - sizeof(packed_len))
+        return SIZE_MAX;
+    if (lz_decompress(packed + sizeof(packed_len), packed_len, data, FS_CLUSTER_BYTES) != len)
+        return SIZE_MAX;
+
+    return len;
+}
+
+
+
+/**
+ * Compress and store one cluster of a compressed file, replacing its old blocks
+ *   A compressed cluster is a 4 byte length followed by the LZ data, padded to
+ *   a whole number of blocks, and leaves the slots after it empty (0); it is
+ *   stored as is instead if that would not save at least one block
+ *   The inode itself is only updated in memory
+ * \param fs The file system to which to write
+ * \param inode The inode of the file
+ * \param cluster The index of the cluster in the file
+ * \param data A buffer of FS_CLUSTER_BYTES with the cluster's data, zeroed past len
+ * \param len The number of bytes in the cluster, no less than it had before
+ * \return 0 if successful, -1 if there is an error, -2 if fs is out of space
+ */
+static int _cluster_store(FS_t *fs, inode_t *inode, size_t cluster, const uint8_t *data, size_t len) {
+    block_store_t *bs_whole = fs->BlockStore_whole;
+    size_t first = cluster * FS_CLUSTER_BLOCKS;
+    size_t start = cluster * FS_CLUSTER_BYTES;
+    size_t n_slots = (len + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    int ret;
+
+    // The blocks that hold the cluster now
+    size_t old_len = start < inode->file_size ? MIN(FS_CLUSTER_BYTES, inode->file_size - start) : 0;
+    size_t n_old = (old_len + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    size_t old_nums[FS_CLUSTER_BLOCKS];
+    if (!_inode_block_nums(fs, inode, first, n_old, old_nums))
+        return -1;
+
+    // Create the pointer blocks for the new slots up front so that nothing
+    // can run out of space once the new data blocks are in place
+    for (size_t i=n_old; i<n_slots; i++)
+        if ((ret = _inode_set_block_num(fs, inode, first + i, 0)) < 0)
+            return ret;
+
+    uint8_t packed[FS_CLUSTER_BYTES];
+    const uint8_t *stored = data;
+    size_t n_stored = n_slots;
+    if (n_slots > 1) {
+        uint32_t packed_len = lz_compress(data, len, packed + sizeof(packed_len),
+                                          (n_slots - 1)*BLOCK_SIZE_BYTES - sizeof(packed_len));
+        if (packed_len > 0) {
+            memcpy(packed, &packed_len, sizeof(packed_len));
+            n_stored = (sizeof(packed_len) + packed_len + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+            memset(packed + sizeof(packed_len) + packed_len, 0,
+                   n_stored*BLOCK_SIZE_BYTES - sizeof(packed_len) - packed_len);
+            stored = packed;
+        }
+    }
+
+    // Write the new blocks before letting go of the old ones
+    size_t new_nums[FS_CLUSTER_BLOCKS];
+    const void *block_bufs[FS_CLUSTER_BLOCKS];
+    size_t n_new = 0;
+    for (; n_new<n_stored; n_new++) {
+        if ((new_nums[n_new] = block_store_allocate(bs_whole)) == SIZE_MAX) {
+            ret = -2;
+            goto err;
+        }
+        block_bufs[n_new] = stored + n_new*BLOCK_SIZE_BYTES;
+    }
+    ret = -1;
+    if (block_store_write_many(bs_whole, new_nums, block_bufs, n_stored) != n_stored*BLOCK_SIZE_BYTES)
+        goto err;
+
+    size_t n_set = 0;
+    for (; n_set<n_slots; n_set++)
+        if (_inode_set_block_num(fs, inode, first + n_set, n_set < n_stored ? new_nums[n_set] : 0) < 0)
+            goto err_unset;
+
+    for (size_t i=0; i<n_old; i++)
+        if (old_nums[i] != 0)
+            block_store_release(bs_whole, old_nums[i]);
+
+    return 0;
+err_unset:
+    // Point the slots already switched back at the old blocks (their pointer
+    // blocks exist, so this only fails if the device does)
+    while (n_set-- > 0)
+        _inode_set_block_num(fs, inode, first + n_set, n_set < n_old ? old_nums[n_set] : 0);
+err:
+    while (n_new-- > 0)
+        block_store_release(bs_whole, new_nums[n_new]);
+    return ret;
+}
+
+
+
+/**
+ * Read from a compressed file, decompressing only the clusters in the range
+ * \param fs The file system from which to read
+ * \param inode The inode of the file
+ * \param cursor The offset in the file at which to start
+ * \param dest The buffer to which to read
+ * \param nbyte The number of bytes to read, must not pass EOF
+ * \return Whether all nbyte bytes were read
+ */
+static bool _compressed_read(FS_t *fs, inode_t *inode, size_t cursor, void *dest, size_t nbyte) {
+    uint8_t data[FS_CLUSTER_BYTES];
+
+    while (nbyte > 0) {
+        size_t offset = cursor % FS_CLUSTER_BYTES;
+        size_t n = MIN(nbyte, FS_CLUSTER_BYTES - offset);
+
+        if (_cluster_load(fs, inode, cursor / FS_CLUSTER_BYTES, data) == SIZE_MAX)
+            return false;
+        memcpy(dest, data + offset, n);
+
+        cursor += n;
+        dest = (uint8_t*)dest + n;
+        nbyte -= n;
+    }
+
+    return true;
+}
+
+
+
+/**
+ * Write to a compressed file, a cluster at a time
+ *   Each cluster in the range is decompressed (unless it is overwritten
+ *   entirely), patched and compressed again
+ * \param fs The file system to which to write
+ * \param inode The inode of the file, updated in memory only
+ * \param cursor The offset in the file at which to start
+ * \param src The data to write
+ * \param nbyte The number of bytes to write
+ * \return The number of bytes written (< nbyte IFF out of space), -1 on error
+ */
+static ssize_t _compressed_write(FS_t *fs, inode_t *inode, size_t cursor, const void *src, size_t nbyte) {
+    uint8_t data[FS_CLUSTER_BYTES];
+    size_t n_written = 0;
+
+    while (n_written < nbyte) {
+        size_t cluster = cursor / FS_CLUSTER_BYTES;
+        size_t offset = cursor % FS_CLUSTER_BYTES;
+        size_t n = MIN(nbyte - n_written, FS_CLUSTER_BYTES - offset);
+
+        memset(data, 0, sizeof(data));
+        size_t len = 0;
+        if (n < FS_CLUSTER_BYTES && (len = _cluster_load(fs, inode, cluster, data)) == SIZE_MAX)
+            return -1;
+        memcpy(data + offset, (const uint8_t*)src + n_written, n);
+
+        int ret = _cluster_store(fs, inode, cluster, data, MAX(len, offset + n));
+        if (ret == -2)
+            break; // No more space available
+        if (ret < 0)
+            return -1;
+
+        cursor += n;
+        n_written += n;
+        if (cursor > inode->file_size)
+            inode->file_size = cursor;
+    }
+
+    return n_written;
+}
+
+
+
+/**
+ * Translate file system options to block store options
+ * \param opts OR'd fs_opt_t values
+ * \return OR'd block_store_opt_t values
+ */
+static int _bs_opts(int opts) {
+    int bs_opts = BS_OPT_NONE;
+    if (opts & FS_OPT_ASYNC_IO)
+        bs_opts |= BS_OPT_ASYNC_IO;
+    if (opts & FS_OPT_HUGEPAGES)
+        bs_opts |= BS_OPT_HUGEPAGES;
+    if (opts & FS_OPT_VERIFY)
+        bs_opts |= BS_OPT_VERIFY;
+    if (opts & (FS_OPT_CSUM | FS_OPT_VERIFY_META))
+        bs_opts |= BS_OPT_CSUM;
+    if (opts & FS_OPT_DEDUP)
+        bs_opts |= BS_OPT_DEDUP;
+    if (opts & FS_OPT_TRACK_DIRTY)
+        bs_opts |= BS_OPT_DIRTY;
+    if (opts & FS_OPT_WIDE)
+        bs_opts |= BS_OPT_WIDE;
+    return bs_opts;
+}
+
+
+
+/**
+ * Set up the lock held by the descriptor calls and the per thread trace depth
+ * \param fs The file system
+ * \return Whether both could be set up
+ */
+static bool _fs_lock_init(FS_t *fs) {
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0)
+        return false;
+    bool ok = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE) == 0
+        && pthread_mutex_init(&fs->lock, &attr) == 0;
+    pthread_mutexattr_destroy(&attr);
+    if (ok && pthread_key_create(&fs->trace_depth, NULL) != 0) {
+        pthread_mutex_destroy(&fs->lock);
+        ok = false;
+    }
+    return ok;
+}
+
+
+
+/**
+ * Start timing a call for the trace
+ *   Only a thread's outermost call into an FS is traced, so the calls the FS
+ *   makes to itself (flushing a buffered descriptor goes through fs_write)
+ *   are not replayed twice, while calls into another FS made meanwhile are
+ *   traced there; every _trace_begin needs a _trace_end
+ * \param fs The file system
+ * \return The call's start time, 0 if it is not traced
+ */
+static uint64_t _trace_begin(FS_t *fs) {
+    if (fs == NULL)
+        return 0;
+    intptr_t depth = (intptr_t)pthread_getspecific(fs->trace_depth);
+    pthread_setspecific(fs->trace_depth, (void *)(depth + 1));
+    if (depth > 0 || fs->trace == NULL)
+        return 0;
+    return fs_trace_clock();
+}
+
+
+
+/**
+ * Finish timing a call and trace it
+ * \param fs The file system
+ * \param start What _trace_begin returned
+ * \param rec The call, its times are filled in here
+ * \param path The call's path, NULL if it has none
+ */
+static void _trace_end(FS_t *fs, uint64_t start, fs_trace_rec_t rec, const char *path) {
+    if (fs == NULL)
+        return;
+    intptr_t depth = (intptr_t)pthread_getspecific(fs->trace_depth);
+    pthread_setspecific(fs->trace_depth, (void *)(depth - 1));
+    if (start == 0)
+        return;
+    rec.start_ns = start;
+    rec.latency_ns = MIN(fs_trace_clock() - start, UINT32_MAX);
+    fs_trace_append(fs->trace, &rec, path);
+}
+
+
+
+/**
+ * Get a descriptor's cursor for the trace
+ * \param fs The file system
+ * \param fd_index The index of the descriptor
+ * \return The cursor, -1 if the descriptor isn't open or the call isn't traced
+ */
+static int64_t _trace_cursor(FS_t *fs, int fd_index) {
+    fileDescriptor_t *fd = fs->trace == NULL ? NULL : _fd_get(fs, fd_index);
+    return fd == NULL ? -1 : (int64_t)_fd_cursor_get(fs, fd);
+}
+
+
+
+/**
+ * Take a file system's geometry from its block store: wide volumes are the
+ *   ones with more blocks than 16-bit pointers reach
+ * \param fs The file system, with its block store set
+ */
+static void _fs_geometry(FS_t *fs) {
+    fs->avail_blocks = block_store_get_avail_blocks(fs->BlockStore_whole);
+    fs->wide = fs->avail_blocks > BLOCK_STORE_AVAIL_BLOCKS;
+    fs->n_blocks = fs->wide ? BLOCK_STORE_WIDE_NUM_BLOCKS : BLOCK_STORE_NUM_BLOCKS;
+    fs->ptrs_per_block = fs->wide ? BLOCK_PTRS_PER_WIDE_BLOCK : BLOCK_PTRS_PER_BLOCK;
 }
 
 
 
 FS_t *fs_format(const char *path)
 {
-    if(path != NULL && strlen(path) != 0)
+    return fs_format_opts(path, FS_OPT_NONE);
+}
+
+
+
+/**
+ * Lay a new file system down on a new block store
+ * \param bs The block store, NULL if it couldn't be created (owned)
+ * \param opts OR'd fs_opt_t values
+ * \return Mounted FS object, NULL on error
+ */
+static FS_t *_fs_format(block_store_t *bs, int opts)
+{
+    if(bs != NULL)
     {
         FS_t * ptr_FS = (FS_t*) calloc(1, sizeof(FS_t));
-        ptr_FS->BlockStore_whole = block_store_create(path);
+        if (ptr_FS == NULL || !_fs_lock_init(ptr_FS)) {
+            free(ptr_FS);
+            block_store_destroy(bs);
+            return NULL;
+        }
+        ptr_FS->BlockStore_whole = bs;
+        _fs_geometry(ptr_FS);
 
-        // reserve the 1st block for bitmap of inode
+        // reserve the 1st block for the inode map
         size_t bitmap_ID = block_store_allocate(ptr_FS->BlockStore_whole);
 
         // 2rd - 17th block for inodes, 16 blocks in total
         size_t inode_start_block = block_store_allocate(ptr_FS->BlockStore_whole);
-        for(int i = 0; i < 15; i++)
+        for(int i = 1; i < FS_FIXED_INODE_BLOCKS; i++)
             block_store_allocate(ptr_FS->BlockStore_whole);
 
-        // install inode block store inside the whole block store
-        ptr_FS->BlockStore_inode = block_store_inode_create(
-            block_store_Data_location(ptr_FS->BlockStore_whole) + bitmap_ID*BLOCK_SIZE_BYTES,
-            block_store_Data_location(ptr_FS->BlockStore_whole) + inode_start_block*BLOCK_SIZE_BYTES
-        );
+        // the block store leaves data blocks untouched (sparse), so clear
+        // just the inode bitmap and inode table, the only metadata we need
+        memset(block_store_Data_location(ptr_FS->BlockStore_whole) + bitmap_ID*BLOCK_SIZE_BYTES, 0x00,
+               (inode_start_block + FS_FIXED_INODE_BLOCKS - bitmap_ID)*BLOCK_SIZE_BYTES);
+
+        // the inode map lives in the 1st block, the fixed inode blocks follow
+        ptr_FS->inode_map = (inodeMap_t*)(block_store_Data_location(ptr_FS->BlockStore_whole) + bitmap_ID*BLOCK_SIZE_BYTES);
+        for (size_t i = 0; i < FS_FIXED_INODE_BLOCKS; i++)
+            ptr_FS->inode_map->blocks[i] = inode_start_block + i;
 
         // the first inode is reserved for root dir
-        block_store_sub_allocate(ptr_FS->BlockStore_inode);
+        _inode_set_used(ptr_FS, 0, true);
 
         // update the root inode info.
         uint8_t root_inum = 0;	// root inode is the first one in the inode table
@@ -681,10 +1693,18 @@ FS_t *fs_format(const char *path)
             .inum = root_inum,
             .link_count = 0,
         };
-        block_store_inode_write(ptr_FS->BlockStore_inode, root_inum, &root_inode);
+        _inode_write(ptr_FS, root_inum, &root_inode);
+
+        // the inode map and table were written through the mapping
+        for (size_t block_num = 0; block_num < FS_META_BLOCKS; block_num++)
+            block_store_csum_refresh(ptr_FS->BlockStore_whole, block_num);
+        ptr_FS->verify_meta = opts & FS_OPT_VERIFY_META;
+        ptr_FS->dedup = opts & FS_OPT_DEDUP;
+        ptr_FS->verify = opts & FS_OPT_VERIFY;
 
-        // now allocate space for the file descriptors
-        ptr_FS->BlockStore_fd = block_store_fd_create();
+        // the descriptor table starts empty and grows on demand
+        ptr_FS->max_fds = FS_MAX_OPEN_FILES;
+        ptr_FS->fd_free = -1;
 
         return ptr_FS;
     }
@@ -694,24 +1714,79 @@ FS_t *fs_format(const char *path)
 
 
 
-FS_t *fs_mount(const char *path)
+FS_t *fs_format_opts(const char *path, int opts)
 {
-    if(path != NULL && strlen(path) != 0)
-    {
-        FS_t * ptr_FS = (FS_t *)calloc(1, sizeof(FS_t));	// get started
-        ptr_FS->BlockStore_whole = block_store_open(path);	// get the chunck of data
+    if(path == NULL || strlen(path) == 0)
+        return NULL;
+    return _fs_format(block_store_create_opts(path, _bs_opts(opts)), opts);
+}
+
 
-        // the bitmap block should be the 1st one
-        size_t bitmap_ID = 0;
 
-        // the inode blocks start with the 2nd block, and goes around until the 17th block, 16 in total
-        size_t inode_start_block = 1;
+FS_t *fs_format_striped(const char *const *paths, size_t n_paths, size_t chunk_blocks, int opts)
+{
+    return _fs_format(block_store_create_striped(paths, n_paths, chunk_blocks, _bs_opts(opts)), opts);
+}
+
+
+
+FS_t *fs_mount(const char *path)
+{
+    return fs_mount_opts(path, FS_OPT_NONE);
+}
+
 
-        // attach the bitmaps to their designated place
-        ptr_FS->BlockStore_inode = block_store_inode_create(block_store_Data_location(ptr_FS->BlockStore_whole) + bitmap_ID * BLOCK_SIZE_BYTES, block_store_Data_location(ptr_FS->BlockStore_whole) + inode_start_block * BLOCK_SIZE_BYTES);
 
-        // since file descriptors are allocated outside of the whole blocks, we can simply reallocate space for it.
-        ptr_FS->BlockStore_fd = block_store_fd_create();
+/**
+ * Mount the file system on an opened block store
+ * \param bs The block store, NULL if it couldn't be opened (owned)
+ * \param opts OR'd fs_opt_t values
+ * \return Mounted FS object, NULL on error
+ */
+static FS_t *_fs_mount(block_store_t *bs, int opts)
+{
+    if(bs != NULL)
+    {
+        FS_t * ptr_FS = (FS_t *)calloc(1, sizeof(FS_t));	// get started
+        if (ptr_FS == NULL || !_fs_lock_init(ptr_FS)) {
+            free(ptr_FS);
+            block_store_destroy(bs);
+            return NULL;
+        }
+        ptr_FS->BlockStore_whole = bs;	// get the chunck of data
+        _fs_geometry(ptr_FS);
+
+        // the inode map is the 1st block, the fixed inode blocks follow it and
+        // the rest are wherever the map says
+        ptr_FS->inode_map = (inodeMap_t*)(block_store_Data_location(ptr_FS->BlockStore_whole) + _INODE_MAP_BLOCK * BLOCK_SIZE_BYTES);
+
+        // file descriptors live outside of the volume, the table starts empty
+        // and grows on demand
+        ptr_FS->max_fds = FS_MAX_OPEN_FILES;
+        ptr_FS->fd_free = -1;
+
+        // the inode map and table and the free block map are never read
+        // through the block store, so check them up front
+        ptr_FS->verify_meta = opts & FS_OPT_VERIFY_META;
+        ptr_FS->dedup = opts & FS_OPT_DEDUP;
+        ptr_FS->verify = opts & FS_OPT_VERIFY;
+        if (opts & (FS_OPT_VERIFY | FS_OPT_VERIFY_META)) {
+            for (size_t block_num = 0; block_num < ptr_FS->n_blocks; block_num++) {
+                if (block_num == FS_META_BLOCKS)
+                    block_num = ptr_FS->avail_blocks;
+                if (!block_store_verify(ptr_FS->BlockStore_whole, block_num)) {
+                    fs_unmount(ptr_FS);
+                    return NULL;
+                }
+            }
+            for (size_t inode_block = FS_FIXED_INODE_BLOCKS; inode_block < FS_INODE_BLOCKS; inode_block++) {
+                size_t block_num = _inode_block_num(ptr_FS, inode_block);
+                if (block_num != 0 && !block_store_verify(ptr_FS->BlockStore_whole, block_num)) {
+                    fs_unmount(ptr_FS);
+                    return NULL;
+                }
+            }
+        }
 
         return ptr_FS;
     }
@@ -721,14 +1796,45 @@ FS_t *fs_mount(const char *path)
 
 
 
+FS_t *fs_mount_opts(const char *path, int opts)
+{
+    if(path == NULL || strlen(path) == 0)
+        return NULL;
+    // verify (and repair) the image before trusting it
+    if ((opts & FS_OPT_CHECK) && fs_check(path, true) < 0)
+        return NULL;
+    return _fs_mount(block_store_open_opts(path, _bs_opts(opts)), opts);
+}
+
+
+
+FS_t *fs_mount_striped(const char *const *paths, size_t n_paths, int opts)
+{
+    // fs_check reads single file images only
+    if (opts & FS_OPT_CHECK)
+        return NULL;
+    return _fs_mount(block_store_open_striped(paths, n_paths, _bs_opts(opts)), opts);
+}
+
+
+
 int fs_unmount(FS_t *fs)
 {
     if(fs != NULL)
     {
-        block_store_inode_destroy(fs->BlockStore_inode);
-
+        // Buffered descriptors still holding data are flushed first
+        for (size_t i=0; i<fs->n_fds; i++) {
+            if (fs->fds[i].open && fs->fds[i].wbuf != NULL) {
+                _fd_flush(fs, i);
+                free(fs->fds[i].wbuf);
+            }
+        }
+        fs_trace_stop(fs);
         block_store_destroy(fs->BlockStore_whole);
-        block_store_fd_destroy(fs->BlockStore_fd);
+        free(fs->fds);
+        free(fs->views);
+        pthread_mutex_destroy(&fs->lock);
+        pthread_key_delete(fs->trace_depth);
 
         free(fs);
         return 0;
@@ -738,14 +1844,95 @@ int fs_unmount(FS_t *fs)
 
 
 
-int fs_create(FS_t *fs, const char *path, file_t type) {
+int fs_trace_start(FS_t *fs, const char *path) {
+    if (fs == NULL || fs->trace != NULL)
+        return -1;
+    fs->trace = fs_trace_create(path);
+    return fs->trace == NULL ? -1 : 0;
+}
+
+
+
+int fs_trace_stop(FS_t *fs) {
+    if (fs == NULL || fs->trace == NULL)
+        return -1;
+    int ret = fs_trace_close(fs->trace);
+    fs->trace = NULL;
+    return ret;
+}
+
+
+
+/**
+ * Flush every buffered descriptor, call with the lock held
+ * \param fs The file system
+ * \return Whether all of them could be flushed
+ */
+static bool _fd_flush_all(FS_t *fs) {
+    bool ok = true;
+    for (size_t i = 0; i < fs->n_fds; i++)
+        if (fs->fds[i].open && fs->fds[i].wbuf_len > 0)
+            ok = _fd_flush(fs, i) && ok;
+    return ok;
+}
+
+
+
+ssize_t fs_serialize(FS_t *fs, const char *image) {
+    if (fs == NULL || image == NULL)
+        return -1;
+
+    // Data still in write buffers belongs in the image
+    pthread_mutex_lock(&fs->lock);
+    size_t written = _fd_flush_all(fs) ? block_store_serialize(fs->BlockStore_whole, image) : 0;
+    pthread_mutex_unlock(&fs->lock);
+    return written == 0 ? -1 : (ssize_t)written;
+}
+
+
+
+FS_t *fs_deserialize(const char *image, const char *path, int opts) {
+    block_store_t *bs = block_store_deserialize(image, path, BS_OPT_NONE);
+    if (bs == NULL)
+        return NULL;
+    block_store_destroy(bs);
+    return fs_mount_opts(path, opts);
+}
+
+
+
+ssize_t fs_export_delta(FS_t *fs, const char *delta) {
+    if (fs == NULL || delta == NULL)
+        return -1;
+
+    pthread_mutex_lock(&fs->lock);
+    size_t written = _fd_flush_all(fs) ? block_store_export_delta(fs->BlockStore_whole, delta) : 0;
+    pthread_mutex_unlock(&fs->lock);
+    return written == 0 ? -1 : (ssize_t)written;
+}
+
+
+
+int fs_apply_delta(const char *delta, const char *path) {
+    return block_store_apply_delta(delta, path) ? 0 : -1;
+}
+
+
+
+/**
+ * Create a file
+ * \param fs The file system
+ * \param path Absolute path to the file to create
+ * \param type Type of file to create
+ * \return 0 on success, -1 on error
+ */
+static int _create(FS_t *fs, const char *path, file_t type) {
     if (fs == NULL || !PATH_OK(path))
         goto err1;
     if (strlen(path) && path[strlen(path)-1] == '/')
         goto err1;
 
     block_store_t *bs_whole = fs->BlockStore_whole;
-    block_store_t *bs_inode = fs->BlockStore_inode;
 
     char new_file_type;
     switch (type) {
@@ -782,15 +1969,18 @@ int fs_create(FS_t *fs, const char *path, file_t type) {
         goto err1;
 
     // Get parent inode entry block number
-    // Use a pointer so that any changes update parent_inode
-    uint16_t *dentry_block_num = &parent_inode.data_direct[0];
+    // Any new block is stored in parent_inode too
+    size_t dentry_block_num = _inode_ptr(fs, &parent_inode, 0);
     bool dentry_block_num_is_new = (parent_inode.file_size == 0);
     if (dentry_block_num_is_new) {
         // Directory has no dir entry block so allocate one
         size_t block_num = block_store_allocate(bs_whole);
         if (block_num == SIZE_MAX)
             goto err2;
-        *dentry_block_num = block_num;
+        dentry_block_num = block_num;
+        _inode_set_ptr(fs, &parent_inode, 0, block_num);
+        // What _inode_dir_load read is block 0 (the inode map), not entries
+        memset(parent_dentry_block, 0x00, BLOCK_SIZE_BYTES);
     }
 
     /**
@@ -818,7 +2008,7 @@ int fs_create(FS_t *fs, const char *path, file_t type) {
      */
 
     // Get new inode number
-    size_t new_inum = block_store_sub_allocate(bs_inode);
+    size_t new_inum = _inode_alloc(fs);
     if (new_inum == SIZE_MAX)
         goto err4;
 
@@ -855,7 +2045,7 @@ int fs_create(FS_t *fs, const char *path, file_t type) {
      */
 
     // Write the parent directory's entry block to the store
-    if (!_BS_WRITE_OK(fs, *dentry_block_num, parent_dentry_block))
+    if (!_BS_WRITE_OK(fs, dentry_block_num, parent_dentry_block))
         goto err5;
 
     // Write the parent directory's inode to the store
@@ -878,12 +2068,12 @@ err6:
     bitmap_reset(parent_dentry_map, index);
     block_store_write(fs->BlockStore_whole, parent_inum, &parent_inode);
 err5:
-    block_store_sub_release(bs_inode, new_inum);
+    _inode_free(fs, new_inum);
 err4:
     free(filename);
 err3:
     if (dentry_block_num_is_new)
-        block_store_release(bs_whole, *dentry_block_num);
+        block_store_release(bs_whole, dentry_block_num);
 err2:
     bitmap_destroy(parent_dentry_map);
 err1:
@@ -892,61 +2082,327 @@ err1:
 
 
 
-int fs_open(FS_t *fs, const char *path) {
-    if (fs == NULL || path == NULL)
-        return -1;
+int fs_create(FS_t *fs, const char *path, file_t type) {
+    uint64_t start = _trace_begin(fs);
+    int ret = _create(fs, path, type);
+    _trace_end(fs, start, (fs_trace_rec_t) {.op = FS_TRACE_CREATE, .arg = type, .ret = ret}, path);
+    return ret;
+}
 
-    int inum = _get_inum(fs, path);
-    if (inum < 0)
-        return -1;
 
-    inode_t inode;
-    if (!_inode_read(fs, inum, &inode))
-        return -1;
 
-    if (inode.file_type == 'd')
+/**
+ * Create a number of files in a directory, all or none of them
+ *   The directory is read and written once for the whole batch
+ * \param fs The file system
+ * \param parent_inum The directory's inode number
+ * \param names The names of the files to create
+ * \param types The type of each file to create
+ * \param n The number of files to create, at least 1
+ * \return 0 on success, -1 on error
+ */
+static int _create_many(FS_t *fs, int parent_inum, const char *const *names, const file_t *types, size_t n) {
+    inode_t parent_inode;
+    if (parent_inum < 0 || !_inode_read(fs, parent_inum, &parent_inode))
         return -1;
 
-    size_t fd_index = block_store_sub_allocate(fs->BlockStore_fd);
-    if (fd_index == SIZE_MAX)
+    bitmap_t *parent_dentry_map = NULL;
+    block_t parent_dentry_block;
+    if (_inode_dir_load(fs, &parent_inode, parent_dentry_block, &parent_dentry_map) < 0)
         return -1;
+    if (parent_inode.file_size == 0)
+        memset(parent_dentry_block, 0, BLOCK_SIZE_BYTES);
 
-    fileDescriptor_t fd = {
-        .inum = inum,
-        .usage = FD_DIRECT,
-        .locate_order = 0,
-        .locate_offset = 0,
-    };
+    size_t *inums = calloc(n, sizeof(size_t));
+    size_t *slots = calloc(n, sizeof(size_t));
+    if (inums == NULL || slots == NULL)
+        goto err1;
 
-    if (!_BS_FD_WRITE_OK(fs, fd_index, &fd)) {
-        block_store_sub_release(fs->BlockStore_fd, fd_index);
-        return -1;
+    // Fill the entries in the loaded block first, so a bad or repeated name
+    //   fails the batch before anything is allocated
+    for (size_t i=0; i<n; i++) {
+        const char *name = names[i];
+        size_t len = name == NULL ? 0 : strnlen(name, FS_FNAME_MAX);
+        if (len == 0 || len == FS_FNAME_MAX || memchr(name, '/', len) != NULL)
+            goto err1;
+        if (types[i] != FS_REGULAR && types[i] != FS_DIRECTORY)
+            goto err1;
+        if (_dir_entries_find(parent_inode.dir_entry_map, parent_dentry_block, name, len) >= 0)
+            goto err1;
+        slots[i] = bitmap_ffz(parent_dentry_map);
+        if (slots[i] == SIZE_MAX || slots[i] >= DIR_ENTRIES_PER_BLOCK)
+            goto err1; // Directory is full
+        bitmap_set(parent_dentry_map, slots[i]);
+        directoryFile_t *entry = (directoryFile_t*)parent_dentry_block + slots[i];
+        memset(entry->filename, 0, sizeof(entry->filename));
+        memcpy(entry->filename, name, len);
     }
 
-    return fd_index;
-}
-
-
+    // The directory's first child gets it an entry block
+    bool dentry_block_num_is_new = (parent_inode.file_size == 0);
+    if (dentry_block_num_is_new) {
+        size_t block_num = block_store_allocate(fs->BlockStore_whole);
+        if (block_num == SIZE_MAX)
+            goto err1;
+        _inode_set_ptr(fs, &parent_inode, 0, block_num);
+    }
+
+    if (!_inode_alloc_many(fs, n, inums))
+        goto err2;
+
+    // Write the new inodes in place, refreshing each inode block's checksum
+    //   once its run of inodes is written
+    size_t inode_block = SIZE_MAX;
+    for (size_t i=0; i<n; i++) {
+        inode_t *inode = _inode_at(fs, inums[i]);
+        if (inode == NULL)
+            goto err3;
+        *inode = (inode_t) {
+            .file_type = types[i] == FS_DIRECTORY ? 'd' : 'r',
+            .inum = inums[i],
+            .link_count = 1,
+        };
+        ((directoryFile_t*)parent_dentry_block + slots[i])->inum = inums[i];
+
+        if (inode_block != SIZE_MAX && inode_block != inums[i] / FS_INODES_PER_BLOCK)
+            block_store_csum_refresh(fs->BlockStore_whole, _inode_block_num(fs, inode_block));
+        inode_block = inums[i] / FS_INODES_PER_BLOCK;
+    }
+    block_store_csum_refresh(fs->BlockStore_whole, _inode_block_num(fs, inode_block));
+
+    // Then the parent's entry block and inode, once each
+    parent_inode.file_size += n;
+    if (!_BS_WRITE_OK(fs, _inode_ptr(fs, &parent_inode, 0), parent_dentry_block))
+        goto err3;
+    if (!_BS_INODE_WRITE_OK(fs, parent_inum, &parent_inode))
+        goto err3;
+
+    bitmap_destroy(parent_dentry_map);
+    free(inums);
+    free(slots);
+    return 0;
+err3:
+    for (size_t i=0; i<n; i++)
+        _inode_free(fs, inums[i]);
+err2:
+    if (dentry_block_num_is_new)
+        block_store_release(fs->BlockStore_whole, _inode_ptr(fs, &parent_inode, 0));
+err1:
+    bitmap_destroy(parent_dentry_map);
+    free(inums);
+    free(slots);
+    return -1;
+}
+
+
+
+int fs_create_many(FS_t *fs, const char *parent, const char *const *names, const file_t *types, size_t n) {
+    if (fs == NULL || !PATH_OK(parent) || (n > 0 && (names == NULL || types == NULL)))
+        return -1;
+    if (n == 0)
+        return 0;
+    return _create_many(fs, _get_inum(fs, parent), names, types, n);
+}
+
+
+
+int fs_createat(FS_t *fs, const fs_dirhandle_t *dir, const char *path, file_t type) {
+    if (fs == NULL || dir == NULL || path == NULL)
+        return -1;
+
+    // Everything before the last '/' names the parent, "" being dir itself
+    //   (or the root, for an absolute path)
+    const char *slash = strrchr(path, '/');
+    const char *name = slash == NULL ? path : slash + 1;
+    int parent_inum = _get_inum_at(fs, dir->inum, path, name - path);
+    return _create_many(fs, parent_inum, &name, &type, 1);
+}
+
+
+
+int fs_set_compressed(FS_t *fs, const char *path, bool compressed) {
+    if (fs == NULL || !PATH_OK(path))
+        return -1;
+
+    int inum = _get_inum(fs, path);
+    if (inum < 0)
+        return -1;
+
+    inode_t inode;
+    if (!_inode_read(fs, inum, &inode))
+        return -1;
+
+    // The compressed and plain layouts are not interchangeable, so only empty
+    // regular files can switch
+    if (inode.file_type != 'r' || inode.file_size != 0)
+        return -1;
+
+    if (compressed)
+        inode.flags |= INODE_COMPRESSED;
+    else
+        inode.flags &= ~INODE_COMPRESSED;
+
+    if (!_BS_INODE_WRITE_OK(fs, inum, &inode))
+        return -1;
+
+    return 0;
+}
+
+
+
+int fs_open(FS_t *fs, const char *path) {
+    return fs_open_flags(fs, path, FS_O_NONE);
+}
+
+
+
+static int _fs_open_flags_locked(FS_t *fs, int inum, int flags) {
+    if (inum < 0 || (flags & ~FS_O_APPEND))
+        return -1;
+
+    inode_t inode;
+    if (!_inode_read(fs, inum, &inode))
+        return -1;
+
+    if (inode.file_type == 'd')
+        return -1;
+
+    int fd_index = _fd_alloc(fs);
+    if (fd_index < 0)
+        return -1;
+
+    fs->fds[fd_index].fd = (fileDescriptor_t) {
+        .inum = inum,
+        .usage = FD_DIRECT,
+        .locate_order = 0,
+        .locate_offset = 0,
+    };
+    fs->fds[fd_index].append = flags & FS_O_APPEND;
+
+    return fd_index;
+}
+
+
+
+int fs_open_flags(FS_t *fs, const char *path, int flags) {
+    if (fs == NULL || path == NULL)
+        return -1;
+
+    pthread_mutex_lock(&fs->lock);
+    uint64_t start = _trace_begin(fs);
+    int ret = _fs_open_flags_locked(fs, _get_inum(fs, path), flags);
+    _trace_end(fs, start, (fs_trace_rec_t) {.op = FS_TRACE_OPEN, .arg = flags, .ret = ret}, path);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+int fs_openat(FS_t *fs, const fs_dirhandle_t *dir, const char *path, int flags) {
+    if (fs == NULL || dir == NULL || path == NULL)
+        return -1;
+
+    pthread_mutex_lock(&fs->lock);
+    int ret = _fs_open_flags_locked(fs, _get_inum_at(fs, dir->inum, path, strlen(path)), flags);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+static int _fs_close_locked(FS_t *fs, int fd) {
+    if (_fd_get(fs, fd) == NULL)
+        return -1;
+
+    // The descriptor is closed even if its buffered data can't be written
+    bool flushed = _fd_flush(fs, fd);
+    free(fs->fds[fd].wbuf);
+    _fd_release(fs, fd);
+
+    return flushed ? 0 : -1;
+}
+
+
 
 int fs_close(FS_t *fs, int fd) {
-    if (fs == NULL || fd < 0 || fd > 255)
+    if (fs == NULL)
         return -1;
 
-    if (!block_store_sub_test(fs->BlockStore_fd, fd))
+    pthread_mutex_lock(&fs->lock);
+    uint64_t start = _trace_begin(fs);
+    int ret = _fs_close_locked(fs, fd);
+    _trace_end(fs, start, (fs_trace_rec_t) {.op = FS_TRACE_CLOSE, .fd = fd, .ret = ret}, NULL);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+static int _fs_set_buffered_locked(FS_t *fs, int fd, bool buffered) {
+    if (_fd_get(fs, fd) == NULL)
         return -1;
 
-    block_store_sub_release(fs->BlockStore_fd, fd);
+    fdSlot_t *slot = &fs->fds[fd];
+    if (buffered && slot->wbuf == NULL) {
+        if ((slot->wbuf = malloc(BLOCK_SIZE_BYTES)) == NULL)
+            return -1;
+        slot->wbuf_len = 0;
+    } else if (!buffered && slot->wbuf != NULL) {
+        bool flushed = _fd_flush(fs, fd);
+        free(slot->wbuf);
+        slot->wbuf = NULL;
+        if (!flushed)
+            return -1;
+    }
 
     return 0;
 }
 
 
 
-dyn_array_t *fs_get_dir(FS_t *fs, const char *path) {
-    if (fs == NULL || !PATH_OK(path))
-        return NULL;
+int fs_set_buffered(FS_t *fs, int fd, bool buffered) {
+    if (fs == NULL)
+        return -1;
 
-    int inum = _get_inum(fs, path);
+    pthread_mutex_lock(&fs->lock);
+    int ret = _fs_set_buffered_locked(fs, fd, buffered);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+int fs_flush(FS_t *fs, int fd) {
+    if (fs == NULL)
+        return -1;
+
+    pthread_mutex_lock(&fs->lock);
+    uint64_t start = _trace_begin(fs);
+    int ret = _fd_get(fs, fd) != NULL && _fd_flush(fs, fd) ? 0 : -1;
+    _trace_end(fs, start, (fs_trace_rec_t) {.op = FS_TRACE_FLUSH, .fd = fd, .ret = ret}, NULL);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+int fs_set_max_open_files(FS_t *fs, size_t max) {
+    if (fs == NULL || max < fs->n_fds || max > INT_MAX)
+        return -1;
+
+    fs->max_fds = max;
+    return 0;
+}
+
+
+
+/**
+ * List a directory
+ * \param fs The file system
+ * \param inum The directory's inode number
+ * \return The directory's entries, NULL on error
+ */
+static dyn_array_t *_get_dir(FS_t *fs, int inum) {
     if (inum < 0)
         return NULL;
 
@@ -978,176 +2434,2292 @@ dyn_array_t *fs_get_dir(FS_t *fs, const char *path) {
 
 
 
-off_t fs_seek(FS_t *fs, int fd_index, off_t offset, seek_t whence) {
-    if (fs == NULL || !FD_OK(fd_index) || !WHENCE_OK(whence))
-        return -1;
+dyn_array_t *fs_get_dir(FS_t *fs, const char *path) {
+    if (fs == NULL || !PATH_OK(path))
+        return NULL;
 
-    // Load the file descriptor
-    fileDescriptor_t fd;
-    if (!_fd_read(fs, fd_index, &fd))
-        return -1;
+    uint64_t start = _trace_begin(fs);
+    dyn_array_t *entries = _get_dir(fs, _get_inum(fs, path));
+    _trace_end(fs, start, (fs_trace_rec_t) {
+        .op = FS_TRACE_GET_DIR, .ret = entries == NULL ? -1 : (int32_t)dyn_array_size(entries),
+    }, path);
+    return entries;
+}
 
-    // Load the inode
-    inode_t inode;
-    if (!_inode_read(fs, fd.inum, &inode))
+
+
+dyn_array_t *fs_get_dirat(FS_t *fs, const fs_dirhandle_t *dir, const char *path) {
+    if (fs == NULL || dir == NULL || path == NULL)
+        return NULL;
+    return _get_dir(fs, _get_inum_at(fs, dir->inum, path, strlen(path)));
+}
+
+
+
+int fs_opendir_handle(FS_t *fs, const char *path, fs_dirhandle_t *dir) {
+    if (!PATH_OK(path))
         return -1;
+    fs_dirhandle_t root = {.inum = 0};
+    return fs_opendir_handleat(fs, &root, path, dir);
+}
 
-    // Calculate the global file offset
-    size_t new_cursor = 0;
-    if      (whence == FS_SEEK_CUR) new_cursor = _fd_cursor_get(&fd);
-    else if (whence == FS_SEEK_END) new_cursor = inode.file_size;
-    new_cursor = _clamped_add(new_cursor, offset, 0, inode.file_size);
 
-    // Update the file descriptor cursor to be new_cursor
-    if (_fd_cursor_set(&fd, new_cursor) == false)
+
+int fs_opendir_handleat(FS_t *fs, const fs_dirhandle_t *dir, const char *path, fs_dirhandle_t *sub) {
+    if (fs == NULL || dir == NULL || path == NULL || sub == NULL)
         return -1;
 
-    // Update the file descriptor
-    if (!_BS_FD_WRITE_OK(fs, fd_index, &fd))
+    int inum = _get_inum_at(fs, dir->inum, path, strlen(path));
+    inode_t inode;
+    if (inum < 0 || !_inode_read(fs, inum, &inode) || inode.file_type != 'd')
         return -1;
 
-    return new_cursor;
+    sub->inum = inum;
+    return 0;
 }
 
 
 
-ssize_t fs_read(FS_t *fs, int fd_index, void *dest, size_t nbyte) {
-    if (fs == NULL || !FD_OK(fd_index) || dest == NULL)
+int fs_opendir(FS_t *fs, const char *path, fs_dir_t *dir) {
+    if (fs == NULL || !PATH_OK(path) || dir == NULL)
         return -1;
 
-    // Load the file descriptor
-    fileDescriptor_t fd;
-    if (!_fd_read(fs, fd_index, &fd))
+    int inum = _get_inum(fs, path);
+    if (inum < 0)
         return -1;
 
-    // Load the inode
     inode_t inode;
-    if (!_inode_read(fs, fd.inum, &inode))
+    if (!_inode_read(fs, inum, &inode) || inode.file_type != 'd')
         return -1;
 
-    size_t cursor = _fd_cursor_get(&fd);
-    if (cursor == SIZE_MAX)
+    // An empty directory may not have an entry block at all
+    if (inode.dir_entry_map != 0 && !_BS_META_READ_OK(fs, _inode_ptr(fs, &inode, 0), dir->entries))
         return -1;
-    if (cursor >= inode.file_size)
-        return 0;
 
-    block_t data_block;
-    size_t n_to_read, n_to_read_remaining, n_read;
-    n_to_read = n_to_read_remaining = MIN(
-        nbyte,                    // Requested
-        inode.file_size - cursor  // Remaining in file from cursor
-    );
+    dir->fs = fs;
+    dir->pending = inode.dir_entry_map;
+    return 0;
+}
 
-    while (n_to_read_remaining > 0) {
-        n_read = MIN(
-            n_to_read_remaining,                 // Remaining requested
-            BLOCK_SIZE_BYTES - fd.locate_offset  // Remaining in block
-        );
 
-        if (n_read == BLOCK_SIZE_BYTES) {
-            if (_fd_data_block_read(fs, &inode, &fd, dest) == false)
-                return -1;
-        } else {
-            if (_fd_data_block_read(fs, &inode, &fd, data_block) == false)
-                return -1;
-            memcpy(dest, data_block + fd.locate_offset, n_read);
-        }
 
-        cursor += n_read;
-        dest += n_read;
-        n_to_read_remaining -= n_read;
+int fs_readdir(fs_dir_t *dir, file_record_t *record) {
+    if (dir == NULL || dir->fs == NULL || record == NULL)
+        return -1;
 
-        if (_fd_cursor_set(&fd, cursor) == false)
-            return -1;
+    while (dir->pending != 0) {
+        size_t i = __builtin_ctz(dir->pending);
+        dir->pending &= dir->pending - 1;
+
+        const directoryFile_t *entry = (const directoryFile_t*)dir->entries + i;
+        inode_t child;
+        if (!_inode_read(dir->fs, entry->inum, &child))
+            continue; // Dangling, fs_check drops these
+
+        strncpy(record->name, entry->filename, FS_FNAME_MAX - 1);
+        record->name[FS_FNAME_MAX - 1] = '\0';
+        record->type = child.file_type == 'd' ? FS_DIRECTORY : FS_REGULAR;
+        return 1;
     }
 
-    // Update the file descriptor
-    if (!_BS_FD_WRITE_OK(fs, fd_index, &fd))
+    return 0;
+}
+
+
+
+int fs_closedir(fs_dir_t *dir) {
+    if (dir == NULL || dir->fs == NULL)
         return -1;
 
-    return n_to_read - n_to_read_remaining;
+    dir->fs = NULL;
+    dir->pending = 0;
+    return 0;
 }
 
 
 
-ssize_t fs_write(FS_t *fs, int fd_index, const void *src, size_t nbyte) {
-    if (fs == NULL || !FD_OK(fd_index) || src == NULL)
-        goto err1;
+int fs_dir_for_each(
+    FS_t *fs,
+    const char *path,
+    int (*fn)(const file_record_t *record, void *arg),
+    void *arg
+) {
+    if (fn == NULL)
+        return -1;
 
-    // Load the file descriptor
-    fileDescriptor_t fd;
-    if (!_fd_read(fs, fd_index, &fd))
-        goto err1;
+    fs_dir_t dir;
+    if (fs_opendir(fs, path, &dir) < 0)
+        return -1;
 
-    // Load the inode
-    inode_t inode;
-    if (!_inode_read(fs, fd.inum, &inode))
-        goto err1;
+    file_record_t record;
+    int ret;
+    while ((ret = fs_readdir(&dir, &record)) > 0) {
+        if ((ret = fn(&record, arg)) != 0)
+            break;
+    }
 
-    size_t cursor = _fd_cursor_get(&fd);
-    if (cursor == SIZE_MAX)
-        goto err1;
+    fs_closedir(&dir);
+    return ret;
+}
 
-    size_t max_new_ptrs = ceil((double)nbyte / BLOCK_SIZE_BYTES);
-    ssize_t *new_ptrs, *new_ptrs_it;
-    new_ptrs = new_ptrs_it = calloc(max_new_ptrs, sizeof(ssize_t));
 
-    block_t data_block;
-    size_t n_write, nbyte_orig = nbyte;
-    const void *chunk_src;
 
-    while (nbyte > 0) {
-        // Allocate a new data block for the file if needed
-        if (_cursor_in_owned_block(&inode, &fd) == false) {
-            if ((*new_ptrs_it = _inode_add_owned_block(fs, &inode)) == -1)
-                goto err2;
-            if (*new_ptrs_it == -2)
-                break; // No more space available
-            new_ptrs_it++;
+/**
+ * Fill in a file's metadata
+ * \param fs The file system
+ * \param inum The file's inode number
+ * \param st Set to the file's metadata
+ * \return Whether the inode could be read
+ */
+static bool _stat_inum(FS_t *fs, size_t inum, fs_stat_t *st) {
+    inode_t inode;
+    if (!_inode_read(fs, inum, &inode))
+        return false;
+
+    st->type = inode.file_type == 'd' ? FS_DIRECTORY : FS_REGULAR;
+    st->size = inode.file_size;
+    st->nlink = inum == 0 ? 1 : inode.link_count; // No entry names the root
+    st->inum = inum;
+    st->blocks = _inode_n_blocks(&inode);
+
+    // Compressed clusters leave holes past their compressed data
+    if (inode.flags & INODE_COMPRESSED) {
+        size_t block_nums[FS_IO_BATCH_BLOCKS];
+        size_t n = st->blocks;
+        st->blocks = 0;
+        for (size_t first=0; first<n; first+=FS_IO_BATCH_BLOCKS) {
+            size_t batch = MIN(n - first, FS_IO_BATCH_BLOCKS);
+            if (!_inode_block_nums(fs, &inode, first, batch, block_nums))
+                return false;
+            for (size_t i=0; i<batch; i++)
+                st->blocks += block_nums[i] != 0;
         }
+    }
 
-        // Calculate the number of bytes to write next
-        n_write = MIN(nbyte, BLOCK_SIZE_BYTES - fd.locate_offset);
+    return true;
+}
 
-        if (n_write < BLOCK_SIZE_BYTES) {
-            // Read data block from store into local temp storage
-            if (_fd_data_block_read(fs, &inode, &fd, data_block) == false)
-                goto err2;
-            // Copy partial data into local temp storage
-            memcpy(data_block + fd.locate_offset, src, n_write);
-            // Next block written to store will be local temp storage
-            chunk_src = data_block;
+
+
+ssize_t fs_stat_many(FS_t *fs, const char *const *paths, size_t n, fs_stat_t *out) {
+    if (fs == NULL || (n > 0 && (paths == NULL || out == NULL)))
+        return -1;
+
+    // The last directory looked in, with its entries loaded
+    const char *dir_path = NULL;
+    size_t dir_len = 0;
+    int dir_inum = -1;
+    inode_t dir_inode;
+    block_t dir_block;
+
+    ssize_t n_found = 0;
+    for (size_t i=0; i<n; i++) {
+        memset(&out[i], 0, sizeof(fs_stat_t));
+        const char *path = paths[i];
+        if (!PATH_OK(path))
+            continue;
+
+        int inum;
+        const char *name = strrchr(path, '/') + 1;
+        size_t name_len = strlen(name);
+        if (name_len == 0) {
+            inum = _get_inum(fs, path); // The root, or a trailing slash
         } else {
-            // Next block written to store will be user buffer
-            chunk_src = src;
+            size_t len = name - path;
+            if (dir_path == NULL || len != dir_len || memcmp(path, dir_path, len) != 0) {
+                dir_path = path;
+                dir_len = len;
+                dir_inum = _get_inum_n(fs, path, len);
+                if (dir_inum >= 0 && (!_inode_read(fs, dir_inum, &dir_inode) || dir_inode.file_type != 'd'
+                        || (dir_inode.dir_entry_map != 0 && !_BS_META_READ_OK(fs, _inode_ptr(fs, &dir_inode, 0), dir_block))))
+                    dir_inum = -1;
+            }
+            inum = dir_inum < 0 || dir_inode.dir_entry_map == 0 || name_len >= FS_FNAME_MAX
+                ? -1 : _dir_entries_find(dir_inode.dir_entry_map, dir_block, name, name_len);
         }
 
-        if (_fd_data_block_write(fs, &inode, &fd, chunk_src) == false)
-            goto err2;
+        if (inum >= 0 && _stat_inum(fs, inum, &out[i]))
+            n_found++;
+        else
+            memset(&out[i], 0, sizeof(fs_stat_t));
+    }
 
-        cursor += n_write;
-        src += n_write;
-        nbyte -= n_write;
+    return n_found;
+}
 
-        if (cursor > inode.file_size)
-            inode.file_size = cursor;
-        if (_fd_cursor_set(&fd, cursor) == false)
-            goto err2;
-    }
 
-    // Update the file descriptor
-    if (!_BS_FD_WRITE_OK(fs, fd_index, &fd))
-        goto err2;
 
-    // Update the inode in case the file size has increased
-    if (!_BS_INODE_WRITE_OK(fs, inode.inum, &inode))
-        goto err2;
+int fs_stat(FS_t *fs, const char *path, fs_stat_t *st) {
+    uint64_t start = _trace_begin(fs);
+    int ret = fs_stat_many(fs, &path, 1, st) == 1 ? 0 : -1;
+    _trace_end(fs, start, (fs_trace_rec_t) {.op = FS_TRACE_STAT, .ret = ret}, path);
+    return ret;
+}
 
-    return nbyte_orig - nbyte;
+
+
+int fs_statvfs(FS_t *fs, fs_statvfs_t *st) {
+    if (fs == NULL || st == NULL)
+        return -1;
+
+    size_t n_used = 0;
+    for (size_t i=0; i<FS_INODE_BLOCKS; i++)
+        n_used += __builtin_popcount(fs->inode_map->used[i]);
+
+    st->blocks = fs->avail_blocks;
+    st->free_blocks = block_store_get_free_blocks(fs->BlockStore_whole);
+    st->inodes = NUM_INODES;
+    st->free_inodes = NUM_INODES - n_used;
+    return 0;
+}
+
+
+
+int fs_statat(FS_t *fs, const fs_dirhandle_t *dir, const char *path, fs_stat_t *st) {
+    if (fs == NULL || dir == NULL || path == NULL || st == NULL)
+        return -1;
+
+    int inum = _get_inum_at(fs, dir->inum, path, strlen(path));
+    if (inum < 0 || !_stat_inum(fs, inum, st)) {
+        memset(st, 0, sizeof(fs_stat_t));
+        return -1;
+    }
+    return 0;
+}
+
+
+
+/**
+ * A directory waiting to be walked by fs_walk
+ */
+typedef struct {
+    uint32_t inum;
+    size_t depth;
+    // Its absolute path, owned by the item
+    char *path;
+} _walk_item_t;
+
+/**
+ * A fs_walk worker's queue of directories
+ *   The owner pushes and pops at the tail, idle workers steal from the head,
+ *   so thieves take the shallowest directories and with them the most work
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    _walk_item_t *items;
+    size_t head, tail, cap;
+} _walk_deque_t;
+
+/**
+ * State shared by the fs_walk workers
+ */
+typedef struct {
+    FS_t *fs;
+    int (*fn)(const fs_walk_entry_t *entry, void *arg);
+    void *arg;
+    int flags;
+    _walk_deque_t *deques;
+    size_t n_workers;
+    // Directories queued or being walked, the walk is done when none are
+    size_t pending;
+    // fn's first non-zero return, or -1 on error; stops the walk
+    int ret;
+} _walk_t;
+
+/**
+ * A single fs_walk worker
+ */
+typedef struct {
+    _walk_t *walk;
+    size_t id;
+    pthread_t thread;
+} _walk_worker_t;
+
+
+
+/**
+ * Stop a walk, keeping the first reason given
+ * \param walk The walk
+ * \param ret The reason, non-zero
+ */
+static void _walk_stop(_walk_t *walk, int ret) {
+    int expected = 0;
+    __atomic_compare_exchange_n(&walk->ret, &expected, ret, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+
+/**
+ * Queue a directory on a worker's deque
+ * \param walk The walk
+ * \param deque The deque
+ * \param item The directory, its path is owned by the deque once queued
+ * \return Whether it was queued
+ */
+static bool _walk_push(_walk_t *walk, _walk_deque_t *deque, _walk_item_t item) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->cap) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(_walk_item_t));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            size_t cap = MAX(2 * deque->cap, 16);
+            _walk_item_t *items = realloc(deque->items, cap * sizeof(_walk_item_t));
+            if (items == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                return false;
+            }
+            deque->items = items;
+            deque->cap = cap;
+        }
+    }
+    deque->items[deque->tail++] = item;
+    __atomic_fetch_add(&walk->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+
+
+/**
+ * Take a directory from a deque
+ * \param deque The deque
+ * \param steal Whether to take the oldest (stealing) or newest (owner)
+ * \param item Set to the directory
+ * \return Whether there was one
+ */
+static bool _walk_take(_walk_deque_t *deque, bool steal, _walk_item_t *item) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->head < deque->tail;
+    if (found)
+        *item = steal ? deque->items[deque->head++] : deque->items[--deque->tail];
+    if (deque->head == deque->tail)
+        deque->head = deque->tail = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+
+
+/**
+ * Visit a file
+ * \param walk The walk
+ * \param inum The file's inode number
+ * \param type The file's type
+ * \param path The file's absolute path
+ * \param name The file's name, within path
+ * \param depth The file's depth
+ * \return Whether the walk should go on
+ */
+static bool _walk_visit(_walk_t *walk, uint32_t inum, file_t type, const char *path, const char *name, size_t depth) {
+    fs_stat_t st;
+    fs_walk_entry_t entry = {
+        .path = path,
+        .name = name,
+        .type = type,
+        .inum = inum,
+        .depth = depth,
+        .stat = NULL,
+    };
+    if (walk->flags & FS_WALK_STAT) {
+        if (!_stat_inum(walk->fs, inum, &st)) {
+            _walk_stop(walk, -1);
+            return false;
+        }
+        entry.stat = &st;
+    }
+
+    int ret = walk->fn(&entry, walk->arg);
+    if (ret != 0)
+        _walk_stop(walk, ret);
+    return ret == 0;
+}
+
+
+
+/**
+ * Visit the files in a directory, queueing its subdirectories on a worker's
+ *   deque
+ * \param walk The walk
+ * \param deque The worker's deque
+ * \param dir The directory
+ */
+static void _walk_dir(_walk_t *walk, _walk_deque_t *deque, const _walk_item_t *dir) {
+    FS_t *fs = walk->fs;
+    inode_t dir_inode;
+    block_t dir_block;
+    if (!_inode_read(fs, dir->inum, &dir_inode) || dir_inode.file_type != 'd') {
+        _walk_stop(walk, -1);
+        return;
+    }
+    if (dir_inode.dir_entry_map == 0)
+        return;
+    if (!_BS_META_READ_OK(fs, _inode_ptr(fs, &dir_inode, 0), dir_block)) {
+        _walk_stop(walk, -1);
+        return;
+    }
+
+    // The root's children are "/name", everyone else's "path/name"
+    size_t prefix = strcmp(dir->path, "/") == 0 ? 0 : strlen(dir->path);
+    char *path = malloc(prefix + 1 + FS_FNAME_MAX);
+    if (path == NULL) {
+        _walk_stop(walk, -1);
+        return;
+    }
+    memcpy(path, dir->path, prefix);
+    path[prefix] = '/';
+    char *name = path + prefix + 1;
+
+    for (size_t i=0; i<DIR_ENTRIES_PER_BLOCK && __atomic_load_n(&walk->ret, __ATOMIC_RELAXED) == 0; i++) {
+        if (!(dir_inode.dir_entry_map & (1u << i)))
+            continue;
+        const directoryFile_t *entry = (const directoryFile_t*)dir_block + i;
+        inode_t inode;
+        if (!_inode_read(fs, entry->inum, &inode)) {
+            _walk_stop(walk, -1);
+            break;
+        }
+        strncpy(name, entry->filename, FS_FNAME_MAX - 1);
+        name[FS_FNAME_MAX - 1] = '\0';
+        file_t type = inode.file_type == 'd' ? FS_DIRECTORY : FS_REGULAR;
+        if (!_walk_visit(walk, entry->inum, type, path, name, dir->depth + 1))
+            break;
+
+        if (type == FS_DIRECTORY) {
+            _walk_item_t sub = {
+                .inum = entry->inum,
+                .depth = dir->depth + 1,
+                .path = strdup(path),
+            };
+            if (sub.path == NULL || !_walk_push(walk, deque, sub)) {
+                free(sub.path);
+                _walk_stop(walk, -1);
+                break;
+            }
+        }
+    }
+
+    free(path);
+}
+
+
+
+/**
+ * fs_walk worker, walks its own directories newest first and steals the
+ *   oldest of the others' once it runs out, until none are left anywhere
+ * \param arg The worker (_walk_worker_t)
+ */
+static void *_walk_worker(void *arg) {
+    _walk_worker_t *worker = arg;
+    _walk_t *walk = worker->walk;
+    _walk_deque_t *own = &walk->deques[worker->id];
+
+    while (__atomic_load_n(&walk->ret, __ATOMIC_RELAXED) == 0) {
+        _walk_item_t item;
+        bool found = _walk_take(own, false, &item);
+        for (size_t n=1; !found && n<walk->n_workers; n++)
+            found = _walk_take(&walk->deques[(worker->id + n) % walk->n_workers], true, &item);
+
+        if (found) {
+            _walk_dir(walk, own, &item);
+            free(item.path);
+            // Only now, so subdirectories are counted before their parent
+            //   stops being
+            __atomic_fetch_sub(&walk->pending, 1, __ATOMIC_RELEASE);
+        } else if (__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else {
+            sched_yield(); // Others are still walking, they may queue more
+        }
+    }
+
+    return NULL;
+}
+
+
+
+int fs_walk(
+    FS_t *fs,
+    const char *root,
+    int (*fn)(const fs_walk_entry_t *entry, void *arg),
+    void *arg,
+    int flags,
+    size_t n_threads
+) {
+    if (fs == NULL || !PATH_OK(root) || fn == NULL || (flags & ~(FS_WALK_ROOT | FS_WALK_STAT)))
+        return -1;
+
+    int root_inum = _get_inum(fs, root);
+    inode_t root_inode;
+    if (root_inum < 0 || !_inode_read(fs, root_inum, &root_inode) || root_inode.file_type != 'd')
+        return -1;
+
+    // Drop trailing slashes, except the root's own
+    size_t root_len = strlen(root);
+    while (root_len > 1 && root[root_len-1] == '/')
+        root_len--;
+    _walk_item_t first = {
+        .inum = root_inum,
+        .depth = 0,
+        .path = strndup(root, root_len),
+    };
+    if (first.path == NULL)
+        return -1;
+
+    if (n_threads == 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = MAX(n_cpus, 1);
+    }
+    _walk_deque_t deques[FS_WALK_MAX_THREADS] = {0};
+    _walk_worker_t workers[FS_WALK_MAX_THREADS];
+    _walk_t walk = {
+        .fs = fs,
+        .fn = fn,
+        .arg = arg,
+        .flags = flags,
+        .deques = deques,
+        .n_workers = MIN(n_threads, FS_WALK_MAX_THREADS),
+        .pending = 0,
+        .ret = 0,
+    };
+    for (size_t w=0; w<walk.n_workers; w++)
+        pthread_mutex_init(&deques[w].lock, NULL);
+
+    if (flags & FS_WALK_ROOT) {
+        const char *name = strrchr(first.path, '/') + 1;
+        _walk_visit(&walk, root_inum, FS_DIRECTORY, first.path, name, 0);
+    }
+    if (walk.ret == 0 && !_walk_push(&walk, &deques[0], first))
+        walk.ret = -1;
+    if (walk.ret != 0)
+        free(first.path);
+
+    // The calling thread is the first worker, the rest start out stealing
+    size_t n_started = 1;
+    if (walk.ret == 0) {
+        for (; n_started < walk.n_workers; n_started++) {
+            workers[n_started] = (_walk_worker_t) {.walk = &walk, .id = n_started};
+            if (pthread_create(&workers[n_started].thread, NULL, _walk_worker, &workers[n_started]) != 0)
+                break;
+        }
+        // Only owners queue, so the deques of workers that didn't start stay
+        //   empty and stealing from them finds nothing
+        workers[0] = (_walk_worker_t) {.walk = &walk, .id = 0};
+        _walk_worker(&workers[0]);
+    }
+
+    for (size_t w=1; w<n_started; w++)
+        pthread_join(workers[w].thread, NULL);
+    // A stopped walk leaves directories queued
+    for (size_t w=0; w<walk.n_workers; w++) {
+        for (size_t i=deques[w].head; i<deques[w].tail; i++)
+            free(deques[w].items[i].path);
+        free(deques[w].items);
+        pthread_mutex_destroy(&deques[w].lock);
+    }
+
+    return walk.ret;
+}
+
+
+
+static off_t _fs_seek_locked(FS_t *fs, int fd_index, off_t offset, seek_t whence) {
+    if (fs == NULL || !WHENCE_OK(whence))
+        return -1;
+
+    // Look up the file descriptor, its buffered data must land first
+    fileDescriptor_t *fd = _fd_get(fs, fd_index);
+    if (fd == NULL || !_fd_flush(fs, fd_index))
+        return -1;
+
+    // Load the inode
+    inode_t inode;
+    if (!_inode_read(fs, fd->inum, &inode))
+        return -1;
+
+    // Calculate the global file offset
+    size_t new_cursor = 0;
+    if      (whence == FS_SEEK_CUR) new_cursor = _fd_cursor_get(fs, fd);
+    else if (whence == FS_SEEK_END) new_cursor = inode.file_size;
+    new_cursor = _clamped_add(new_cursor, offset, 0, inode.file_size);
+
+    // Update the file descriptor cursor to be new_cursor
+    if (_fd_cursor_set(fs, fd, new_cursor) == false)
+        return -1;
+
+    return new_cursor;
+}
+
+
+
+off_t fs_seek(FS_t *fs, int fd, off_t offset, seek_t whence) {
+    if (fs == NULL)
+        return -1;
+
+    pthread_mutex_lock(&fs->lock);
+    uint64_t start = _trace_begin(fs);
+    off_t ret = _fs_seek_locked(fs, fd, offset, whence);
+    _trace_end(fs, start, (fs_trace_rec_t) {
+        .op = FS_TRACE_SEEK, .fd = fd, .offset = offset, .arg = whence, .ret = _TRACE_RET(ret),
+    }, NULL);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+static ssize_t _fs_read_locked(FS_t *fs, int fd_index, void *dest, size_t nbyte) {
+    if (fs == NULL || dest == NULL)
+        return -1;
+
+    // Look up the file descriptor, its buffered data must land first
+    fileDescriptor_t *fd = _fd_get(fs, fd_index);
+    if (fd == NULL || !_fd_flush(fs, fd_index))
+        return -1;
+
+    // Load the inode
+    inode_t inode;
+    if (!_inode_read(fs, fd->inum, &inode))
+        return -1;
+
+    size_t cursor = _fd_cursor_get(fs, fd);
+    if (cursor == SIZE_MAX)
+        return -1;
+    if (cursor >= inode.file_size)
+        return 0;
+
+    block_t head_block, tail_block;
+    size_t block_nums[FS_IO_BATCH_BLOCKS];
+    void *block_bufs[FS_IO_BATCH_BLOCKS];
+    size_t n_to_read, n_to_read_remaining, n_read;
+    n_to_read = n_to_read_remaining = MIN(
+        nbyte,                    // Requested
+        inode.file_size - cursor  // Remaining in file from cursor
+    );
+
+    if (inode.flags & INODE_COMPRESSED) {
+        if (!_compressed_read(fs, &inode, cursor, dest, n_to_read))
+            return -1;
+        cursor += n_to_read;
+        n_to_read_remaining = 0;
+    }
+
+    // Read in runs of up to FS_IO_BATCH_BLOCKS blocks so that each run is
+    // fetched as one batch
+    while (n_to_read_remaining > 0) {
+        size_t first = cursor / BLOCK_SIZE_BYTES;
+        size_t offset = cursor % BLOCK_SIZE_BYTES;
+        size_t n_blocks = MIN(
+            FS_IO_BATCH_BLOCKS,
+            (offset + n_to_read_remaining + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES
+        );
+        size_t last = n_blocks - 1;
+        n_read = MIN(n_to_read_remaining, n_blocks*BLOCK_SIZE_BYTES - offset);
+        size_t tail_len = (offset + n_read) - last*BLOCK_SIZE_BYTES;
+
+        if (!_inode_block_nums(fs, &inode, first, n_blocks, block_nums))
+            return -1;
+
+        // Whole blocks land straight in dest, partial ones go through a
+        // temporary block
+        for (size_t i=1; i<last; i++)
+            block_bufs[i] = (uint8_t*)dest + i*BLOCK_SIZE_BYTES - offset;
+        if (offset == 0 && (last > 0 || n_read == BLOCK_SIZE_BYTES))
+            block_bufs[0] = dest;
+        else
+            block_bufs[0] = head_block;
+        if (last > 0)
+            block_bufs[last] = tail_len == BLOCK_SIZE_BYTES
+                ? (uint8_t*)dest + last*BLOCK_SIZE_BYTES - offset
+                : tail_block;
+
+        if (block_store_read_many(fs->BlockStore_whole, block_nums, block_bufs, n_blocks)
+                != n_blocks*BLOCK_SIZE_BYTES)
+            return -1;
+
+        if (block_bufs[0] == head_block)
+            memcpy(dest, head_block + offset, MIN(n_read, BLOCK_SIZE_BYTES - offset));
+        if (last > 0 && block_bufs[last] == tail_block)
+            memcpy((uint8_t*)dest + last*BLOCK_SIZE_BYTES - offset, tail_block, tail_len);
+
+        cursor += n_read;
+        dest += n_read;
+        n_to_read_remaining -= n_read;
+    }
+
+    if (_fd_cursor_set(fs, fd, cursor) == false)
+        return -1;
+
+    return n_to_read - n_to_read_remaining;
+}
+
+
+
+ssize_t fs_read(FS_t *fs, int fd, void *dst, size_t nbyte) {
+    if (fs == NULL)
+        return -1;
+
+    pthread_mutex_lock(&fs->lock);
+    uint64_t start = _trace_begin(fs);
+    int64_t cursor = _trace_cursor(fs, fd);
+    ssize_t ret = _fs_read_locked(fs, fd, dst, nbyte);
+    _trace_end(fs, start, (fs_trace_rec_t) {
+        .op = FS_TRACE_READ, .fd = fd, .offset = cursor, .size = nbyte, .ret = _TRACE_RET(ret),
+    }, NULL);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+static ssize_t _fs_write_locked(FS_t *fs, int fd_index, const void *src, size_t nbyte) {
+    if (fs == NULL || src == NULL)
+        goto err1;
+
+    // Look up the file descriptor
+    fileDescriptor_t *fd = _fd_get(fs, fd_index);
+    if (fd == NULL)
+        goto err1;
+
+    // Small writes to a buffered descriptor are gathered, larger ones flush
+    //   what was gathered and go straight through
+    if (fs->fds[fd_index].wbuf != NULL) {
+        if (nbyte < BLOCK_SIZE_BYTES)
+            return _fd_buffer_write(fs, fd_index, src, nbyte);
+        if (!_fd_flush(fs, fd_index))
+            goto err1;
+    }
+
+    // Load the inode
+    inode_t inode;
+    if (!_inode_read(fs, fd->inum, &inode))
+        goto err1;
+
+    // Appends land at the end of the file wherever the cursor is
+    size_t cursor = fs->fds[fd_index].append ? inode.file_size : _fd_cursor_get(fs, fd);
+    if (cursor == SIZE_MAX)
+        goto err1;
+
+    if (inode.flags & INODE_COMPRESSED) {
+        ssize_t n_written = _compressed_write(fs, &inode, cursor, src, nbyte);
+        // Keep the clusters that made it even if a later one failed
+        if (!_BS_INODE_WRITE_OK(fs, inode.inum, &inode) || n_written < 0)
+            goto err1;
+        if (_fd_cursor_set(fs, fd, cursor + n_written) == false)
+            goto err1;
+        return n_written;
+    }
+
+    size_t max_new_ptrs = ceil((double)(cursor % BLOCK_SIZE_BYTES + nbyte) / BLOCK_SIZE_BYTES);
+    ssize_t *new_ptrs, *new_ptrs_it;
+    new_ptrs = new_ptrs_it = calloc(MAX(max_new_ptrs, 1), sizeof(ssize_t));
+    if (new_ptrs == NULL)
+        goto err1;
+
+    block_t head_block, tail_block;
+    size_t block_nums[FS_IO_BATCH_BLOCKS];
+    // Where the old data of each block is, which differs for shared blocks
+    size_t old_block_nums[FS_IO_BATCH_BLOCKS];
+    const void *block_bufs[FS_IO_BATCH_BLOCKS];
+    size_t n_write, nbyte_orig = nbyte;
+
+    // Write in runs of up to FS_IO_BATCH_BLOCKS blocks so that each run is
+    // stored as one batch
+    while (nbyte > 0) {
+        size_t first = cursor / BLOCK_SIZE_BYTES;
+        size_t offset = cursor % BLOCK_SIZE_BYTES;
+        size_t n_blocks = MIN(
+            FS_IO_BATCH_BLOCKS,
+            (offset + nbyte + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES
+        );
+
+        // Allocate new data blocks for the run where needed
+        size_t n_owned = ceil((double)inode.file_size / BLOCK_SIZE_BYTES);
+        size_t first_new = n_owned > first ? n_owned - first : 0;
+        ssize_t *run_new_ptrs = new_ptrs_it;
+        for (size_t i=0; i<n_blocks; i++) {
+            if (first + i < n_owned)
+                continue;
+            if ((*new_ptrs_it = _inode_add_owned_block(fs, &inode, first + i)) == -1)
+                goto err2;
+            if (*new_ptrs_it == -2) {
+                n_blocks = i; // No more space available
+                break;
+            }
+            new_ptrs_it++;
+        }
+        if (n_blocks == 0)
+            break;
+
+        size_t last = n_blocks - 1;
+        n_write = MIN(nbyte, n_blocks*BLOCK_SIZE_BYTES - offset);
+        size_t tail_len = (offset + n_write) - last*BLOCK_SIZE_BYTES;
+
+        if (!_inode_block_nums(fs, &inode, first, n_blocks, block_nums))
+            goto err2;
+
+        // Shared blocks are copied on write
+        for (size_t i=0; i<n_blocks && i<first_new; i++) {
+            old_block_nums[i] = block_nums[i];
+            ssize_t private = _inode_unshare_block(fs, &inode, first + i, block_nums[i]);
+            if (private < 0)
+                goto err2;
+            block_nums[i] = private;
+        }
+
+        // Whole blocks are stored straight from src. Partial ones are written
+        // in place where they can be, so they never put back bytes that an
+        // append (see _append_copy) put in the same block meanwhile; copies of
+        // shared blocks and blocks for the content index are merged with the
+        // old data first
+        for (size_t i=1; i<last; i++)
+            block_bufs[i] = (const uint8_t*)src + i*BLOCK_SIZE_BYTES - offset;
+        size_t batch_first = 0, batch_end = n_blocks;
+
+        if (offset == 0 && (last > 0 || n_write == BLOCK_SIZE_BYTES)) {
+            block_bufs[0] = src;
+        } else if (!fs->dedup && (first_new == 0 || old_block_nums[0] == block_nums[0])) {
+            size_t head_len = MIN(n_write, BLOCK_SIZE_BYTES - offset);
+            if (block_store_write_range(fs->BlockStore_whole, block_nums[0], offset, src, head_len) != head_len)
+                goto err2;
+            batch_first = 1;
+        } else {
+            if (!_BS_READ_OK(fs, first_new > 0 ? old_block_nums[0] : block_nums[0], head_block))
+                goto err2;
+            memcpy(head_block + offset, src, MIN(n_write, BLOCK_SIZE_BYTES - offset));
+            block_bufs[0] = head_block;
+        }
+
+        if (last > 0) {
+            const uint8_t *tail_src = (const uint8_t*)src + last*BLOCK_SIZE_BYTES - offset;
+            if (tail_len == BLOCK_SIZE_BYTES) {
+                block_bufs[last] = tail_src;
+            } else if (!fs->dedup && (last >= first_new || old_block_nums[last] == block_nums[last])) {
+                if (block_store_write_range(fs->BlockStore_whole, block_nums[last], 0, tail_src, tail_len) != tail_len)
+                    goto err2;
+                batch_end = last;
+            } else {
+                if (!_BS_READ_OK(fs, last < first_new ? old_block_nums[last] : block_nums[last], tail_block))
+                    goto err2;
+                memcpy(tail_block, tail_src, tail_len);
+                block_bufs[last] = tail_block;
+            }
+        }
+
+        if (!fs->dedup && batch_end > batch_first) {
+            size_t n_batch = batch_end - batch_first;
+            if (block_store_write_many(fs->BlockStore_whole, block_nums + batch_first, block_bufs + batch_first, n_batch)
+                    != n_batch*BLOCK_SIZE_BYTES)
+                goto err2;
+        }
+
+        // Blocks identical to one already stored point at that one instead
+        bool repointed = false;
+        for (size_t i=0; fs->dedup && i<n_blocks; i++) {
+            size_t stored = block_store_write_shared(fs->BlockStore_whole, block_nums[i], block_bufs[i]);
+            if (stored == SIZE_MAX)
+                goto err2;
+            if (stored == block_nums[i])
+                continue;
+            if (_inode_set_block_num(fs, &inode, first + i, stored) < 0) {
+                block_store_release(fs->BlockStore_whole, stored);
+                goto err2;
+            }
+            block_store_release(fs->BlockStore_whole, block_nums[i]);
+            if (i >= first_new)
+                run_new_ptrs[i - first_new] = -1; // Already released
+            repointed = true;
+        }
+        if (repointed && !_BS_INODE_WRITE_OK(fs, inode.inum, &inode))
+            goto err2;
+
+        cursor += n_write;
+        src += n_write;
+        nbyte -= n_write;
+
+        if (cursor > inode.file_size)
+            inode.file_size = cursor;
+    }
+
+    if (_fd_cursor_set(fs, fd, cursor) == false)
+        goto err2;
+
+    // Update the inode in case the file size has increased
+    if (!_BS_INODE_WRITE_OK(fs, inode.inum, &inode))
+        goto err2;
+
+    free(new_ptrs);
+    return nbyte_orig - nbyte;
+err2:
+    for (ssize_t *it=new_ptrs; it!=new_ptrs_it; it++)
+        block_store_release(fs->BlockStore_whole, *it);
+    free(new_ptrs);
+err1:
+    return -1;
+}
+
+
+
+/**
+ * Check whether a write can be an append that copies its data without the FS
+ *   lock (see _append_reserve)
+ *   The block store must keep nothing per block that writes to parts of one
+ *   block would race on (checksums, shared blocks), and the descriptor must
+ *   be an unbuffered append to an uncompressed file
+ * \param fs The file system
+ * \param fd_index The index of the descriptor
+ * \param inode Set to the file's inode
+ * \return Whether the write can go without the lock
+ */
+static bool _append_unlocked_ok(FS_t *fs, int fd_index, inode_t *inode) {
+    block_store_t *bs_whole = fs->BlockStore_whole;
+    fileDescriptor_t *fd = _fd_get(fs, fd_index);
+    return fd != NULL && fs->fds[fd_index].append && fs->fds[fd_index].wbuf == NULL
+        && !fs->dedup && !block_store_has_csums(bs_whole) && !block_store_has_refs(bs_whole)
+        && _inode_read(fs, fd->inum, inode) && !(inode->flags & INODE_COMPRESSED);
+}
+
+
+
+/**
+ * Reserve the end of a file for an append: allocate its blocks, grow the file
+ *   over them and move the descriptor past them, leaving the data to
+ *   _append_copy
+ *   Readers may see the reserved range before its data lands there
+ * \param fs The file system
+ * \param fd_index The index of the descriptor, see _append_unlocked_ok
+ * \param inode The file's inode
+ * \param nbyte The number of bytes to append
+ * \param start Set to the offset in the file at which the range starts
+ * \param block_nums Set to the blocks under the range, the first one may
+ *   already hold the end of the file (free it after _append_copy)
+ * \return The number of bytes reserved, fewer than nbyte if the volume is
+ *   full, -1 on error
+ */
+static ssize_t _append_reserve(FS_t *fs, int fd_index, inode_t *inode, size_t nbyte, size_t *start, size_t **block_nums) {
+    *start = inode->file_size;
+    size_t first = *start / BLOCK_SIZE_BYTES;
+    size_t offset = *start % BLOCK_SIZE_BYTES;
+    size_t n_blocks = (offset + nbyte + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    size_t n_owned = (inode->file_size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    size_t *nums = *block_nums = malloc(MAX(n_blocks, 1) * sizeof(size_t));
+    if (nums == NULL)
+        return -1;
+
+    // The block the file ends in is shared with the append before this one
+    size_t n_old = 0;
+    if (n_blocks > 0 && first < n_owned) {
+        if (!_inode_block_nums(fs, inode, first, 1, nums))
+            return -1;
+        n_old = 1;
+    }
+    size_t n_new = n_old;
+    for (; n_new<n_blocks; n_new++) {
+        ssize_t block_num = _inode_add_owned_block(fs, inode, first + n_new);
+        if (block_num == -1)
+            goto err;
+        if (block_num == -2)
+            break; // No more space available
+        nums[n_new] = block_num;
+    }
+
+    size_t n = n_new == 0 ? 0 : MIN(nbyte, n_new*BLOCK_SIZE_BYTES - offset);
+    inode->file_size += n;
+    if (!_BS_INODE_WRITE_OK(fs, inode->inum, inode) || !_fd_cursor_set(fs, &fs->fds[fd_index].fd, inode->file_size))
+        goto err;
+    return n;
+err:
+    while (n_new-- > n_old)
+        block_store_release(fs->BlockStore_whole, nums[n_new]);
+    return -1;
+}
+
+
+
+/**
+ * Copy an append's data into the range _append_reserve set aside for it
+ *   Needs no lock: the whole blocks in the range are the append's alone, and
+ *   the blocks at its ends, which it shares with the appends on either side,
+ *   are written only where its own bytes go
+ * \param fs The file system
+ * \param start The offset in the file at which the range starts
+ * \param n The number of bytes in the range
+ * \param block_nums The blocks under the range
+ * \param src The data
+ * \return Whether all the data was written
+ */
+static bool _append_copy(FS_t *fs, size_t start, size_t n, const size_t *block_nums, const void *src) {
+    block_store_t *bs_whole = fs->BlockStore_whole;
+    size_t batch_nums[FS_IO_BATCH_BLOCKS];
+    const void *batch_bufs[FS_IO_BATCH_BLOCKS];
+    size_t n_batch = 0;
+
+    // Whole blocks go in batches, partial ones (only the first and last can
+    //   be) straight away
+    size_t done = 0;
+    for (size_t i=0; done<n; i++) {
+        size_t offset = i == 0 ? start % BLOCK_SIZE_BYTES : 0;
+        size_t len = MIN(BLOCK_SIZE_BYTES - offset, n - done);
+        const uint8_t *data = (const uint8_t*)src + done;
+        if (len < BLOCK_SIZE_BYTES) {
+            if (block_store_write_range(bs_whole, block_nums[i], offset, data, len) != len)
+                return false;
+        } else {
+            batch_nums[n_batch] = block_nums[i];
+            batch_bufs[n_batch++] = data;
+        }
+        done += len;
+        if (n_batch == FS_IO_BATCH_BLOCKS || (done == n && n_batch > 0)) {
+            if (block_store_write_many(bs_whole, batch_nums, batch_bufs, n_batch) != n_batch*BLOCK_SIZE_BYTES)
+                return false;
+            n_batch = 0;
+        }
+    }
+    return true;
+}
+
+
+
+ssize_t fs_write(FS_t *fs, int fd, const void *src, size_t nbyte) {
+    if (fs == NULL)
+        return -1;
+
+    pthread_mutex_lock(&fs->lock);
+
+    // Appends only hold the lock while they reserve their range, so several
+    //   appenders copy their data at once (traced calls keep the lock so they
+    //   are timed whole)
+    inode_t inode;
+    if (src != NULL && fs->trace == NULL && _append_unlocked_ok(fs, fd, &inode)) {
+        size_t at, *block_nums = NULL;
+        ssize_t ret = _append_reserve(fs, fd, &inode, nbyte, &at, &block_nums);
+        pthread_mutex_unlock(&fs->lock);
+        if (ret > 0 && !_append_copy(fs, at, ret, block_nums, src))
+            ret = -1;
+        free(block_nums);
+        return ret;
+    }
+
+    uint64_t start = _trace_begin(fs);
+    int64_t cursor = _trace_cursor(fs, fd);
+    ssize_t ret = _fs_write_locked(fs, fd, src, nbyte);
+    _trace_end(fs, start, (fs_trace_rec_t) {
+        .op = FS_TRACE_WRITE, .fd = fd, .offset = cursor, .size = nbyte, .ret = _TRACE_RET(ret),
+    }, NULL);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+/**
+ * Point the start of a range of a file at the blocks of a range of another
+ *   (or the same) file instead of copying them, both ranges must be block
+ *   aligned and the device must keep reference counts
+ *   The destination's old blocks are released, its inode is only updated in
+ *   memory
+ * \param fs The file system
+ * \param in The inode of the source file
+ * \param first_in The index of the first source data block
+ * \param out The inode of the destination file
+ * \param first_out The index of the first destination data block, at most
+ *   the number of blocks the destination owns
+ * \param n The number of blocks to share
+ * \return The number of blocks shared, -1 if there is an error
+ */
+static ssize_t _copy_range_share(
+    FS_t *fs,
+    inode_t *in,
+    size_t first_in,
+    inode_t *out,
+    size_t first_out,
+    size_t n
+) {
+    block_store_t *bs_whole = fs->BlockStore_whole;
+    size_t n_owned_out = (out->file_size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    size_t in_nums[FS_IO_BATCH_BLOCKS], out_nums[FS_IO_BATCH_BLOCKS];
+
+    size_t done = 0;
+    while (done < n) {
+        size_t batch = MIN(n - done, FS_IO_BATCH_BLOCKS);
+        // Only the destination blocks the file already owns have pointers
+        size_t n_old = first_out + done < n_owned_out ? MIN(batch, n_owned_out - first_out - done) : 0;
+        if (!_inode_block_nums(fs, in, first_in + done, batch, in_nums))
+            return -1;
+        if (n_old > 0 && !_inode_block_nums(fs, out, first_out + done, n_old, out_nums))
+            return -1;
+
+        for (size_t i=0; i<batch; i++) {
+            size_t refs = block_store_refs(bs_whole, in_nums[i]);
+            if (refs == UINT16_MAX)
+                return done + i; // Copy the rest
+            if (!block_store_set_refs(bs_whole, in_nums[i], refs + 1))
+                return -1;
+            if (_inode_set_block_num(fs, out, first_out + done + i, in_nums[i]) < 0) {
+                block_store_set_refs(bs_whole, in_nums[i], refs);
+                return -1;
+            }
+            if (i < n_old)
+                block_store_release(bs_whole, out_nums[i]);
+        }
+
+        done += batch;
+        size_t end = (first_out + done) * BLOCK_SIZE_BYTES;
+        if (end > out->file_size)
+            out->file_size = end;
+    }
+
+    return done;
+}
+
+
+
+/**
+ * Copy a range of a file to a range of another (or the same) file, block to
+ *   block inside the mapping
+ *   Whole aligned blocks are written straight from the source's mapping, the
+ *   destination blocks past its end are allocated as one contiguous run
+ * \param fs The file system
+ * \param in The inode of the source file
+ * \param off_in The offset of the source range
+ * \param out The inode of the destination file, only updated in memory
+ * \param off_out The offset of the destination range, at most its size
+ * \param len The length of the range, within the source file
+ * \return 0 if successful, -1 if there is an error, -2 if fs is out of space
+ */
+static int _copy_range_blocks(
+    FS_t *fs,
+    inode_t *in,
+    size_t off_in,
+    inode_t *out,
+    size_t off_out,
+    size_t len
+) {
+    if (len == 0)
+        return 0;
+
+    block_store_t *bs_whole = fs->BlockStore_whole;
+    const uint8_t *mapping = block_store_Data_location(bs_whole);
+
+    // Allocate the blocks past the destination's end in one batch
+    size_t n_owned_out = (out->file_size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    size_t n_end_out = (off_out + len + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    if (n_end_out > n_owned_out) {
+        size_t n_new = n_end_out - n_owned_out;
+        size_t *new_nums = malloc(n_new * sizeof(size_t));
+        if (new_nums == NULL)
+            return -1;
+        if (block_store_allocate_run(bs_whole, n_new, new_nums) != n_new) {
+            free(new_nums);
+            return -2;
+        }
+        for (size_t i=0; i<n_new; i++) {
+            int ret = _inode_set_block_num(fs, out, n_owned_out + i, new_nums[i]);
+            if (ret < 0) {
+                // The blocks already linked stay with the file, the rest go
+                for (size_t j=i; j<n_new; j++)
+                    block_store_release(bs_whole, new_nums[j]);
+                free(new_nums);
+                return ret;
+            }
+        }
+        free(new_nums);
+    }
+
+    size_t in_nums[FS_IO_BATCH_BLOCKS + 1], out_nums[FS_IO_BATCH_BLOCKS];
+    block_t buf;
+
+    size_t done = 0;
+    while (done < len) {
+        size_t pos_in = off_in + done, pos_out = off_out + done;
+        size_t first_in = pos_in / BLOCK_SIZE_BYTES, first_out = pos_out / BLOCK_SIZE_BYTES;
+        size_t chunk = MIN(len - done, FS_IO_BATCH_BLOCKS*BLOCK_SIZE_BYTES - pos_out % BLOCK_SIZE_BYTES);
+        size_t n_in = (pos_in % BLOCK_SIZE_BYTES + chunk + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+        size_t n_out = (pos_out % BLOCK_SIZE_BYTES + chunk + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+        if (!_inode_block_nums(fs, in, first_in, n_in, in_nums))
+            return -1;
+        if (!_inode_block_nums(fs, out, first_out, n_out, out_nums))
+            return -1;
+        if (fs->verify) {
+            for (size_t i=0; i<n_in; i++)
+                if (!block_store_verify(bs_whole, in_nums[i]))
+                    return -1;
+        }
+
+        for (size_t j=0, copied=0; j<n_out; j++) {
+            size_t seg_off = j == 0 ? pos_out % BLOCK_SIZE_BYTES : 0;
+            size_t seg_len = MIN(BLOCK_SIZE_BYTES - seg_off, chunk - copied);
+            size_t src_pos = pos_in + copied;
+            size_t k = src_pos / BLOCK_SIZE_BYTES - first_in;
+            size_t src_off = src_pos % BLOCK_SIZE_BYTES;
+            const uint8_t *src = mapping + in_nums[k]*BLOCK_SIZE_BYTES + src_off;
+
+            if (seg_len < BLOCK_SIZE_BYTES || src_off != 0) {
+                // Merge with the destination's data, then pull in the source
+                //   bytes, which may straddle two source blocks
+                if (seg_len == BLOCK_SIZE_BYTES || first_out + j >= n_owned_out)
+                    memset(buf, 0, BLOCK_SIZE_BYTES);
+                else if (!_BS_READ_OK(fs, out_nums[j], buf))
+                    return -1;
+                size_t n1 = MIN(seg_len, BLOCK_SIZE_BYTES - src_off);
+                memcpy(buf + seg_off, src, n1);
+                if (n1 < seg_len)
+                    memcpy(buf + seg_off + n1, mapping + in_nums[k+1]*BLOCK_SIZE_BYTES, seg_len - n1);
+                src = buf;
+            }
+
+            ssize_t private = _inode_unshare_block(fs, out, first_out + j, out_nums[j]);
+            if (private < 0)
+                return private;
+            if (!_BS_WRITE_OK(fs, private, src))
+                return -1;
+            copied += seg_len;
+        }
+
+        done += chunk;
+        if (off_out + done > out->file_size)
+            out->file_size = off_out + done;
+    }
+
+    return 0;
+}
+
+
+
+/**
+ * Copy a range between files through a buffer, for compressed files
+ *   The caller holds fs->lock
+ * \param fs The file system
+ * \param fd_in The source descriptor
+ * \param off_in The offset of the source range
+ * \param fd_out The destination descriptor
+ * \param off_out The offset of the destination range
+ * \param len The length of the range
+ * \return The number of bytes copied, -1 if there is an error
+ */
+static ssize_t _copy_range_buffered(FS_t *fs, int fd_in, size_t off_in, int fd_out, size_t off_out, size_t len) {
+    uint8_t *buf = malloc(FS_CLUSTER_BYTES);
+    if (buf == NULL)
+        return -1;
+
+    // The descriptors' cursors are left where they were
+    fileDescriptor_t saved_in = *_fd_get(fs, fd_in), saved_out = *_fd_get(fs, fd_out);
+
+    ssize_t done = 0;
+    while ((size_t)done < len) {
+        size_t chunk = MIN(len - done, FS_CLUSTER_BYTES);
+        if (_fs_seek_locked(fs, fd_in, off_in + done, FS_SEEK_SET) != (off_t)(off_in + done)
+                || _fs_read_locked(fs, fd_in, buf, chunk) != (ssize_t)chunk
+                || _fs_seek_locked(fs, fd_out, off_out + done, FS_SEEK_SET) != (off_t)(off_out + done)) {
+            done = -1;
+            break;
+        }
+        ssize_t n_written = _fs_write_locked(fs, fd_out, buf, chunk);
+        if (n_written <= 0) {
+            done = done > 0 ? done : -1;
+            break;
+        }
+        done += n_written;
+        if ((size_t)n_written < chunk)
+            break; // Out of space
+    }
+
+    if (!_fd_flush(fs, fd_out))
+        done = -1;
+    *_fd_get(fs, fd_in) = saved_in;
+    *_fd_get(fs, fd_out) = saved_out;
+    free(buf);
+    return done;
+}
+
+
+
+static ssize_t _fs_copy_file_range_locked(FS_t *fs, int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len) {
+    if (off_in < 0 || off_out < 0)
+        return -1;
+
+    fileDescriptor_t *fd_in_p = _fd_get(fs, fd_in), *fd_out_p = _fd_get(fs, fd_out);
+    if (fd_in_p == NULL || fd_out_p == NULL || !_fd_flush(fs, fd_in) || !_fd_flush(fs, fd_out))
+        return -1;
+
+    inode_t in, out;
+    if (!_inode_read(fs, fd_in_p->inum, &in) || !_inode_read(fs, fd_out_p->inum, &out))
+        return -1;
+    if ((size_t)off_out > out.file_size)
+        return -1;
+    if ((size_t)off_in >= in.file_size)
+        return 0;
+    len = MIN(len, in.file_size - off_in);
+
+    // Like copy_file_range(2), a range can't be copied over itself
+    if (in.inum == out.inum && (size_t)off_in < off_out + len && (size_t)off_out < off_in + len)
+        return -1;
+
+    if ((in.flags | out.flags) & INODE_COMPRESSED)
+        return _copy_range_buffered(fs, fd_in, off_in, fd_out, off_out, len);
+
+    // Within one file both ranges must see the pointers as they change
+    inode_t *src = in.inum == out.inum ? &out : &in;
+
+    // Whole aligned blocks are shared copy on write where the device allows it
+    size_t shared = 0;
+    if (off_in % BLOCK_SIZE_BYTES == 0 && off_out % BLOCK_SIZE_BYTES == 0
+            && block_store_has_refs(fs->BlockStore_whole)) {
+        ssize_t n_shared = _copy_range_share(fs, src, off_in / BLOCK_SIZE_BYTES,
+                                             &out, off_out / BLOCK_SIZE_BYTES, len / BLOCK_SIZE_BYTES);
+        if (n_shared < 0) {
+            _BS_INODE_WRITE_OK(fs, out.inum, &out);
+            return -1;
+        }
+        shared = n_shared * BLOCK_SIZE_BYTES;
+    }
+
+    int ret = _copy_range_blocks(fs, src, off_in + shared, &out, off_out + shared, len - shared);
+    // Whatever made it into the file is kept even if the copy failed part way
+    if (!_BS_INODE_WRITE_OK(fs, out.inum, &out) || ret == -1)
+        return -1;
+    if (ret == -2)
+        return shared > 0 ? (ssize_t)shared : -1;
+
+    return len;
+}
+
+
+
+ssize_t fs_copy_file_range(FS_t *fs, int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len) {
+    if (fs == NULL)
+        return -1;
+
+    pthread_mutex_lock(&fs->lock);
+    uint64_t start = _trace_begin(fs);
+    ssize_t ret = _fs_copy_file_range_locked(fs, fd_in, off_in, fd_out, off_out, len);
+    _trace_end(fs, start, (fs_trace_rec_t) {
+        .op = FS_TRACE_COPY_RANGE, .fd = fd_in, .offset = off_in, .fd_out = fd_out, .offset_out = off_out,
+        .size = len, .ret = _TRACE_RET(ret),
+    }, NULL);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+/**
+ * Record a view onto a file's blocks until fs_munmap releases it
+ * \param fs The file system
+ * \param ptr The start of the view
+ * \param len The length of the view
+ * \param inum The file's inode number
+ * \return Whether there was room to record it
+ */
+static bool _view_add(FS_t *fs, const void *ptr, size_t len, size_t inum) {
+    if (fs->n_views == fs->max_views) {
+        size_t max_views = MAX(fs->max_views * 2, 16);
+        fsView_t *views = realloc(fs->views, max_views * sizeof(fsView_t));
+        if (views == NULL)
+            return false;
+        fs->views = views;
+        fs->max_views = max_views;
+    }
+    fs->views[fs->n_views++] = (fsView_t){ .ptr = ptr, .len = len, .inum = inum };
+    return true;
+}
+
+
+
+/**
+ * Check whether a file has views onto its blocks out, which moving the blocks
+ *   would leave pointing at freed ones
+ * \param fs The file system
+ * \param inum The file's inode number
+ * \return Whether a view recorded by _view_add is onto the file
+ */
+static bool _inode_mapped(const FS_t *fs, size_t inum) {
+    for (size_t i=0; i<fs->n_views; i++)
+        if (fs->views[i].inum == inum)
+            return true;
+    return false;
+}
+
+
+
+static ssize_t _fs_mmap_locked(FS_t *fs, int fd_index, off_t offset, size_t len, const void **ptr) {
+    if (ptr == NULL || offset < 0)
+        return -1;
+    *ptr = NULL;
+
+    fileDescriptor_t *fd = _fd_get(fs, fd_index);
+    if (fd == NULL || !_fd_flush(fs, fd_index))
+        return -1;
+    inode_t inode;
+    if (!_inode_read(fs, fd->inum, &inode))
+        return -1;
+    if ((size_t)offset >= inode.file_size || len == 0)
+        return 0;
+    len = MIN(len, inode.file_size - offset);
+
+    size_t first = offset / BLOCK_SIZE_BYTES;
+    size_t head = offset % BLOCK_SIZE_BYTES;
+    size_t n_blocks = (head + len + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+    block_store_t *bs_whole = fs->BlockStore_whole;
+
+    // Compressed data has no blocks to point at, so it's decompressed into a
+    //   view laid out like the block views, which fs_munmap releases alike
+    if (inode.flags & INODE_COMPRESSED) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t view_bytes = (len + page - 1) / page * page;
+        uint8_t *view = mmap(NULL, view_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (view == MAP_FAILED)
+            return -1;
+        if (!_compressed_read(fs, &inode, offset, view, len)) {
+            munmap(view, view_bytes);
+            return -1;
+        }
+        mprotect(view, view_bytes, PROT_READ);
+        *ptr = view;
+        return len;
+    }
+
+    size_t *block_nums = malloc(n_blocks * sizeof(size_t));
+    if (block_nums == NULL)
+        return -1;
+    bool contiguous = true;
+    for (size_t i=0; i<n_blocks; i+=FS_IO_BATCH_BLOCKS) {
+        if (!_inode_block_nums(fs, &inode, first + i, MIN(n_blocks - i, FS_IO_BATCH_BLOCKS), block_nums + i))
+            goto err;
+    }
+    for (size_t i=0; i<n_blocks; i++) {
+        if (fs->verify && !block_store_verify(bs_whole, block_nums[i]))
+            goto err;
+        contiguous = contiguous && block_nums[i] == block_nums[0] + i;
+    }
+
+    if (contiguous) {
+        *ptr = block_store_Data_location(bs_whole) + block_nums[0]*BLOCK_SIZE_BYTES + head;
+    } else {
+        const uint8_t *view = block_store_map_view(bs_whole, block_nums, n_blocks);
+        if (view == NULL)
+            goto err;
+        *ptr = view + head;
+    }
+    if (!_view_add(fs, *ptr, len, fd->inum)) {
+        if (!contiguous)
+            block_store_unmap_view((const uint8_t*)*ptr - head, n_blocks);
+        *ptr = NULL;
+        goto err;
+    }
+    free(block_nums);
+    return len;
+
+err:
+    free(block_nums);
+    return -1;
+}
+
+
+
+ssize_t fs_mmap(FS_t *fs, int fd_index, off_t offset, size_t len, const void **ptr) {
+    if (fs == NULL)
+        return -1;
+
+    pthread_mutex_lock(&fs->lock);
+    ssize_t ret = _fs_mmap_locked(fs, fd_index, offset, len, ptr);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+
+
+int fs_munmap(FS_t *fs, const void *ptr, size_t len) {
+    if (fs == NULL)
+        return -1;
+    if (ptr == NULL)
+        return len == 0 ? 0 : -1;
+
+    // Views onto files' blocks are recorded, compressed files' aren't
+    pthread_mutex_lock(&fs->lock);
+    for (size_t i=0; i<fs->n_views; i++) {
+        if (fs->views[i].ptr == ptr && fs->views[i].len == len) {
+            fs->views[i] = fs->views[--fs->n_views];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    // Direct views are the volume's own mapping
+    const uint8_t *mapping = block_store_Data_location(fs->BlockStore_whole);
+    if ((const uint8_t*)ptr >= mapping && (const uint8_t*)ptr < mapping + fs->n_blocks*BLOCK_SIZE_BYTES)
+        return 0;
+
+    // Views start on a page, at most a block before ptr
+    size_t page = sysconf(_SC_PAGESIZE);
+    const uint8_t *view = (const uint8_t*)((uintptr_t)ptr / page * page);
+    size_t head = (const uint8_t*)ptr - view;
+    if (head >= BLOCK_SIZE_BYTES)
+        return -1;
+    block_store_unmap_view(view, (head + len + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES);
+    return 0;
+}
+
+
+
+/**
+ * The files an fs_defrag pass covers, in inode order
+ */
+typedef struct {
+    size_t *inums;
+    size_t n, cap;
+} _defrag_set_t;
+
+
+
+/**
+ * Add a file to the files a defrag pass covers
+ * \param set The files
+ * \param inum The file's inode number
+ * \return Whether there was memory for it
+ */
+static bool _defrag_set_add(_defrag_set_t *set, size_t inum) {
+    if (set->n == set->cap) {
+        size_t cap = set->cap ? 2 * set->cap : 64;
+        size_t *inums = realloc(set->inums, cap * sizeof(size_t));
+        if (inums == NULL)
+            return false;
+        set->inums = inums;
+        set->cap = cap;
+    }
+    set->inums[set->n++] = inum;
+    return true;
+}
+
+
+
+/**
+ * Collect the regular files under a directory, an fs_walk callback
+ * \param entry The file
+ * \param arg The files so far (_defrag_set_t)
+ * \return 0 to go on, -1 when out of memory
+ */
+static int _defrag_collect(const fs_walk_entry_t *entry, void *arg) {
+    return entry->type == FS_REGULAR && !_defrag_set_add(arg, entry->inum) ? -1 : 0;
+}
+
+
+
+static int _defrag_cmp_inum(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+
+/**
+ * Find the regular files a defrag pass covers, call with the lock held
+ * \param fs The file system
+ * \param path A file, a directory for every file under it, NULL for all files
+ * \param set Set to the files, in inode order
+ * \return Whether the files could be found
+ */
+static bool _defrag_set_build(FS_t *fs, const char *path, _defrag_set_t *set) {
+    *set = (_defrag_set_t){0};
+    inode_t inode;
+    if (path == NULL) {
+        for (size_t inum = 0; inum < NUM_INODES; inum++)
+            if (_inode_read(fs, inum, &inode) && inode.file_type == 'r' && !_defrag_set_add(set, inum))
+                return false;
+        return true;
+    }
+
+    int inum = _get_inum(fs, path);
+    if (inum < 0 || !_inode_read(fs, inum, &inode))
+        return false;
+    if (inode.file_type == 'r')
+        return _defrag_set_add(set, inum);
+    if (fs_walk(fs, path, _defrag_collect, set, FS_WALK_NONE, 1) != 0)
+        return false;
+    qsort(set->inums, set->n, sizeof(size_t), _defrag_cmp_inum);
+    return true;
+}
+
+
+
+/**
+ * Count the breaks in a file's data: consecutive data blocks of the file that
+ *   aren't next to each other on the volume
+ * \param block_nums The file's block numbers, 0 for the empty slots of
+ *   compressed clusters
+ * \param n The number of block numbers
+ * \param n_pairs Set to the number of pairs of consecutive data blocks
+ * \return The number of breaks
+ */
+static size_t _defrag_breaks(const size_t *block_nums, size_t n, size_t *n_pairs) {
+    size_t breaks = 0, prev = 0;
+    *n_pairs = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (block_nums[i] == 0)
+            continue;
+        if (prev != 0) {
+            (*n_pairs)++;
+            breaks += block_nums[i] != prev + 1;
+        }
+        prev = block_nums[i];
+    }
+    return breaks;
+}
+
+
+
+/**
+ * Load where a file's data blocks are
+ * \param fs The file system
+ * \param inode The inode of the file
+ * \param n The number of data blocks (see _inode_n_blocks)
+ * \param block_nums A buffer for the n block numbers
+ * \return Whether every block number was loaded and is a data block
+ */
+static bool _defrag_layout(FS_t *fs, inode_t *inode, size_t n, size_t *block_nums) {
+    if (!_inode_block_nums(fs, inode, 0, n, block_nums))
+        return false;
+    for (size_t i = 0; i < n; i++)
+        if (block_nums[i] != 0 && !_DATA_BLOCK_OK(fs, block_nums[i]))
+            return false;
+    return true;
+}
+
+
+
+/**
+ * Score how fragmented a set of files is
+ * \param fs The file system
+ * \param set The files
+ * \return The fraction of pairs of consecutive data blocks that are apart,
+ *   files that can't be read are left out
+ */
+static double _defrag_score(FS_t *fs, const _defrag_set_t *set) {
+    size_t breaks = 0, pairs = 0;
+    size_t *block_nums = NULL, cap = 0;
+    for (size_t i = 0; i < set->n; i++) {
+        pthread_mutex_lock(&fs->lock);
+        inode_t inode;
+        size_t n = 0, n_pairs;
+        if (_inode_read(fs, set->inums[i], &inode))
+            n = _inode_n_blocks(&inode);
+        if (n > cap) {
+            size_t *grown = realloc(block_nums, n * sizeof(size_t));
+            if (grown == NULL) {
+                n = 0;
+            } else {
+                block_nums = grown;
+                cap = n;
+            }
+        }
+        if (n > 0 && _defrag_layout(fs, &inode, n, block_nums)) {
+            breaks += _defrag_breaks(block_nums, n, &n_pairs);
+            pairs += n_pairs;
+        }
+        pthread_mutex_unlock(&fs->lock);
+    }
+    free(block_nums);
+    return pairs == 0 ? 0 : (double)breaks / pairs;
+}
+
+
+
+/**
+ * Copy data blocks to where they are moving, in batches
+ * \param fs The file system
+ * \param from The blocks to copy
+ * \param to Where to copy each block
+ * \param n The number of blocks
+ * \return Whether every block was copied
+ */
+static bool _defrag_copy(FS_t *fs, const size_t *from, const size_t *to, size_t n) {
+    block_t *buf = malloc(MIN(n, FS_IO_BATCH_BLOCKS) * sizeof(block_t));
+    if (buf == NULL)
+        return false;
+    void *bufs[FS_IO_BATCH_BLOCKS];
+    for (size_t i = 0; i < MIN(n, FS_IO_BATCH_BLOCKS); i++)
+        bufs[i] = buf[i];
+
+    bool ok = true;
+    for (size_t done = 0; ok && done < n; done += FS_IO_BATCH_BLOCKS) {
+        size_t batch = MIN(n - done, FS_IO_BATCH_BLOCKS);
+        ok = block_store_read_many(fs->BlockStore_whole, from + done, bufs, batch) == batch * BLOCK_SIZE_BYTES
+            && block_store_write_many(fs->BlockStore_whole, to + done, (const void *const *)bufs, batch) == batch * BLOCK_SIZE_BYTES;
+    }
+    free(buf);
+    return ok;
+}
+
+
+
+/**
+ * Move a file into one contiguous run of blocks: its pointer blocks, then its
+ *   data blocks in file order. Blocks it shares with other files stay put,
+ *   moved blocks that could be shared (FS_OPT_DEDUP) stay shareable, and
+ *   files open for appending or with views out are left alone
+ *   The copies and new pointer blocks are written before the inode switches
+ *   over to them, the old blocks are freed after
+ * \param fs The file system
+ * \param inum The file's inode number
+ * \return The number of blocks moved, 0 if moving the file wouldn't make it
+ *   more contiguous, there is no free run long enough or the file is gone,
+ *   -1 on error
+ */
+static ssize_t _defrag_file(FS_t *fs, size_t inum) {
+    block_store_t *bs_whole = fs->BlockStore_whole;
+    inode_t inode;
+    if (!_inode_read(fs, inum, &inode))
+        return _inode_in_use(fs, inum) ? -1 : 0;
+    size_t n = _inode_n_blocks(&inode);
+    if (inode.file_type != 'r' || n < 2 || _fd_appending(fs, inum) || _inode_mapped(fs, inum))
+        return 0;
+
+    // Old and new block numbers, then the moving blocks' old and new numbers
+    size_t *old_nums = malloc(4 * n * sizeof(size_t));
+    if (old_nums == NULL)
+        return -1;
+    size_t *new_nums = old_nums + n, *from = new_nums + n, *to = from + n;
+    ssize_t ret = -1;
+    size_t run = SIZE_MAX, n_run = 0, n_moving = 0, n_pairs;
+    if (!_defrag_layout(fs, &inode, n, old_nums))
+        goto out;
+    size_t breaks = _defrag_breaks(old_nums, n, &n_pairs);
+    ret = 0;
+    if (breaks == 0)
+        goto out;
+
+    size_t n_ind2 = n > _INDIRECT_MAX_PTRS(fs)
+        ? (n - _INDIRECT_MAX_PTRS(fs) + fs->ptrs_per_block - 1) / fs->ptrs_per_block : 0;
+    size_t n_ptr = (n > FD_DIRECT_MAX_PTRS) + (n_ind2 > 0) + n_ind2;
+    for (size_t i = 0; i < n; i++)
+        if (old_nums[i] != 0 && block_store_refs(bs_whole, old_nums[i]) == 0)
+            n_moving++;
+    n_run = n_ptr + n_moving;
+    if ((run = block_store_allocate_contiguous(bs_whole, n_run)) == SIZE_MAX)
+        goto out;
+
+    size_t next = run + n_ptr;
+    n_moving = 0;
+    for (size_t i = 0; i < n; i++) {
+        new_nums[i] = old_nums[i];
+        if (old_nums[i] != 0 && block_store_refs(bs_whole, old_nums[i]) == 0) {
+            from[n_moving] = old_nums[i];
+            to[n_moving++] = new_nums[i] = next++;
+        }
+    }
+    ret = -1;
+    if (_defrag_breaks(new_nums, n, &n_pairs) >= breaks) {
+        ret = 0;
+        goto out_release;
+    }
+    if (!_defrag_copy(fs, from, to, n_moving))
+        goto out_release;
+
+    // The new pointer blocks lead the run
+    inode_t moved = inode;
+    ind_block_t ind_block, db_ind_block;
+    size_t ptr_next = run;
+    for (size_t i = 0; i < MIN(n, FD_DIRECT_MAX_PTRS); i++)
+        _inode_set_ptr(fs, &moved, i, new_nums[i]);
+    if (n > FD_DIRECT_MAX_PTRS) {
+        memset(&ind_block, 0x00, sizeof(ind_block));
+        for (size_t i = FD_DIRECT_MAX_PTRS; i < MIN(n, _INDIRECT_MAX_PTRS(fs)); i++)
+            _ptr_set(fs, &ind_block, i - FD_DIRECT_MAX_PTRS, new_nums[i]);
+        _inode_set_ptr(fs, &moved, _SLOT_INDIRECT, ptr_next);
+        if (!_BS_WRITE_OK(fs, ptr_next++, &ind_block))
+            goto out_release;
+    }
+    if (n_ind2 > 0) {
+        memset(&db_ind_block, 0x00, sizeof(db_ind_block));
+        _inode_set_ptr(fs, &moved, _SLOT_DOUBLE_INDIRECT, ptr_next++);
+        for (size_t k = 0; k < n_ind2; k++) {
+            memset(&ind_block, 0x00, sizeof(ind_block));
+            size_t first = _INDIRECT_MAX_PTRS(fs) + k * fs->ptrs_per_block;
+            for (size_t i = first; i < MIN(n, first + fs->ptrs_per_block); i++)
+                _ptr_set(fs, &ind_block, i - first, new_nums[i]);
+            _ptr_set(fs, &db_ind_block, k, ptr_next);
+            if (!_BS_WRITE_OK(fs, ptr_next++, &ind_block))
+                goto out_release;
+        }
+        if (!_BS_WRITE_OK(fs, _inode_ptr(fs, &moved, _SLOT_DOUBLE_INDIRECT), &db_ind_block))
+            goto out_release;
+    }
+
+    // The old double indirect block names the old pointer blocks below it
+    if (n_ind2 > 0 && !_BS_META_READ_OK(fs, _inode_ptr(fs, &inode, _SLOT_DOUBLE_INDIRECT), &db_ind_block))
+        goto out_release;
+    if (!_BS_INODE_WRITE_OK(fs, inum, &moved))
+        goto out_release;
+
+    // Releasing a block drops it from the dedup index, its copy takes its place
+    for (size_t i = 0; i < n_moving; i++) {
+        bool shareable = block_store_shareable(bs_whole, from[i]);
+        block_store_release(bs_whole, from[i]);
+        if (shareable)
+            block_store_share(bs_whole, to[i]);
+    }
+    if (n > FD_DIRECT_MAX_PTRS)
+        block_store_release(bs_whole, _inode_ptr(fs, &inode, _SLOT_INDIRECT));
+    if (n_ind2 > 0) {
+        for (size_t k = 0; k < n_ind2; k++)
+            block_store_release(bs_whole, _ptr_get(fs, &db_ind_block, k));
+        block_store_release(bs_whole, _inode_ptr(fs, &inode, _SLOT_DOUBLE_INDIRECT));
+    }
+    ret = n_run;
+    goto out;
+
+out_release:
+    for (size_t block_num = run; block_num < run + n_run; block_num++)
+        block_store_release(bs_whole, block_num);
+out:
+    free(old_nums);
+    return ret;
+}
+
+
+
+int fs_defrag(FS_t *fs, const char *path, size_t budget, fs_defrag_t *pass) {
+    if (fs == NULL || pass == NULL)
+        return -1;
+
+    // The first call finds the files, the calls after resume in the set
+    _defrag_set_t set = {pass->inums, pass->n_inums, pass->n_inums};
+    if (set.inums == NULL) {
+        pthread_mutex_lock(&fs->lock);
+        bool found = _defrag_set_build(fs, path, &set);
+        pthread_mutex_unlock(&fs->lock);
+        if (!found) {
+            free(set.inums);
+            return -1;
+        }
+        pass->inums = set.inums;
+        pass->n_inums = set.n;
+        pass->next_inum = 0;
+        pass->score_before = pass->score_after = _defrag_score(fs, &set);
+        pass->files_moved = pass->blocks_moved = 0;
+    }
+
+    // A file at a time, so other calls get the lock in between
+    int ret = 0;
+    size_t moved = 0, i = 0, hi = set.n;
+    while (i < hi) {
+        size_t mid = i + (hi - i) / 2;
+        if (set.inums[mid] < pass->next_inum)
+            i = mid + 1;
+        else
+            hi = mid;
+    }
+    for (; i < set.n && (budget == 0 || moved < budget); i++) {
+        pthread_mutex_lock(&fs->lock);
+        ssize_t n = _defrag_file(fs, set.inums[i]);
+        pthread_mutex_unlock(&fs->lock);
+        if (n < 0) {
+            ret = -1;
+            i++;
+            break;
+        }
+        if (n > 0) {
+            pass->files_moved++;
+            pass->blocks_moved += n;
+            moved += n;
+        }
+    }
+
+    if (i < set.n) {
+        pass->next_inum = set.inums[i];
+        return ret < 0 ? ret : 1;
+    }
+    pass->score_after = _defrag_score(fs, &set);
+    fs_defrag_cancel(pass);
+    return ret;
+}
+
+
+
+void fs_defrag_cancel(fs_defrag_t *pass) {
+    if (pass == NULL)
+        return;
+    free(pass->inums);
+    pass->inums = NULL;
+    pass->n_inums = 0;
+    pass->next_inum = 0;
+}
+
+
+
+/**
+ * State shared by the fs_check block walk workers
+ */
+typedef struct {
+    FS_t *fs;
+    // The inodes to walk and the next one to claim
+    const size_t *inums;
+    size_t n_inums, next;
+    // Per inode: the number of data blocks that have valid pointers
+    size_t *n_valid;
+    // Per block: the number of times the walked inodes claim it, counted by
+    //   all the workers at once
+    uint16_t *claims;
+} _check_walk_t;
+
+/**
+ * A single fs_check block walk worker
+ */
+typedef struct {
+    _check_walk_t *walk;
+    pthread_t thread;
+} _check_worker_t;
+
+
+
+/**
+ * Count a claim on a block by a file, the count stops at UINT16_MAX
+ * \param block_num The block
+ * \param worker The worker walking the file
+ */
+static void _check_claim(size_t block_num, _check_worker_t *worker) {
+    uint16_t *claim = &worker->walk->claims[block_num];
+    uint16_t count = __atomic_load_n(claim, __ATOMIC_RELAXED);
+    while (count < UINT16_MAX
+        && !__atomic_compare_exchange_n(claim, &count, count + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+
+/**
+ * Walk all of a file's data and pointer blocks, claiming each one
+ *   Pointer blocks are only claimed once a data block below them checks out
+ * \param fs The file system
+ * \param inode The inode of the file
+ * \param worker The worker walking the file
+ * \return The number of leading data blocks with valid pointers
+ */
+static size_t _check_inode_blocks(FS_t *fs, const inode_t *inode, _check_worker_t *worker) {
+    ind_block_t ind_block, db_ind_block;
+    size_t pending_ind = SIZE_MAX, pending_db_ind = SIZE_MAX;
+    size_t n = _inode_n_blocks(inode);
+
+    for (size_t i=0; i<n; i++) {
+        size_t block_num;
+
+        if (i < FD_DIRECT_MAX_PTRS) {
+            block_num = _inode_ptr(fs, inode, i);
+        }
+
+        else if (i < _INDIRECT_MAX_PTRS(fs)) {
+            size_t index = i - FD_DIRECT_MAX_PTRS;
+            if (index == 0) {
+                pending_ind = _inode_ptr(fs, inode, _SLOT_INDIRECT);
+                if (!_DATA_BLOCK_OK(fs, pending_ind) || !_BS_META_READ_OK(fs, pending_ind, &ind_block))
+                    return i;
+            }
+            block_num = _ptr_get(fs, &ind_block, index);
+        }
+
+        else if (i < _DOUBLE_INDIRECT_MAX_PTRS(fs)) {
+            size_t index = i - _INDIRECT_MAX_PTRS(fs);
+            if (index == 0) {
+                pending_db_ind = _inode_ptr(fs, inode, _SLOT_DOUBLE_INDIRECT);
+                if (!_DATA_BLOCK_OK(fs, pending_db_ind) || !_BS_META_READ_OK(fs, pending_db_ind, &db_ind_block))
+                    return i;
+            }
+            if (index % fs->ptrs_per_block == 0) {
+                pending_ind = _ptr_get(fs, &db_ind_block, index / fs->ptrs_per_block);
+                if (!_DATA_BLOCK_OK(fs, pending_ind) || !_BS_META_READ_OK(fs, pending_ind, &ind_block))
+                    return i;
+            }
+            block_num = _ptr_get(fs, &ind_block, index % fs->ptrs_per_block);
+        }
+
+        else {
+            return i; // Past the largest file
+        }
+
+        // The slots after a compressed cluster's data are empty
+        bool hole = block_num == 0 && (inode->flags & INODE_COMPRESSED);
+        if (!hole && !_DATA_BLOCK_OK(fs, block_num))
+            return i;
+
+        if (pending_db_ind != SIZE_MAX)
+            _check_claim(pending_db_ind, worker);
+        if (pending_ind != SIZE_MAX)
+            _check_claim(pending_ind, worker);
+        pending_db_ind = pending_ind = SIZE_MAX;
+        if (!hole)
+            _check_claim(block_num, worker);
+    }
+
+    return n;
+}
+
+
+
+/**
+ * fs_check block walk worker, claims inodes until there are none left
+ * \param arg The worker (_check_worker_t)
+ */
+static void *_check_worker(void *arg) {
+    _check_worker_t *worker = arg;
+    _check_walk_t *walk = worker->walk;
+
+    size_t i;
+    while ((i = __atomic_fetch_add(&walk->next, 1, __ATOMIC_RELAXED)) < walk->n_inums) {
+        inode_t inode;
+        if (!_inode_read(walk->fs, walk->inums[i], &inode))
+            continue;
+        walk->n_valid[walk->inums[i]] = _check_inode_blocks(walk->fs, &inode, worker);
+    }
+
+    return NULL;
+}
+
+
+
+/**
+ * Walk the blocks of the given inodes on worker threads
+ * \param fs The file system
+ * \param inums The inodes to walk
+ * \param n_inums The number of inodes
+ * \param n_valid Per inode number, set to the number of leading valid data blocks
+ * \param claims Per block, set to the number of times the walked inodes claim it
+ */
+static void _check_walk(
+    FS_t *fs,
+    const size_t *inums,
+    size_t n_inums,
+    size_t *n_valid,
+    uint16_t *claims
+) {
+    _check_walk_t walk = {
+        .fs = fs,
+        .inums = inums,
+        .n_inums = n_inums,
+        .next = 0,
+        .n_valid = n_valid,
+        .claims = claims,
+    };
+    memset(claims, 0x00, fs->avail_blocks * sizeof(uint16_t));
+
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_workers = MAX(1, MIN((size_t)MAX(n_cpus, 1), FS_CHECK_MAX_THREADS));
+    n_workers = MIN(n_workers, MAX(n_inums, 1));
+
+    _check_worker_t workers[FS_CHECK_MAX_THREADS];
+    size_t n_started = 0;
+    for (; n_started < n_workers; n_started++) {
+        _check_worker_t *worker = &workers[n_started];
+        worker->walk = &walk;
+        // The calling thread is the first worker
+        if (n_started > 0 && pthread_create(&worker->thread, NULL, _check_worker, worker) != 0)
+            break;
+    }
+    _check_worker(&workers[0]);
+    for (size_t w=1; w<n_started; w++)
+        pthread_join(workers[w].thread, NULL);
+}
+
+
+
+int fs_check(const char *path, bool repair) {
+    FS_t *fs = fs_mount(path);
+    if (fs == NULL)
+        return -1;
+
+    block_store_t *bs_whole = fs->BlockStore_whole;
+    inodeMap_t *map = fs->inode_map;
+    int n_problems = 0;
+
+    size_t refs[NUM_INODES] = {0};
+    size_t n_valid[NUM_INODES] = {0};
+    bool reachable[NUM_INODES] = {false};
+    size_t live[NUM_INODES], n_live = 0;
+
+    /**
+     * Drop inode blocks with bad block numbers from the inode map, along with
+     * the inodes in them
+     */
+
+    for (size_t inode_block=FS_FIXED_INODE_BLOCKS; inode_block<FS_INODE_BLOCKS; inode_block++) {
+        bool mapped = _inode_block_num(fs, inode_block) != 0;
+        if (mapped || (map->blocks[inode_block] == 0 && map->used[inode_block] == 0))
+            continue;
+        n_problems++;
+        if (repair) {
+            map->blocks[inode_block] = 0;
+            map->used[inode_block] = 0;
+            block_store_csum_refresh(bs_whole, _INODE_MAP_BLOCK);
+        }
+    }
+
+    /**
+     * Find the reachable inodes, breadth first from the root, and count the
+     * directory entries that reference each of them
+     */
+
+    inode_t root;
+    if (!_inode_read(fs, 0, &root) || root.file_type != 'd')
+        goto err;
+    reachable[0] = true;
+    live[n_live++] = 0;
+
+    for (size_t q=0; q<n_live; q++) {
+        inode_t dir;
+        if (!_inode_read(fs, live[q], &dir) || dir.file_type != 'd')
+            continue;
+
+        // A directory's size is its entry count
+        size_t n_entries = __builtin_popcount(dir.dir_entry_map);
+        if (dir.file_size != n_entries) {
+            n_problems++;
+            dir.file_size = n_entries;
+            if (repair && !_BS_INODE_WRITE_OK(fs, live[q], &dir))
+                goto err;
+        }
+        if (dir.file_size == 0)
+            continue;
+        if (!_DATA_BLOCK_OK(fs, _inode_ptr(fs, &dir, 0)))
+            continue; // Reported by the block walk
+
+        block_t block;
+        if (!_BS_META_READ_OK(fs, _inode_ptr(fs, &dir, 0), block))
+            goto err;
+
+        for (size_t i=0; i<DIR_ENTRIES_PER_BLOCK; i++) {
+            if (!(dir.dir_entry_map & (1u << i)))
+                continue;
+            directoryFile_t *entry = (directoryFile_t*)block + i;
+
+            // Drop entries that lead nowhere
+            inode_t child;
+            if (!INUM_OK(entry->inum) || !_inode_read(fs, entry->inum, &child)
+                    || (child.file_type != 'r' && child.file_type != 'd')) {
+                n_problems++;
+                dir.dir_entry_map &= ~(1u << i);
+                dir.file_size--;
+                if (repair && !_BS_INODE_WRITE_OK(fs, live[q], &dir))
+                    goto err;
+                continue;
+            }
+
+            refs[entry->inum]++;
+            if (!reachable[entry->inum]) {
+                reachable[entry->inum] = true;
+                live[n_live++] = entry->inum;
+            }
+        }
+    }
+
+    /**
+     * Free in-use inodes that nothing references, fix up the ones that are
+     * reachable
+     */
+
+    for (size_t inum=0; inum<NUM_INODES; inum++) {
+        if (!_inode_in_use(fs, inum))
+            continue;
+        if (!reachable[inum]) {
+            n_problems++;
+            if (repair)
+                _inode_free(fs, inum);
+            continue;
+        }
+
+        inode_t inode;
+        if (!_inode_read(fs, inum, &inode))
+            goto err;
+        bool dirty = false;
+        if (inode.inum != inum) {
+            inode.inum = inum;
+            dirty = true;
+        }
+        if (inum != 0 && inode.link_count != refs[inum]) {
+            inode.link_count = refs[inum];
+            dirty = true;
+        }
+        if (dirty) {
+            n_problems++;
+            if (repair && !_BS_INODE_WRITE_OK(fs, inum, &inode))
+                goto err;
+        }
+    }
+
+    /**
+     * Walk every live file's blocks in parallel and count the claims on each
+     * block
+     */
+
+    uint16_t *claims = malloc(fs->avail_blocks * sizeof(uint16_t));
+    if (claims == NULL)
+        goto err;
+    _check_walk(fs, live, n_live, n_valid, claims);
+
+    // Truncate files at their first bad block pointer
+    for (size_t i=0; i<n_live; i++) {
+        inode_t inode;
+        if (!_inode_read(fs, live[i], &inode))
+            goto err2;
+        if (n_valid[live[i]] == _inode_n_blocks(&inode))
+            continue;
+        n_problems++;
+        if (inode.file_type == 'd') {
+            inode.file_size = 0;
+            inode.dir_entry_map = 0;
+        } else if (inode.flags & INODE_COMPRESSED) {
+            // A cluster is only readable whole
+            inode.file_size = n_valid[live[i]] / FS_CLUSTER_BLOCKS * FS_CLUSTER_BYTES;
+        } else {
+            inode.file_size = n_valid[live[i]] * BLOCK_SIZE_BYTES;
+        }
+        if (repair && !_BS_INODE_WRITE_OK(fs, live[i], &inode))
+            goto err2;
+    }
+
+    // The inode map and the inode table are always in use
+    for (size_t block_num=0; block_num<FS_META_BLOCKS; block_num++)
+        claims[block_num] = 1;
+    for (size_t inode_block=FS_FIXED_INODE_BLOCKS; inode_block<FS_INODE_BLOCKS; inode_block++) {
+        size_t block_num = _inode_block_num(fs, inode_block);
+        if (block_num != 0 && claims[block_num] < UINT16_MAX)
+            claims[block_num]++;
+    }
+
+    /**
+     * Reconcile the reference counts of shared blocks with the claims, then
+     * the free block map
+     */
+
+    for (size_t block_num=0; block_num<fs->avail_blocks; block_num++) {
+        size_t extra = claims[block_num] > 0 ? claims[block_num] - 1u : 0;
+        if (block_store_refs(bs_whole, block_num) == extra)
+            continue;
+        // Without a reference table a block claimed twice can't be made
+        // right, there is no telling which file the data belongs to
+        n_problems++;
+        if (repair)
+            block_store_set_refs(bs_whole, block_num, extra);
+    }
+
+    for (size_t block_num=0; block_num<fs->avail_blocks; block_num++) {
+        bool in_use = claims[block_num] > 0;
+        if (block_store_test(bs_whole, block_num) == in_use)
+            continue;
+        n_problems++;
+        if (!repair)
+            continue;
+        if (in_use)
+            block_store_request(bs_whole, block_num);
+        else
+            block_store_release(bs_whole, block_num); // Leaked
+    }
+
+    free(claims);
+    fs_unmount(fs);
+    return n_problems;
 err2:
-    for (ssize_t *it=new_ptrs; it!=new_ptrs_it; it++)
-        block_store_release(fs->BlockStore_whole, *it);
-    free(new_ptrs);
-err1:
+    free(claims);
+err:
+    fs_unmount(fs);
     return -1;
 }
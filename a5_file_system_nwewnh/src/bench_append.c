@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "FS.h"
+
+#define USAGE "%s <scratch image> [max threads] [records per pass]\n", argv[0]
+
+#define RECORD_BYTES 100
+
+typedef struct {
+    uint32_t thread;
+    uint32_t seq;
+    uint8_t fill[RECORD_BYTES - 8];
+} record_t;
+
+typedef struct {
+    FS_t *fs;
+    uint32_t id;
+    size_t n_records;
+    bool buffered;
+    bool failed;
+} appender_t;
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Append records to the log through a descriptor of its own
+ * \param arg The appender_t
+ * \return NULL
+ */
+static void *_append(void *arg) {
+    appender_t *app = arg;
+    int fd = fs_open_flags(app->fs, "/log", FS_O_APPEND);
+    if (fd < 0 || fs_set_buffered(app->fs, fd, app->buffered) < 0) {
+        app->failed = true;
+        return NULL;
+    }
+
+    record_t rec;
+    rec.thread = app->id;
+    for (size_t i = 0; i < app->n_records; i++) {
+        rec.seq = i;
+        memset(rec.fill, (uint8_t) (app->id * 31 + i), sizeof(rec.fill));
+        if (fs_write(app->fs, fd, &rec, sizeof(rec)) != sizeof(rec)) {
+            app->failed = true;
+            break;
+        }
+    }
+    if (fs_close(app->fs, fd) < 0)
+        app->failed = true;
+    return NULL;
+}
+
+/**
+ * Check that every record in the log is whole and each thread's are in order
+ * \param fs The FS
+ * \param n_threads Number of appenders
+ * \param n_records Records per appender
+ * \return Whether the log checks out
+ */
+static bool _verify(FS_t *fs, size_t n_threads, size_t n_records) {
+    int fd = fs_open(fs, "/log");
+    uint32_t *next = calloc(n_threads, sizeof(uint32_t));
+    bool ok = fd >= 0 && next != NULL;
+
+    record_t rec;
+    size_t n_read = 0;
+    while (ok && fs_read(fs, fd, &rec, sizeof(rec)) == sizeof(rec)) {
+        ok = rec.thread < n_threads && rec.seq == next[rec.thread]++;
+        for (size_t i = 0; ok && i < sizeof(rec.fill); i++)
+            ok = rec.fill[i] == (uint8_t) (rec.thread * 31 + rec.seq);
+        n_read++;
+    }
+
+    free(next);
+    if (fd >= 0)
+        fs_close(fs, fd);
+    return ok && n_read == n_threads * n_records;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(USAGE);
+        return EXIT_FAILURE;
+    }
+
+    size_t max_threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+    size_t total = argc > 3 ? strtoul(argv[3], NULL, 10) : 200000;
+    appender_t *apps = calloc(max_threads, sizeof(appender_t));
+    pthread_t *threads = calloc(max_threads, sizeof(pthread_t));
+    if (max_threads == 0 || total == 0 || apps == NULL || threads == NULL) {
+        printf("Error: bad thread or record count\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu records of %d bytes per pass\n", total, RECORD_BYTES);
+    for (int buffered = 0; buffered < 2; buffered++) {
+        for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+            // A fresh volume per pass so every pass appends to an empty log
+            FS_t *fs = fs_format(argv[1]);
+            if (fs == NULL || fs_create(fs, "/log", FS_REGULAR) < 0) {
+                printf("Error: could not format %s\n", argv[1]);
+                return EXIT_FAILURE;
+            }
+
+            double start = _now();
+            for (size_t t = 0; t < n_threads; t++) {
+                apps[t] = (appender_t) {
+                    .fs = fs,
+                    .id = t,
+                    .n_records = total / n_threads,
+                    .buffered = buffered,
+                };
+                pthread_create(&threads[t], NULL, _append, &apps[t]);
+            }
+            bool failed = false;
+            for (size_t t = 0; t < n_threads; t++) {
+                pthread_join(threads[t], NULL);
+                failed = failed || apps[t].failed;
+            }
+            double secs = _now() - start;
+
+            size_t n = total / n_threads * n_threads;
+            printf("%-10s %2zu threads  ", buffered ? "buffered" : "unbuffered", n_threads);
+            if (failed || !_verify(fs, n_threads, total / n_threads))
+                printf("error\n");
+            else
+                printf("%10.0f records/s  %7.1f MiB/s\n", n / secs, n * RECORD_BYTES / secs / (1 << 20));
+            fs_unmount(fs);
+        }
+    }
+
+    free(apps);
+    free(threads);
+    unlink(argv[1]);
+    return EXIT_SUCCESS;
+}
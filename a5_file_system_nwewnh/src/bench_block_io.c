@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block_io.h"
+#include "consts.h"
+
+#define USAGE "%s <scratch file> [blocks per pass]\n", argv[0]
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Drop the scratch file from the page cache so the next pass hits the device
+ * \param fd The scratch file
+ */
+static void _drop_cache(int fd) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * Read every block in ids, either one pread at a time or in engine batches
+ * \return Seconds taken, negative on error
+ */
+static double _pass(int fd, block_io_t *bio, const size_t *ids, size_t n, uint8_t *buf) {
+    block_io_req_t reqs[BLOCK_STORE_IO_QUEUE_DEPTH];
+
+    double start = _now();
+    for (size_t done = 0; done < n; ) {
+        size_t batch = n - done < BLOCK_STORE_IO_QUEUE_DEPTH ? n - done : BLOCK_STORE_IO_QUEUE_DEPTH;
+        if (bio == NULL) {
+            for (size_t i = 0; i < batch; i++)
+                if (pread(fd, buf + i*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES,
+                          (off_t)ids[done+i]*BLOCK_SIZE_BYTES) != BLOCK_SIZE_BYTES)
+                    return -1;
+        } else {
+            for (size_t i = 0; i < batch; i++)
+                reqs[i] = (block_io_req_t) { BLOCK_IO_READ, ids[done+i], buf + i*BLOCK_SIZE_BYTES };
+            if (block_io_submit(bio, reqs, batch) != batch)
+                return -1;
+        }
+        done += batch;
+    }
+    return _now() - start;
+}
+
+static void _report(const char *name, const char *order, const char *cache, double secs, size_t n) {
+    if (secs < 0) {
+        printf("%-14s %-10s %-5s  error\n", name, order, cache);
+        return;
+    }
+    double mib = (double)n * BLOCK_SIZE_BYTES / (1024 * 1024);
+    printf("%-14s %-10s %-5s  %9.1f MiB/s  %8.2f us/block\n",
+           name, order, cache, mib / secs, secs * 1e6 / n);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(USAGE);
+        return EXIT_FAILURE;
+    }
+
+    size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : BLOCK_STORE_AVAIL_BLOCKS;
+    if (n == 0 || n > BLOCK_STORE_AVAIL_BLOCKS) {
+        printf("Error: blocks per pass must be in [1,%zu]\n", (size_t) BLOCK_STORE_AVAIL_BLOCKS);
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // Fill the scratch file so that every block is backed by real data
+    uint8_t *buf = malloc(BLOCK_STORE_IO_QUEUE_DEPTH * BLOCK_SIZE_BYTES);
+    size_t *seq = malloc(n * sizeof(size_t)), *rnd = malloc(n * sizeof(size_t));
+    if (buf == NULL || seq == NULL || rnd == NULL) {
+        printf("Error: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    memset(buf, 0xa5, BLOCK_STORE_IO_QUEUE_DEPTH * BLOCK_SIZE_BYTES);
+    for (size_t i = 0; i < BLOCK_STORE_NUM_BLOCKS; i += BLOCK_STORE_IO_QUEUE_DEPTH) {
+        if (write(fd, buf, BLOCK_STORE_IO_QUEUE_DEPTH * BLOCK_SIZE_BYTES) < 0) {
+            perror("write");
+            return EXIT_FAILURE;
+        }
+    }
+
+    srand(4520);
+    for (size_t i = 0; i < n; i++)
+        seq[i] = rnd[i] = i;
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = (size_t)rand() % (i + 1);
+        size_t tmp = rnd[i];
+        rnd[i] = rnd[j];
+        rnd[j] = tmp;
+    }
+
+    block_io_t *engines[2] = {
+        block_io_create(fd, BLOCK_STORE_IO_QUEUE_DEPTH, BLOCK_IO_DEFAULT),
+        block_io_create(fd, BLOCK_STORE_IO_QUEUE_DEPTH, BLOCK_IO_NO_URING),
+    };
+    const char *names[3] = {
+        "pread",
+        block_io_is_uring(engines[0]) ? "io_uring" : "pool (no uring)",
+        "thread pool",
+    };
+
+    printf("%zu blocks of %d bytes per pass\n", n, BLOCK_SIZE_BYTES);
+    const size_t *orders[2] = { seq, rnd };
+    const char *order_names[2] = { "sequential", "random" };
+    for (int o = 0; o < 2; o++) {
+        for (int cold = 1; cold >= 0; cold--) {
+            for (int e = 0; e < 3; e++) {
+                block_io_t *bio = e == 0 ? NULL : engines[e - 1];
+                if (e > 0 && bio == NULL)
+                    continue;
+                if (cold)
+                    _drop_cache(fd);
+                else
+                    _pass(fd, bio, orders[o], n, buf); // Warm up
+                double secs = _pass(fd, bio, orders[o], n, buf);
+                _report(names[e], order_names[o], cold ? "cold" : "warm", secs, n);
+            }
+        }
+    }
+
+    block_io_destroy(engines[0]);
+    block_io_destroy(engines[1]);
+    free(buf);
+    free(seq);
+    free(rnd);
+    close(fd);
+    unlink(argv[1]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "FS.h"
+#include "block_store.h"
+#include "consts.h"
+#include "crc32c.h"
+
+#define USAGE "%s <scratch image> [MiB per pass]\n", argv[0]
+
+#define BATCH BLOCK_STORE_IO_QUEUE_DEPTH
+#define FIRST_BLOCK 17 // Past the inode bitmap and table
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Move n blocks through the store in batches, cycling over the data region
+ * \param bs The store
+ * \param write Whether to write rather than read
+ * \param bufs BATCH block buffers
+ * \param n Number of blocks to move
+ * \return Seconds taken, negative on error
+ */
+static double _pass(block_store_t *bs, int write, uint8_t *bufs, size_t n) {
+    size_t ids[BATCH];
+    void *ptrs[BATCH];
+    for (size_t i = 0; i < BATCH; i++)
+        ptrs[i] = bufs + i*BLOCK_SIZE_BYTES;
+
+    size_t next = FIRST_BLOCK;
+    double start = _now();
+    for (size_t done = 0; done < n; done += BATCH) {
+        for (size_t i = 0; i < BATCH; i++) {
+            ids[i] = next++;
+            if (next == BLOCK_STORE_AVAIL_BLOCKS)
+                next = FIRST_BLOCK;
+        }
+        size_t moved = write
+            ? block_store_write_many(bs, ids, (const void *const *) ptrs, BATCH)
+            : block_store_read_many(bs, ids, ptrs, BATCH);
+        if (moved != BATCH * BLOCK_SIZE_BYTES)
+            return -1;
+    }
+    return _now() - start;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(USAGE);
+        return EXIT_FAILURE;
+    }
+
+    size_t mib = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+    size_t n = (mib * 1024 * 1024 / BLOCK_SIZE_BYTES + BATCH - 1) / BATCH * BATCH;
+    uint8_t *bufs = malloc(BATCH * BLOCK_SIZE_BYTES);
+    if (n == 0 || bufs == NULL) {
+        printf("Error: bad pass size\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < BATCH * BLOCK_SIZE_BYTES; i++)
+        bufs[i] = (uint8_t) (i * 31 + i / 977);
+
+    // Raw checksum speed
+    double start = _now();
+    uint32_t sink = 0;
+    for (size_t i = 0; i < n; i++)
+        sink ^= crc32c(0, bufs + (i % BATCH)*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+    double crc_secs = _now() - start;
+    printf("crc32c (%s): %.2f GiB/s (%08x)\n", crc32c_hw() ? "sse4.2" : "software",
+           (double) n * BLOCK_SIZE_BYTES / (1 << 30) / crc_secs, sink);
+
+    // fs_format keeps no checksums, so the first pass runs without a table
+    FS_t *fs = fs_format(argv[1]);
+    if (fs == NULL || fs_unmount(fs) < 0) {
+        printf("Error: could not format %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%zu MiB per pass, %d block batches\n", mib, BATCH);
+    const int modes[2] = { BS_OPT_NONE, BS_OPT_ASYNC_IO };
+    const char *mode_names[2] = { "mapped", "async io" };
+    const int csum_opts[3] = { BS_OPT_NONE, BS_OPT_CSUM, BS_OPT_VERIFY };
+    const char *csum_names[3] = { "no checksums", "checksums", "verify" };
+    for (int m = 0; m < 2; m++) {
+        double base[2] = { 0, 0 };
+        for (int c = 0; c < 3; c++) {
+            block_store_t *bs = block_store_open_opts(argv[1], modes[m] | csum_opts[c]);
+            if (bs == NULL) {
+                printf("Error: could not open %s\n", argv[1]);
+                return EXIT_FAILURE;
+            }
+            _pass(bs, 1, bufs, BLOCK_STORE_AVAIL_BLOCKS / BATCH * BATCH); // Warm up
+            double secs[2] = { _pass(bs, 1, bufs, n), _pass(bs, 0, bufs, n) };
+            block_store_destroy(bs);
+
+            for (int w = 0; w < 2; w++) {
+                if (secs[w] < 0) {
+                    printf("%-9s %-13s %-5s  error\n", mode_names[m], csum_names[c], w ? "read" : "write");
+                    continue;
+                }
+                double gib = (double) n * BLOCK_SIZE_BYTES / (1 << 30);
+                printf("%-9s %-13s %-5s  %8.1f MiB/s  %6.3f s/GiB", mode_names[m], csum_names[c],
+                       w == 0 ? "write" : "read", gib * 1024 / secs[w], secs[w] / gib);
+                if (c == 0)
+                    base[w] = secs[w];
+                else
+                    printf("  %+6.1f%%", (secs[w] / base[w] - 1) * 100);
+                printf("\n");
+            }
+        }
+        if (truncate(argv[1], BLOCK_STORE_NUM_BYTES) < 0) {
+            printf("Error: could not drop the checksum table\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    free(bufs);
+    unlink(argv[1]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "FS.h"
+#include "block_store.h"
+#include "consts.h"
+
+#define USAGE "%s <scratch image> [reads per pass]\n", argv[0]
+
+static double _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Open a user-space data TLB read miss counter for this thread
+ * \return The counter fd, -1 if perf events are unavailable
+ */
+static int _dtlb_counter_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Touch a few bytes of n random blocks through the device mapping
+ * \param data The mapped device
+ * \param ids The blocks to touch
+ * \param n Number of blocks
+ * \param counter A dTLB miss counter, -1 to skip counting
+ * \param misses Set to the number of dTLB misses, -1 if not counted
+ * \return Seconds taken
+ */
+static double _pass(const uint8_t *data, const size_t *ids, size_t n, int counter, long long *misses) {
+    volatile uint64_t sink = 0;
+
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    double start = _now();
+    for (size_t i = 0; i < n; i++) {
+        uint64_t word;
+        memcpy(&word, data + ids[i]*BLOCK_SIZE_BYTES + (i & 0x7f)*8, sizeof(word));
+        sink += word;
+    }
+    double secs = _now() - start;
+
+    *misses = -1;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, misses, sizeof(*misses)) != sizeof(*misses))
+            *misses = -1;
+    }
+    (void) sink;
+    return secs;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf(USAGE);
+        return EXIT_FAILURE;
+    }
+
+    size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 4 * 1024 * 1024;
+    size_t *ids = malloc(n * sizeof(size_t));
+    if (n == 0 || ids == NULL) {
+        printf("Error: bad pass size\n");
+        return EXIT_FAILURE;
+    }
+    srand(4520);
+    for (size_t i = 0; i < n; i++)
+        ids[i] = (size_t)rand() % BLOCK_STORE_AVAIL_BLOCKS;
+
+    // Format a volume, then fill its data region so every page of the mapping is backed
+    FS_t *fs = fs_format(argv[1]);
+    if (fs == NULL || fs_unmount(fs) < 0) {
+        printf("Error: could not format %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    block_store_t *bs = block_store_open(argv[1]);
+    if (bs == NULL) {
+        printf("Error: could not open %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    uint8_t block[BLOCK_SIZE_BYTES];
+    for (size_t i = FS_META_BLOCKS; i < BLOCK_STORE_AVAIL_BLOCKS; i++) { // Past the inode bitmap and table
+        memset(block, (int) i, sizeof(block));
+        block_store_write(bs, i, block);
+    }
+    block_store_destroy(bs);
+
+    int counter = _dtlb_counter_open();
+    if (counter < 0)
+        printf("dTLB counter unavailable (perf_event_paranoid?), reporting time only\n");
+
+    printf("%zu random 8-byte reads across %zu blocks\n", n, (size_t) BLOCK_STORE_AVAIL_BLOCKS);
+    const int opts[2] = { BS_OPT_NONE, BS_OPT_HUGEPAGES };
+    const char *names[2] = { "4 KiB pages", "huge pages" };
+    for (int o = 0; o < 2; o++) {
+        bs = block_store_open_opts(argv[1], opts[o]);
+        if (bs == NULL) {
+            printf("Error: could not open %s\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        const uint8_t *data = block_store_Data_location(bs);
+
+        long long misses;
+        _pass(data, ids, n, -1, &misses); // Fault everything in
+        double secs = _pass(data, ids, n, counter, &misses);
+
+        printf("%-12s (%s)  %8.2f ns/read", names[o],
+               o == 0 ? "default" : (block_store_huge_pages(bs) ? "active" : "fallback"),
+               secs * 1e9 / n);
+        if (misses >= 0)
+            printf("  %12lld dTLB misses  %.4f/read", misses, (double)misses / n);
+        printf("\n");
+
+        block_store_destroy(bs);
+    }
+
+    if (counter >= 0)
+        close(counter);
+    free(ids);
+    unlink(argv[1]);
+    return EXIT_SUCCESS;
+}
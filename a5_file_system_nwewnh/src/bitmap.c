@@ -93,10 +93,22 @@ size_t bitmap_ffs(const bitmap_t *const bitmap) {
 
 size_t bitmap_ffz(const bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
+        // Skip full words, then full bytes, so only the byte holding the zero
+        // is tested bit by bit (allocators call this for every block)
+        size_t byte = 0;
+        uint64_t word;
+        for (; byte + sizeof(word) <= bitmap->byte_count; byte += sizeof(word)) {
+            memcpy(&word, bitmap->data + byte, sizeof(word));
+            if (word != UINT64_MAX) {
+                break;
+            }
+        }
+        for (; byte < bitmap->byte_count && bitmap->data[byte] == 0xFF; ++byte) {
+        }
+        size_t result = byte * 8;
         for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) {
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        return (result >= bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
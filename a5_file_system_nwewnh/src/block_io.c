@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE_BITS // <linux/fs.h> has its own, consts.h defines ours
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+#include "block_io.h"
+#include "consts.h"
+
+#define BLOCK_IO_N_THREADS 4 // Pool threads per file
+#define BLOCK_IO_MAX_THREADS 16
+
+struct block_io {
+    // The block store files (not owned), striped chunk_blocks at a time
+    int fds[BLOCK_IO_MAX_FILES];
+    size_t n_fds;
+    size_t chunk_blocks;
+
+    // Serializes batches, neither the ring nor the pool take two at once
+    pthread_mutex_t submit_lock;
+
+    // io_uring state, only valid when uring is true
+    bool uring;
+#if HAVE_IO_URING
+    int ring_fd;
+    unsigned sq_entries;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+
+    // Thread pool state, only valid when uring is false
+    pthread_t threads[BLOCK_IO_MAX_THREADS];
+    size_t n_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv, done_cv;
+    const block_io_req_t *batch;
+    size_t batch_n, next, done, ok;
+    bool shutdown;
+};
+
+
+
+/**
+ * Find where a block lives, chunk c of the device is chunk c / n_fds of
+ *   file c % n_fds
+ * \param bio The engine
+ * \param block_id The block
+ * \param off Set to the block's offset in its file
+ * \return The block's file
+ */
+static int _block_io_locate(const block_io_t *bio, size_t block_id, off_t *off) {
+    size_t chunk = block_id / bio->chunk_blocks;
+    *off = (off_t)((chunk / bio->n_fds) * bio->chunk_blocks + block_id % bio->chunk_blocks) * BLOCK_SIZE_BYTES;
+    return bio->fds[chunk % bio->n_fds];
+}
+
+/**
+ * Perform one transfer synchronously
+ * \param bio The engine
+ * \param req The transfer
+ * \return Whether the whole block was transferred
+ */
+static bool _block_io_sync(const block_io_t *bio, const block_io_req_t *req) {
+    off_t off;
+    int fd = _block_io_locate(bio, req->block_id, &off);
+    ssize_t res;
+    do {
+        if (req->op == BLOCK_IO_READ)
+            res = pread(fd, req->buffer, BLOCK_SIZE_BYTES, off);
+        else
+            res = pwrite(fd, req->buffer, BLOCK_SIZE_BYTES, off);
+    } while (res < 0 && errno == EINTR);
+    return res == BLOCK_SIZE_BYTES;
+}
+
+
+
+#if HAVE_IO_URING
+
+static int _uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * Check that the kernel implements the read and write opcodes
+ * \param ring_fd The ring to probe
+ * \return Whether both IORING_OP_READ and IORING_OP_WRITE are supported
+ */
+static bool _uring_probe(int ring_fd) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (probe == NULL)
+        return false;
+
+    bool ok = false;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        ok = probe->last_op >= IORING_OP_WRITE
+            && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+            && (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return ok;
+}
+
+static void _uring_unmap(block_io_t *bio) {
+    if (bio->sqes != NULL && bio->sqes != MAP_FAILED)
+        munmap(bio->sqes, bio->sqes_size);
+    if (bio->cq_ring != NULL && bio->cq_ring != MAP_FAILED && bio->cq_ring != bio->sq_ring)
+        munmap(bio->cq_ring, bio->cq_ring_size);
+    if (bio->sq_ring != NULL && bio->sq_ring != MAP_FAILED)
+        munmap(bio->sq_ring, bio->sq_ring_size);
+    close(bio->ring_fd);
+}
+
+/**
+ * Set up an io_uring instance for the engine
+ * \param bio The engine
+ * \param entries The requested submission queue depth
+ * \return Whether the ring is ready for use
+ */
+static bool _uring_init(block_io_t *bio, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    bio->ring_fd = _uring_setup(entries, &p);
+    if (bio->ring_fd < 0)
+        return false;
+
+    bio->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    bio->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (bio->cq_ring_size > bio->sq_ring_size)
+            bio->sq_ring_size = bio->cq_ring_size;
+        bio->cq_ring_size = bio->sq_ring_size;
+    }
+
+    bio->sq_ring = mmap(NULL, bio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        bio->ring_fd, IORING_OFF_SQ_RING);
+    if (bio->sq_ring == MAP_FAILED)
+        goto err;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        bio->cq_ring = bio->sq_ring;
+    } else {
+        bio->cq_ring = mmap(NULL, bio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                            bio->ring_fd, IORING_OFF_CQ_RING);
+        if (bio->cq_ring == MAP_FAILED)
+            goto err;
+    }
+
+    bio->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    bio->sqes = mmap(NULL, bio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     bio->ring_fd, IORING_OFF_SQES);
+    if (bio->sqes == MAP_FAILED)
+        goto err;
+
+    uint8_t *sq = bio->sq_ring, *cq = bio->cq_ring;
+    bio->sq_entries = p.sq_entries;
+    bio->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    bio->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    bio->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    bio->sq_array = (unsigned *)(sq + p.sq_off.array);
+    bio->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    bio->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    bio->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    bio->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (!_uring_probe(bio->ring_fd))
+        goto err;
+
+    return true;
+err:
+    _uring_unmap(bio);
+    bio->sq_ring = bio->cq_ring = NULL;
+    bio->sqes = NULL;
+    return false;
+}
+
+/**
+ * Push a batch through the ring, keeping up to sq_entries transfers in flight
+ * \param bio The engine
+ * \param reqs The transfers to perform
+ * \param n The number of transfers
+ * \return Number of transfers that completed successfully
+ */
+static size_t _uring_submit(block_io_t *bio, const block_io_req_t *reqs, size_t n) {
+    size_t next = 0, inflight = 0, ok = 0;
+    unsigned pending = 0; // Queued in the ring but not yet accepted by the kernel
+
+    while (next < n || pending > 0 || inflight > 0) {
+        unsigned tail = *bio->sq_tail;
+
+        while (next < n && inflight + pending < bio->sq_entries) {
+            unsigned idx = tail & *bio->sq_mask;
+            struct io_uring_sqe *sqe = &bio->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = reqs[next].op == BLOCK_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+            off_t off;
+            sqe->fd = _block_io_locate(bio, reqs[next].block_id, &off);
+            sqe->off = (uint64_t)off;
+            sqe->addr = (uint64_t)(uintptr_t)reqs[next].buffer;
+            sqe->len = BLOCK_SIZE_BYTES;
+            sqe->user_data = next;
+            bio->sq_array[idx] = idx;
+            tail++;
+            next++;
+            pending++;
+        }
+        __atomic_store_n(bio->sq_tail, tail, __ATOMIC_RELEASE);
+
+        int ret;
+        do {
+            ret = _uring_enter(bio->ring_fd, pending, 1, IORING_ENTER_GETEVENTS);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            // The ring stopped accepting work, take back what the kernel has
+            // not seen and do it synchronously
+            __atomic_store_n(bio->sq_tail, tail - pending, __ATOMIC_RELEASE);
+            for (size_t i=next-pending; i<n; i++)
+                ok += _block_io_sync(bio, &reqs[i]);
+            next = n;
+            pending = 0;
+            if (inflight == 0)
+                break;
+            ret = 0; // Still reap what is in flight
+        }
+        pending -= ret;
+        inflight += ret;
+
+        unsigned head = *bio->cq_head;
+        unsigned ctail = __atomic_load_n(bio->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            struct io_uring_cqe *cqe = &bio->cqes[head & *bio->cq_mask];
+            if (cqe->res == BLOCK_SIZE_BYTES) {
+                ok++;
+            } else if (cqe->res >= 0) {
+                // Short transfer, finish it the slow way
+                ok += _block_io_sync(bio, &reqs[cqe->user_data]);
+            }
+            inflight--;
+        }
+        __atomic_store_n(bio->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return ok;
+}
+
+#endif
+
+
+
+/**
+ * Thread pool worker, claims transfers from the current batch until shutdown
+ * \param arg The engine
+ */
+static void *_block_io_worker(void *arg) {
+    block_io_t *bio = arg;
+
+    pthread_mutex_lock(&bio->lock);
+    for (;;) {
+        while (!bio->shutdown && bio->next >= bio->batch_n)
+            pthread_cond_wait(&bio->work_cv, &bio->lock);
+        if (bio->shutdown)
+            break;
+
+        const block_io_req_t *req = &bio->batch[bio->next++];
+        pthread_mutex_unlock(&bio->lock);
+        bool ok = _block_io_sync(bio, req);
+        pthread_mutex_lock(&bio->lock);
+
+        if (ok)
+            bio->ok++;
+        if (++bio->done == bio->batch_n)
+            pthread_cond_signal(&bio->done_cv);
+    }
+    pthread_mutex_unlock(&bio->lock);
+
+    return NULL;
+}
+
+static size_t _pool_submit(block_io_t *bio, const block_io_req_t *reqs, size_t n) {
+    pthread_mutex_lock(&bio->lock);
+    bio->batch = reqs;
+    bio->batch_n = n;
+    bio->next = bio->done = bio->ok = 0;
+    pthread_cond_broadcast(&bio->work_cv);
+    while (bio->done < n)
+        pthread_cond_wait(&bio->done_cv, &bio->lock);
+    size_t ok = bio->ok;
+    bio->batch = NULL;
+    bio->batch_n = bio->next = 0;
+    pthread_mutex_unlock(&bio->lock);
+    return ok;
+}
+
+static bool _pool_init(block_io_t *bio) {
+    if (pthread_mutex_init(&bio->lock, NULL) != 0)
+        return false;
+    pthread_cond_init(&bio->work_cv, NULL);
+    pthread_cond_init(&bio->done_cv, NULL);
+
+    // Transfers to different files don't wait on each other, so the pool
+    // grows with the number of files
+    size_t want = BLOCK_IO_N_THREADS * bio->n_fds;
+    if (want > BLOCK_IO_MAX_THREADS)
+        want = BLOCK_IO_MAX_THREADS;
+    for (bio->n_threads = 0; bio->n_threads < want; bio->n_threads++)
+        if (pthread_create(&bio->threads[bio->n_threads], NULL, _block_io_worker, bio) != 0)
+            break;
+
+    if (bio->n_threads == 0) {
+        pthread_cond_destroy(&bio->done_cv);
+        pthread_cond_destroy(&bio->work_cv);
+        pthread_mutex_destroy(&bio->lock);
+        return false;
+    }
+    return true;
+}
+
+static void _pool_destroy(block_io_t *bio) {
+    pthread_mutex_lock(&bio->lock);
+    bio->shutdown = true;
+    pthread_cond_broadcast(&bio->work_cv);
+    pthread_mutex_unlock(&bio->lock);
+
+    for (size_t i=0; i<bio->n_threads; i++)
+        pthread_join(bio->threads[i], NULL);
+
+    pthread_cond_destroy(&bio->done_cv);
+    pthread_cond_destroy(&bio->work_cv);
+    pthread_mutex_destroy(&bio->lock);
+}
+
+
+
+block_io_t *block_io_create(const int fd, const size_t queue_depth, const int flags) {
+    return block_io_create_striped(&fd, 1, BLOCK_STORE_NUM_BLOCKS, queue_depth, flags);
+}
+
+block_io_t *block_io_create_striped(const int *const fds, const size_t n_fds, const size_t chunk_blocks,
+                                    const size_t queue_depth, const int flags) {
+    if (fds == NULL || n_fds == 0 || n_fds > BLOCK_IO_MAX_FILES || chunk_blocks == 0 || queue_depth == 0)
+        return NULL;
+    for (size_t i=0; i<n_fds; i++)
+        if (fds[i] < 0)
+            return NULL;
+
+    block_io_t *bio = calloc(1, sizeof(block_io_t));
+    if (bio == NULL)
+        return NULL;
+
+    memcpy(bio->fds, fds, n_fds * sizeof(int));
+    bio->n_fds = n_fds;
+    bio->chunk_blocks = chunk_blocks;
+    if (pthread_mutex_init(&bio->submit_lock, NULL) != 0) {
+        free(bio);
+        return NULL;
+    }
+
+#if HAVE_IO_URING
+    if (!(flags & BLOCK_IO_NO_URING))
+        bio->uring = _uring_init(bio, queue_depth);
+#else
+    (void) flags;
+#endif
+
+    if (!bio->uring && !_pool_init(bio)) {
+        pthread_mutex_destroy(&bio->submit_lock);
+        free(bio);
+        return NULL;
+    }
+
+    return bio;
+}
+
+void block_io_destroy(block_io_t *const bio) {
+    if (bio) {
+#if HAVE_IO_URING
+        if (bio->uring)
+            _uring_unmap(bio);
+#endif
+        if (!bio->uring)
+            _pool_destroy(bio);
+        pthread_mutex_destroy(&bio->submit_lock);
+        free(bio);
+    }
+}
+
+size_t block_io_submit(block_io_t *const bio, const block_io_req_t *const reqs, const size_t n) {
+    if (bio == NULL || reqs == NULL || n == 0)
+        return 0;
+
+    size_t ok;
+    pthread_mutex_lock(&bio->submit_lock);
+#if HAVE_IO_URING
+    if (bio->uring)
+        ok = _uring_submit(bio, reqs, n);
+    else
+#endif
+        ok = _pool_submit(bio, reqs, n);
+    pthread_mutex_unlock(&bio->submit_lock);
+
+    return ok;
+}
+
+bool block_io_is_uring(const block_io_t *const bio) {
+    return bio != NULL && bio->uring;
+}
@@ -1,31 +1,158 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "FS.h"
 #include "bitmap.h"
+#include "block_io.h"
 #include "block_store.h"
 #include "consts.h"
+#include "crc32c.h"
 
 
 struct block_store {
+    // Blocks in the device, BLOCK_STORE_NUM_BLOCKS or (BS_OPT_WIDE)
+    //  BLOCK_STORE_WIDE_NUM_BLOCKS, and how many of them come before the FBM
+    size_t n_blocks, avail_blocks;
+    // The backing file, the first stripe of a striped device
     int fd;
+    // Every backing file in stripe order, stripe_fds[0] is fd
+    int stripe_fds[BLOCK_STORE_MAX_STRIPES];
+    size_t n_stripes;
+    // Blocks per stripe chunk, chunk c of the device is chunk c / n_stripes
+    //  of stripe c % n_stripes (the whole device when there is one file)
+    size_t chunk_blocks;
+    // Where the checksum table starts in fd, the tables that follow it are
+    //  laid out from there
+    off_t tables_base;
     uint8_t *data_blocks;
     bitmap_t *fbm;
+    // Data block I/O engine, NULL when data blocks go through the mapping
+    block_io_t *io;
+    // Whether the mapping was set up for huge pages (BS_OPT_HUGEPAGES)
+    bool huge_pages;
+    // CRC32C of every block, mapped from past the end of the device, NULL if
+    //  the device has no checksum table
+    uint32_t *csums;
+    // Whether reads are verified against csums (BS_OPT_VERIFY)
+    bool verify;
+    // Extra references to shared blocks, mapped after the checksum table,
+    //  NULL if the device has no reference table
+    uint16_t *refs;
+    // The blocks written with block_store_write_shared, which may be shared
+    bitmap_t *shareable;
+    // Content index of the shareable blocks (BS_OPT_DEDUP), NULL if off
+    struct dedup_slot *dedup;
+    // Index slots, a power of two, and those that are not empty, tombstones
+    //  included
+    size_t dedup_slots, dedup_used;
+    // Data blocks changed since the last block_store_export_delta, mapped
+    //  after the reference table, NULL if the device doesn't track them
+    bitmap_t *dirty;
+};
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Each file of a striped device holds its share of the chunks, then a page
+//  for the header, then (first stripe only) the tables
+#define STRIPE_MAGIC 0x50525453 // "STRP"
+#define STRIPE_HEADER_BYTES 4096
+#define STRIPE_MAX_CHUNKS 16384 // Mapped one by one, well under vm.max_map_count
+
+typedef struct {
+    uint32_t magic;
+    uint32_t n_stripes;
+    uint32_t index;
+    uint32_t chunk_blocks;
+    // Shared by the stripes of one device, so files of different devices
+    //  can't be mixed up
+    uint64_t volume_id;
+} stripe_header_t;
+
+_Static_assert(BLOCK_STORE_MAX_STRIPES <= BLOCK_IO_MAX_FILES, "the I/O engine must take every stripe");
+
+// The checksum table follows the device in its file (at tables_base): a page
+//  for the header, then one CRC32C per block
+#define CSUM_MAGIC 0x43524343 // "CCRC"
+#define CSUM_HEADER_BYTES 4096
+#define CSUM_REGION_BYTES(bs) (CSUM_HEADER_BYTES + (bs)->n_blocks * sizeof(uint32_t))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t n_blocks;
+} csum_header_t;
+
+// The reference table follows the checksum table: a page for the header, the
+//  shareable block bitmap, then the extra reference count of every block
+#define REFS_MAGIC 0x53464552 // "REFS"
+#define REFS_OFFSET(bs) ((bs)->tables_base + CSUM_REGION_BYTES(bs))
+#define REFS_HEADER_BYTES 4096
+#define REFS_SHAREABLE_BYTES(bs) ((bs)->n_blocks / 8)
+#define REFS_REGION_BYTES(bs) (REFS_HEADER_BYTES + REFS_SHAREABLE_BYTES(bs) + (bs)->n_blocks * sizeof(uint16_t))
+
+typedef csum_header_t refs_header_t;
+
+// The dirty block table follows the reference table: a page for the header,
+//  then a bit per block
+#define DIRTY_MAGIC 0x54524944 // "DIRT"
+#define DIRTY_OFFSET(bs) (REFS_OFFSET(bs) + REFS_REGION_BYTES(bs))
+#define DIRTY_HEADER_BYTES 4096
+#define DIRTY_REGION_BYTES(bs) (DIRTY_HEADER_BYTES + (bs)->n_blocks / 8)
+
+typedef csum_header_t dirty_header_t;
+
+// Open addressed content index keyed by block checksum, sized on each rebuild
+//  to at least twice the shareable blocks in use so probe chains stay short,
+//  and rebuilt (growing it) once three quarters of it is taken
+#define DEDUP_SLOTS(bs) ((bs)->dedup_slots)
+#define DEDUP_MIN_SLOTS 1024
+#define DEDUP_EMPTY 0
+#define DEDUP_TOMBSTONE UINT32_MAX
+
+struct dedup_slot {
+    uint32_t csum;
+    // The block id + 1, or DEDUP_EMPTY/DEDUP_TOMBSTONE
+    uint32_t id1;
 };
 
-int create_file(const char *const fname) {
+///
+///-- Work out which size of device a backing file belongs to from its size:
+///--  its share of the data blocks, what always follows them, and room for
+///--  the tables after that
+/// \param size The file's size
+/// \param n_stripes Number of backing files of the device
+/// \param extra Bytes that always follow the data blocks (a stripe header)
+/// \return BLOCK_STORE_NUM_BLOCKS or BLOCK_STORE_WIDE_NUM_BLOCKS, 0 if the
+///--  size fits neither
+///
+static size_t device_blocks(const off_t size, const size_t n_stripes, const off_t extra) {
+    static const size_t n_blocks[2] = { BLOCK_STORE_NUM_BLOCKS, BLOCK_STORE_WIDE_NUM_BLOCKS };
+    for (size_t i = 0; i < 2; i++) {
+        const off_t data_bytes = (off_t) (n_blocks[i] * BLOCK_SIZE_BYTES / n_stripes) + extra;
+        if (size >= data_bytes && size <= data_bytes + (off_t) (n_blocks[i] * BLOCK_SIZE_BYTES / 8)) {
+            return n_blocks[i];
+        }
+    }
+    return 0;
+}
+
+int create_file(const char *const fname, const size_t n_blocks) {
     if (fname) {
         int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if (fd != -1) {
-            if (ftruncate(fd, BLOCK_STORE_NUM_BYTES) != -1) {
+            if (ftruncate(fd, n_blocks * BLOCK_SIZE_BYTES) != -1) {
                 return fd;
             }
             close(fd);
@@ -34,12 +161,12 @@ int create_file(const char *const fname) {
     return -1;
 }
 
-int check_file(const char *const fname) {
+int check_file(const char *const fname, size_t *const n_blocks) {
     if (fname) {
         int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if (fd != -1) {
             struct stat file_info;
-			if (fstat(fd, &file_info) != -1 && file_info.st_size >= BLOCK_STORE_NUM_BYTES && file_info.st_size <= BLOCK_STORE_NUM_BYTES + BLOCK_STORE_NUM_BYTES/8 ) {
+			if (fstat(fd, &file_info) != -1 && (*n_blocks = device_blocks(file_info.st_size, 1, 0)) != 0) {
             //if (fstat(fd, &file_info) != -1 && file_info.st_size == BLOCK_STORE_NUM_BYTES) {
                 return fd;
             }
@@ -49,44 +176,647 @@ int check_file(const char *const fname) {
     return -1;
 }
 
-block_store_t *block_store_init(const bool init, const char *const fname) {
-    if (fname) {
-        block_store_t *bs = (block_store_t *) malloc(sizeof(block_store_t));
-        if (bs) {
-            bs->fd = init ? create_file(fname) : check_file(fname);
-            if (bs->fd != -1) {
-                bs->data_blocks = (uint8_t *) mmap(NULL, BLOCK_STORE_NUM_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, bs->fd, 0);
-                if (bs->data_blocks != (uint8_t *) MAP_FAILED) {
-                         if (init) {
-                                memset(bs->data_blocks, 0X00, BLOCK_STORE_NUM_BYTES);
-								                bs->data_blocks[BLOCK_STORE_NUM_BYTES - 1] = 0xff;
-								                // in case you are trying to write to the bitmap, that will be a disaster
-                          }
-                          bs->fbm = bitmap_overlay(BLOCK_STORE_AVAIL_BLOCKS, bs->data_blocks + BLOCK_STORE_AVAIL_BLOCKS*BLOCK_SIZE_BYTES);
-                          if (bs->fbm) {
-                                return bs;
-                           }
-                           munmap(bs->data_blocks, BLOCK_STORE_NUM_BYTES);
+///
+///-- Map the whole device, backed by huge pages if requested and possible
+///-- Tries MAP_HUGETLB (hugetlbfs images), then a 2 MiB aligned mapping
+///--  advised with MADV_HUGEPAGE, then falls back to a plain mapping
+/// \param fd The device file
+/// \param n_bytes The size of the device
+/// \param opts OR'd block_store_opt_t values
+/// \param huge Set to whether the huge page setup succeeded
+/// \return The mapping, MAP_FAILED on error
+///
+static uint8_t *map_blocks(const int fd, const size_t n_bytes, const int opts, bool *huge) {
+    *huge = false;
+    if (opts & BS_OPT_HUGEPAGES) {
+#ifdef MAP_HUGETLB
+        void *mapped = mmap(NULL, n_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_HUGETLB, fd, 0);
+        if (mapped != MAP_FAILED) {
+            *huge = true;
+            return (uint8_t *) mapped;
+        }
+#endif
+#ifdef MADV_HUGEPAGE
+        // Reserve an oversized window so the mapping can start on a huge page boundary
+        const size_t window_size = n_bytes + HUGE_PAGE_SIZE;
+        uint8_t *window = (uint8_t *) mmap(NULL, window_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (window != (uint8_t *) MAP_FAILED) {
+            uint8_t *aligned = (uint8_t *) (((uintptr_t) window + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+            void *fixed = mmap(aligned, n_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+            if (fixed != MAP_FAILED) {
+                // Give back the unused ends of the window
+                if (aligned > window) {
+                    munmap(window, aligned - window);
+                }
+                if (window + window_size > aligned + n_bytes) {
+                    munmap(aligned + n_bytes, window + window_size - (aligned + n_bytes));
+                }
+                *huge = madvise(fixed, n_bytes, MADV_HUGEPAGE) == 0;
+                return (uint8_t *) fixed;
+            }
+            munmap(window, window_size);
+        }
+#endif
+    }
+    return (uint8_t *) mmap(NULL, n_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+}
+
+///
+///-- Check the shape of a striped device: a power of two number of stripes
+///--  and a power of two chunk of whole pages, so chunks tile the device and
+///--  can be mapped one by one, and not too many of them
+/// \param n_blocks Blocks in the device
+/// \param n_stripes Number of backing files
+/// \param chunk_blocks Blocks per chunk
+/// \return Whether the device can be laid out that way
+///
+static bool stripe_geometry_ok(const size_t n_blocks, const size_t n_stripes, const size_t chunk_blocks) {
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return n_stripes >= 2 && n_stripes <= BLOCK_STORE_MAX_STRIPES && (n_stripes & (n_stripes - 1)) == 0
+        && chunk_blocks > 0 && (chunk_blocks & (chunk_blocks - 1)) == 0
+        && chunk_blocks * BLOCK_SIZE_BYTES % page == 0 && chunk_blocks * n_stripes <= n_blocks
+        && n_blocks / chunk_blocks <= STRIPE_MAX_CHUNKS;
+}
+
+///
+///-- Create or open one backing file of a striped device
+/// \param fname The file
+/// \param init Whether to create it (header is written) or open it
+/// \param header The stripe's header; when opening, the file's header must
+///--  match its n_stripes and index, and its chunk_blocks and volume_id too
+///--  unless chunk_blocks is 0, and is then copied into it
+/// \param n_blocks Blocks in the device; when opening, 0 to take it from the
+///--  file's size (and set it), otherwise the file's size must match it
+/// \return The file descriptor, -1 on error
+///
+static int stripe_open(const char *const fname, const bool init, stripe_header_t *const header, size_t *const n_blocks) {
+    int fd = open(fname, init ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat file_info;
+    if (!init && *n_blocks == 0 && fstat(fd, &file_info) != -1) {
+        *n_blocks = device_blocks(file_info.st_size, header->n_stripes, STRIPE_HEADER_BYTES);
+    }
+    const off_t data_bytes = (off_t) (*n_blocks * BLOCK_SIZE_BYTES / header->n_stripes);
+    if (*n_blocks == 0) {
+        close(fd);
+        return -1;
+    }
+    if (init) {
+        if (ftruncate(fd, data_bytes + STRIPE_HEADER_BYTES) != -1
+                && pwrite(fd, header, sizeof(stripe_header_t), data_bytes) == sizeof(stripe_header_t)) {
+            return fd;
+        }
+    } else {
+        stripe_header_t found;
+        if (fstat(fd, &file_info) != -1 && file_info.st_size >= data_bytes + STRIPE_HEADER_BYTES
+                && file_info.st_size <= data_bytes + STRIPE_HEADER_BYTES + (off_t) (*n_blocks * BLOCK_SIZE_BYTES / 8)
+                && pread(fd, &found, sizeof(found), data_bytes) == sizeof(found)
+                && found.magic == STRIPE_MAGIC && found.n_stripes == header->n_stripes && found.index == header->index
+                && (header->chunk_blocks == 0
+                    || (found.chunk_blocks == header->chunk_blocks && found.volume_id == header->volume_id))) {
+            *header = found;
+            return fd;
+        }
+    }
+    close(fd);
+    return -1;
+}
+
+///
+///-- Create or open the backing files of a device, one unless it is striped
+/// \param bs BS device, with n_stripes and (when init is set) n_blocks and
+///--  chunk_blocks filled in, n_blocks and avail_blocks are set when opening
+/// \param init Whether to create the files
+/// \param fnames The files, n_stripes of them
+/// \return Whether every file is open, none are left open otherwise
+///
+static bool files_open(block_store_t *const bs, const bool init, const char *const *const fnames) {
+    if (!init) {
+        bs->n_blocks = 0; // Taken from the first file
+    }
+    if (bs->n_stripes == 1) {
+        bs->fd = init ? create_file(fnames[0], bs->n_blocks) : check_file(fnames[0], &bs->n_blocks);
+        bs->stripe_fds[0] = bs->fd;
+        bs->chunk_blocks = bs->n_blocks;
+        bs->avail_blocks = bs->n_blocks - bs->n_blocks / BLOCK_SIZE_BITS;
+        bs->tables_base = bs->n_blocks * BLOCK_SIZE_BYTES;
+        return bs->fd != -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    stripe_header_t header = {
+        .magic = STRIPE_MAGIC,
+        .n_stripes = bs->n_stripes,
+        .chunk_blocks = init ? bs->chunk_blocks : 0,
+        .volume_id = init ? ((uint64_t) now.tv_sec * 1000000000u + now.tv_nsec) ^ ((uint64_t) getpid() << 32) : 0,
+    };
+    for (size_t i = 0; i < bs->n_stripes; i++) {
+        header.index = i;
+        bs->stripe_fds[i] = stripe_open(fnames[i], init, &header, &bs->n_blocks);
+        // The first stripe's header sets the chunk size, check it before use
+        if (bs->stripe_fds[i] == -1 || !stripe_geometry_ok(bs->n_blocks, header.n_stripes, header.chunk_blocks)) {
+            for (size_t j = 0; j <= i; j++) {
+                if (bs->stripe_fds[j] != -1) {
+                    close(bs->stripe_fds[j]);
                 }
-                close(bs->fd);
             }
-            free(bs);
+            return false;
+        }
+    }
+    bs->fd = bs->stripe_fds[0];
+    bs->chunk_blocks = header.chunk_blocks;
+    bs->avail_blocks = bs->n_blocks - bs->n_blocks / BLOCK_SIZE_BITS;
+    bs->tables_base = bs->n_blocks * BLOCK_SIZE_BYTES / bs->n_stripes + STRIPE_HEADER_BYTES;
+    return true;
+}
+
+///
+///-- Close the backing files of a device
+/// \param bs BS device
+///
+static void files_close(block_store_t *const bs) {
+    for (size_t i = 0; i < bs->n_stripes; i++) {
+        close(bs->stripe_fds[i]);
+    }
+}
+
+///
+///-- Map a striped device chunk by chunk into one window, so it reads and
+///--  writes through data_blocks like a single file device
+/// \param bs BS device, with its files open
+/// \return The mapping, MAP_FAILED on error
+///
+static uint8_t *map_stripes(const block_store_t *const bs) {
+    uint8_t *window = (uint8_t *) mmap(NULL, bs->n_blocks * BLOCK_SIZE_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (window == (uint8_t *) MAP_FAILED) {
+        return window;
+    }
+    const size_t chunk_bytes = bs->chunk_blocks * BLOCK_SIZE_BYTES;
+    for (size_t c = 0; c < bs->n_blocks / bs->chunk_blocks; c++) {
+        if (mmap(window + c*chunk_bytes, chunk_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 bs->stripe_fds[c % bs->n_stripes], (off_t) (c / bs->n_stripes * chunk_bytes)) == MAP_FAILED) {
+            munmap(window, bs->n_blocks * BLOCK_SIZE_BYTES);
+            return (uint8_t *) MAP_FAILED;
+        }
+    }
+    return window;
+}
+
+///
+///-- Find where a block lives in the backing files
+/// \param bs BS device
+/// \param block_id The block
+/// \param off Set to the block's offset in its file
+/// \return The block's file
+///
+static int stripe_locate(const block_store_t *const bs, const size_t block_id, off_t *const off) {
+    const size_t chunk = block_id / bs->chunk_blocks;
+    *off = (off_t) ((chunk / bs->n_stripes) * bs->chunk_blocks + block_id % bs->chunk_blocks) * BLOCK_SIZE_BYTES;
+    return bs->stripe_fds[chunk % bs->n_stripes];
+}
+
+///
+///-- Recompute the checksum of a block from its contents in the mapping
+/// \param bs BS device
+/// \param block_id The block
+///
+static void csum_update(block_store_t *const bs, const size_t block_id) {
+    if (bs->csums) {
+        bs->csums[block_id] = crc32c(0, bs->data_blocks + block_id*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+    }
+}
+
+///
+///-- Recompute the checksum of the free block map block holding a block's bit
+/// \param bs BS device
+/// \param block_id The block whose bit changed
+///
+static void csum_update_fbm(block_store_t *const bs, const size_t block_id) {
+    csum_update(bs, bs->avail_blocks + block_id / BLOCK_SIZE_BITS);
+}
+
+///
+///-- Map the checksum table that follows the device in its file
+///-- A device without one gets one if BS_OPT_CSUM or BS_OPT_VERIFY is given,
+///--  every block is checksummed then, except on a fresh device whose data
+///--  blocks are all known to be zero
+/// \param bs BS device, with the device already mapped
+/// \param init Whether the device was just created
+/// \param opts OR'd block_store_opt_t values
+/// \return false on error, true otherwise (including when there is no table)
+///
+static bool csum_attach(block_store_t *const bs, const bool init, const int opts) {
+    bs->csums = NULL;
+    bs->verify = false;
+    const bool wanted = opts & (BS_OPT_CSUM | BS_OPT_VERIFY | BS_OPT_DEDUP);
+
+    struct stat file_info;
+    if (fstat(bs->fd, &file_info) == -1) {
+        return false;
+    }
+    const bool present = file_info.st_size >= (off_t) (bs->tables_base + CSUM_REGION_BYTES(bs));
+    if (!present && !wanted) {
+        return true;
+    }
+    if (!present && ftruncate(bs->fd, bs->tables_base + CSUM_REGION_BYTES(bs)) == -1) {
+        return false;
+    }
+
+    uint8_t *region = (uint8_t *) mmap(NULL, CSUM_REGION_BYTES(bs), PROT_READ | PROT_WRITE, MAP_SHARED, bs->fd, bs->tables_base);
+    if (region == (uint8_t *) MAP_FAILED) {
+        return false;
+    }
+    csum_header_t *header = (csum_header_t *) region;
+    bs->csums = (uint32_t *) (region + CSUM_HEADER_BYTES);
+
+    if (header->magic != CSUM_MAGIC || header->n_blocks != bs->n_blocks) {
+        if (!wanted) {
+            munmap(region, CSUM_REGION_BYTES(bs));
+            bs->csums = NULL;
+            return true;
+        }
+        if (init) {
+            static const uint8_t zero_block[BLOCK_SIZE_BYTES];
+            const uint32_t zero_csum = crc32c(0, zero_block, BLOCK_SIZE_BYTES);
+            for (size_t i = 0; i < bs->avail_blocks; i++) {
+                bs->csums[i] = zero_csum;
+            }
+            for (size_t i = bs->avail_blocks; i < bs->n_blocks; i++) {
+                csum_update(bs, i);
+            }
+        } else {
+            for (size_t i = 0; i < bs->n_blocks; i++) {
+                csum_update(bs, i);
+            }
+        }
+        header->magic = CSUM_MAGIC;
+        header->n_blocks = bs->n_blocks;
+    }
+
+    bs->verify = opts & BS_OPT_VERIFY;
+    return true;
+}
+
+///
+///-- Map the reference table that follows the checksum table, creating it if
+///--  it is missing and BS_OPT_DEDUP was given
+/// \param bs BS device, with the checksum table already attached
+/// \param opts OR'd block_store_opt_t values
+/// \return false on error, true otherwise (including when there is no table)
+///
+static bool refs_attach(block_store_t *const bs, const int opts) {
+    bs->refs = NULL;
+    bs->shareable = NULL;
+    const bool wanted = opts & BS_OPT_DEDUP;
+    if (bs->csums == NULL) {
+        return !wanted;
+    }
+
+    struct stat file_info;
+    if (fstat(bs->fd, &file_info) == -1) {
+        return false;
+    }
+    const bool present = file_info.st_size >= (off_t) (REFS_OFFSET(bs) + REFS_REGION_BYTES(bs));
+    if (!present && !wanted) {
+        return true;
+    }
+    if (!present && ftruncate(bs->fd, REFS_OFFSET(bs) + REFS_REGION_BYTES(bs)) == -1) {
+        return false;
+    }
+
+    uint8_t *region = (uint8_t *) mmap(NULL, REFS_REGION_BYTES(bs), PROT_READ | PROT_WRITE, MAP_SHARED, bs->fd, REFS_OFFSET(bs));
+    if (region == (uint8_t *) MAP_FAILED) {
+        return false;
+    }
+    refs_header_t *header = (refs_header_t *) region;
+    if (header->magic != REFS_MAGIC || header->n_blocks != bs->n_blocks) {
+        if (!wanted) {
+            munmap(region, REFS_REGION_BYTES(bs));
+            return true;
+        }
+        memset(region + REFS_HEADER_BYTES, 0x00, REFS_REGION_BYTES(bs) - REFS_HEADER_BYTES);
+        header->magic = REFS_MAGIC;
+        header->n_blocks = bs->n_blocks;
+    }
+    bs->shareable = bitmap_overlay(bs->n_blocks, region + REFS_HEADER_BYTES);
+    if (bs->shareable == NULL) {
+        munmap(region, REFS_REGION_BYTES(bs));
+        return false;
+    }
+    bs->refs = (uint16_t *) (region + REFS_HEADER_BYTES + REFS_SHAREABLE_BYTES(bs));
+    return true;
+}
+
+///
+///-- Map the dirty block table that follows the reference table, creating it
+///--  if it is missing and BS_OPT_DIRTY was given
+///-- A new table on a device that was in use marks every block dirty, there
+///--  is no checkpoint to compare against yet
+/// \param bs BS device, with the device already mapped
+/// \param init Whether the device was just created
+/// \param opts OR'd block_store_opt_t values
+/// \return false on error, true otherwise (including when there is no table)
+///
+static bool dirty_attach(block_store_t *const bs, const bool init, const int opts) {
+    bs->dirty = NULL;
+    const bool wanted = opts & BS_OPT_DIRTY;
+
+    struct stat file_info;
+    if (fstat(bs->fd, &file_info) == -1) {
+        return false;
+    }
+    const bool present = file_info.st_size >= (off_t) (DIRTY_OFFSET(bs) + DIRTY_REGION_BYTES(bs));
+    if (!present && !wanted) {
+        return true;
+    }
+    if (!present && ftruncate(bs->fd, DIRTY_OFFSET(bs) + DIRTY_REGION_BYTES(bs)) == -1) {
+        return false;
+    }
+
+    uint8_t *region = (uint8_t *) mmap(NULL, DIRTY_REGION_BYTES(bs), PROT_READ | PROT_WRITE, MAP_SHARED, bs->fd, DIRTY_OFFSET(bs));
+    if (region == (uint8_t *) MAP_FAILED) {
+        return false;
+    }
+    dirty_header_t *header = (dirty_header_t *) region;
+    if (header->magic != DIRTY_MAGIC || header->n_blocks != bs->n_blocks) {
+        if (!wanted) {
+            munmap(region, DIRTY_REGION_BYTES(bs));
+            return true;
+        }
+        memset(region + DIRTY_HEADER_BYTES, init ? 0x00 : 0xff, DIRTY_REGION_BYTES(bs) - DIRTY_HEADER_BYTES);
+        header->magic = DIRTY_MAGIC;
+        header->n_blocks = bs->n_blocks;
+    }
+    bs->dirty = bitmap_overlay(bs->avail_blocks, region + DIRTY_HEADER_BYTES);
+    if (bs->dirty == NULL) {
+        munmap(region, DIRTY_REGION_BYTES(bs));
+        return false;
+    }
+    return true;
+}
+
+///
+///-- Note that a data block changed since the last delta
+/// \param bs BS device
+/// \param block_id The block
+///
+static void dirty_mark(block_store_t *const bs, const size_t block_id) {
+    if (bs->dirty && block_id < bs->avail_blocks) {
+        // Atomic, since block_store_write_range may run on several threads
+        uint8_t *const bits = (uint8_t *) bitmap_export(bs->dirty);
+        __atomic_fetch_or(&bits[block_id / 8], (uint8_t) (1u << block_id % 8), __ATOMIC_RELAXED);
+    }
+}
+
+///
+///-- Unmap the checksum, reference and dirty block tables
+/// \param bs BS device
+///
+static void tables_detach(block_store_t *const bs) {
+    if (bs->dirty) {
+        munmap((uint8_t *) bitmap_export(bs->dirty) - DIRTY_HEADER_BYTES, DIRTY_REGION_BYTES(bs));
+        bitmap_destroy(bs->dirty);
+        bs->dirty = NULL;
+    }
+    if (bs->refs) {
+        bitmap_destroy(bs->shareable);
+        munmap((uint8_t *) bs->refs - REFS_SHAREABLE_BYTES(bs) - REFS_HEADER_BYTES, REFS_REGION_BYTES(bs));
+        bs->refs = NULL;
+    }
+    if (bs->csums) {
+        munmap((uint8_t *) bs->csums - CSUM_HEADER_BYTES, CSUM_REGION_BYTES(bs));
+        bs->csums = NULL;
+    }
+    free(bs->dedup);
+    bs->dedup = NULL;
+}
+
+///
+///-- Add a shareable block to the content index under its current checksum
+///--  The index is rebuilt once it fills up with blocks and tombstones
+/// \param bs BS device with dedup on
+/// \param block_id The block
+///
+static void dedup_insert(block_store_t *const bs, const size_t block_id);
+
+///
+///-- Rebuild the content index from the shareable blocks in use, resizing it
+///--  to twice their number
+///-- If it can't grow, dedup is turned off until the device is next opened
+/// \param bs BS device with dedup on, or being opened with it
+/// \return false if the index couldn't grow
+///
+static bool dedup_rebuild(block_store_t *const bs) {
+    size_t live = 0;
+    for (size_t id = 0; id < bs->avail_blocks; id++) {
+        live += bitmap_test(bs->shareable, id) && bitmap_test(bs->fbm, id);
+    }
+    size_t slots = DEDUP_MIN_SLOTS;
+    while (slots < 2 * live) {
+        slots *= 2;
+    }
+    if (slots != bs->dedup_slots) {
+        struct dedup_slot *dedup = (struct dedup_slot *) realloc(bs->dedup, slots * sizeof(struct dedup_slot));
+        if (dedup != NULL) {
+            bs->dedup = dedup;
+            bs->dedup_slots = slots;
+        } else if (slots > bs->dedup_slots) {
+            free(bs->dedup);
+            bs->dedup = NULL;
+            bs->dedup_slots = 0;
+            return false;
+        }
+    }
+
+    memset(bs->dedup, 0x00, DEDUP_SLOTS(bs) * sizeof(struct dedup_slot));
+    bs->dedup_used = 0;
+    for (size_t id = 0; id < bs->avail_blocks; id++) {
+        if (bitmap_test(bs->shareable, id) && bitmap_test(bs->fbm, id)) {
+            dedup_insert(bs, id);
+        }
+    }
+    return true;
+}
+
+static void dedup_insert(block_store_t *const bs, const size_t block_id) {
+    if (bs->dedup_used >= DEDUP_SLOTS(bs) / 4 * 3) {
+        dedup_rebuild(bs); // Every shareable block is back in the index after this, or dedup is off
+        return;
+    }
+    const uint32_t csum = bs->csums[block_id];
+    for (size_t i = csum & (DEDUP_SLOTS(bs) - 1); ; i = (i + 1) & (DEDUP_SLOTS(bs) - 1)) {
+        struct dedup_slot *slot = &bs->dedup[i];
+        if (slot->id1 == DEDUP_EMPTY || slot->id1 == DEDUP_TOMBSTONE) {
+            if (slot->id1 == DEDUP_EMPTY) {
+                bs->dedup_used++;
+            }
+            slot->csum = csum;
+            slot->id1 = block_id + 1;
+            return;
+        }
+    }
+}
+
+///
+///-- Make a block unshareable, dropping it from the content index
+///-- Must run before the block's checksum changes
+/// \param bs BS device
+/// \param block_id The block
+///
+static void dedup_remove(block_store_t *const bs, const size_t block_id) {
+    if (bs->refs == NULL || !bitmap_test(bs->shareable, block_id)) {
+        return;
+    }
+    bitmap_reset(bs->shareable, block_id);
+    if (bs->dedup == NULL) {
+        return;
+    }
+    const uint32_t csum = bs->csums[block_id];
+    for (size_t i = csum & (DEDUP_SLOTS(bs) - 1); bs->dedup[i].id1 != DEDUP_EMPTY; i = (i + 1) & (DEDUP_SLOTS(bs) - 1)) {
+        if (bs->dedup[i].id1 == block_id + 1) {
+            bs->dedup[i].id1 = DEDUP_TOMBSTONE;
+            return;
+        }
+    }
+}
+
+///
+///-- Look for a shareable block in use with the given contents
+/// \param bs BS device with dedup on
+/// \param buffer The contents
+/// \param csum The checksum of buffer
+/// \return The block's id, SIZE_MAX if there is none
+///
+static size_t dedup_find(const block_store_t *const bs, const void *const buffer, const uint32_t csum) {
+    for (size_t i = csum & (DEDUP_SLOTS(bs) - 1); bs->dedup[i].id1 != DEDUP_EMPTY; i = (i + 1) & (DEDUP_SLOTS(bs) - 1)) {
+        const struct dedup_slot *slot = &bs->dedup[i];
+        if (slot->id1 == DEDUP_TOMBSTONE || slot->csum != csum) {
+            continue;
+        }
+        const size_t id = slot->id1 - 1;
+        // Checksums can collide, so compare the contents too
+        if (bs->csums[id] == csum && bitmap_test(bs->fbm, id)
+                && memcmp(bs->data_blocks + id*BLOCK_SIZE_BYTES, buffer, BLOCK_SIZE_BYTES) == 0) {
+            return id;
+        }
+    }
+    return SIZE_MAX;
+}
+
+///
+///-- Create or open a device on one backing file or striped across several
+/// \param init Whether to create the files
+/// \param fnames The files, in stripe order
+/// \param n Number of files, 1 for an unstriped device
+/// \param chunk_blocks Blocks per stripe chunk when creating a striped device
+/// \param opts OR'd block_store_opt_t values
+/// \return The device, NULL on error
+///
+static block_store_t *block_store_init_files(const bool init, const char *const *const fnames, const size_t n,
+                                             const size_t chunk_blocks, const int opts) {
+    const size_t n_blocks = (opts & BS_OPT_WIDE) ? BLOCK_STORE_WIDE_NUM_BLOCKS : BLOCK_STORE_NUM_BLOCKS;
+    if (fnames == NULL || n == 0 || n > BLOCK_STORE_MAX_STRIPES || (init && n > 1 && !stripe_geometry_ok(n_blocks, n, chunk_blocks))) {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (fnames[i] == NULL) {
+            return NULL;
+        }
+    }
+    block_store_t *bs = (block_store_t *) malloc(sizeof(block_store_t));
+    if (bs) {
+        bs->io = NULL;
+        bs->csums = NULL;
+        bs->refs = NULL;
+        bs->dedup = NULL;
+        bs->dedup_slots = 0;
+        bs->dirty = NULL;
+        bs->n_blocks = n_blocks;
+        bs->n_stripes = n;
+        bs->chunk_blocks = chunk_blocks;
+        if (files_open(bs, init, fnames)) {
+            if (n == 1) {
+                bs->data_blocks = map_blocks(bs->fd, bs->n_blocks * BLOCK_SIZE_BYTES, opts, &bs->huge_pages);
+            } else {
+                // Huge pages would span chunks of different files
+                bs->huge_pages = false;
+                bs->data_blocks = map_stripes(bs);
+            }
+            if (bs->data_blocks != (uint8_t *) MAP_FAILED) {
+                     if (init) {
+                            // create_file truncated the file, so the data blocks already read back as
+                            // zeros without ever being touched; only initialize the FBM so the rest
+                            // of the image stays sparse and formatting costs the same at any size
+                            memset(bs->data_blocks + bs->avail_blocks*BLOCK_SIZE_BYTES, 0X00,
+                                   (bs->n_blocks - bs->avail_blocks)*BLOCK_SIZE_BYTES);
+							                bs->data_blocks[bs->n_blocks*BLOCK_SIZE_BYTES - 1] = 0xff;
+							                // in case you are trying to write to the bitmap, that will be a disaster
+                      }
+                      bs->fbm = bitmap_overlay(bs->avail_blocks, bs->data_blocks + bs->avail_blocks*BLOCK_SIZE_BYTES);
+                      if (bs->fbm) {
+                            if (csum_attach(bs, init, opts) && refs_attach(bs, opts) && dirty_attach(bs, init, opts)) {
+                                bool ready = true;
+                                if (opts & BS_OPT_DEDUP) {
+                                    ready = dedup_rebuild(bs);
+                                }
+                                // Striped devices always batch through the engine, that is what
+                                //  spreads large transfers over the stripes
+                                if (ready && ((opts & BS_OPT_ASYNC_IO) || n > 1)) {
+                                    bs->io = block_io_create_striped(bs->stripe_fds, n, bs->chunk_blocks,
+                                                                     BLOCK_STORE_IO_QUEUE_DEPTH, BLOCK_IO_DEFAULT);
+                                    ready = bs->io != NULL;
+                                }
+                                if (ready) {
+                                    return bs;
+                                }
+                            }
+                            tables_detach(bs);
+                            bitmap_destroy(bs->fbm);
+                       }
+                       munmap(bs->data_blocks, bs->n_blocks * BLOCK_SIZE_BYTES);
+            }
+            files_close(bs);
         }
+        free(bs);
     }
     return NULL;
 }
 
+block_store_t *block_store_init(const bool init, const char *const fname, const int opts) {
+    return block_store_init_files(init, &fname, 1, 0, opts);
+}
+
 ///
 ///-- Create a new BS device.
 ///-- Return pointer to the new block storage device, NULL on error
 ///
 block_store_t *block_store_create(const char *const fname) {
-    return block_store_init(true, fname);
+    return block_store_init(true, fname, BS_OPT_NONE);
 }
 
 //
 block_store_t *block_store_open(const char *const fname) {
-    return block_store_init(false, fname);
+    return block_store_init(false, fname, BS_OPT_NONE);
+}
+
+block_store_t *block_store_create_opts(const char *const fname, const int opts) {
+    return block_store_init(true, fname, opts);
+}
+
+block_store_t *block_store_open_opts(const char *const fname, const int opts) {
+    return block_store_init(false, fname, opts);
+}
+
+block_store_t *block_store_create_striped(const char *const *const fnames, const size_t n, const size_t chunk_blocks, const int opts) {
+    const size_t default_chunk = (opts & BS_OPT_WIDE) ? BLOCK_STORE_WIDE_STRIPE_CHUNK_BLOCKS : BLOCK_STORE_STRIPE_CHUNK_BLOCKS;
+    return block_store_init_files(true, fnames, n, chunk_blocks ? chunk_blocks : default_chunk, opts);
+}
+
+block_store_t *block_store_open_striped(const char *const *const fnames, const size_t n, const int opts) {
+    return block_store_init_files(false, fnames, n, 0, opts);
 }
 
 ///
@@ -95,9 +825,11 @@ block_store_t *block_store_open(const char *const fname) {
 ///
 void block_store_destroy(block_store_t *const bs) {
       if (bs) {
+        block_io_destroy(bs->io);
         bitmap_destroy(bs->fbm);
-        munmap(bs->data_blocks, BLOCK_STORE_NUM_BYTES);
-        close(bs->fd);
+        tables_detach(bs);
+        munmap(bs->data_blocks, bs->n_blocks * BLOCK_SIZE_BYTES);
+        files_close(bs);
         free(bs);
     }
 }
@@ -118,10 +850,95 @@ size_t block_store_allocate(block_store_t *const bs) {
         return SIZE_MAX; // return SIZE_MAX since the last block is not available for storing data
     }
     bitmap_set(bs->fbm, id); // mark it as in use
+    csum_update_fbm(bs, id);
   //  bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
     return id;
 }
 
+///
+///-- Find the first free run of blocks long enough
+/// \param bs BS device
+/// \param n Number of blocks in the run
+/// \return The first block of the run, SIZE_MAX if there is none
+///
+static size_t fbm_find_run(const block_store_t *const bs, const size_t n) {
+    const uint8_t *fbm_data = bitmap_export(bs->fbm);
+    size_t run_start = 0, run_len = 0;
+    for (size_t id = 0; id < bs->avail_blocks && run_len < n; id++) {
+        if (id % 8 == 0 && fbm_data[id / 8] == 0xFF && id + 8 <= bs->avail_blocks) {
+            run_len = 0; // Skip full bytes whole
+            id += 7;
+            continue;
+        }
+        if (bitmap_test(bs->fbm, id)) {
+            run_len = 0;
+            continue;
+        }
+        if (run_len++ == 0) {
+            run_start = id;
+        }
+    }
+    return run_len == n ? run_start : SIZE_MAX;
+}
+
+///
+///-- Allocates a contiguous run of blocks (first fit)
+/// \param bs BS device
+/// \param n Number of blocks to allocate
+/// \return The first block of the run, SIZE_MAX on error or if there is no
+///--  free run long enough (nothing is allocated)
+///
+size_t block_store_allocate_contiguous(block_store_t *const bs, const size_t n) {
+    if (bs == NULL || n == 0 || block_store_get_free_blocks(bs) < n) {
+        return SIZE_MAX;
+    }
+    const size_t run_start = fbm_find_run(bs, n);
+    if (run_start == SIZE_MAX) {
+        return SIZE_MAX;
+    }
+    for (size_t id = run_start; id < run_start + n; id++) {
+        bitmap_set(bs->fbm, id);
+        csum_update_fbm(bs, id);
+    }
+    return run_start;
+}
+
+///
+///-- Allocates a batch of blocks, as one contiguous run if there is a free run
+///--  long enough (first fit), one by one otherwise
+/// \param bs BS device
+/// \param n Number of blocks to allocate
+/// \param block_ids Set to the ids of the n blocks, in order
+/// \return n on success, 0 on error (nothing is allocated)
+///
+size_t block_store_allocate_run(block_store_t *const bs, const size_t n, size_t *const block_ids) {
+    if (bs == NULL || block_ids == NULL || n == 0) {
+        return 0;
+    }
+    const size_t run_start = block_store_allocate_contiguous(bs, n);
+    if (run_start != SIZE_MAX) {
+        for (size_t i = 0; i < n; i++) {
+            block_ids[i] = run_start + i;
+        }
+        return n;
+    }
+    if (block_store_get_free_blocks(bs) < n) {
+        return 0;
+    }
+
+    // Too fragmented, settle for scattered blocks
+    for (size_t i = 0; i < n; i++) {
+        block_ids[i] = block_store_allocate(bs);
+        if (block_ids[i] == SIZE_MAX) {
+            while (i-- > 0) {
+                block_store_release(bs, block_ids[i]);
+            }
+            return 0;
+        }
+    }
+    return n;
+}
+
 ///
 ///-- Attempts to allocate the requested block id
 /// \param bs the block store object
@@ -129,7 +946,7 @@ size_t block_store_allocate(block_store_t *const bs) {
 /// \return boolean indicating succes of operation
 ///
 bool block_store_request(block_store_t *const bs, const size_t block_id) {
-    if (block_id > BLOCK_STORE_AVAIL_BLOCKS || bs == NULL) {
+    if (bs == NULL || block_id > bs->avail_blocks) {
         return false;
     }
     bool blockUsed = 0;
@@ -140,22 +957,43 @@ bool block_store_request(block_store_t *const bs, const size_t block_id) {
     }
     else { // if this block is not in use
         bitmap_set(bs->fbm, block_id); // mark the block as in use
+        csum_update_fbm(bs, block_id);
         //bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
         return true;
     }
 }
 
+///
+///-- Tests whether the specified block is marked as in use
+/// \param bs BS device
+/// \param block_id The block to test
+/// \return true if the block is in use, false if it is free or on error
+///
+bool block_store_test(const block_store_t *const bs, const size_t block_id) {
+    if (bs == NULL || block_id >= bs->avail_blocks) {
+        return false;
+    }
+    return bitmap_test(bs->fbm, block_id);
+}
+
 ///
 ///-- Frees the specified block
 /// \param bs BS device
 /// \param block_id The block to free
 ///
 void block_store_release(block_store_t *const bs, const size_t block_id) {
-    if (block_id <= BLOCK_STORE_AVAIL_BLOCKS && bs != NULL) {
+    if (bs != NULL && block_id <= bs->avail_blocks) {
+        if (bs->refs && bs->refs[block_id] > 0) {
+            bs->refs[block_id]--; // Still shared
+            dirty_mark(bs, block_id);
+            return;
+        }
         bool success = 0;
         success = bitmap_test(bs->fbm, block_id); // check if the block is in use
         if (success) {
+            dedup_remove(bs, block_id);
             bitmap_reset(bs->fbm, block_id); // clear requested bit in bitmap
+            csum_update_fbm(bs, block_id);
     //        bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
         }
     }
@@ -188,7 +1026,7 @@ size_t block_store_get_free_blocks(const block_store_t *const bs) {
         size_t numZero = 0;
         numSet = bitmap_total_set(bs->fbm); // count all bits set
         //bitmap_destroy(bs->fbm); // destruct and destroy bitmap object
-        numZero = BLOCK_STORE_AVAIL_BLOCKS - numSet; // count zero bits
+        numZero = bs->avail_blocks - numSet; // count zero bits
         return numZero;
     }
     return SIZE_MAX;
@@ -204,15 +1042,35 @@ size_t block_store_get_total_blocks() {
 }
 
 ///
-///-- Reads data from the specified block and writes it to the designated buffer
+///-- Returns the number of user-addressable blocks of a device
 /// \param bs BS device
-/// \param block_id Source block id
-/// \param buffer Data buffer to write to
+/// \return Total blocks, 0 on error
+///
+size_t block_store_get_avail_blocks(const block_store_t *const bs) {
+    return bs ? bs->avail_blocks : 0;
+}
+
+///
+///-- Reads data from the specified block and writes it to the designated buffer
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param buffer Data buffer to write to
 /// \return Number of bytes read, 0 on error
 ///
 size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer) {
-    if (bs && buffer && block_id <= BLOCK_STORE_AVAIL_BLOCKS) {
-        memcpy(buffer, bs->data_blocks+block_id*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+    if (bs && buffer && block_id <= bs->avail_blocks) {
+        if (bs->io) {
+            off_t off;
+            const int fd = stripe_locate(bs, block_id, &off);
+            if (pread(fd, buffer, BLOCK_SIZE_BYTES, off) != BLOCK_SIZE_BYTES) {
+                return 0;
+            }
+        } else {
+            memcpy(buffer, bs->data_blocks+block_id*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+        }
+        if (bs->verify && crc32c(0, buffer, BLOCK_SIZE_BYTES) != bs->csums[block_id]) {
+            return 0; // Corrupt
+        }
         return BLOCK_SIZE_BYTES;
     }
     return 0;
@@ -227,8 +1085,21 @@ size_t block_store_read(const block_store_t *const bs, const size_t block_id, vo
 /// \return Number of bytes written, 0 on error
 ///
 size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer) {
-    if (bs && buffer && block_id <= BLOCK_STORE_AVAIL_BLOCKS) {
-        memcpy(bs->data_blocks+block_id*BLOCK_SIZE_BYTES, buffer, BLOCK_SIZE_BYTES);
+    if (bs && buffer && block_id <= bs->avail_blocks) {
+        dedup_remove(bs, block_id);
+        if (bs->io) {
+            off_t off;
+            const int fd = stripe_locate(bs, block_id, &off);
+            if (pwrite(fd, buffer, BLOCK_SIZE_BYTES, off) != BLOCK_SIZE_BYTES) {
+                return 0;
+            }
+        } else {
+            memcpy(bs->data_blocks+block_id*BLOCK_SIZE_BYTES, buffer, BLOCK_SIZE_BYTES);
+        }
+        if (bs->csums) {
+            bs->csums[block_id] = crc32c(0, buffer, BLOCK_SIZE_BYTES);
+        }
+        dirty_mark(bs, block_id);
         return BLOCK_SIZE_BYTES;
     }
     return 0;
@@ -236,54 +1107,740 @@ size_t block_store_write(block_store_t *const bs, const size_t block_id, const v
 
 
 ///
-///-- Imports BS device from the given file
-/// \param filename The file to load
-/// \return Pointer to new BS device, NULL on error
+///-- Reads a batch of blocks, submitted together through the I/O engine if there is one
+/// \param bs BS device
+/// \param block_ids Source block ids
+/// \param buffers Data buffers to write to, one per block
+/// \param n Number of blocks in the batch
+/// \return Number of bytes read, 0 on error
 ///
-block_store_t *block_store_deserialize(const char *const filename) {
-    if (filename) {
-        int fd = open(filename, O_RDONLY); // open file (read only)
-        if (fd < 0) { // if opening file fails
+size_t block_store_read_many(const block_store_t *const bs, const size_t *const block_ids, void *const *const buffers, const size_t n) {
+    if (bs == NULL || block_ids == NULL || buffers == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (buffers[i] == NULL || block_ids[i] > bs->avail_blocks) {
             return 0;
         }
-        block_store_t *bs = NULL;
-        bs = block_store_create(filename);
-        int df_read1, df_read2;
-        df_read1 = read(fd, bs->data_blocks, BLOCK_STORE_AVAIL_BLOCKS*BLOCK_SIZE_BYTES); // read bs->Data from the file
-        df_read2 = read(fd, bs->fbm, BLOCK_STORE_NUM_BLOCKS/8); // read bs->FBM from the file
-        if (df_read1 < 0 || df_read2 < 0) { // if the system call returns an error
+    }
+    if (bs->io == NULL) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(buffers[i], bs->data_blocks+block_ids[i]*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+        }
+    } else {
+        block_io_req_t reqs[BLOCK_STORE_IO_QUEUE_DEPTH];
+        for (size_t done = 0; done < n; ) {
+            size_t batch = n - done < BLOCK_STORE_IO_QUEUE_DEPTH ? n - done : BLOCK_STORE_IO_QUEUE_DEPTH;
+            for (size_t i = 0; i < batch; i++) {
+                reqs[i] = (block_io_req_t) { BLOCK_IO_READ, block_ids[done+i], buffers[done+i] };
+            }
+            if (block_io_submit(bs->io, reqs, batch) != batch) {
+                return 0;
+            }
+            done += batch;
+        }
+    }
+    if (bs->verify) {
+        for (size_t i = 0; i < n; i++) {
+            if (crc32c(0, buffers[i], BLOCK_SIZE_BYTES) != bs->csums[block_ids[i]]) {
+                return 0; // Corrupt
+            }
+        }
+    }
+    return n*BLOCK_SIZE_BYTES;
+}
+
+
+///
+///-- Writes a batch of blocks, submitted together through the I/O engine if there is one
+/// \param bs BS device
+/// \param block_ids Destination block ids
+/// \param buffers Data buffers to read from, one per block
+/// \param n Number of blocks in the batch
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_write_many(block_store_t *const bs, const size_t *const block_ids, const void *const *const buffers, const size_t n) {
+    if (bs == NULL || block_ids == NULL || buffers == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (buffers[i] == NULL || block_ids[i] > bs->avail_blocks) {
             return 0;
         }
-        return bs;
     }
-    return 0;
+    for (size_t i = 0; i < n; i++) {
+        dedup_remove(bs, block_ids[i]);
+    }
+    if (bs->io == NULL) {
+        for (size_t i = 0; i < n; i++) {
+            memcpy(bs->data_blocks+block_ids[i]*BLOCK_SIZE_BYTES, buffers[i], BLOCK_SIZE_BYTES);
+        }
+    } else {
+        block_io_req_t reqs[BLOCK_STORE_IO_QUEUE_DEPTH];
+        for (size_t done = 0; done < n; ) {
+            size_t batch = n - done < BLOCK_STORE_IO_QUEUE_DEPTH ? n - done : BLOCK_STORE_IO_QUEUE_DEPTH;
+            for (size_t i = 0; i < batch; i++) {
+                reqs[i] = (block_io_req_t) { BLOCK_IO_WRITE, block_ids[done+i], (void *) buffers[done+i] };
+            }
+            if (block_io_submit(bs->io, reqs, batch) != batch) {
+                return 0;
+            }
+            done += batch;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (bs->csums) {
+            bs->csums[block_ids[i]] = crc32c(0, buffers[i], BLOCK_SIZE_BYTES);
+        }
+        dirty_mark(bs, block_ids[i]);
+    }
+    return n*BLOCK_SIZE_BYTES;
 }
 
+
 ///
-///-- Writes the entirety of the BS device to file, overwriting it if it exists
+///-- Writes part of a block in place, leaving the rest of it as it is
 /// \param bs BS device
-/// \param filename The file to write to
+/// \param block_id Destination block id
+/// \param offset Where in the block the data goes
+/// \param buffer Data buffer to read from
+/// \param len Number of bytes to write, offset + len at most BLOCK_SIZE_BYTES
 /// \return Number of bytes written, 0 on error
 ///
-size_t block_store_serialize(const block_store_t *const bs, const char *const filename) {
-    if (bs && filename) {
-        int fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR); // open file (write only)
-        if (fd < 0) { // if opening file fails
+size_t block_store_write_range(block_store_t *const bs, const size_t block_id, const size_t offset, const void *buffer, const size_t len) {
+    if (bs == NULL || buffer == NULL || block_id > bs->avail_blocks
+            || offset > BLOCK_SIZE_BYTES || len > BLOCK_SIZE_BYTES - offset) {
+        return 0;
+    }
+    dedup_remove(bs, block_id);
+    if (bs->io) {
+        off_t off;
+        const int fd = stripe_locate(bs, block_id, &off);
+        if (pwrite(fd, buffer, len, off + (off_t) offset) != (ssize_t) len) {
             return 0;
         }
-        write(fd, bs->data_blocks, BLOCK_STORE_AVAIL_BLOCKS*BLOCK_SIZE_BYTES); // write bs->Data to file
-        write(fd, bs->fbm, BLOCK_STORE_NUM_BLOCKS/8); // write bs->FBM to file
-        close(fd); // close file
-        size_t wr_size = block_store_get_used_blocks(bs); // number of block in use
-        return (wr_size*BLOCK_SIZE_BYTES); // return number of bytes written
+    } else {
+        memcpy(bs->data_blocks+block_id*BLOCK_SIZE_BYTES+offset, buffer, len);
     }
-    return 0;
+    csum_update(bs, block_id);
+    dirty_mark(bs, block_id);
+    return len;
+}
+
+
+///
+///-- Writes a data block that may share its storage with identical blocks
+///-- With BS_OPT_DEDUP, an identical shareable block in use gains a reference
+///--  and is returned instead, leaving block_id untouched (and allocated)
+///-- Otherwise buffer is written to block_id, which becomes shareable
+/// \param bs BS device
+/// \param block_id Destination block id, must not be shared
+/// \param buffer Data buffer to read from
+/// \return The id of the block holding the data, SIZE_MAX on error
+///
+size_t block_store_write_shared(block_store_t *const bs, const size_t block_id, const void *buffer) {
+    if (bs == NULL || buffer == NULL || block_id > bs->avail_blocks) {
+        return SIZE_MAX;
+    }
+    if (bs->dedup == NULL) {
+        return block_store_write(bs, block_id, buffer) == BLOCK_SIZE_BYTES ? block_id : SIZE_MAX;
+    }
+
+    const uint32_t csum = crc32c(0, buffer, BLOCK_SIZE_BYTES);
+    const size_t match = dedup_find(bs, buffer, csum);
+    if (match == block_id) {
+        return block_id; // Same contents as before
+    }
+    if (match != SIZE_MAX && bs->refs[match] < UINT16_MAX) {
+        bs->refs[match]++;
+        dirty_mark(bs, match);
+        return match;
+    }
+
+    if (block_store_write(bs, block_id, buffer) != BLOCK_SIZE_BYTES) {
+        return SIZE_MAX;
+    }
+    bitmap_set(bs->shareable, block_id);
+    dedup_insert(bs, block_id);
+    return block_id;
 }
 
+// Serialized images hold only the allocated blocks: a header, the free block
+//  map, then runs of consecutive allocated blocks, each a run header and its
+//  blocks, ending with an empty run. Devices with a reference table add the
+//  shareable bitmap after the map and each run's reference counts after its
+//  blocks, so shared blocks stay shared. Deltas are images of just the
+//  allocated blocks changed since the last delta. Checksums aren't stored,
+//  only whether the device kept them, so the loaded one does too
+#define IMAGE_MAGIC 0x4d494253 // "SBIM"
+#define IMAGE_VERSION 1
+#define IMAGE_HAS_REFS 1u
+#define IMAGE_DELTA 2u
+#define IMAGE_HAS_CSUMS 4u
+#define IMAGE_FBM_BYTES(n_blocks) ((n_blocks) / BLOCK_SIZE_BITS * BLOCK_SIZE_BYTES)
+#define IMAGE_BATCH_BYTES (4 * 1024 * 1024) // Moved per system call, at most
+#define IMAGE_BATCH_IOVS 1024
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_blocks;
+    uint32_t flags;
+    // Blocks in the runs
+    uint64_t n_used;
+} image_header_t;
+
+typedef struct {
+    uint32_t first;
+    // 0 for the run that ends the image
+    uint32_t count;
+} image_run_t;
+
+// A buffered image being written out, blocks are written straight from the
+//  mapping
+typedef struct {
+    int fd;
+    struct iovec iov[IMAGE_BATCH_IOVS];
+    size_t n_iov, n_bytes;
+    // Run headers referenced by iov
+    image_run_t runs[IMAGE_BATCH_IOVS];
+    size_t n_runs;
+    size_t written;
+    bool failed;
+} image_writer_t;
+
+// A buffered image being read in
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t pos, len;
+} image_reader_t;
+
+///
+///-- Write out everything an image writer has gathered
+/// \param w The writer
+/// \return false on error
+///
+static bool image_flush(image_writer_t *const w) {
+    struct iovec *iov = w->iov;
+    size_t n_iov = w->n_iov;
+    while (!w->failed && n_iov > 0) {
+        ssize_t n = writev(w->fd, iov, n_iov > IOV_MAX ? IOV_MAX : n_iov);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            w->failed = true;
+            break;
+        }
+        w->written += n;
+        // Step past what was written, partly written vectors are trimmed
+        for (size_t done = n; n_iov > 0 && done >= iov->iov_len; iov++, n_iov--) {
+            done -= iov->iov_len;
+            n = done;
+        }
+        if (n_iov > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    w->n_iov = w->n_bytes = w->n_runs = 0;
+    return !w->failed;
+}
+
+///
+///-- Add bytes to an image, they must stay put until the next flush
+/// \param w The writer
+/// \param data The bytes
+/// \param len The number of bytes
+/// \return false on error
+///
+static bool image_put(image_writer_t *const w, const void *const data, const size_t len) {
+    if (len == 0) {
+        return !w->failed;
+    }
+    if (w->n_iov == IMAGE_BATCH_IOVS && !image_flush(w)) {
+        return false;
+    }
+    w->iov[w->n_iov++] = (struct iovec) { (void *) data, len };
+    w->n_bytes += len;
+    return w->n_bytes < IMAGE_BATCH_BYTES || image_flush(w);
+}
+
+///
+///-- Add a run of blocks to an image
+/// \param w The writer
+/// \param bs BS device the blocks are in
+/// \param first The first block of the run
+/// \param count The number of blocks, 0 to end the image
+/// \return false on error
+///
+static bool image_put_run(image_writer_t *const w, const block_store_t *const bs, const size_t first, const size_t count) {
+    // Header, blocks and reference counts take three vectors
+    if ((w->n_runs == IMAGE_BATCH_IOVS || w->n_iov + 3 > IMAGE_BATCH_IOVS) && !image_flush(w)) {
+        return false;
+    }
+    image_run_t *run = &w->runs[w->n_runs++];
+    *run = (image_run_t) { first, count };
+    return image_put(w, run, sizeof(*run))
+        && image_put(w, bs->data_blocks + first*BLOCK_SIZE_BYTES, count*BLOCK_SIZE_BYTES)
+        && (bs->refs == NULL || image_put(w, bs->refs + first, count*sizeof(uint16_t)));
+}
+
+///
+///-- Write the runs of blocks set in a bitmap to an image, and the empty run
+///--  that ends it
+/// \param w The writer
+/// \param bs BS device the blocks are in
+/// \param blocks The blocks to write, one bit per data block
+/// \return false on error
+///
+static bool image_put_blocks(image_writer_t *const w, const block_store_t *const bs, const bitmap_t *const blocks) {
+    size_t first = SIZE_MAX;
+    for (size_t block_id = 0; block_id <= bs->avail_blocks; block_id++) {
+        const bool set = block_id < bs->avail_blocks && bitmap_test(blocks, block_id);
+        if (set && first == SIZE_MAX) {
+            first = block_id;
+        } else if (!set && first != SIZE_MAX) {
+            if (!image_put_run(w, bs, first, block_id - first)) {
+                return false;
+            }
+            first = SIZE_MAX;
+        }
+    }
+    return image_put_run(w, bs, 0, 0) && image_flush(w);
+}
+
+///
+///-- Read bytes from an image, large reads go straight to their destination
+/// \param r The reader
+/// \param dest Where to put the bytes
+/// \param len The number of bytes
+/// \return false on error or if the image ends first
+///
+static bool image_get(image_reader_t *const r, void *const dest, const size_t len) {
+    uint8_t *out = (uint8_t *) dest;
+    size_t done = 0;
+    while (done < len) {
+        if (r->pos == r->len) {
+            r->pos = r->len = 0;
+            uint8_t *to = len - done >= IMAGE_BATCH_BYTES ? out + done : r->buf;
+            size_t want = len - done >= IMAGE_BATCH_BYTES ? len - done : IMAGE_BATCH_BYTES;
+            ssize_t n = read(r->fd, to, want);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            if (to != r->buf) {
+                done += n;
+                continue;
+            }
+            r->len = n;
+        }
+        size_t n = r->len - r->pos < len - done ? r->len - r->pos : len - done;
+        memcpy(out + done, r->buf + r->pos, n);
+        r->pos += n;
+        done += n;
+    }
+    return true;
+}
+
+///
+///-- Skip over bytes of an image
+/// \param r The reader
+/// \param len The number of bytes
+/// \return false on error or if the image ends first
+///
+static bool image_skip(image_reader_t *const r, const size_t len) {
+    const size_t buffered = r->len - r->pos;
+    if (len <= buffered) {
+        r->pos += len;
+        return true;
+    }
+    r->pos = r->len = 0;
+    struct stat file_info;
+    const off_t at = lseek(r->fd, 0, SEEK_CUR);
+    const off_t to = at + (off_t) (len - buffered);
+    return at != -1 && fstat(r->fd, &file_info) != -1 && to <= file_info.st_size && lseek(r->fd, to, SEEK_SET) == to;
+}
+
+///
+///-- Check the layout of a whole image without reading its blocks, then go
+///--  back to its start
+/// \param r The reader, at the start of the image
+/// \param header Set to the image's header
+/// \return false on error or if the image is corrupt
+///
+static bool image_check(image_reader_t *const r, image_header_t *const header) {
+    if (!image_get(r, header, sizeof(*header)) || header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION
+            || (header->n_blocks != BLOCK_STORE_NUM_BLOCKS && header->n_blocks != BLOCK_STORE_WIDE_NUM_BLOCKS)) {
+        return false;
+    }
+    const size_t avail_blocks = header->n_blocks - header->n_blocks / BLOCK_SIZE_BITS;
+    const bool has_refs = header->flags & IMAGE_HAS_REFS;
+    if (!image_skip(r, IMAGE_FBM_BYTES(header->n_blocks)) || (has_refs && !image_skip(r, header->n_blocks / 8))) {
+        return false;
+    }
+    const size_t block_bytes = BLOCK_SIZE_BYTES + (has_refs ? sizeof(uint16_t) : 0);
+    uint64_t n_blocks = 0;
+    image_run_t run;
+    while (image_get(r, &run, sizeof(run)) && run.count != 0) {
+        if (run.first >= avail_blocks || run.count > avail_blocks - run.first
+                || !image_skip(r, (size_t) run.count*block_bytes)) {
+            return false;
+        }
+        n_blocks += run.count;
+    }
+    // Nothing may follow the empty run
+    uint8_t extra;
+    if (run.count != 0 || n_blocks != header->n_used || image_get(r, &extra, 1)) {
+        return false;
+    }
+    r->pos = r->len = 0;
+    return lseek(r->fd, 0, SEEK_SET) == 0;
+}
+
+///
+///-- Read the runs of an image into a device, up to and including the empty
+///--  run that ends them
+/// \param r The reader
+/// \param bs BS device to fill
+/// \param has_refs Whether the runs carry reference counts
+/// \return false on error or if the image is corrupt
+///
+static bool image_get_blocks(image_reader_t *const r, block_store_t *const bs, const bool has_refs) {
+    image_run_t run;
+    while (image_get(r, &run, sizeof(run)) && run.count != 0) {
+        if (run.first >= bs->avail_blocks || run.count > bs->avail_blocks - run.first) {
+            return false;
+        }
+        if (!image_get(r, bs->data_blocks + (size_t) run.first*BLOCK_SIZE_BYTES, (size_t) run.count*BLOCK_SIZE_BYTES)) {
+            return false;
+        }
+        if (has_refs) {
+            if (!image_get(r, bs->refs + run.first, run.count*sizeof(uint16_t))) {
+                return false;
+            }
+        } else if (bs->refs) {
+            memset(bs->refs + run.first, 0x00, run.count*sizeof(uint16_t)); // Nothing was shared
+        }
+        for (size_t block_id = run.first; block_id < (size_t) run.first + run.count; block_id++) {
+            csum_update(bs, block_id);
+            dirty_mark(bs, block_id);
+        }
+    }
+    return run.count == 0;
+}
+
+///
+///-- Load an image into a device, a full image into a new one or a delta (or
+///--  a full image) over an existing one of the same size
+///-- The image is checked first, so a corrupt one leaves the device alone
+/// \param filename The image to load
+/// \param device The device file
+/// \param init Whether to create the device, deltas are refused then
+/// \return false on error or if the image is corrupt
+///
+static bool image_load(const char *const filename, const char *const device, const bool init) {
+    image_reader_t r = { open(filename, O_RDONLY), malloc(IMAGE_BATCH_BYTES), 0, 0 };
+    image_header_t header;
+    bool ok = r.fd >= 0 && r.buf != NULL && image_check(&r, &header)
+        && !(init && (header.flags & IMAGE_DELTA)) && image_skip(&r, sizeof(header));
+
+    // Filled in through the mapping with the tables it needs
+    const bool has_refs = ok && (header.flags & IMAGE_HAS_REFS);
+    const bool has_csums = ok && (header.flags & IMAGE_HAS_CSUMS);
+    block_store_t *bs = NULL;
+    const bool attempted = ok;
+    if (ok) {
+        const int wide = header.n_blocks == BLOCK_STORE_WIDE_NUM_BLOCKS ? BS_OPT_WIDE : 0;
+        bs = block_store_init(init, device, (has_csums ? BS_OPT_CSUM : 0) | (has_refs ? BS_OPT_DEDUP : 0) | wide);
+        ok = bs != NULL && bs->n_blocks == header.n_blocks;
+    }
+    if (ok) {
+        ok = image_get(&r, bs->data_blocks + bs->avail_blocks*BLOCK_SIZE_BYTES, IMAGE_FBM_BYTES(bs->n_blocks));
+        for (size_t block_id = bs->avail_blocks; ok && block_id < bs->n_blocks; block_id++) {
+            csum_update(bs, block_id);
+        }
+    }
+    if (ok && has_refs) {
+        ok = image_get(&r, (uint8_t *) bs->refs - REFS_SHAREABLE_BYTES(bs), REFS_SHAREABLE_BYTES(bs));
+    } else if (ok && bs->refs) {
+        bitmap_format(bs->shareable, 0x00);
+    }
+    ok = ok && image_get_blocks(&r, bs, has_refs);
+
+    block_store_destroy(bs);
+    if (r.fd >= 0) {
+        close(r.fd);
+    }
+    free(r.buf);
+    if (!ok && init && attempted) {
+        unlink(device);
+    }
+    return ok;
+}
+
+///
+///-- Imports a BS device from an image made by block_store_serialize
+/// \param filename The image to load
+/// \param device The device file to create (truncated if it exists)
+/// \param opts OR'd block_store_opt_t values to open the device with
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_deserialize(const char *const filename, const char *const device, const int opts) {
+    if (filename == NULL || device == NULL || !image_load(filename, device, true)) {
+        return NULL;
+    }
+    return block_store_open_opts(device, opts);
+}
+
+///
+///-- Applies a delta made by block_store_export_delta to a device that isn't
+///--  open, bringing it to the state the delta was exported in
+/// \param filename The delta (or full image) to load
+/// \param device The device file
+/// \return false on error or if the delta is corrupt
+///
+bool block_store_apply_delta(const char *const filename, const char *const device) {
+    return filename != NULL && device != NULL && image_load(filename, device, false);
+}
+
+///
+///-- Write an image of some of the allocated blocks
+/// \param bs BS device
+/// \param filename The file to write to
+/// \param blocks The blocks to write, one bit per data block
+/// \param flags IMAGE_DELTA or 0, IMAGE_HAS_REFS and IMAGE_HAS_CSUMS are
+///  worked out here
+/// \return Number of bytes written, 0 on error
+///
+static size_t image_save(const block_store_t *const bs, const char *const filename, const bitmap_t *const blocks, const uint32_t flags) {
+    image_writer_t *w = (image_writer_t *) calloc(1, sizeof(image_writer_t));
+    if (w == NULL) {
+        return 0;
+    }
+    w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    w->failed = w->fd < 0;
+
+    image_header_t header = {
+        .magic = IMAGE_MAGIC,
+        .version = IMAGE_VERSION,
+        .n_blocks = (uint32_t) bs->n_blocks,
+        .flags = flags | (bs->refs != NULL ? IMAGE_HAS_REFS : 0) | (bs->csums != NULL ? IMAGE_HAS_CSUMS : 0),
+        .n_used = bitmap_total_set(blocks),
+    };
+    bool ok = image_put(w, &header, sizeof(header))
+        && image_put(w, bs->data_blocks + bs->avail_blocks*BLOCK_SIZE_BYTES, IMAGE_FBM_BYTES(bs->n_blocks))
+        && (bs->refs == NULL || image_put(w, (const uint8_t *) bs->refs - REFS_SHAREABLE_BYTES(bs), REFS_SHAREABLE_BYTES(bs)))
+        && image_put_blocks(w, bs, blocks);
+
+    size_t written = w->written;
+    if (w->fd >= 0 && close(w->fd) != 0) {
+        ok = false;
+    }
+    free(w);
+    return ok ? written : 0;
+}
+
+///
+///-- Writes the allocated blocks of the BS device to an image, overwriting it
+///--  if it exists, so the image grows with the used space rather than the
+///--  size of the device
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_serialize(const block_store_t *const bs, const char *const filename) {
+    if (bs == NULL || filename == NULL) {
+        return 0;
+    }
+    return image_save(bs, filename, bs->fbm, 0);
+}
+
+///
+///-- Writes the allocated blocks changed since the last delta to a delta
+///--  image, overwriting it if it exists, then starts tracking afresh
+///-- Freed blocks are left out, the free block map in the delta frees them
+/// \param bs BS device that tracks dirty blocks
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_export_delta(block_store_t *const bs, const char *const filename) {
+    if (bs == NULL || bs->dirty == NULL || filename == NULL) {
+        return 0;
+    }
+    const size_t n_bytes = bitmap_get_bytes(bs->fbm);
+    uint8_t *data = (uint8_t *) malloc(n_bytes);
+    bitmap_t *blocks = bitmap_overlay(bs->avail_blocks, data);
+    size_t written = 0;
+    if (blocks != NULL) {
+        const uint8_t *used = bitmap_export(bs->fbm), *dirty = bitmap_export(bs->dirty);
+        for (size_t i = 0; i < n_bytes; i++) {
+            data[i] = used[i] & dirty[i];
+        }
+        written = image_save(bs, filename, blocks, IMAGE_DELTA);
+    }
+    if (written != 0) {
+        bitmap_format(bs->dirty, 0x00);
+    }
+    bitmap_destroy(blocks);
+    free(data);
+    return written;
+}
 
 /// new library functions
 
 
+///
+/// Reports whether the device mapping was set up for huge pages
+/// \param bs BS device
+/// \return true if BS_OPT_HUGEPAGES was requested and took effect
+bool block_store_huge_pages(const block_store_t *const bs)
+{
+	return bs != NULL && bs->huge_pages;
+}
+
+
+///
+/// Recomputes the checksum of a block that was changed in place through the
+///  mapping (see block_store_Data_location), and marks it dirty
+/// \param bs BS device
+/// \param block_id The block
+/// \return false on error, true otherwise (including when there is no table)
+bool block_store_csum_refresh(block_store_t *const bs, const size_t block_id)
+{
+	if (bs == NULL || block_id >= bs->n_blocks)
+	{
+		return false;
+	}
+	dirty_mark(bs, block_id);
+	if (bs->csums == NULL)
+	{
+		return true;
+	}
+	// The shared mapping sees pwrite()s too, so it always has the current data
+	csum_update(bs, block_id);
+	return true;
+}
+
+
+///
+/// Checks a block against its checksum
+/// \param bs BS device
+/// \param block_id The block
+/// \return true if the block matches (or there is no table), false if it is corrupt or on error
+bool block_store_verify(const block_store_t *const bs, const size_t block_id)
+{
+	if (bs == NULL || block_id >= bs->n_blocks)
+	{
+		return false;
+	}
+	if (bs->csums == NULL)
+	{
+		return true;
+	}
+	return crc32c(0, bs->data_blocks + block_id*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES) == bs->csums[block_id];
+}
+
+
+///
+/// Counts the extra references to a shared block
+/// \param bs BS device
+/// \param block_id The block
+/// \return The number of references beyond the first, 0 if the block is not shared or on error
+size_t block_store_refs(const block_store_t *const bs, const size_t block_id)
+{
+	if (bs == NULL || bs->refs == NULL || block_id >= bs->avail_blocks)
+	{
+		return 0;
+	}
+	return bs->refs[block_id];
+}
+
+
+///
+/// Tells whether identical writes may share a block
+/// \param bs BS device
+/// \param block_id The block
+/// \return Whether the block is shareable, false if the device has no reference table or on error
+bool block_store_shareable(const block_store_t *const bs, const size_t block_id)
+{
+	if (bs == NULL || bs->refs == NULL || block_id >= bs->avail_blocks)
+	{
+		return false;
+	}
+	return bitmap_test(bs->shareable, block_id);
+}
+
+
+///
+/// Makes a block in use shareable, as if block_store_write_shared had written it
+/// \param bs BS device
+/// \param block_id The block
+/// \return false if the device has no reference table, the block is free or on error
+bool block_store_share(block_store_t *const bs, const size_t block_id)
+{
+	if (bs == NULL || bs->refs == NULL || block_id >= bs->avail_blocks || !bitmap_test(bs->fbm, block_id))
+	{
+		return false;
+	}
+	if (!bitmap_test(bs->shareable, block_id))
+	{
+		bitmap_set(bs->shareable, block_id);
+		if (bs->dedup != NULL)
+		{
+			dedup_insert(bs, block_id);
+		}
+	}
+	return true;
+}
+
+
+///
+/// Sets the extra references to a block, for repairs
+/// \param bs BS device
+/// \param block_id The block
+/// \param refs The number of references beyond the first
+/// \return false if the device has no reference table (and refs > 0) or on error
+bool block_store_set_refs(block_store_t *const bs, const size_t block_id, const size_t refs)
+{
+	if (bs == NULL || block_id >= bs->avail_blocks || refs > UINT16_MAX)
+	{
+		return false;
+	}
+	if (bs->refs == NULL)
+	{
+		return refs == 0;
+	}
+	bs->refs[block_id] = (uint16_t) refs;
+	dirty_mark(bs, block_id);
+	return true;
+}
+
+
+///
+/// Reports whether the device keeps a checksum table
+/// \param bs BS device
+/// \return true if every block is checksummed
+bool block_store_has_csums(const block_store_t *const bs)
+{
+	return bs != NULL && bs->csums != NULL;
+}
+
+
+///
+/// Reports whether the device keeps a reference table
+/// \param bs BS device
+/// \return true if blocks can be shared (see block_store_set_refs)
+bool block_store_has_refs(const block_store_t *const bs)
+{
+	return bs != NULL && bs->refs != NULL;
+}
+
+
 ///
 /// This returns pointer to start of the Data of a block store
 /// \param bs BS device
@@ -298,6 +1855,89 @@ uint8_t * block_store_Data_location(block_store_t *const bs)
 }
 
 
+///
+/// Builds a private read only view of a list of blocks, laid out back to back
+///  Page sized groups of the list that are contiguous and page aligned in the
+///  device are mapped straight from its file, the rest are copied in
+/// \param bs BS device
+/// \param block_ids The blocks, in view order
+/// \param n Number of blocks
+/// \return The view, to be released with block_store_unmap_view, NULL on error
+const uint8_t * block_store_map_view(const block_store_t *const bs, const size_t *const block_ids, const size_t n)
+{
+	if (bs == NULL || block_ids == NULL || n == 0)
+	{
+		return NULL;
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		if (block_ids[i] >= bs->n_blocks)
+		{
+			return NULL;
+		}
+	}
+
+	const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	const size_t per_page = page / BLOCK_SIZE_BYTES;
+	const size_t view_bytes = (n * BLOCK_SIZE_BYTES + page - 1) / page * page;
+	// Huge page mappings can't be split into small pages
+	const bool can_remap = per_page > 0 && page % BLOCK_SIZE_BYTES == 0 && !bs->huge_pages;
+
+	uint8_t *view = (uint8_t *) mmap(NULL, view_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (view == (uint8_t *) MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	for (size_t i = 0; i < n; i += per_page)
+	{
+		const size_t group = n - i < per_page ? n - i : per_page;
+		uint8_t *dst = view + i * BLOCK_SIZE_BYTES;
+
+		bool remap = can_remap && block_ids[i] % per_page == 0;
+		for (size_t j = 1; remap && j < group; j++)
+		{
+			remap = block_ids[i + j] == block_ids[i] + j;
+		}
+		// Chunks are whole pages, so an aligned page never straddles two stripes
+		off_t off = 0;
+		const int fd = remap ? stripe_locate(bs, block_ids[i], &off) : -1;
+		if (remap && mmap(dst, page, PROT_READ, MAP_SHARED | MAP_FIXED, fd, off) != MAP_FAILED)
+		{
+			continue;
+		}
+
+		// A failed MAP_FIXED may have dropped the page, so put it back
+		if (remap && mmap(dst, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+		{
+			munmap(view, view_bytes);
+			return NULL;
+		}
+		for (size_t j = 0; j < group; j++)
+		{
+			memcpy(dst + j * BLOCK_SIZE_BYTES, bs->data_blocks + block_ids[i + j] * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+		}
+		mprotect(dst, page, PROT_READ);
+	}
+	return view;
+}
+
+
+///
+/// Releases a view built by block_store_map_view
+/// \param view The view
+/// \param n Number of blocks in the view
+void block_store_unmap_view(const uint8_t *const view, const size_t n)
+{
+	if (view == NULL || n == 0)
+	{
+		return;
+	}
+	const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	munmap((void *) view, (n * BLOCK_SIZE_BYTES + page - 1) / page * page);
+}
+
+
 size_t block_store_sub_allocate(block_store_t *const bs) {
     if (bs == NULL) {
         return SIZE_MAX; // return SIZE_MAX if the input is a null pointer
@@ -344,7 +1984,19 @@ block_store_t *block_store_inode_create(void *const BM_start_pos, void *const da
 	block_store_t* BS = (block_store_t*)malloc(sizeof(block_store_t));
 	if(BS != NULL)	// pointer of the new block store has successfully created
 	{
-		BS->fbm = bitmap_overlay(NUM_INODES, BM_start_pos);
+		BS->n_blocks = BLOCK_STORE_NUM_BLOCKS;
+		BS->avail_blocks = BLOCK_STORE_AVAIL_BLOCKS;
+		BS->fd = -1;
+		BS->n_stripes = 0;
+		BS->io = NULL;
+		BS->huge_pages = false;
+		BS->csums = NULL;
+		BS->verify = false;
+		BS->refs = NULL;
+		BS->shareable = NULL;
+		BS->dedup = NULL;
+		BS->dirty = NULL;
+		BS->fbm = bitmap_overlay(FS_FIXED_INODE_BLOCKS * FS_INODES_PER_BLOCK, BM_start_pos);
 		BS->data_blocks = data_start_pos;
 		return BS;
 	}
@@ -356,6 +2008,18 @@ block_store_t *block_store_fd_create()
 	block_store_t* BS = (block_store_t*)malloc(sizeof(block_store_t));
 	if(BS != NULL)	// pointer of the new block store has successfully created
 	{
+		BS->n_blocks = BLOCK_STORE_NUM_BLOCKS;
+		BS->avail_blocks = BLOCK_STORE_AVAIL_BLOCKS;
+		BS->fd = -1;
+		BS->n_stripes = 0;
+		BS->io = NULL;
+		BS->huge_pages = false;
+		BS->csums = NULL;
+		BS->verify = false;
+		BS->refs = NULL;
+		BS->shareable = NULL;
+		BS->dedup = NULL;
+		BS->dirty = NULL;
 		BS->data_blocks = calloc(NUM_FDS, FD_SIZE);	// create space for the blocks
 		BS->fbm = bitmap_create(NUM_FDS);
 		return BS;
@@ -0,0 +1,126 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    #include <nmmintrin.h>
+    #define CRC32C_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u // Reflected Castagnoli polynomial
+
+// Bytes per stream in the hardware loop, which runs three independent streams
+//  to hide the latency of the crc32 instruction and then stitches them together
+#define CRC32C_STRIDE 336
+
+// Slicing-by-8 tables for the software version
+static uint32_t crc_table[8][256];
+// Advances a CRC over CRC32C_STRIDE zero bytes, one table per byte of the CRC
+static uint32_t shift_table[4][256];
+static bool have_hw;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/**
+ * CRC without the pre/post inversion, a byte at a time
+ */
+static uint32_t _sw_bytes(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--)
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+/**
+ * CRC without the pre/post inversion, 8 bytes at a time
+ */
+static uint32_t _sw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF]
+            ^ crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24]
+            ^ crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF]
+            ^ crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+    }
+    return _sw_bytes(crc, p, len);
+}
+
+static inline uint32_t _shift(uint32_t crc) {
+    return shift_table[0][crc & 0xFF] ^ shift_table[1][(crc >> 8) & 0xFF]
+         ^ shift_table[2][(crc >> 16) & 0xFF] ^ shift_table[3][crc >> 24];
+}
+
+#ifdef CRC32C_SSE42
+/**
+ * CRC without the pre/post inversion on the SSE4.2 crc32 instruction
+ */
+__attribute__((target("sse4.2")))
+static uint32_t _hw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 3*CRC32C_STRIDE; p += 3*CRC32C_STRIDE, len -= 3*CRC32C_STRIDE) {
+        uint64_t c0 = crc, c1 = 0, c2 = 0;
+        for (size_t i = 0; i < CRC32C_STRIDE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC32C_STRIDE + i, 8);
+            memcpy(&v2, p + 2*CRC32C_STRIDE + i, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        // CRCs are linear, so crc(A|B) = crc(A) advanced over |B| zeros ^ crc(B)
+        crc = _shift((uint32_t)c0) ^ (uint32_t)c1;
+        crc = _shift(crc) ^ (uint32_t)c2;
+    }
+
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static void _init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc_table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            crc_table[k][n] = crc_table[0][crc_table[k-1][n] & 0xFF] ^ (crc_table[k-1][n] >> 8);
+
+    static const uint8_t zeros[CRC32C_STRIDE];
+    for (int k = 0; k < 4; k++)
+        for (uint32_t n = 0; n < 256; n++)
+            shift_table[k][n] = _sw(n << (8*k), zeros, CRC32C_STRIDE);
+
+#ifdef CRC32C_SSE42
+    __builtin_cpu_init();
+    have_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *const buf, const size_t len) {
+    pthread_once(&init_once, _init);
+    if (buf == NULL)
+        return crc;
+
+    crc = ~crc;
+#ifdef CRC32C_SSE42
+    if (have_hw)
+        return ~_hw(crc, buf, len);
+#endif
+    return ~_sw(crc, buf, len);
+}
+
+bool crc32c_hw(void) {
+    pthread_once(&init_once, _init);
+    return have_hw;
+}
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 32 // struct fuse_loop_config
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "FS.h"
+#include "consts.h"
+
+#define USAGE "%s <image> <mountpoint> [fuse options]\n", argv[0]
+
+// Largest single read/write request asked of the kernel
+#define FUSE_MAX_IO (1024 * 1024)
+// The volume only changes through this mount, so the kernel may cache freely
+#define FUSE_TIMEOUT 60.0
+
+// FUSE inode numbers are handed out on first lookup and never reused, there
+//  is no fs_remove or rename to invalidate them
+static struct {
+    char **paths;     // Path of each inode number, from 1 (the root)
+    size_t n_paths;
+    size_t cap_paths;
+    size_t *slots;    // Open addressed index of paths, 0 is empty
+    size_t n_slots;   // A power of two
+} inos;
+
+// The FS isn't thread safe, requests come in on several threads and are
+//  serialized here; the loop threads still overlap the kernel round trips
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static FS_t *fs;
+
+static size_t _path_hash(const char *path) {
+    size_t h = 14695981039346656037ULL;
+    for (; *path; path++)
+        h = (h ^ (uint8_t) *path) * 1099511628211ULL;
+    return h;
+}
+
+/**
+ * Find the inode number of a path, handing out a new one if it has none
+ * \param path The path
+ * \return The inode number, 0 on error
+ */
+static fuse_ino_t _ino_get(const char *path) {
+    size_t mask = inos.n_slots - 1;
+    size_t i = _path_hash(path) & mask;
+    for (; inos.slots[i] != 0; i = (i + 1) & mask) {
+        if (strcmp(inos.paths[inos.slots[i] - 1], path) == 0)
+            return inos.slots[i];
+    }
+
+    if (inos.n_paths == inos.cap_paths) {
+        size_t cap = inos.cap_paths * 2;
+        char **paths = realloc(inos.paths, cap * sizeof(char *));
+        if (paths == NULL)
+            return 0;
+        inos.paths = paths;
+        inos.cap_paths = cap;
+    }
+    // Keep the index at most half full
+    if ((inos.n_paths + 1) * 2 > inos.n_slots) {
+        size_t n_slots = inos.n_slots * 2;
+        size_t *slots = calloc(n_slots, sizeof(size_t));
+        if (slots == NULL)
+            return 0;
+        for (size_t ino = 1; ino <= inos.n_paths; ino++) {
+            size_t j = _path_hash(inos.paths[ino - 1]) & (n_slots - 1);
+            while (slots[j] != 0)
+                j = (j + 1) & (n_slots - 1);
+            slots[j] = ino;
+        }
+        free(inos.slots);
+        inos.slots = slots;
+        inos.n_slots = n_slots;
+        mask = n_slots - 1;
+        for (i = _path_hash(path) & mask; inos.slots[i] != 0; i = (i + 1) & mask)
+            ;
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL)
+        return 0;
+    inos.paths[inos.n_paths++] = copy;
+    inos.slots[i] = inos.n_paths;
+    return inos.n_paths;
+}
+
+/**
+ * Look up the path of an inode number
+ * \param ino The inode number
+ * \return The path, NULL if the number was never handed out
+ */
+static const char *_ino_path(fuse_ino_t ino) {
+    return ino >= 1 && ino <= inos.n_paths ? inos.paths[ino - 1] : NULL;
+}
+
+/**
+ * Join a directory path and an entry name
+ * \param dir The directory's path
+ * \param name The entry's name
+ * \param path A buffer of PATH_MAX bytes for the result
+ * \return 0 on success, an errno value on error
+ */
+static int _join(const char *dir, const char *name, char *path) {
+    if (strlen(name) >= FS_FNAME_MAX)
+        return ENAMETOOLONG;
+    int n = snprintf(path, PATH_MAX, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    return n < 0 || n >= PATH_MAX ? ENAMETOOLONG : 0;
+}
+
+/**
+ * Fill in the attributes of a file
+ * \param path The file's path
+ * \param st Set to the attributes
+ * \return 0 on success, an errno value on error
+ */
+static int _stat(const char *path, struct stat *st) {
+    fs_stat_t fs_st;
+    if (fs_stat(fs, path, &fs_st) < 0)
+        return ENOENT;
+
+    memset(st, 0, sizeof(*st));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_blksize = BLOCK_SIZE_BYTES;
+    st->st_mode = fs_st.type == FS_DIRECTORY ? S_IFDIR | 0755 : S_IFREG | 0644;
+    st->st_nlink = fs_st.nlink;
+    st->st_size = fs_st.size;
+    st->st_blocks = fs_st.blocks * (BLOCK_SIZE_BYTES / 512);
+
+    // Only files that exist get a number
+    st->st_ino = _ino_get(path);
+    return st->st_ino == 0 ? ENOMEM : 0;
+}
+
+/**
+ * Reply to a request with the entry of a file
+ * \param req The request
+ * \param path The file's path
+ */
+static void _reply_entry(fuse_req_t req, const char *path) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    int err = _stat(path, &e.attr);
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    e.ino = e.attr.st_ino;
+    e.attr_timeout = FUSE_TIMEOUT;
+    e.entry_timeout = FUSE_TIMEOUT;
+    fuse_reply_entry(req, &e);
+}
+
+/**
+ * Extend a file with zeros, the FS can't seek past EOF
+ * \param fd The file, its position is left at its end
+ * \param size The size to grow the file to
+ * \return 0 on success, an errno value on error
+ */
+static int _extend(int fd, off_t size) {
+    static const uint8_t zeros[BLOCK_SIZE_BYTES * 16];
+    off_t end = fs_seek(fs, fd, 0, FS_SEEK_END);
+    if (end < 0)
+        return EIO;
+    while (end < size) {
+        size_t n = size - end < (off_t) sizeof(zeros) ? (size_t) (size - end) : sizeof(zeros);
+        ssize_t n_written = fs_write(fs, fd, zeros, n);
+        if (n_written < 0)
+            return EIO;
+        if ((size_t) n_written < n)
+            return ENOSPC;
+        end += n_written;
+    }
+    return 0;
+}
+
+static void _op_init(void *userdata, struct fuse_conn_info *conn) {
+    (void) userdata;
+    conn->max_write = FUSE_MAX_IO;
+    conn->max_readahead = FUSE_MAX_IO;
+}
+
+static void _op_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    char path[PATH_MAX];
+    pthread_mutex_lock(&fs_lock);
+    const char *dir = _ino_path(parent);
+    int err = dir == NULL ? ENOENT : _join(dir, name, path);
+    if (err != 0)
+        fuse_reply_err(req, err);
+    else
+        _reply_entry(req, path);
+    pthread_mutex_unlock(&fs_lock);
+}
+
+static void _op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) fi;
+    struct stat st;
+    pthread_mutex_lock(&fs_lock);
+    const char *path = _ino_path(ino);
+    int err = path == NULL ? ENOENT : _stat(path, &st);
+    pthread_mutex_unlock(&fs_lock);
+    if (err != 0)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_attr(req, &st, FUSE_TIMEOUT);
+}
+
+// Only growing a file is supported (ftruncate up, as fio's layout step does),
+//  there is no way to shrink one; other attributes are fixed and ignored
+static void _op_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct stat st;
+    pthread_mutex_lock(&fs_lock);
+    const char *path = _ino_path(ino);
+    int err = path == NULL ? ENOENT : _stat(path, &st);
+    if (err == 0 && (to_set & FUSE_SET_ATTR_SIZE) && attr->st_size != st.st_size) {
+        if (!S_ISREG(st.st_mode))
+            err = EISDIR;
+        else if (attr->st_size < st.st_size)
+            err = EOPNOTSUPP;
+        else {
+            int fd = fi != NULL ? (int) fi->fh : fs_open(fs, path);
+            err = fd < 0 ? EIO : _extend(fd, attr->st_size);
+            if (fi == NULL && fd >= 0)
+                fs_close(fs, fd);
+            if (err == 0)
+                err = _stat(path, &st);
+        }
+    }
+    pthread_mutex_unlock(&fs_lock);
+    if (err != 0)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_attr(req, &st, FUSE_TIMEOUT);
+}
+
+/**
+ * Create a file or directory and reply with its entry, or with it opened
+ * \param req The request
+ * \param parent The directory to create it in
+ * \param name Its name
+ * \param type Regular file or directory
+ * \param fi Where to open a new regular file, NULL to only reply the entry
+ */
+static void _create(fuse_req_t req, fuse_ino_t parent, const char *name, file_t type, struct fuse_file_info *fi) {
+    char path[PATH_MAX];
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    pthread_mutex_lock(&fs_lock);
+    const char *dir = _ino_path(parent);
+    int err = dir == NULL ? ENOENT : _join(dir, name, path);
+    if (err == 0 && fs_create(fs, path, type) < 0)
+        err = _stat(path, &e.attr) == 0 ? EEXIST : ENOSPC;
+    if (err == 0)
+        err = _stat(path, &e.attr);
+    if (err == 0 && fi != NULL) {
+        int fd = fs_open(fs, path);
+        if (fd < 0)
+            err = EMFILE;
+        fi->fh = fd;
+    }
+    pthread_mutex_unlock(&fs_lock);
+
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    e.ino = e.attr.st_ino;
+    e.attr_timeout = FUSE_TIMEOUT;
+    e.entry_timeout = FUSE_TIMEOUT;
+    if (fi != NULL)
+        fuse_reply_create(req, &e, fi);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void _op_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    (void) mode;
+    _create(req, parent, name, FS_DIRECTORY, NULL);
+}
+
+static void _op_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    (void) mode;
+    _create(req, parent, name, FS_REGULAR, fi);
+}
+
+static void _op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    pthread_mutex_lock(&fs_lock);
+    const char *path = _ino_path(ino);
+    int fd = path == NULL ? -1 : fs_open(fs, path);
+    int err = 0;
+    if (fd >= 0 && (fi->flags & O_TRUNC) && fs_seek(fs, fd, 0, FS_SEEK_END) != 0) {
+        err = EOPNOTSUPP; // No way to shrink a file
+        fs_close(fs, fd);
+    }
+    pthread_mutex_unlock(&fs_lock);
+
+    if (fd < 0)
+        fuse_reply_err(req, path == NULL ? ENOENT : EMFILE);
+    else if (err != 0)
+        fuse_reply_err(req, err);
+    else {
+        fi->fh = fd;
+        fi->keep_cache = 1;
+        fuse_reply_open(req, fi);
+    }
+}
+
+static void _op_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void) ino;
+    pthread_mutex_lock(&fs_lock);
+    fs_close(fs, (int) fi->fh);
+    pthread_mutex_unlock(&fs_lock);
+    fuse_reply_err(req, 0);
+}
+
+// Replies straight from a view of the file, which for contiguous ranges is
+//  the volume's own mapping, so the data is only copied into the kernel
+static void _op_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    (void) ino;
+    const void *view;
+    pthread_mutex_lock(&fs_lock);
+    ssize_t n = fs_mmap(fs, (int) fi->fh, off, size, &view);
+    if (n < 0)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_buf(req, view, n);
+    fs_munmap(fs, view, n < 0 ? 0 : n);
+    pthread_mutex_unlock(&fs_lock);
+}
+
+static void _op_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    (void) ino;
+    int fd = (int) fi->fh;
+    int err = 0;
+    ssize_t n_written = 0;
+    pthread_mutex_lock(&fs_lock);
+    if (fs_seek(fs, fd, off, FS_SEEK_SET) != off)
+        err = _extend(fd, off); // Writes past EOF leave zeros behind
+    if (err == 0 && (n_written = fs_write(fs, fd, buf, size)) < 0)
+        err = EIO;
+    pthread_mutex_unlock(&fs_lock);
+
+    if (err != 0)
+        fuse_reply_err(req, err);
+    else if (n_written == 0 && size > 0)
+        fuse_reply_err(req, ENOSPC);
+    else
+        fuse_reply_write(req, n_written);
+}
+
+// Directory offsets are entry indices, "." and ".." come first
+static void _op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    (void) fi;
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&fs_lock);
+    const char *dir_path = _ino_path(ino);
+    fs_dir_t dir;
+    if (dir_path == NULL || fs_opendir(fs, dir_path, &dir) < 0) {
+        pthread_mutex_unlock(&fs_lock);
+        free(buf);
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    size_t used = 0;
+    off_t index = 0;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    file_record_t record;
+    int ret = 1;
+    for (const char *dots[2] = { ".", ".." }; index < 2; index++) {
+        if (index < off)
+            continue;
+        st.st_ino = ino;
+        st.st_mode = S_IFDIR;
+        size_t n = fuse_add_direntry(req, buf + used, size - used, dots[index], &st, index + 1);
+        if (n > size - used)
+            goto full;
+        used += n;
+    }
+    for (; (ret = fs_readdir(&dir, &record)) == 1; index++) {
+        if (index < off)
+            continue;
+        char path[PATH_MAX];
+        if (_join(dir_path, record.name, path) != 0)
+            continue;
+        st.st_ino = _ino_get(path);
+        st.st_mode = record.type == FS_DIRECTORY ? S_IFDIR : S_IFREG;
+        size_t n = fuse_add_direntry(req, buf + used, size - used, record.name, &st, index + 1);
+        if (n > size - used)
+            break;
+        used += n;
+    }
+full:
+    fs_closedir(&dir);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (ret < 0)
+        fuse_reply_err(req, EIO);
+    else
+        fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void _op_statfs(fuse_req_t req, fuse_ino_t ino) {
+    (void) ino;
+    fs_statvfs_t fs_st;
+    pthread_mutex_lock(&fs_lock);
+    int ret = fs_statvfs(fs, &fs_st);
+    pthread_mutex_unlock(&fs_lock);
+    if (ret < 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    struct statvfs st;
+    memset(&st, 0, sizeof(st));
+    st.f_bsize = BLOCK_SIZE_BYTES;
+    st.f_frsize = BLOCK_SIZE_BYTES;
+    st.f_blocks = fs_st.blocks;
+    st.f_bfree = fs_st.free_blocks;
+    st.f_bavail = fs_st.free_blocks;
+    st.f_files = fs_st.inodes;
+    st.f_ffree = fs_st.free_inodes;
+    st.f_favail = fs_st.free_inodes;
+    st.f_namemax = FS_FNAME_MAX - 1;
+    fuse_reply_statfs(req, &st);
+}
+
+static const struct fuse_lowlevel_ops ops = {
+    .init    = _op_init,
+    .lookup  = _op_lookup,
+    .getattr = _op_getattr,
+    .setattr = _op_setattr,
+    .mkdir   = _op_mkdir,
+    .create  = _op_create,
+    .open    = _op_open,
+    .release = _op_release,
+    .read    = _op_read,
+    .write   = _op_write,
+    .readdir = _op_readdir,
+    .statfs  = _op_statfs,
+};
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf(USAGE);
+        return EXIT_FAILURE;
+    }
+
+    // The image is ours, everything after it goes to FUSE
+    const char *image = argv[1];
+    argv[1] = argv[0];
+    struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv + 1);
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) != 0 || opts.mountpoint == NULL) {
+        printf(USAGE);
+        return EXIT_FAILURE;
+    }
+
+    inos.cap_paths = 64;
+    inos.n_slots = 128;
+    inos.paths = malloc(inos.cap_paths * sizeof(char *));
+    inos.slots = calloc(inos.n_slots, sizeof(size_t));
+    fs = fs_mount(image);
+    if (inos.paths == NULL || inos.slots == NULL || fs == NULL || _ino_get("/") != FUSE_ROOT_ID) {
+        printf("Error: could not mount %s\n", image);
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_FAILURE;
+    struct fuse_session *se = fuse_session_new(&args, &ops, sizeof(ops), NULL);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, opts.mountpoint) == 0) {
+                fuse_daemonize(opts.foreground);
+                if (opts.singlethread) {
+                    ret = fuse_session_loop(se);
+                } else {
+                    struct fuse_loop_config config = {
+                        .clone_fd = opts.clone_fd,
+                        .max_idle_threads = opts.max_idle_threads,
+                    };
+                    ret = fuse_session_loop_mt(se, &config);
+                }
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+
+    fs_unmount(fs);
+    for (size_t i = 0; i < inos.n_paths; i++)
+        free(inos.paths[i]);
+    free(inos.paths);
+    free(inos.slots);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
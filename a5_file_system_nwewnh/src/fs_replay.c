@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "FS.h"
+#include "fs_trace.h"
+
+#define USAGE "%s <trace> <scratch image> [--timed]\n", argv[0]
+
+#define MIN(a, b) ((a) <= (b) ? (a) : (b))
+#define MAX(a, b) ((a) >= (b) ? (a) : (b))
+
+static const char *const OP_NAMES[FS_TRACE_N_OPS] = {
+    [FS_TRACE_CREATE] = "create",
+    [FS_TRACE_OPEN] = "open",
+    [FS_TRACE_CLOSE] = "close",
+    [FS_TRACE_SEEK] = "seek",
+    [FS_TRACE_READ] = "read",
+    [FS_TRACE_WRITE] = "write",
+    [FS_TRACE_FLUSH] = "flush",
+    [FS_TRACE_STAT] = "stat",
+    [FS_TRACE_GET_DIR] = "get_dir",
+    [FS_TRACE_COPY_RANGE] = "copy_range",
+};
+
+// Latencies of one kind of call, replayed and as traced
+typedef struct {
+    uint32_t *replayed, *traced;
+    size_t n, cap;
+    size_t n_failed;
+} op_stats_t;
+
+typedef struct {
+    FS_t *fs;
+    // Per traced descriptor: the replay's descriptor, -1 if it isn't open
+    int *fds;
+    size_t n_fds;
+    uint8_t *buf;
+    size_t buf_size;
+    op_stats_t ops[FS_TRACE_N_OPS];
+    size_t n_skipped, n_prepared;
+    uint64_t bytes_read, bytes_written;
+} replay_t;
+
+/**
+ * Record a replayed call's latency
+ * \return Whether there was memory for it
+ */
+static bool _record(op_stats_t *op, uint32_t replayed, uint32_t traced, bool failed) {
+    if (op->n == op->cap) {
+        size_t cap = op->cap ? 2 * op->cap : 1024;
+        uint32_t *r = realloc(op->replayed, cap * sizeof(uint32_t));
+        if (r != NULL)
+            op->replayed = r;
+        uint32_t *t = realloc(op->traced, cap * sizeof(uint32_t));
+        if (t != NULL)
+            op->traced = t;
+        if (r == NULL || t == NULL)
+            return false;
+        op->cap = cap;
+    }
+    op->replayed[op->n] = replayed;
+    op->traced[op->n] = traced;
+    op->n++;
+    op->n_failed += failed;
+    return true;
+}
+
+/**
+ * Look up the replay's descriptor for a traced one
+ * \return The descriptor, -1 if the traced one isn't open in the replay
+ */
+static int _fd(replay_t *rp, int32_t traced) {
+    return traced >= 0 && (size_t)traced < rp->n_fds ? rp->fds[traced] : -1;
+}
+
+/**
+ * Map a traced descriptor to the replay's
+ * \return Whether there was memory for it
+ */
+static bool _map_fd(replay_t *rp, int32_t traced, int fd) {
+    if (traced < 0)
+        return true;
+    if ((size_t)traced >= rp->n_fds) {
+        size_t n = MAX((size_t)traced + 1, 2 * rp->n_fds);
+        int *fds = realloc(rp->fds, n * sizeof(int));
+        if (fds == NULL)
+            return false;
+        for (size_t i = rp->n_fds; i < n; i++)
+            fds[i] = -1;
+        rp->fds = fds;
+        rp->n_fds = n;
+    }
+    rp->fds[traced] = fd;
+    return true;
+}
+
+/**
+ * Create the directories above a path that don't exist yet
+ *   Files the trace uses without creating existed before it started, so the
+ *   replay makes empty stand-ins
+ */
+static void _prepare_parents(replay_t *rp, const char *path) {
+    char dir[FS_TRACE_PATH_MAX + 1];
+    strcpy(dir, path);
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (fs_create(rp->fs, dir, FS_DIRECTORY) == 0)
+            rp->n_prepared++;
+        *slash = '/';
+    }
+}
+
+/**
+ * Replay one call
+ * \return Whether the replay can go on
+ */
+static bool _replay(replay_t *rp, const fs_trace_rec_t *rec, const char *path) {
+    if ((rec->op == FS_TRACE_READ || rec->op == FS_TRACE_WRITE) && rec->size > rp->buf_size) {
+        uint8_t *buf = realloc(rp->buf, rec->size);
+        if (buf == NULL)
+            return false;
+        memset(buf + rp->buf_size, 0xA5, rec->size - rp->buf_size);
+        rp->buf = buf;
+        rp->buf_size = rec->size;
+    }
+
+    // Calls that succeeded when traced must find their files
+    bool traced_ok = rec->ret >= 0;
+    if (traced_ok && (rec->op == FS_TRACE_CREATE || rec->op == FS_TRACE_OPEN || rec->op == FS_TRACE_STAT))
+        _prepare_parents(rp, path);
+    if (traced_ok && rec->op == FS_TRACE_OPEN && fs_create(rp->fs, path, FS_REGULAR) == 0)
+        rp->n_prepared++;
+
+    int fd = _fd(rp, rec->fd), fd_out = _fd(rp, rec->fd_out);
+    bool needs_fd = rec->op == FS_TRACE_CLOSE || rec->op == FS_TRACE_SEEK || rec->op == FS_TRACE_READ
+        || rec->op == FS_TRACE_WRITE || rec->op == FS_TRACE_FLUSH || rec->op == FS_TRACE_COPY_RANGE;
+    if ((needs_fd && fd < 0) || (rec->op == FS_TRACE_COPY_RANGE && fd_out < 0)) {
+        rp->n_skipped++; // Opened before the trace started, or the open failed
+        return true;
+    }
+
+    fs_stat_t st;
+    dyn_array_t *entries;
+    int64_t ret = -1;
+    uint64_t start = fs_trace_clock();
+    switch (rec->op) {
+        case FS_TRACE_CREATE:  ret = fs_create(rp->fs, path, rec->arg); break;
+        case FS_TRACE_OPEN:    ret = fs_open_flags(rp->fs, path, rec->arg); break;
+        case FS_TRACE_CLOSE:   ret = fs_close(rp->fs, fd); break;
+        case FS_TRACE_SEEK:    ret = fs_seek(rp->fs, fd, rec->offset, rec->arg); break;
+        case FS_TRACE_READ:    ret = fs_read(rp->fs, fd, rp->buf, rec->size); break;
+        case FS_TRACE_WRITE:   ret = fs_write(rp->fs, fd, rp->buf, rec->size); break;
+        case FS_TRACE_FLUSH:   ret = fs_flush(rp->fs, fd); break;
+        case FS_TRACE_STAT:    ret = fs_stat(rp->fs, path, &st); break;
+        case FS_TRACE_GET_DIR:
+            entries = fs_get_dir(rp->fs, path);
+            ret = entries == NULL ? -1 : 0;
+            dyn_array_destroy(entries);
+            break;
+        case FS_TRACE_COPY_RANGE:
+            ret = fs_copy_file_range(rp->fs, fd, rec->offset, fd_out, rec->offset_out, rec->size);
+            break;
+    }
+    uint64_t latency = fs_trace_clock() - start;
+
+    if (rec->op == FS_TRACE_OPEN && rec->ret < 0 && ret >= 0)
+        fs_close(rp->fs, ret); // Later calls won't name it, it failed when traced
+    if (rec->op == FS_TRACE_OPEN && !_map_fd(rp, rec->ret, ret))
+        return false;
+    if (rec->op == FS_TRACE_CLOSE)
+        _map_fd(rp, rec->fd, -1);
+    if (rec->op == FS_TRACE_READ && ret > 0)
+        rp->bytes_read += ret;
+    if ((rec->op == FS_TRACE_WRITE || rec->op == FS_TRACE_COPY_RANGE) && ret > 0)
+        rp->bytes_written += ret;
+
+    return _record(&rp->ops[rec->op], MIN(latency, UINT32_MAX), rec->latency_ns, ret < 0);
+}
+
+static int _cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Get a percentile of sorted latencies in microseconds
+ */
+static double _pct(const uint32_t *sorted, size_t n, double p) {
+    return n == 0 ? 0 : sorted[MIN((size_t)(p * n), n - 1)] / 1e3;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || (argc > 3 && strcmp(argv[3], "--timed") != 0)) {
+        printf(USAGE);
+        return EXIT_FAILURE;
+    }
+    bool timed = argc > 3;
+
+    fs_trace_t *trace = fs_trace_load(argv[1]);
+    if (trace == NULL) {
+        printf("Error: could not read trace %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    replay_t rp = {.fs = fs_format(argv[2])};
+    if (rp.fs == NULL) {
+        printf("Error: could not format %s\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    fs_trace_rec_t rec;
+    char path[FS_TRACE_PATH_MAX + 1];
+    int got;
+    uint64_t begin = fs_trace_clock();
+    while ((got = fs_trace_next(trace, &rec, path)) > 0) {
+        // At recorded timing calls wait for their moment, running late ones
+        //   right away
+        if (timed) {
+            uint64_t due = begin + rec.start_ns, now = fs_trace_clock();
+            if (due > now) {
+                struct timespec ts = {(due - now) / 1000000000u, (due - now) % 1000000000u};
+                nanosleep(&ts, NULL);
+            }
+        }
+        if (!_replay(&rp, &rec, path)) {
+            printf("Error: out of memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+    double secs = (fs_trace_clock() - begin) / 1e9;
+    if (got < 0)
+        printf("Warning: trace is corrupt, replayed the calls before it\n");
+
+    size_t n_calls = 0;
+    for (int op = 1; op < FS_TRACE_N_OPS; op++)
+        n_calls += rp.ops[op].n;
+    printf("%zu calls in %.3f s (%s): %.0f calls/s, read %.1f MiB/s, write %.1f MiB/s\n",
+        n_calls, secs, timed ? "recorded timing" : "as fast as possible", n_calls / secs,
+        rp.bytes_read / secs / (1 << 20), rp.bytes_written / secs / (1 << 20));
+    printf("%zu calls skipped on descriptors opened before the trace, %zu files stood in for ones it didn't create\n",
+        rp.n_skipped, rp.n_prepared);
+    printf("\n%-10s %9s %7s   %9s %9s %9s %9s   %9s %9s  (us)\n",
+        "call", "count", "failed", "p50", "p90", "p99", "max", "traced50", "traced99");
+    for (int op = 1; op < FS_TRACE_N_OPS; op++) {
+        op_stats_t *s = &rp.ops[op];
+        if (s->n == 0)
+            continue;
+        qsort(s->replayed, s->n, sizeof(uint32_t), _cmp_u32);
+        qsort(s->traced, s->n, sizeof(uint32_t), _cmp_u32);
+        printf("%-10s %9zu %7zu   %9.1f %9.1f %9.1f %9.1f   %9.1f %9.1f\n",
+            OP_NAMES[op], s->n, s->n_failed,
+            _pct(s->replayed, s->n, 0.5), _pct(s->replayed, s->n, 0.9), _pct(s->replayed, s->n, 0.99),
+            s->replayed[s->n - 1] / 1e3, _pct(s->traced, s->n, 0.5), _pct(s->traced, s->n, 0.99));
+        free(s->replayed);
+        free(s->traced);
+    }
+
+    free(rp.fds);
+    free(rp.buf);
+    fs_trace_close(trace);
+    fs_unmount(rp.fs);
+    remove(argv[2]);
+    return EXIT_SUCCESS;
+}
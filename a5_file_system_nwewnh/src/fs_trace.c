@@ -0,0 +1,131 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs_trace.h"
+
+struct fs_trace {
+    FILE *file;
+    // Serializes appends, calls are traced from whichever thread makes them
+    pthread_mutex_t lock;
+    // fs_trace_clock at fs_trace_create
+    uint64_t start_ns;
+    bool writing;
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} fs_trace_header_t;
+
+
+
+uint64_t fs_trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+
+
+/**
+ * Open a trace file
+ * \param path The file
+ * \param writing Whether to create it rather than read it
+ * \return The trace, NULL on error
+ */
+static fs_trace_t *_trace_open(const char *path, bool writing) {
+    if (path == NULL)
+        return NULL;
+
+    fs_trace_t *trace = calloc(1, sizeof(fs_trace_t));
+    if (trace == NULL)
+        return NULL;
+    trace->file = fopen(path, writing ? "wb" : "rb");
+    if (trace->file == NULL) {
+        free(trace);
+        return NULL;
+    }
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->writing = writing;
+    trace->start_ns = fs_trace_clock();
+    return trace;
+}
+
+
+
+fs_trace_t *fs_trace_create(const char *path) {
+    fs_trace_t *trace = _trace_open(path, true);
+    if (trace == NULL)
+        return NULL;
+
+    fs_trace_header_t header = {FS_TRACE_MAGIC, FS_TRACE_VERSION};
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+        fs_trace_close(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+
+
+fs_trace_t *fs_trace_load(const char *path) {
+    fs_trace_t *trace = _trace_open(path, false);
+    if (trace == NULL)
+        return NULL;
+
+    fs_trace_header_t header;
+    if (fread(&header, sizeof(header), 1, trace->file) != 1
+            || header.magic != FS_TRACE_MAGIC || header.version != FS_TRACE_VERSION) {
+        fs_trace_close(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+
+
+bool fs_trace_append(fs_trace_t *trace, const fs_trace_rec_t *rec, const char *path) {
+    if (trace == NULL || !trace->writing || rec == NULL)
+        return false;
+
+    fs_trace_rec_t out = *rec;
+    out.start_ns = rec->start_ns > trace->start_ns ? rec->start_ns - trace->start_ns : 0;
+    out.path_len = path == NULL ? 0 : strnlen(path, FS_TRACE_PATH_MAX);
+
+    pthread_mutex_lock(&trace->lock);
+    bool ok = fwrite(&out, sizeof(out), 1, trace->file) == 1
+        && fwrite(path, 1, out.path_len, trace->file) == out.path_len;
+    pthread_mutex_unlock(&trace->lock);
+    return ok;
+}
+
+
+
+int fs_trace_next(fs_trace_t *trace, fs_trace_rec_t *rec, char *path) {
+    if (trace == NULL || trace->writing || rec == NULL || path == NULL)
+        return -1;
+
+    if (fread(rec, sizeof(fs_trace_rec_t), 1, trace->file) != 1)
+        return feof(trace->file) ? 0 : -1;
+    if (rec->path_len > FS_TRACE_PATH_MAX || rec->op == 0 || rec->op >= FS_TRACE_N_OPS)
+        return -1; // Corrupt
+    if (fread(path, 1, rec->path_len, trace->file) != rec->path_len)
+        return -1;
+    path[rec->path_len] = '\0';
+    return 1;
+}
+
+
+
+int fs_trace_close(fs_trace_t *trace) {
+    if (trace == NULL)
+        return -1;
+
+    int ret = fclose(trace->file) == 0 ? 0 : -1;
+    pthread_mutex_destroy(&trace->lock);
+    free(trace);
+    return ret;
+}
@@ -0,0 +1,194 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * Compressed data is a series of sequences:
+ *
+ *   token | [literal length bytes] | literals | offset (2B LE) | [match length bytes]
+ *
+ * The token's high nibble is the literal count and its low nibble is the match
+ * length minus LZ_MIN_MATCH. A nibble of 15 is continued by bytes that are
+ * added to it, up to and including the first byte that is not 255. The last
+ * sequence has literals only and ends the data.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 12
+
+static inline uint32_t _read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t _hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Write a nibble overflow as 255-continued length bytes
+ * \return The new output position, NULL if it does not fit
+ */
+static uint8_t *_put_len(uint8_t *op, const uint8_t *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * Emit one sequence
+ * \param match_len 0 for the final, literal only sequence
+ * \return The new output position, NULL if it does not fit
+ */
+static uint8_t *_put_sequence(
+    uint8_t *op,
+    const uint8_t *oend,
+    const uint8_t *lit,
+    size_t lit_len,
+    size_t offset,
+    size_t match_len
+) {
+    if (op >= oend)
+        return NULL;
+    uint8_t *token = op++;
+    size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15 && (op = _put_len(op, oend, lit_len - 15)) == NULL)
+        return NULL;
+
+    if ((size_t)(oend - op) < lit_len)
+        return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = (uint8_t)(offset & 0xFF);
+    *op++ = (uint8_t)(offset >> 8);
+
+    *token |= (uint8_t)(match_code < 15 ? match_code : 15);
+    if (match_code >= 15 && (op = _put_len(op, oend, match_code - 15)) == NULL)
+        return NULL;
+
+    return op;
+}
+
+size_t lz_compress(const void *const src, const size_t src_len, void *const dst, const size_t dst_cap) {
+    if (src == NULL || dst == NULL || src_len > UINT32_MAX)
+        return 0;
+
+    const uint8_t *in = src;
+    uint8_t *op = dst;
+    const uint8_t *oend = op + dst_cap;
+
+    // Last position + 1 of each hashed 4-byte sequence, 0 if none
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t anchor = 0, i = 0;
+    while (i + LZ_MIN_MATCH <= src_len) {
+        uint32_t seq = _read32(in + i);
+        uint32_t h = _hash(seq);
+        size_t cand = table[h];
+        table[h] = (uint32_t)(i + 1);
+
+        if (cand == 0 || i - (cand - 1) > LZ_MAX_OFFSET || _read32(in + cand - 1) != seq) {
+            i++;
+            continue;
+        }
+
+        size_t match = cand - 1;
+        size_t len = LZ_MIN_MATCH;
+        while (i + len < src_len && in[match + len] == in[i + len])
+            len++;
+
+        op = _put_sequence(op, oend, in + anchor, i - anchor, i - match, len);
+        if (op == NULL)
+            return 0;
+
+        i += len;
+        anchor = i;
+    }
+
+    op = _put_sequence(op, oend, in + anchor, src_len - anchor, 0, 0);
+    if (op == NULL)
+        return 0;
+
+    return op - (uint8_t*)dst;
+}
+
+/**
+ * Read a 255-continued length and add it to len
+ * \return Whether the length was read without running off the input
+ */
+static bool _get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+size_t lz_decompress(const void *const src, const size_t src_len, void *const dst, const size_t dst_cap) {
+    if (src == NULL || dst == NULL)
+        return SIZE_MAX;
+
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + src_len;
+    uint8_t *out = dst;
+    size_t o = 0;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !_get_len(&ip, iend, &lit_len))
+            return SIZE_MAX;
+        if ((size_t)(iend - ip) < lit_len || dst_cap - o < lit_len)
+            return SIZE_MAX;
+        memcpy(out + o, ip, lit_len);
+        ip += lit_len;
+        o += lit_len;
+
+        if (ip == iend)
+            break; // Final literal only sequence
+
+        if (iend - ip < 2)
+            return SIZE_MAX;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+
+        size_t match_len = token & 0x0F;
+        if (match_len == 15 && !_get_len(&ip, iend, &match_len))
+            return SIZE_MAX;
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > o || dst_cap - o < match_len)
+            return SIZE_MAX;
+
+        // Byte at a time since the match may overlap its own output
+        const uint8_t *m = out + o - offset;
+        for (size_t i = 0; i < match_len; i++)
+            out[o + i] = m[i];
+        o += match_len;
+    }
+
+    return o;
+}
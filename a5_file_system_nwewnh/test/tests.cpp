@@ -1,12 +1,21 @@
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <new>
+#include <set>
+#include <thread>
 #include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
 using std::vector;
 using std::string;
 #include <gtest/gtest.h>
 extern "C" {
 #include "FS.h"
+#include "fs_trace.h"
 }
 
 unsigned int score;
@@ -97,7 +106,7 @@ TEST(a_tests, format_mount_unmount) {
    17. Error, bad path, path part too long
    18. Error, bad path, desired filename too long
    19. Error, directory full.
-   20. Error, out of inodes.
+   20. Normal, the inode table grows past its first 256 inodes (see k_tests.inode_table).
    21. Error, out of data blocks & file is directory (requires functional write)
  */
 TEST(b_tests, file_creation_one) {
@@ -245,7 +254,6 @@ TEST(b_tests, file_creation_two) {
 	}
 	score += 5;
 
-	//puts("Inode table full?");
 	// CREATE_FILE 20
 	fname[0] = '/';
 	fname[1] = 'e';
@@ -253,7 +261,7 @@ TEST(b_tests, file_creation_two) {
 	fname[3] = 'c';
 	fname[4] = '/';
 	fname[5] = 'f';
-	ASSERT_LT(fs_create(fs, fname, FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, fname, FS_REGULAR), 0);
 	// save file for inspection
 	fs_unmount(fs);
 	// ... Can't really test 21 yet.
@@ -1088,6 +1096,2238 @@ TEST(j_tests, link) {
 	score += 20;
 }
  */
+/*
+   FS_t *fs_format_opts(const char *path, int opts) with FS_OPT_ASYNC_IO
+   1. Normal, unaligned write through direct, indirect and double indirect blocks
+   2. Normal, unaligned reads of the same range
+   3. Normal, data is visible after remounting without the engine
+ */
+TEST(k_tests, async_io) {
+	const char *test_fname = "k_tests.FS";
+	const size_t file_size = 700 * 1024 + 123;
+	FS *fs = fs_format_opts(test_fname, FS_OPT_ASYNC_IO);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+
+	vector<uint8_t> data(file_size), check(file_size);
+	for (size_t i = 0; i < file_size; ++i) {
+		data[i] = (uint8_t)(i * 7 + i / 1024);
+	}
+
+	// 1
+	int fd = fs_open(fs, "/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), 100), 100);
+	ASSERT_EQ(fs_write(fs, fd, data.data() + 100, file_size - 100), (ssize_t)(file_size - 100));
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+
+	// 2
+	size_t pos = 0;
+	while (pos < file_size) {
+		ssize_t n = fs_read(fs, fd, check.data() + pos, 3000);
+		ASSERT_GT(n, 0);
+		pos += n;
+	}
+	ASSERT_EQ(memcmp(data.data(), check.data(), file_size), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 3
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/big");
+	ASSERT_GE(fd, 0);
+	check.assign(file_size, 0);
+	ASSERT_EQ(fs_read(fs, fd, check.data(), file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(data.data(), check.data(), file_size), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
+/*
+   FS_t *fs_format_opts(const char *path, int opts) with FS_OPT_HUGEPAGES
+   1. Normal, format with huge pages (falls back silently if unavailable)
+   2. Normal, mount with huge pages and read back
+ */
+TEST(k_tests, huge_pages) {
+	const char *test_fname = "k_tests_huge.FS";
+	uint8_t data[3000], check[3000];
+	for (size_t i = 0; i < sizeof(data); ++i) {
+		data[i] = (uint8_t)(i * 13);
+	}
+
+	// 1
+	FS *fs = fs_format_opts(test_fname, FS_OPT_HUGEPAGES);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t)sizeof(data));
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 2
+	fs = fs_mount_opts(test_fname, FS_OPT_HUGEPAGES);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, sizeof(check)), (ssize_t)sizeof(check));
+	ASSERT_EQ(memcmp(data, check, sizeof(data)), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_unmount(fs);
+}
+
+/*
+   FS_t *fs_format(const char *path) leaves the data region sparse
+   1. Normal, a fresh format allocates only the metadata on disk
+   2. Normal, reformatting a used image gives an empty volume
+ */
+TEST(k_tests, sparse_format) {
+	const char *test_fname = "k_tests_sparse.FS";
+	struct stat st;
+
+	// 1
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(stat(test_fname, &st), 0);
+	ASSERT_GE(st.st_size, 65536 * 1024); // Plus the checksum table
+	ASSERT_LT(st.st_blocks * 512, 1024 * 1024);
+
+	// 2
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	dyn_array_t *record_results = fs_get_dir(fs, "/");
+	ASSERT_NE(record_results, nullptr);
+	ASSERT_EQ(dyn_array_size(record_results), 0);
+	dyn_array_destroy(record_results);
+	ASSERT_LT(fs_open(fs, "/file"), 0);
+	fs_unmount(fs);
+}
+
+/*
+   int fs_check(const char *path, bool repair);
+   1. Normal, a consistent volume has no problems
+   2. Normal, a freed in-use block and a leaked block are both found
+   3. Normal, repair fixes them
+   4. Normal, mounting with FS_OPT_CHECK repairs before mounting
+   5. Error, NULL/missing path
+ */
+TEST(k_tests, check) {
+	const char *test_fname = "k_tests_check.FS";
+	const size_t big_size = 600 * 1024;
+	vector<uint8_t> data(big_size, 0x5a);
+
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/big", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/small", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/dir/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), big_size), (ssize_t)big_size);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/small");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), 10), 10);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 1
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 2
+	block_store_t *bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	ASSERT_TRUE(block_store_test(bs, 17)); // Root directory entries
+	block_store_release(bs, 17);
+	ASSERT_TRUE(block_store_request(bs, 60000));
+	block_store_destroy(bs);
+	ASSERT_EQ(fs_check(test_fname, false), 2);
+
+	// 3
+	ASSERT_EQ(fs_check(test_fname, true), 2);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 4
+	bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	ASSERT_TRUE(block_store_request(bs, 60001));
+	block_store_destroy(bs);
+	fs = fs_mount_opts(test_fname, FS_OPT_CHECK);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/dir/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), (off_t)big_size);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 5
+	ASSERT_LT(fs_check(NULL, false), 0);
+	ASSERT_LT(fs_check("k_tests_missing.FS", false), 0);
+}
+
+/*
+   int fs_set_compressed(FS_t *fs, const char *path, bool compressed);
+   1. Normal, a compressible file larger than the volume fits
+   2. Normal, incompressible data and unaligned overwrites across clusters
+   3. Normal, data survives a remount and the volume checks clean
+   4. Error, directory/non-empty file/missing file/NULL
+ */
+TEST(k_tests, compression) {
+	const char *test_fname = "k_tests_lz.FS";
+	const size_t chunk = 1024 * 1024, big_size = 96 * chunk;
+	const size_t mixed_size = 5 * 16 * 1024 + 777;
+
+	vector<uint8_t> text(chunk);
+	for (size_t i = 0; i < chunk; ) {
+		char line[64];
+		int n = snprintf(line, sizeof(line), "log line %zu: nothing to report\n", i / 40);
+		for (int j = 0; j < n && i < chunk; ++j) {
+			text[i++] = line[j];
+		}
+	}
+	vector<uint8_t> mixed(mixed_size), check(mixed_size);
+	srand(4520);
+	for (size_t i = 0; i < mixed_size; ++i) {
+		mixed[i] = i < mixed_size / 2 ? (uint8_t)rand() : (uint8_t)(i / 100);
+	}
+
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/log", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/mixed", FS_REGULAR), 0);
+	ASSERT_EQ(fs_set_compressed(fs, "/log", true), 0);
+	ASSERT_EQ(fs_set_compressed(fs, "/mixed", true), 0);
+
+	// 1
+	int fd = fs_open(fs, "/log");
+	ASSERT_GE(fd, 0);
+	for (size_t i = 0; i < big_size; i += chunk) {
+		ASSERT_EQ(fs_write(fs, fd, text.data(), chunk), (ssize_t)chunk);
+	}
+	ASSERT_EQ(fs_seek(fs, fd, big_size - chunk / 2 - 5, FS_SEEK_SET), (off_t)(big_size - chunk / 2 - 5));
+	check.assign(chunk, 0);
+	ASSERT_EQ(fs_read(fs, fd, check.data(), chunk), (ssize_t)(chunk / 2 + 5));
+	ASSERT_EQ(memcmp(check.data(), text.data() + chunk / 2 - 5, chunk / 2 + 5), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 2
+	fd = fs_open(fs, "/mixed");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, mixed.data(), 5000), 5000);
+	ASSERT_EQ(fs_write(fs, fd, mixed.data() + 5000, mixed_size - 5000), (ssize_t)(mixed_size - 5000));
+	for (size_t i = 16 * 1024 - 50; i < 16 * 1024 + 50; ++i) {
+		mixed[i] = 'x';
+	}
+	ASSERT_EQ(fs_seek(fs, fd, 16 * 1024 - 50, FS_SEEK_SET), (off_t)(16 * 1024 - 50));
+	ASSERT_EQ(fs_write(fs, fd, mixed.data() + 16 * 1024 - 50, 100), 100);
+	ASSERT_EQ(fs_seek(fs, fd, 3, FS_SEEK_SET), 3);
+	check.assign(mixed_size, 0);
+	ASSERT_EQ(fs_read(fs, fd, check.data(), mixed_size), (ssize_t)(mixed_size - 3));
+	ASSERT_EQ(memcmp(check.data(), mixed.data() + 3, mixed_size - 3), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 3
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/mixed");
+	ASSERT_GE(fd, 0);
+	check.assign(mixed_size, 0);
+	ASSERT_EQ(fs_read(fs, fd, check.data(), mixed_size), (ssize_t)mixed_size);
+	ASSERT_EQ(memcmp(check.data(), mixed.data(), mixed_size), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 4
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_LT(fs_set_compressed(fs, "/dir", true), 0);
+	ASSERT_LT(fs_set_compressed(fs, "/mixed", false), 0);
+	ASSERT_LT(fs_set_compressed(fs, "/missing", true), 0);
+	ASSERT_LT(fs_set_compressed(NULL, "/log", true), 0);
+	ASSERT_LT(fs_set_compressed(fs, NULL, true), 0);
+	fs_unmount(fs);
+}
+
+/*
+   FS_t *fs_mount_opts(const char *path, int opts) with FS_OPT_VERIFY/FS_OPT_VERIFY_META
+   1. Normal, a clean volume verifies
+   2. Normal, a corrupt data block fails reads with FS_OPT_VERIFY only
+   3. Normal, a corrupt pointer block fails reads with FS_OPT_VERIFY_META
+   4. Normal, a corrupt inode table fails verifying mounts only
+   5. Normal, an image without checksums gets them on its first verifying mount
+   6. Normal, fs_format keeps checksums only with FS_OPT_CSUM (or a verify option)
+ */
+TEST(k_tests, checksums) {
+	const char *test_fname = "k_tests_csum.FS";
+	const size_t file_size = 10 * 1024;
+	uint8_t data[file_size], check[file_size];
+	for (size_t i = 0; i < file_size; ++i) {
+		data[i] = (uint8_t)(i * 3);
+	}
+
+	FS *fs = fs_format_opts(test_fname, FS_OPT_CSUM);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data, file_size), (ssize_t)file_size);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 1
+	fs = fs_mount_opts(test_fname, FS_OPT_VERIFY);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(data, check, file_size), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// Block 17 holds the root directory entries, the file's data starts at 18
+	// and its indirect block comes right after its seventh data block
+	block_store_t *bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	block_store_Data_location(bs)[18 * 1024 + 5] ^= 0xff;
+	block_store_Data_location(bs)[25 * 1024] ^= 0x01;
+	block_store_destroy(bs);
+
+	// 2
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, 100), 100);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount_opts(test_fname, FS_OPT_VERIFY);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_LT(fs_read(fs, fd, check, 100), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 3
+	fs = fs_mount_opts(test_fname, FS_OPT_VERIFY_META);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, 100), 100);
+	ASSERT_EQ(fs_seek(fs, fd, 7 * 1024, FS_SEEK_SET), 7 * 1024);
+	ASSERT_LT(fs_read(fs, fd, check, 100), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 4
+	bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	block_store_Data_location(bs)[1 * 1024 + 900] ^= 0x10;
+	block_store_destroy(bs);
+	ASSERT_EQ(fs_mount_opts(test_fname, FS_OPT_VERIFY), nullptr);
+	ASSERT_EQ(fs_mount_opts(test_fname, FS_OPT_VERIFY_META), nullptr);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 5
+	ASSERT_EQ(truncate(test_fname, 65536 * 1024), 0);
+	fs = fs_mount_opts(test_fname, FS_OPT_VERIFY);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, file_size), (ssize_t)file_size);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 6
+	const int format_opts[3] = {FS_OPT_NONE, FS_OPT_CSUM, FS_OPT_VERIFY_META};
+	for (int i = 0; i < 3; ++i) {
+		fs = fs_format_opts(test_fname, format_opts[i]);
+		ASSERT_NE(fs, nullptr);
+		ASSERT_EQ(fs_unmount(fs), 0);
+		bs = block_store_open(test_fname);
+		ASSERT_NE(bs, nullptr);
+		ASSERT_EQ(block_store_has_csums(bs), format_opts[i] != FS_OPT_NONE);
+		block_store_destroy(bs);
+	}
+	unlink(test_fname);
+}
+
+/*
+   FS_t *fs_format_opts(const char *path, int opts) with FS_OPT_DEDUP
+   1. Normal, identical files share their data blocks
+   2. Normal, zero blocks collapse into one
+   3. Normal, writing to a shared block copies it, the other file keeps its data
+   4. Normal, shared blocks are copied on write after a mount without dedup too
+   5. Normal, fs_check finds and repairs a wrong reference count
+   6. Normal, thousands of distinct blocks written in one mount (the content
+      index grows) are all found again by an identical file
+ */
+TEST(k_tests, dedup) {
+	const char *test_fname = "k_tests_dedup.FS";
+	const size_t file_size = 32 * 1024;
+	uint8_t data[file_size], zeros[file_size] = {0}, check[file_size];
+	for (size_t i = 0; i < file_size; ++i) {
+		data[i] = (uint8_t)(i + i / 1024 * 13);
+	}
+	const char patch[] = "changed";
+
+	FS *fs = fs_format_opts(test_fname, FS_OPT_DEDUP);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	block_store_t *bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	size_t used_empty = block_store_get_used_blocks(bs);
+	block_store_destroy(bs);
+
+	// 1
+	fs = fs_mount_opts(test_fname, FS_OPT_DEDUP);
+	ASSERT_NE(fs, nullptr);
+	const char *paths[2] = {"/a", "/b"};
+	size_t used[2];
+	for (int f = 0; f < 2; ++f) {
+		ASSERT_EQ(fs_create(fs, paths[f], FS_REGULAR), 0);
+		int fd = fs_open(fs, paths[f]);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_write(fs, fd, data, file_size), (ssize_t)file_size);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+		ASSERT_EQ(fs_unmount(fs), 0);
+		bs = block_store_open(test_fname);
+		ASSERT_NE(bs, nullptr);
+		used[f] = block_store_get_used_blocks(bs);
+		block_store_destroy(bs);
+		fs = fs_mount_opts(test_fname, FS_OPT_DEDUP);
+		ASSERT_NE(fs, nullptr);
+	}
+	ASSERT_GE(used[0], used_empty + 32);
+	ASSERT_LE(used[1], used[0] + 1); // Just its indirect block
+
+	// 2
+	ASSERT_EQ(fs_create(fs, "/zeros", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/zeros");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, zeros, file_size), (ssize_t)file_size);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	ASSERT_LE(block_store_get_used_blocks(bs), used[1] + 2);
+	block_store_destroy(bs);
+
+	// 3
+	fs = fs_mount_opts(test_fname, FS_OPT_DEDUP);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/b");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_seek(fs, fd, 10 * 1024 + 100, FS_SEEK_SET), 10 * 1024 + 100);
+	ASSERT_EQ(fs_write(fs, fd, patch, sizeof(patch)), (ssize_t)sizeof(patch));
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+	ASSERT_EQ(fs_read(fs, fd, check, file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(check + 10 * 1024 + 100, patch, sizeof(patch)), 0);
+	memcpy(check + 10 * 1024 + 100, data + 10 * 1024 + 100, sizeof(patch));
+	ASSERT_EQ(memcmp(check, data, file_size), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/a");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(check, data, file_size), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 4
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/a");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_seek(fs, fd, 20 * 1024, FS_SEEK_SET), 20 * 1024);
+	ASSERT_EQ(fs_write(fs, fd, patch, sizeof(patch)), (ssize_t)sizeof(patch));
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/b");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_seek(fs, fd, 20 * 1024, FS_SEEK_SET), 20 * 1024);
+	ASSERT_EQ(fs_read(fs, fd, check, 1024), 1024);
+	ASSERT_EQ(memcmp(check, data + 20 * 1024, 1024), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 5
+	bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	size_t shared = 0;
+	while (shared < 65536 && block_store_refs(bs, shared) == 0) {
+		++shared;
+	}
+	ASSERT_LT(shared, (size_t)65536);
+	ASSERT_TRUE(block_store_set_refs(bs, shared, 0));
+	block_store_destroy(bs);
+	ASSERT_EQ(fs_check(test_fname, false), 1);
+	ASSERT_EQ(fs_check(test_fname, true), 1);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 6
+	const size_t big_size = 3000 * 1024;
+	vector<uint8_t> big(big_size);
+	for (size_t i = 0; i < big_size; i += sizeof(uint32_t)) {
+		uint32_t word = (uint32_t)(i * 2654435761u);
+		memcpy(&big[i], &word, sizeof(word));
+	}
+	fs = fs_mount_opts(test_fname, FS_OPT_DEDUP);
+	ASSERT_NE(fs, nullptr);
+	fs_statvfs_t before, after;
+	const char *big_paths[2] = {"/big_a", "/big_b"};
+	for (int f = 0; f < 2; ++f) {
+		ASSERT_EQ(fs_statvfs(fs, &before), 0);
+		ASSERT_EQ(fs_create(fs, big_paths[f], FS_REGULAR), 0);
+		fd = fs_open(fs, big_paths[f]);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_write(fs, fd, big.data(), big_size), (ssize_t)big_size);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+		ASSERT_EQ(fs_statvfs(fs, &after), 0);
+	}
+	ASSERT_LE(before.free_blocks - after.free_blocks, 10u); // Just its pointer blocks
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+}
+
+/*
+   int fs_opendir(FS_t *fs, const char *path, fs_dir_t *dir) and friends
+   1. Normal, root lists its files and their types, then hits the end
+   2. Normal, empty dir
+   3. Normal, fs_dir_for_each visits every file and stops early when asked
+   4. Error, bad path, not a directory, NULL arguments
+ */
+static int count_records(const file_record_t *record, void *arg) {
+	(void)record;
+	return ++*(int *)arg >= 100 ? 1 : 0;
+}
+
+static int stop_at_folder(const file_record_t *record, void *arg) {
+	(void)arg;
+	return strcmp(record->name, "folder") == 0 ? 7 : 0;
+}
+
+TEST(k_tests, dir_stream) {
+	const char *test_fname = "k_tests_dir.FS";
+	ASSERT_EQ(system("cp c_tests.FS k_tests_dir.FS"), 0);
+	FS *fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+
+	// 1
+	fs_dir_t dir;
+	file_record_t record;
+	ASSERT_EQ(fs_opendir(fs, "/", &dir), 0);
+	bool seen_file = false, seen_folder = false;
+	int n = 0, ret;
+	while ((ret = fs_readdir(&dir, &record)) > 0) {
+		++n;
+		if (strcmp(record.name, "file") == 0) {
+			ASSERT_EQ(record.type, FS_REGULAR);
+			seen_file = true;
+		} else if (strcmp(record.name, "folder") == 0) {
+			ASSERT_EQ(record.type, FS_DIRECTORY);
+			seen_folder = true;
+		}
+	}
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(n, 2);
+	ASSERT_TRUE(seen_file && seen_folder);
+	ASSERT_EQ(fs_readdir(&dir, &record), 0);
+	ASSERT_EQ(fs_closedir(&dir), 0);
+	ASSERT_LT(fs_readdir(&dir, &record), 0);
+
+	// 2
+	ASSERT_EQ(fs_opendir(fs, "/folder/with_folder", &dir), 0);
+	ASSERT_EQ(fs_readdir(&dir, &record), 0);
+	ASSERT_EQ(fs_closedir(&dir), 0);
+
+	// 3
+	n = 0;
+	ASSERT_EQ(fs_dir_for_each(fs, "/folder", count_records, &n), 0);
+	ASSERT_EQ(n, 2);
+	ASSERT_EQ(fs_dir_for_each(fs, "/", stop_at_folder, NULL), 7);
+
+	// 4
+	ASSERT_LT(fs_opendir(fs, "/DOESNOTEXIST", &dir), 0);
+	ASSERT_LT(fs_opendir(fs, "/file", &dir), 0);
+	ASSERT_LT(fs_opendir(fs, "folder", &dir), 0);
+	ASSERT_LT(fs_opendir(NULL, "/", &dir), 0);
+	ASSERT_LT(fs_opendir(fs, NULL, &dir), 0);
+	ASSERT_LT(fs_opendir(fs, "/", NULL), 0);
+	ASSERT_LT(fs_dir_for_each(fs, "/file", count_records, &n), 0);
+	ASSERT_LT(fs_dir_for_each(fs, "/", NULL, NULL), 0);
+	ASSERT_LT(fs_closedir(NULL), 0);
+	fs_unmount(fs);
+}
+
+/*
+   Dynamic inode table
+   1. Normal, the table grows block by block until NUM_INODES inodes are in use
+   2. Error, out of inodes
+   3. Normal, files in grown inode blocks survive a remount and the volume checks clean
+ */
+TEST(k_tests, inode_table) {
+	const char *test_fname = "k_tests_inodes.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+
+	// 1, three levels of directories of 15 (full) hold far more files than
+	// there are inodes, so stop at the first failure
+	char path[32], last[32] = "";
+	size_t created = 0;
+	auto make = [&](file_t type) {
+		if (fs_create(fs, path, type) < 0) {
+			return false;
+		}
+		++created;
+		if (type == FS_REGULAR) {
+			strcpy(last, path);
+		}
+		return true;
+	};
+	bool full = false;
+	for (int a = 0; a < 15 && !full; ++a) {
+		snprintf(path, sizeof(path), "/d%d", a);
+		full = !make(FS_DIRECTORY);
+		for (int b = 0; b < 15 && !full; ++b) {
+			snprintf(path, sizeof(path), "/d%d/d%d", a, b);
+			full = !make(FS_DIRECTORY);
+			for (int c = 0; c < 15 && !full; ++c) {
+				snprintf(path, sizeof(path), "/d%d/d%d/d%d", a, b, c);
+				full = !make(FS_DIRECTORY);
+				for (int d = 0; d < 15 && !full; ++d) {
+					snprintf(path, sizeof(path), "/d%d/d%d/d%d/f%d", a, b, c, d);
+					full = !make(FS_REGULAR);
+				}
+			}
+		}
+	}
+	ASSERT_EQ(created, (size_t)NUM_INODES - 1); // Plus the root
+
+	// 2, path is the one that failed, its parent has room
+	ASSERT_LT(fs_create(fs, path, FS_REGULAR), 0);
+
+	// 3
+	int fd = fs_open(fs, last);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, "hello", 5), 5);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+	fs = fs_mount_opts(test_fname, FS_OPT_VERIFY);
+	ASSERT_NE(fs, nullptr);
+	char check[5];
+	fd = fs_open(fs, last);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, 5), 5);
+	ASSERT_EQ(memcmp(check, "hello", 5), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   int fs_set_max_open_files(FS_t *fs, size_t max);
+   1. Normal, thousands of descriptors on one file keep their own cursors
+   2. Normal, closed descriptors are reused
+   3. Error, past the limit, below the grown table, NULL fs
+ */
+TEST(k_tests, fd_table) {
+	const char *test_fname = "k_tests_fds.FS";
+	const int n_fds = 5000;
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/file");
+	ASSERT_GE(fd, 0);
+	uint8_t data[100];
+	for (int i = 0; i < 100; ++i) {
+		data[i] = (uint8_t)i;
+	}
+	ASSERT_EQ(fs_write(fs, fd, data, 100), 100);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 1
+	ASSERT_EQ(fs_set_max_open_files(fs, n_fds), 0);
+	vector<int> fds(n_fds);
+	for (int i = 0; i < n_fds; ++i) {
+		fds[i] = fs_open(fs, "/file");
+		ASSERT_GE(fds[i], 0);
+		ASSERT_EQ(fs_seek(fs, fds[i], i % 100, FS_SEEK_SET), i % 100);
+	}
+	for (int i = 0; i < n_fds; i += 7) {
+		uint8_t byte;
+		ASSERT_EQ(fs_read(fs, fds[i], &byte, 1), 1);
+		ASSERT_EQ(byte, i % 100);
+	}
+
+	// 3
+	ASSERT_LT(fs_open(fs, "/file"), 0);
+	ASSERT_LT(fs_set_max_open_files(fs, 100), 0);
+	ASSERT_LT(fs_set_max_open_files(NULL, 100), 0);
+
+	// 2
+	ASSERT_EQ(fs_close(fs, fds[1234]), 0);
+	ASSERT_LT(fs_close(fs, fds[1234]), 0);
+	ASSERT_LT(fs_seek(fs, fds[1234], 0, FS_SEEK_SET), 0);
+	ASSERT_EQ(fs_open(fs, "/file"), fds[1234]);
+	for (int i = 0; i < n_fds; ++i) {
+		ASSERT_EQ(fs_close(fs, fds[i]), 0);
+	}
+	ASSERT_LT(fs_close(fs, n_fds), 0);
+	fs_unmount(fs);
+}
+
+/*
+   ssize_t fs_copy_file_range(FS_t *fs, int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len);
+   1. Normal, unaligned ranges, past the destination's end, cursors untouched
+   2. Normal, aligned ranges on a dedup volume share blocks copy on write
+   3. Normal, compressed source, clipped at the source's end
+   4. Error, overlapping ranges in one file, offset past the destination's end,
+      bad descriptors, NULL fs
+   5. Normal, copies made while another thread opens enough descriptors to
+      grow the table land whole, plain and compressed sources alike
+ */
+TEST(k_tests, copy_range) {
+	const char *test_fname = "k_tests_copy.FS";
+	const size_t file_size = 100 * 1024;
+	vector<uint8_t> data(file_size), check(file_size);
+	for (size_t i = 0; i < file_size; ++i) {
+		data[i] = (uint8_t)(i * 7 + i / 1024);
+	}
+	FS *fs = fs_format_opts(test_fname, FS_OPT_DEDUP);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/src", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/dst", FS_REGULAR), 0);
+	int src = fs_open(fs, "/src"), dst = fs_open(fs, "/dst");
+	ASSERT_GE(src, 0);
+	ASSERT_GE(dst, 0);
+	ASSERT_EQ(fs_write(fs, src, data.data(), file_size), (ssize_t)file_size);
+	ASSERT_EQ(fs_write(fs, dst, data.data(), 3000), 3000);
+
+	// 1
+	ASSERT_EQ(fs_copy_file_range(fs, src, 1234, dst, 2999, 70000), 70000);
+	ASSERT_EQ(fs_seek(fs, src, 0, FS_SEEK_CUR), (off_t)file_size);
+	ASSERT_EQ(fs_seek(fs, dst, 0, FS_SEEK_CUR), 3000);
+	ASSERT_EQ(fs_seek(fs, dst, 0, FS_SEEK_SET), 0);
+	ASSERT_EQ(fs_read(fs, dst, check.data(), file_size), 2999 + 70000);
+	ASSERT_EQ(memcmp(check.data(), data.data(), 2999), 0);
+	ASSERT_EQ(memcmp(check.data() + 2999, data.data() + 1234, 70000), 0);
+
+	// 2
+	ASSERT_EQ(fs_create(fs, "/clone", FS_REGULAR), 0);
+	int clone = fs_open(fs, "/clone");
+	ASSERT_GE(clone, 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	block_store_t *bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	size_t used = block_store_get_used_blocks(bs);
+	block_store_destroy(bs);
+	fs = fs_mount_opts(test_fname, FS_OPT_DEDUP);
+	ASSERT_NE(fs, nullptr);
+	src = fs_open(fs, "/src");
+	clone = fs_open(fs, "/clone");
+	ASSERT_EQ(fs_copy_file_range(fs, src, 0, clone, 0, file_size), (ssize_t)file_size);
+	const char patch[] = "changed";
+	ASSERT_EQ(fs_seek(fs, clone, 50 * 1024 + 10, FS_SEEK_SET), 50 * 1024 + 10);
+	ASSERT_EQ(fs_write(fs, clone, patch, sizeof(patch)), (ssize_t)sizeof(patch));
+	ASSERT_EQ(fs_seek(fs, src, 0, FS_SEEK_SET), 0);
+	ASSERT_EQ(fs_read(fs, src, check.data(), file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(check.data(), data.data(), file_size), 0);
+	ASSERT_EQ(fs_seek(fs, clone, 0, FS_SEEK_SET), 0);
+	ASSERT_EQ(fs_read(fs, clone, check.data(), file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(check.data() + 50 * 1024 + 10, patch, sizeof(patch)), 0);
+	ASSERT_EQ(memcmp(check.data(), data.data(), 50 * 1024 + 10), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	bs = block_store_open(test_fname);
+	ASSERT_NE(bs, nullptr);
+	ASSERT_LE(block_store_get_used_blocks(bs), used + 2); // Pointer block and the patched block
+	block_store_destroy(bs);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 3
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/packed", FS_REGULAR), 0);
+	ASSERT_EQ(fs_set_compressed(fs, "/packed", true), 0);
+	int packed = fs_open(fs, "/packed");
+	src = fs_open(fs, "/src");
+	ASSERT_GE(packed, 0);
+	ASSERT_EQ(fs_copy_file_range(fs, src, 0, packed, 0, file_size), (ssize_t)file_size);
+	ASSERT_EQ(fs_create(fs, "/unpacked", FS_REGULAR), 0);
+	int unpacked = fs_open(fs, "/unpacked");
+	ASSERT_GE(unpacked, 0);
+	ASSERT_EQ(fs_copy_file_range(fs, packed, 1000, unpacked, 0, file_size), (ssize_t)file_size - 1000);
+	ASSERT_EQ(fs_copy_file_range(fs, packed, file_size, unpacked, 0, 10), 0);
+	ASSERT_EQ(fs_read(fs, unpacked, check.data(), file_size), (ssize_t)file_size - 1000);
+	ASSERT_EQ(memcmp(check.data(), data.data() + 1000, file_size - 1000), 0);
+
+	// 4
+	ASSERT_LT(fs_copy_file_range(fs, src, 0, src, 4096, 8192), 0);
+	ASSERT_LT(fs_copy_file_range(fs, src, 0, unpacked, file_size, 10), 0);
+	ASSERT_LT(fs_copy_file_range(fs, src, -1, unpacked, 0, 10), 0);
+	ASSERT_LT(fs_copy_file_range(fs, src, 0, 999, 0, 10), 0);
+	ASSERT_LT(fs_copy_file_range(NULL, src, 0, unpacked, 0, 10), 0);
+	ASSERT_EQ(fs_copy_file_range(fs, src, 0, src, 4096, 4096), 4096);
+
+	// 5
+	ASSERT_EQ(fs_create(fs, "/copies", FS_REGULAR), 0);
+	int copies = fs_open(fs, "/copies");
+	ASSERT_GE(copies, 0);
+	int open_failures = 0;
+	std::atomic<bool> copying(false), opening(true);
+	std::thread opener([&]() {
+		while (!copying) {
+			std::this_thread::yield();
+		}
+		for (int round = 0; round < 20; ++round) {
+			vector<int> fds;
+			for (int i = 0; i < 200; ++i) {
+				fds.push_back(fs_open(fs, "/unpacked"));
+				open_failures += fds.back() < 0;
+			}
+			for (int fd : fds) {
+				open_failures += fs_close(fs, fd) != 0;
+			}
+		}
+		opening = false;
+	});
+	int copy_failures = 0;
+	for (int i = 0; i < 20 || opening; ++i) {
+		copying = true;
+		copy_failures += fs_copy_file_range(fs, unpacked, 0, copies, 0, 20000) != 20000;
+		copy_failures += fs_copy_file_range(fs, packed, 1000, copies, 20000, 20000) != 20000;
+	}
+	opener.join();
+	ASSERT_EQ(open_failures, 0);
+	ASSERT_EQ(copy_failures, 0);
+	ASSERT_EQ(fs_read(fs, copies, check.data(), file_size), 40000);
+	ASSERT_EQ(memcmp(check.data(), data.data() + 1000, 20000), 0);
+	ASSERT_EQ(memcmp(check.data() + 20000, data.data() + 1000, 20000), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+}
+
+/*
+   ssize_t fs_mmap(FS_t *fs, int fd, off_t offset, size_t len, const void **ptr);
+   int fs_munmap(FS_t *fs, const void *ptr, size_t len);
+   1. Normal, contiguous file gives the same direct pointer every time
+   2. Normal, fragmented ranges give private views of the right data
+   3. Normal, compressed file, range clipped at EOF, empty range past EOF
+   4. Error, bad descriptor, negative offset, NULL fs or ptr
+   5. Normal, views taken while another thread opens enough descriptors to
+      grow the table hold the right data
+ */
+TEST(k_tests, mmap) {
+	const char *test_fname = "k_tests_mmap.FS";
+	const size_t file_size = 200 * 1024;
+	vector<uint8_t> data(file_size);
+	for (size_t i = 0; i < file_size; ++i) {
+		data[i] = (uint8_t)(i * 13 + i / 1024);
+	}
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	const char *paths[3] = {"/flat", "/even", "/odd"};
+	int fds[3];
+	for (int f = 0; f < 3; ++f) {
+		ASSERT_EQ(fs_create(fs, paths[f], FS_REGULAR), 0);
+		fds[f] = fs_open(fs, paths[f]);
+		ASSERT_GE(fds[f], 0);
+	}
+	ASSERT_EQ(fs_write(fs, fds[0], data.data(), file_size), (ssize_t)file_size);
+	for (size_t off = 0; off < file_size; off += 3000) {
+		size_t n = std::min((size_t)3000, file_size - off);
+		ASSERT_EQ(fs_write(fs, fds[1], data.data() + off, n), (ssize_t)n);
+		ASSERT_EQ(fs_write(fs, fds[2], data.data() + off, n), (ssize_t)n);
+	}
+
+	// 1 (the indirect block sits before the first indirect data block)
+	const void *ptr, *again;
+	const off_t flat_off = FD_DIRECT_MAX_PTRS * 1024 + 1500;
+	ASSERT_EQ(fs_mmap(fs, fds[0], flat_off, 60 * 1024, &ptr), 60 * 1024);
+	ASSERT_EQ(fs_mmap(fs, fds[0], flat_off, 60 * 1024, &again), 60 * 1024);
+	ASSERT_EQ(ptr, again);
+	ASSERT_EQ(memcmp(ptr, data.data() + flat_off, 60 * 1024), 0);
+	ASSERT_EQ(fs_munmap(fs, ptr, 60 * 1024), 0);
+	ASSERT_EQ(fs_munmap(fs, again, 60 * 1024), 0);
+
+	// 2
+	for (int f = 0; f < 3; ++f) {
+		ASSERT_EQ(fs_mmap(fs, fds[f], 0, file_size, &ptr), (ssize_t)file_size);
+		ASSERT_EQ(memcmp(ptr, data.data(), file_size), 0);
+		ASSERT_EQ(fs_munmap(fs, ptr, file_size), 0);
+		ASSERT_EQ(fs_mmap(fs, fds[f], 777, 100 * 1024, &ptr), 100 * 1024);
+		ASSERT_EQ(memcmp(ptr, data.data() + 777, 100 * 1024), 0);
+		ASSERT_EQ(fs_munmap(fs, ptr, 100 * 1024), 0);
+	}
+
+	// 3
+	ASSERT_EQ(fs_create(fs, "/packed", FS_REGULAR), 0);
+	ASSERT_EQ(fs_set_compressed(fs, "/packed", true), 0);
+	int packed = fs_open(fs, "/packed");
+	ASSERT_GE(packed, 0);
+	ASSERT_EQ(fs_write(fs, packed, data.data(), file_size), (ssize_t)file_size);
+	ASSERT_EQ(fs_mmap(fs, packed, 5000, file_size, &ptr), (ssize_t)file_size - 5000);
+	ASSERT_EQ(memcmp(ptr, data.data() + 5000, file_size - 5000), 0);
+	ASSERT_EQ(fs_munmap(fs, ptr, file_size - 5000), 0);
+	ASSERT_EQ(fs_mmap(fs, fds[0], file_size, 10, &ptr), 0);
+	ASSERT_EQ(ptr, nullptr);
+	ASSERT_EQ(fs_munmap(fs, ptr, 0), 0);
+
+	// 4
+	ASSERT_LT(fs_mmap(fs, 999, 0, 10, &ptr), 0);
+	ASSERT_LT(fs_mmap(fs, fds[0], -1, 10, &ptr), 0);
+	ASSERT_LT(fs_mmap(NULL, fds[0], 0, 10, &ptr), 0);
+	ASSERT_LT(fs_mmap(fs, fds[0], 0, 10, NULL), 0);
+	ASSERT_LT(fs_munmap(NULL, ptr, 10), 0);
+
+	// 5
+	int open_failures = 0;
+	std::atomic<bool> mapping(false), opening(true);
+	std::thread opener([&]() {
+		while (!mapping) {
+			std::this_thread::yield();
+		}
+		for (int round = 0; round < 20; ++round) {
+			vector<int> opened;
+			for (int i = 0; i < 200; ++i) {
+				opened.push_back(fs_open(fs, "/flat"));
+				open_failures += opened.back() < 0;
+			}
+			for (int fd : opened) {
+				open_failures += fs_close(fs, fd) != 0;
+			}
+		}
+		opening = false;
+	});
+	int map_failures = 0;
+	for (int i = 0; i < 20 || opening; ++i) {
+		mapping = true;
+		if (fs_mmap(fs, fds[1], 3000, 60 * 1024, &ptr) != 60 * 1024) {
+			++map_failures;
+			continue;
+		}
+		map_failures += memcmp(ptr, data.data() + 3000, 60 * 1024) != 0;
+		map_failures += fs_munmap(fs, ptr, 60 * 1024) != 0;
+	}
+	opener.join();
+	ASSERT_EQ(open_failures, 0);
+	ASSERT_EQ(map_failures, 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   int fs_stat(FS_t *fs, const char *path, fs_stat_t *st);
+   ssize_t fs_stat_many(FS_t *fs, const char *const *paths, size_t n, fs_stat_t *out);
+   1. Normal, files and directories, sizes and block counts
+   2. Normal, batch mixing directories, missing files, and the root
+   int fs_statvfs(FS_t *fs, fs_statvfs_t *st);
+   3. Normal, compressed file holds fewer blocks than it spans
+   4. Normal, fs_statvfs free counts follow files being created
+   5. Error, missing file, file used as a directory, bad path, NULL fs
+ */
+TEST(k_tests, stat) {
+	const char *test_fname = "k_tests_stat.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	vector<uint8_t> data(40 * 1024, 'x');
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/sub", FS_DIRECTORY), 0);
+	const char *files[4] = {"/dir/empty", "/dir/small", "/dir/big", "/top"};
+	const size_t sizes[4] = {0, 100, 40 * 1024, 1025};
+	for (int f = 0; f < 4; ++f) {
+		ASSERT_EQ(fs_create(fs, files[f], FS_REGULAR), 0);
+		int fd = fs_open(fs, files[f]);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_write(fs, fd, data.data(), sizes[f]), (ssize_t)sizes[f]);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+
+	// 1
+	fs_stat_t st;
+	for (int f = 0; f < 4; ++f) {
+		ASSERT_EQ(fs_stat(fs, files[f], &st), 0);
+		ASSERT_EQ(st.type, FS_REGULAR);
+		ASSERT_EQ(st.size, sizes[f]);
+		ASSERT_EQ(st.nlink, 1u);
+		ASSERT_EQ(st.blocks, (sizes[f] + 1023) / 1024);
+	}
+	ASSERT_EQ(fs_stat(fs, "/dir/sub", &st), 0);
+	ASSERT_EQ(st.type, FS_DIRECTORY);
+	ASSERT_EQ(st.blocks, 0u);
+	ASSERT_EQ(fs_stat(fs, "/dir", &st), 0);
+	ASSERT_EQ(st.type, FS_DIRECTORY);
+	ASSERT_EQ(st.blocks, 1u);
+
+	// 2
+	const char *batch[8] = {"/dir/small", "/dir/nope", "/dir/big", "/dir/sub", "/", "/top", "/dir/empty", "/dir/"};
+	fs_stat_t out[8];
+	ASSERT_EQ(fs_stat_many(fs, batch, 8, out), 7);
+	ASSERT_EQ(out[0].size, 100u);
+	ASSERT_EQ(out[1].nlink, 0u);
+	ASSERT_EQ(out[2].size, 40u * 1024);
+	ASSERT_EQ(out[3].type, FS_DIRECTORY);
+	ASSERT_EQ(out[4].type, FS_DIRECTORY);
+	ASSERT_EQ(out[4].inum, 0u);
+	ASSERT_EQ(out[4].nlink, 1u);
+	ASSERT_EQ(out[5].size, 1025u);
+	ASSERT_EQ(out[6].size, 0u);
+	ASSERT_EQ(out[6].nlink, 1u);
+	ASSERT_EQ(out[7].inum, st.inum); // "/dir"
+	ASSERT_EQ(out[7].type, FS_DIRECTORY);
+	ASSERT_EQ(fs_stat_many(fs, batch, 0, NULL), 0);
+
+	// 3
+	ASSERT_EQ(fs_create(fs, "/packed", FS_REGULAR), 0);
+	ASSERT_EQ(fs_set_compressed(fs, "/packed", true), 0);
+	int fd = fs_open(fs, "/packed");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_stat(fs, "/packed", &st), 0);
+	ASSERT_EQ(st.size, data.size());
+	ASSERT_GT(st.blocks, 0u);
+	ASSERT_LT(st.blocks, 10u);
+
+	// 4
+	fs_statvfs_t before, after;
+	ASSERT_EQ(fs_statvfs(fs, &before), 0);
+	ASSERT_EQ(before.blocks, (size_t)BLOCK_STORE_AVAIL_BLOCKS);
+	ASSERT_LT(before.free_blocks, before.blocks);
+	ASSERT_EQ(before.inodes, (size_t)NUM_INODES);
+	ASSERT_EQ(before.free_inodes, before.inodes - 8); // The root and 7 files
+	ASSERT_EQ(fs_create(fs, "/more", FS_REGULAR), 0);
+	fd = fs_open(fs, "/more");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t)data.size());
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_statvfs(fs, &after), 0);
+	ASSERT_EQ(after.free_inodes, before.free_inodes - 1);
+	ASSERT_LE(after.free_blocks, before.free_blocks - 40);
+
+	// 5
+	ASSERT_LT(fs_statvfs(NULL, &after), 0);
+	ASSERT_LT(fs_statvfs(fs, NULL), 0);
+	ASSERT_LT(fs_stat(fs, "/missing", &st), 0);
+	ASSERT_LT(fs_stat(fs, "/top/x", &st), 0);
+	ASSERT_LT(fs_stat(fs, "relative", &st), 0);
+	ASSERT_LT(fs_stat(NULL, "/top", &st), 0);
+	ASSERT_LT(fs_stat_many(fs, NULL, 1, out), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   int fs_set_buffered(FS_t *fs, int fd, bool buffered);
+   int fs_flush(FS_t *fs, int fd);
+   1. Normal, small appends are gathered until a block fills or a flush
+   2. Normal, seek and read on the descriptor see the buffered data
+   3. Normal, large writes and turning buffering off write through, close
+      flushes
+   4. Error, bad descriptor, NULL fs; unmount flushes
+ */
+TEST(k_tests, buffered) {
+	const char *test_fname = "k_tests_buffered.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/log", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/log");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_set_buffered(fs, fd, true), 0);
+	char record[100];
+	vector<char> expected;
+
+	// 1
+	fs_stat_t st;
+	for (int i = 0; i < 10; ++i) {
+		memset(record, 'a' + i, sizeof(record));
+		ASSERT_EQ(fs_write(fs, fd, record, sizeof(record)), (ssize_t)sizeof(record));
+		expected.insert(expected.end(), record, record + sizeof(record));
+	}
+	ASSERT_EQ(fs_stat(fs, "/log", &st), 0);
+	ASSERT_EQ(st.size, 0u);
+	ASSERT_EQ(fs_write(fs, fd, record, 24), 24); // Fills the first block
+	expected.insert(expected.end(), record, record + 24);
+	ASSERT_EQ(fs_stat(fs, "/log", &st), 0);
+	ASSERT_EQ(st.size, 1024u);
+	ASSERT_EQ(fs_write(fs, fd, record, 50), 50);
+	expected.insert(expected.end(), record, record + 50);
+	ASSERT_EQ(fs_flush(fs, fd), 0);
+	ASSERT_EQ(fs_stat(fs, "/log", &st), 0);
+	ASSERT_EQ(st.size, 1074u);
+
+	// 2
+	ASSERT_EQ(fs_write(fs, fd, "tail", 4), 4);
+	expected.insert(expected.end(), "tail", "tail" + 4);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), 1078);
+	ASSERT_EQ(fs_seek(fs, fd, 500, FS_SEEK_SET), 500);
+	ASSERT_EQ(fs_write(fs, fd, "mid", 3), 3);
+	memcpy(expected.data() + 500, "mid", 3);
+	vector<char> check(2000);
+	ASSERT_EQ(fs_read(fs, fd, check.data(), 10), 10);
+	ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+	ASSERT_EQ(fs_read(fs, fd, check.data(), check.size()), (ssize_t)expected.size());
+	ASSERT_EQ(memcmp(check.data(), expected.data(), expected.size()), 0);
+
+	// 3
+	vector<char> big(3000, 'z');
+	ASSERT_EQ(fs_write(fs, fd, "x", 1), 1);
+	ASSERT_EQ(fs_write(fs, fd, big.data(), big.size()), (ssize_t)big.size());
+	expected.push_back('x');
+	expected.insert(expected.end(), big.begin(), big.end());
+	ASSERT_EQ(fs_stat(fs, "/log", &st), 0);
+	ASSERT_EQ(st.size, expected.size());
+	ASSERT_EQ(fs_write(fs, fd, "y", 1), 1);
+	expected.push_back('y');
+	ASSERT_EQ(fs_set_buffered(fs, fd, false), 0);
+	ASSERT_EQ(fs_stat(fs, "/log", &st), 0);
+	ASSERT_EQ(st.size, expected.size());
+	ASSERT_EQ(fs_set_buffered(fs, fd, true), 0);
+	ASSERT_EQ(fs_write(fs, fd, "end", 3), 3);
+	expected.insert(expected.end(), "end", "end" + 3);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/log");
+	ASSERT_GE(fd, 0);
+	check.resize(expected.size() + 10);
+	ASSERT_EQ(fs_read(fs, fd, check.data(), check.size()), (ssize_t)expected.size());
+	ASSERT_EQ(memcmp(check.data(), expected.data(), expected.size()), 0);
+
+	// 4
+	ASSERT_LT(fs_set_buffered(fs, 999, true), 0);
+	ASSERT_LT(fs_set_buffered(NULL, fd, true), 0);
+	ASSERT_LT(fs_flush(fs, 999), 0);
+	ASSERT_LT(fs_flush(NULL, fd), 0);
+	ASSERT_EQ(fs_set_buffered(fs, fd, true), 0);
+	ASSERT_EQ(fs_write(fs, fd, "unmount", 7), 7);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_stat(fs, "/log", &st), 0);
+	ASSERT_EQ(st.size, expected.size() + 7);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   int fs_open_flags(FS_t *fs, const char *path, int flags) with FS_O_APPEND
+   1. Normal, appends land at the end past other descriptors' writes
+   2. Normal, threads appending through their own descriptors keep every
+      record whole
+   3. Normal, buffered appends don't split records
+   4. Error, unknown flags, directory
+   5. Normal, appends spanning several blocks alongside small ones keep every
+      record whole, with and without checksums; fs_defrag leaves the file
+      alone while it is open for appending
+ */
+TEST(k_tests, append) {
+	const char *test_fname = "k_tests_append.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/log", FS_REGULAR), 0);
+
+	// 1
+	int plain = fs_open(fs, "/log");
+	int app[2] = {fs_open_flags(fs, "/log", FS_O_APPEND), fs_open_flags(fs, "/log", FS_O_APPEND)};
+	ASSERT_GE(plain, 0);
+	ASSERT_GE(app[0], 0);
+	ASSERT_GE(app[1], 0);
+	ASSERT_EQ(fs_write(fs, app[0], "aaaa", 4), 4);
+	ASSERT_EQ(fs_write(fs, app[1], "bb", 2), 2);
+	ASSERT_EQ(fs_write(fs, plain, "c", 1), 1); // Overwrites at its cursor
+	ASSERT_EQ(fs_write(fs, app[0], "dd", 2), 2);
+	ASSERT_EQ(fs_seek(fs, app[0], 0, FS_SEEK_CUR), 8);
+	ASSERT_EQ(fs_seek(fs, app[1], 0, FS_SEEK_SET), 0);
+	char check[16];
+	ASSERT_EQ(fs_read(fs, app[1], check, sizeof(check)), 8);
+	ASSERT_EQ(memcmp(check, "caaabbdd", 8), 0);
+	for (int fd : {plain, app[0], app[1]}) {
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+
+	// 2
+	const int n_threads = 4, n_records = 500;
+	struct record_t {
+		uint32_t thread, seq;
+		uint8_t fill[56];
+	};
+	ASSERT_EQ(fs_create(fs, "/shared", FS_REGULAR), 0);
+	for (int buffered = 0; buffered < 2; ++buffered) {
+		vector<std::thread> threads;
+		vector<int> failures(n_threads, 0);
+		for (int t = 0; t < n_threads; ++t) {
+			threads.emplace_back([&, t]() {
+				int fd = fs_open_flags(fs, "/shared", FS_O_APPEND);
+				failures[t] += fd < 0 || fs_set_buffered(fs, fd, buffered) != 0;
+				for (int i = 0; i < n_records; ++i) {
+					record_t rec;
+					rec.thread = t;
+					rec.seq = i;
+					memset(rec.fill, t * 31 + i, sizeof(rec.fill));
+					failures[t] += fs_write(fs, fd, &rec, sizeof(rec)) != (ssize_t)sizeof(rec);
+				}
+				failures[t] += fs_close(fs, fd) != 0;
+			});
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		for (int t = 0; t < n_threads; ++t) {
+			ASSERT_EQ(failures[t], 0);
+		}
+	}
+
+	// 3 (and the unbuffered run)
+	fs_stat_t st;
+	ASSERT_EQ(fs_stat(fs, "/shared", &st), 0);
+	ASSERT_EQ(st.size, 2 * n_threads * n_records * sizeof(record_t));
+	int fd = fs_open(fs, "/shared");
+	ASSERT_GE(fd, 0);
+	vector<record_t> records(2 * n_threads * n_records);
+	ASSERT_EQ(fs_read(fs, fd, records.data(), st.size), (ssize_t)st.size);
+	vector<uint32_t> next(2 * n_threads, 0);
+	for (size_t r = 0; r < records.size(); ++r) {
+		const record_t &rec = records[r];
+		ASSERT_LT(rec.thread, (uint32_t)n_threads);
+		size_t run = r < records.size() / 2 ? 0 : n_threads;
+		ASSERT_EQ(rec.seq, next[run + rec.thread]++);
+		for (uint8_t byte : rec.fill) {
+			ASSERT_EQ(byte, (uint8_t)(rec.thread * 31 + rec.seq));
+		}
+	}
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 4
+	ASSERT_LT(fs_open_flags(fs, "/log", 1 << 7), 0);
+	ASSERT_LT(fs_open_flags(fs, "/", FS_O_APPEND), 0);
+	ASSERT_LT(fs_open_flags(NULL, "/log", FS_O_APPEND), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 5
+	for (int opts : {FS_OPT_NONE, FS_OPT_CSUM}) {
+		fs = fs_format_opts(test_fname, opts);
+		ASSERT_NE(fs, nullptr);
+		ASSERT_EQ(fs_create(fs, "/mixed", FS_REGULAR), 0);
+		vector<std::thread> threads;
+		vector<int> failures(n_threads, 0);
+		for (int t = 0; t < n_threads; ++t) {
+			threads.emplace_back([&, t]() {
+				int mixed = fs_open_flags(fs, "/mixed", FS_O_APPEND);
+				failures[t] += mixed < 0;
+				for (int i = 0; i < 100; ++i) {
+					// Odd threads append 2 KiB and more, so their records hold whole blocks
+					vector<uint8_t> rec(t % 2 ? 2048 + 7 * i : 60, (uint8_t)(t * 31 + i));
+					uint32_t head[3] = {(uint32_t)t, (uint32_t)i, (uint32_t)rec.size()};
+					memcpy(rec.data(), head, sizeof(head));
+					failures[t] += fs_write(fs, mixed, rec.data(), rec.size()) != (ssize_t)rec.size();
+				}
+				failures[t] += fs_close(fs, mixed) != 0;
+			});
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		for (int t = 0; t < n_threads; ++t) {
+			ASSERT_EQ(failures[t], 0);
+		}
+
+		fd = fs_open_flags(fs, "/mixed", FS_O_APPEND);
+		ASSERT_GE(fd, 0);
+		fs_defrag_t pass = {};
+		ASSERT_EQ(fs_defrag(fs, "/mixed", 0, &pass), 0);
+		ASSERT_EQ(pass.files_moved, 0u);
+		ASSERT_EQ(fs_stat(fs, "/mixed", &st), 0);
+		vector<uint8_t> data(st.size);
+		ASSERT_EQ(fs_read(fs, fd, data.data(), st.size), (ssize_t)st.size);
+		vector<uint32_t> next_seq(n_threads, 0);
+		for (size_t off = 0; off < data.size(); ) {
+			uint32_t head[3];
+			memcpy(head, &data[off], sizeof(head));
+			ASSERT_LT(head[0], (uint32_t)n_threads);
+			ASSERT_EQ(head[1], next_seq[head[0]]++);
+			ASSERT_EQ(head[2], head[0] % 2 ? 2048 + 7 * head[1] : 60);
+			ASSERT_LE(off + head[2], data.size());
+			for (size_t b = sizeof(head); b < head[2]; ++b) {
+				ASSERT_EQ(data[off + b], (uint8_t)(head[0] * 31 + head[1]));
+			}
+			off += head[2];
+		}
+		for (int t = 0; t < n_threads; ++t) {
+			ASSERT_EQ(next_seq[t], 100u);
+		}
+		ASSERT_EQ(fs_close(fs, fd), 0);
+		ASSERT_EQ(fs_unmount(fs), 0);
+	}
+	unlink(test_fname);
+}
+
+/*
+   int fs_create_many(FS_t *fs, const char *parent, const char *const *names,
+                      const file_t *types, size_t n)
+   1. Normal, a batch into an empty directory
+   2. Normal, a second batch fills the directory, the files survive a remount
+   3. Error, a taken name, a repeated name, a bad name, no room, and nothing
+      of a failed batch is left behind
+   4. Error, bad parent, NULL arguments
+ */
+TEST(k_tests, create_many) {
+	const char *test_fname = "k_tests_create_many.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+
+	// 1
+	const char *first[4] = {"a", "b", "sub", "0123456789012345678901234567890"};
+	const file_t first_types[4] = {FS_REGULAR, FS_REGULAR, FS_DIRECTORY, FS_REGULAR};
+	ASSERT_EQ(fs_create_many(fs, "/dir", first, first_types, 4), 0);
+	fs_stat_t st;
+	ASSERT_EQ(fs_stat(fs, "/dir/a", &st), 0);
+	ASSERT_EQ(st.type, FS_REGULAR);
+	ASSERT_EQ(st.nlink, 1u);
+	ASSERT_EQ(fs_stat(fs, "/dir/sub", &st), 0);
+	ASSERT_EQ(st.type, FS_DIRECTORY);
+	ASSERT_EQ(fs_create(fs, "/dir/sub/deeper", FS_REGULAR), 0);
+	ASSERT_EQ(fs_stat(fs, "/dir/0123456789012345678901234567890", &st), 0);
+	int fd = fs_open(fs, "/dir/b");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, "hello", 5), 5);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 2
+	vector<string> more_names;
+	for (int i = 0; i < 12; ++i)
+		more_names.push_back("f" + std::to_string(i));
+	vector<const char *> more;
+	for (const string &name : more_names)
+		more.push_back(name.c_str());
+	vector<file_t> more_types(more.size(), FS_REGULAR);
+	ASSERT_EQ(fs_create_many(fs, "/dir", more.data(), more_types.data(), more.size()), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	dyn_array_t *list = fs_get_dir(fs, "/dir");
+	ASSERT_NE(list, nullptr);
+	ASSERT_EQ(dyn_array_size(list), 16u);
+	dyn_array_destroy(list);
+	ASSERT_EQ(fs_stat(fs, "/dir/b", &st), 0);
+	ASSERT_EQ(st.size, 5u);
+	ASSERT_EQ(fs_stat(fs, "/dir/f11", &st), 0);
+
+	// 3
+	ASSERT_EQ(fs_create(fs, "/other", FS_DIRECTORY), 0);
+	const char *taken[2] = {"x", "file"};
+	const char *repeated[3] = {"x", "y", "x"};
+	const char *slash[2] = {"x", "y/z"};
+	const char *empty[2] = {"x", ""};
+	const char *too_long[1] = {"01234567890123456789012345678901"};
+	const file_t types[3] = {FS_REGULAR, FS_REGULAR, FS_REGULAR};
+	ASSERT_EQ(fs_create_many(fs, "/", taken, types, 2), -1);
+	ASSERT_EQ(fs_create_many(fs, "/other", repeated, types, 3), -1);
+	ASSERT_EQ(fs_create_many(fs, "/other", slash, types, 2), -1);
+	ASSERT_EQ(fs_create_many(fs, "/other", empty, types, 2), -1);
+	ASSERT_EQ(fs_create_many(fs, "/other", too_long, types, 1), -1);
+	ASSERT_EQ(fs_create_many(fs, "/dir", repeated, types, 1), -1); // Full
+	const file_t bad_types[2] = {FS_REGULAR, (file_t)7};
+	ASSERT_EQ(fs_create_many(fs, "/other", repeated, bad_types, 2), -1);
+	ASSERT_EQ(fs_stat(fs, "/x", &st), -1);
+	ASSERT_EQ(fs_stat(fs, "/other/x", &st), -1);
+	ASSERT_EQ(fs_stat(fs, "/other", &st), 0);
+	ASSERT_EQ(st.size, 0u);
+	ASSERT_EQ(st.blocks, 0u);
+	ASSERT_EQ(fs_create_many(fs, "/other", repeated, types, 2), 0);
+	ASSERT_EQ(fs_stat(fs, "/other/y", &st), 0);
+
+	// 4
+	ASSERT_EQ(fs_create_many(fs, "/file", repeated, types, 1), -1);
+	ASSERT_EQ(fs_create_many(fs, "/nope", repeated, types, 1), -1);
+	ASSERT_EQ(fs_create_many(fs, "/other", NULL, types, 1), -1);
+	ASSERT_EQ(fs_create_many(fs, "/other", repeated, NULL, 1), -1);
+	ASSERT_EQ(fs_create_many(NULL, "/other", repeated, types, 1), -1);
+	ASSERT_EQ(fs_create_many(fs, "/other", NULL, NULL, 0), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   int fs_walk(FS_t *fs, const char *root,
+               int (*fn)(const fs_walk_entry_t *entry, void *arg), void *arg,
+               int flags, size_t n_threads)
+   1. Normal, every file of a tree is visited once with the right path, type
+      and depth, from one thread and from several
+   2. Normal, the root with FS_WALK_ROOT, metadata with FS_WALK_STAT, a
+      subtree, an empty directory
+   3. Normal, fn stops the walk
+   4. Error, a regular file, a missing root, bad flags, NULL arguments
+ */
+struct walk_seen {
+	std::mutex lock;
+	std::map<string, fs_walk_entry_t> entries;
+	std::map<string, string> names;
+	std::map<string, size_t> sizes;
+	size_t visits = 0;
+};
+
+static int walk_record(const fs_walk_entry_t *entry, void *arg) {
+	walk_seen *seen = (walk_seen *)arg;
+	std::lock_guard<std::mutex> guard(seen->lock);
+	seen->visits++;
+	seen->entries[entry->path] = *entry; // path and name only live during the call
+	seen->names[entry->path] = entry->name;
+	if (entry->stat != NULL)
+		seen->sizes[entry->path] = entry->stat->size;
+	return 0;
+}
+
+static int walk_stop(const fs_walk_entry_t *entry, void *arg) {
+	return walk_record(entry, arg) == 0 && ((walk_seen *)arg)->visits == 5 ? 7 : 0;
+}
+
+TEST(k_tests, walk) {
+	const char *test_fname = "k_tests_walk.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+
+	// Three levels of six directories, each with four files
+	std::set<string> expected;
+	vector<string> dirs = {""};
+	for (int level = 1; level <= 3; ++level) {
+		vector<string> next;
+		for (const string &dir : dirs) {
+			const char *names[10] = {"d0", "d1", "d2", "d3", "d4", "d5", "f0", "f1", "f2", "f3"};
+			file_t types[10];
+			for (int i = 0; i < 10; ++i)
+				types[i] = i < 6 && level < 3 ? FS_DIRECTORY : FS_REGULAR;
+			ASSERT_EQ(fs_create_many(fs, dir.empty() ? "/" : dir.c_str(), names, types, 10), 0);
+			for (int i = 0; i < 10; ++i) {
+				expected.insert(dir + "/" + names[i]);
+				if (types[i] == FS_DIRECTORY)
+					next.push_back(dir + "/" + names[i]);
+			}
+		}
+		dirs = next;
+	}
+	ASSERT_EQ(fs_create(fs, "/d0/empty", FS_DIRECTORY), 0);
+	expected.insert("/d0/empty");
+	int fd = fs_open(fs, "/d3/d1/f2");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, "twelve bytes", 12), 12);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 1
+	for (size_t n_threads : {1, 4, 0}) {
+		walk_seen seen;
+		ASSERT_EQ(fs_walk(fs, "/", walk_record, &seen, FS_WALK_NONE, n_threads), 0);
+		ASSERT_EQ(seen.visits, expected.size());
+		ASSERT_EQ(seen.entries.size(), expected.size());
+		for (const auto &kv : seen.entries) {
+			ASSERT_EQ(expected.count(kv.first), 1u);
+			ASSERT_EQ(kv.second.depth, (size_t)std::count(kv.first.begin(), kv.first.end(), '/'));
+			// Every level but the last has directories d0-d5
+			bool is_dir = (kv.second.depth < 3 && kv.first.find("/d", kv.first.rfind('/')) != string::npos)
+				|| kv.first.find("empty") != string::npos;
+			ASSERT_EQ(kv.second.type, is_dir ? FS_DIRECTORY : FS_REGULAR);
+			ASSERT_EQ(kv.second.stat, nullptr);
+		}
+	}
+
+	// 2
+	walk_seen seen;
+	ASSERT_EQ(fs_walk(fs, "/d3/", walk_record, &seen, FS_WALK_ROOT | FS_WALK_STAT, 3), 0);
+	ASSERT_EQ(seen.visits, 1u + 10 + 6 * 10);
+	ASSERT_EQ(seen.entries.count("/d3"), 1u);
+	ASSERT_EQ(seen.entries["/d3"].depth, 0u);
+	ASSERT_EQ(seen.entries["/d3/d1"].depth, 1u);
+	ASSERT_EQ(seen.entries["/d3/d1/f2"].depth, 2u);
+	ASSERT_EQ(seen.sizes["/d3/d1/f2"], 12u);
+	ASSERT_EQ(seen.sizes["/d3/d1/f1"], 0u);
+	walk_seen root;
+	ASSERT_EQ(fs_walk(fs, "/d0/empty", walk_record, &root, FS_WALK_ROOT, 2), 0);
+	ASSERT_EQ(root.visits, 1u);
+	walk_seen slash;
+	ASSERT_EQ(fs_walk(fs, "/", walk_record, &slash, FS_WALK_ROOT, 2), 0);
+	ASSERT_EQ(slash.visits, expected.size() + 1);
+	ASSERT_EQ(slash.names["/"], "");
+	ASSERT_EQ(slash.names["/d2/d4/f1"], "f1");
+
+	// 3
+	walk_seen stopped;
+	ASSERT_EQ(fs_walk(fs, "/", walk_stop, &stopped, FS_WALK_NONE, 4), 7);
+	ASSERT_GE(stopped.visits, 5u);
+	ASSERT_LT(stopped.visits, expected.size());
+
+	// 4
+	ASSERT_LT(fs_walk(fs, "/f0", walk_record, &seen, FS_WALK_NONE, 1), 0);
+	ASSERT_LT(fs_walk(fs, "/nope", walk_record, &seen, FS_WALK_NONE, 1), 0);
+	ASSERT_LT(fs_walk(fs, "/", walk_record, &seen, 1 << 5, 1), 0);
+	ASSERT_LT(fs_walk(fs, "/", NULL, &seen, FS_WALK_NONE, 1), 0);
+	ASSERT_LT(fs_walk(fs, NULL, walk_record, &seen, FS_WALK_NONE, 1), 0);
+	ASSERT_LT(fs_walk(NULL, "/", walk_record, &seen, FS_WALK_NONE, 1), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   int fs_opendir_handle(FS_t *fs, const char *path, fs_dirhandle_t *dir)
+   and the *at calls
+   1. Normal, create, open, stat and list relative to a deep directory
+   2. Normal, multi-component and absolute paths, a handle from a handle
+   3. Error, missing files, a file as a handle, taken names, NULL arguments
+ */
+TEST(k_tests, dirhandle) {
+	const char *test_fname = "k_tests_dirhandle.FS";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/a", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/a/b", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/a/b/c", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/a/b/c/d", FS_DIRECTORY), 0);
+
+	// 1
+	fs_dirhandle_t d;
+	ASSERT_EQ(fs_opendir_handle(fs, "/a/b/c/d", &d), 0);
+	ASSERT_EQ(fs_createat(fs, &d, "file", FS_REGULAR), 0);
+	ASSERT_EQ(fs_createat(fs, &d, "sub", FS_DIRECTORY), 0);
+	int fd = fs_openat(fs, &d, "file", FS_O_NONE);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, "relative", 8), 8);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fs_stat_t st;
+	ASSERT_EQ(fs_statat(fs, &d, "file", &st), 0);
+	ASSERT_EQ(st.size, 8u);
+	ASSERT_EQ(fs_stat(fs, "/a/b/c/d/file", &st), 0);
+	ASSERT_EQ(st.size, 8u);
+	ASSERT_EQ(fs_statat(fs, &d, "", &st), 0);
+	ASSERT_EQ(st.type, FS_DIRECTORY);
+	dyn_array_t *list = fs_get_dirat(fs, &d, "");
+	ASSERT_NE(list, nullptr);
+	ASSERT_EQ(dyn_array_size(list), 2u);
+	dyn_array_destroy(list);
+
+	// 2
+	fs_dirhandle_t b, sub;
+	ASSERT_EQ(fs_opendir_handle(fs, "/a/b/", &b), 0);
+	ASSERT_EQ(fs_createat(fs, &b, "c/d/sub/deep", FS_REGULAR), 0);
+	ASSERT_EQ(fs_statat(fs, &b, "c/d/sub/deep", &st), 0);
+	ASSERT_EQ(fs_opendir_handleat(fs, &b, "c/d/sub", &sub), 0);
+	ASSERT_EQ(fs_statat(fs, &sub, "deep", &st), 0);
+	ASSERT_EQ(fs_createat(fs, &sub, "/top", FS_REGULAR), 0);
+	ASSERT_EQ(fs_stat(fs, "/top", &st), 0);
+	ASSERT_EQ(fs_statat(fs, &sub, "/a/b/c/d/file", &st), 0);
+	ASSERT_EQ(st.size, 8u);
+	list = fs_get_dirat(fs, &sub, "/");
+	ASSERT_NE(list, nullptr);
+	ASSERT_EQ(dyn_array_size(list), 2u);
+	dyn_array_destroy(list);
+	ASSERT_EQ(fs_opendir_handleat(fs, &b, "c", &b), 0);
+	ASSERT_EQ(fs_statat(fs, &b, "d/file", &st), 0);
+
+	// 3
+	fs_dirhandle_t bad;
+	ASSERT_LT(fs_statat(fs, &d, "nope", &st), 0);
+	ASSERT_EQ(st.nlink, 0u);
+	ASSERT_LT(fs_openat(fs, &d, "nope", FS_O_NONE), 0);
+	ASSERT_LT(fs_openat(fs, &d, "sub", FS_O_NONE), 0);
+	ASSERT_LT(fs_opendir_handleat(fs, &d, "file", &bad), 0);
+	ASSERT_LT(fs_opendir_handle(fs, "/nope", &bad), 0);
+	ASSERT_LT(fs_opendir_handle(fs, "relative", &bad), 0);
+	ASSERT_LT(fs_createat(fs, &d, "file", FS_REGULAR), 0);
+	ASSERT_LT(fs_createat(fs, &d, "nope/file", FS_REGULAR), 0);
+	ASSERT_LT(fs_createat(fs, &d, "sub/", FS_REGULAR), 0);
+	ASSERT_LT(fs_createat(fs, &d, "", FS_REGULAR), 0);
+	ASSERT_EQ(fs_get_dirat(fs, &d, "file"), nullptr);
+	ASSERT_LT(fs_openat(fs, NULL, "file", FS_O_NONE), 0);
+	ASSERT_LT(fs_openat(fs, &d, NULL, FS_O_NONE), 0);
+	ASSERT_LT(fs_createat(NULL, &d, "x", FS_REGULAR), 0);
+	ASSERT_LT(fs_statat(fs, &d, "file", NULL), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+   int fs_trace_start(FS_t *fs, const char *path)
+   1. Normal, every traced call lands in order with its arguments and result
+   2. Normal, calls the FS makes to itself (a buffered flush) aren't traced,
+      and nothing is traced once stopped
+   3. Error, a second trace, stopping twice, not a trace file
+ */
+TEST(k_tests, trace) {
+	const char *test_fname = "k_tests_trace.FS";
+	const char *trace_fname = "k_tests_trace.trace";
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/before", FS_REGULAR), 0);
+
+	// 1
+	ASSERT_EQ(fs_trace_start(fs, trace_fname), 0);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/log", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/dir/log");
+	ASSERT_GE(fd, 0);
+	char data[3000] = {0};
+	ASSERT_EQ(fs_write(fs, fd, data, sizeof(data)), (ssize_t)sizeof(data));
+	ASSERT_EQ(fs_seek(fs, fd, 100, FS_SEEK_SET), 100);
+	ASSERT_EQ(fs_read(fs, fd, data, 50), 50);
+	ASSERT_EQ(fs_copy_file_range(fs, fd, 200, fd, 3000, 100), 100);
+	fs_stat_t st;
+	ASSERT_EQ(fs_stat(fs, "/dir/log", &st), 0);
+	ASSERT_LT(fs_stat(fs, "/nope", &st), 0);
+	dyn_array_t *list = fs_get_dir(fs, "/dir");
+	ASSERT_NE(list, nullptr);
+	dyn_array_destroy(list);
+
+	// 2
+	ASSERT_EQ(fs_set_buffered(fs, fd, true), 0);
+	ASSERT_EQ(fs_write(fs, fd, data, 10), 10);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_trace_stop(fs), 0);
+	ASSERT_EQ(fs_create(fs, "/after", FS_REGULAR), 0);
+
+	// 3
+	ASSERT_LT(fs_trace_stop(fs), 0);
+	ASSERT_EQ(fs_trace_start(fs, "k_tests_trace_2.trace"), 0);
+	ASSERT_LT(fs_trace_start(fs, trace_fname), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_trace_load(test_fname), nullptr);
+	ASSERT_EQ(fs_trace_load("k_tests_trace_missing.trace"), nullptr);
+	ASSERT_LT(fs_trace_start(NULL, trace_fname), 0);
+
+	// 1, 2
+	struct expect {
+		fs_trace_op_t op;
+		const char *path;
+		int64_t offset;
+		uint64_t size;
+		int32_t ret;
+	};
+	const expect expected[] = {
+		{FS_TRACE_CREATE, "/dir", 0, 0, 0},
+		{FS_TRACE_CREATE, "/dir/log", 0, 0, 0},
+		{FS_TRACE_OPEN, "/dir/log", 0, 0, fd},
+		{FS_TRACE_WRITE, "", 0, 3000, 3000},
+		{FS_TRACE_SEEK, "", 100, 0, 100},
+		{FS_TRACE_READ, "", 100, 50, 50},
+		{FS_TRACE_COPY_RANGE, "", 200, 100, 100},
+		{FS_TRACE_STAT, "/dir/log", 0, 0, 0},
+		{FS_TRACE_STAT, "/nope", 0, 0, -1},
+		{FS_TRACE_GET_DIR, "/dir", 0, 0, 1},
+		{FS_TRACE_WRITE, "", 150, 10, 10},
+		{FS_TRACE_CLOSE, "", 0, 0, 0},
+	};
+	fs_trace_t *trace = fs_trace_load(trace_fname);
+	ASSERT_NE(trace, nullptr);
+	fs_trace_rec_t rec;
+	char path[FS_TRACE_PATH_MAX + 1];
+	uint64_t last_start = 0;
+	for (const expect &e : expected) {
+		ASSERT_EQ(fs_trace_next(trace, &rec, path), 1);
+		ASSERT_EQ(rec.op, e.op);
+		ASSERT_STREQ(path, e.path);
+		ASSERT_EQ(rec.ret, e.ret);
+		if (e.op == FS_TRACE_READ || e.op == FS_TRACE_WRITE || e.op == FS_TRACE_SEEK || e.op == FS_TRACE_COPY_RANGE) {
+			ASSERT_EQ(rec.fd, fd);
+			ASSERT_EQ(rec.offset, e.offset);
+			ASSERT_EQ(rec.size, e.size);
+		}
+		if (e.op == FS_TRACE_COPY_RANGE) {
+			ASSERT_EQ(rec.fd_out, fd);
+			ASSERT_EQ(rec.offset_out, 3000);
+		}
+		ASSERT_GE(rec.start_ns, last_start);
+		last_start = rec.start_ns;
+	}
+	ASSERT_EQ(fs_trace_next(trace, &rec, path), 0);
+	ASSERT_EQ(fs_trace_close(trace), 0);
+}
+
+/*
+   ssize_t fs_serialize(FS_t *fs, const char *image)
+   FS_t *fs_deserialize(const char *image, const char *path, int opts)
+   1. Normal, an image of a near empty volume holds little more than its
+      allocated blocks, and restores to an empty volume that keeps checksums
+      only if the source or the mount asks for them
+   2. Normal, files (buffered data included) round trip and read back
+   3. Normal, shared blocks stay shared, writing to one copies it
+   4. Error, bad arguments, not an image, a cut short image
+ */
+TEST(k_tests, serialize) {
+	const char *test_fname = "k_tests_serialize.FS";
+	const char *image_fname = "k_tests_serialize.img";
+	const char *restored_fname = "k_tests_serialize_2.FS";
+	const size_t file_size = 40 * 1024;
+	uint8_t data[file_size], check[file_size];
+	for (size_t i = 0; i < file_size; ++i) {
+		data[i] = (uint8_t)(i * 7 + i / 1024);
+	}
+
+	// 1
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ssize_t empty_size = fs_serialize(fs, image_fname);
+	ASSERT_GT(empty_size, 0);
+	ASSERT_LT(empty_size, 64 * 1024);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_deserialize(image_fname, restored_fname, FS_OPT_VERIFY_META);
+	ASSERT_NE(fs, nullptr);
+	dyn_array_t *list = fs_get_dir(fs, "/");
+	ASSERT_NE(list, nullptr);
+	ASSERT_EQ(dyn_array_size(list), 0u);
+	dyn_array_destroy(list);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	block_store_t *bs = block_store_open(restored_fname);
+	ASSERT_NE(bs, nullptr);
+	ASSERT_TRUE(block_store_has_csums(bs));
+	block_store_destroy(bs);
+	fs = fs_deserialize(image_fname, restored_fname, FS_OPT_NONE);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	bs = block_store_open(restored_fname);
+	ASSERT_NE(bs, nullptr);
+	ASSERT_FALSE(block_store_has_csums(bs));
+	block_store_destroy(bs);
+
+	// 2
+	fs = fs_format_opts(test_fname, FS_OPT_DEDUP);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	const char *paths[2] = {"/dir/a", "/b"};
+	for (int f = 0; f < 2; ++f) {
+		ASSERT_EQ(fs_create(fs, paths[f], FS_REGULAR), 0);
+		int fd = fs_open(fs, paths[f]);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_write(fs, fd, data, file_size), (ssize_t)file_size);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	ASSERT_EQ(fs_create(fs, "/buffered", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/buffered");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_set_buffered(fs, fd, true), 0);
+	ASSERT_EQ(fs_write(fs, fd, "pending", 7), 7);
+	ssize_t image_size = fs_serialize(fs, image_fname);
+	ASSERT_GT(image_size, empty_size + (ssize_t)file_size);
+	ASSERT_LT(image_size, empty_size + (ssize_t)file_size + 16 * 1024); // The second file is shared
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	fs = fs_deserialize(image_fname, restored_fname, FS_OPT_DEDUP | FS_OPT_VERIFY);
+	ASSERT_NE(fs, nullptr);
+	for (int f = 0; f < 2; ++f) {
+		fd = fs_open(fs, paths[f]);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_read(fs, fd, check, file_size), (ssize_t)file_size);
+		ASSERT_EQ(memcmp(check, data, file_size), 0);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	}
+	fd = fs_open(fs, "/buffered");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, sizeof(check)), 7);
+	ASSERT_EQ(memcmp(check, "pending", 7), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+
+	// 3
+	fd = fs_open(fs, "/b");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, "changed", 7), 7);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/dir/a");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(fs, fd, check, file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(check, data, file_size), 0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(restored_fname, false), 0);
+
+	// 4
+	ASSERT_LT(fs_serialize(NULL, image_fname), 0);
+	ASSERT_EQ(fs_deserialize(NULL, restored_fname, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_deserialize(image_fname, NULL, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_deserialize("k_tests_serialize_missing.img", restored_fname, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_deserialize(test_fname, restored_fname, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(truncate(image_fname, image_size - 100), 0);
+	ASSERT_EQ(fs_deserialize(image_fname, restored_fname, FS_OPT_NONE), nullptr);
+	remove(image_fname);
+}
+
+/*
+   ssize_t fs_export_delta(FS_t *fs, const char *delta)
+   int fs_apply_delta(const char *delta, const char *path)
+   1. Normal, the first delta brings a freshly formatted copy up to date
+   2. Normal, a later delta holds just the changed blocks, tracking survives
+      a mount without the option
+   3. Normal, a delta with no changes holds no blocks
+   4. Error, untracked FS, bad arguments, a delta isn't a full image, a cut
+      short delta leaves the copy as it was
+ */
+TEST(k_tests, delta) {
+	const char *test_fname = "k_tests_delta.FS";
+	const char *copy_fname = "k_tests_delta_copy.FS";
+	const char *delta_fname = "k_tests_delta.img";
+	const size_t file_size = 64 * 1024;
+	uint8_t data[file_size], check[file_size];
+	for (size_t i = 0; i < file_size; ++i) {
+		data[i] = (uint8_t)(i * 13 + i / 1024);
+	}
+
+	// 1
+	FS *fs = fs_format_opts(test_fname, FS_OPT_TRACK_DIRTY);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/big", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/small", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/dir/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data, file_size), (ssize_t)file_size);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/small");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_set_buffered(fs, fd, true), 0);
+	ASSERT_EQ(fs_write(fs, fd, "pending", 7), 7);
+	ssize_t first_size = fs_export_delta(fs, delta_fname);
+	ASSERT_GT(first_size, (ssize_t)file_size);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	FS *copy = fs_format(copy_fname);
+	ASSERT_NE(copy, nullptr);
+	ASSERT_EQ(fs_unmount(copy), 0);
+	ASSERT_EQ(fs_apply_delta(delta_fname, copy_fname), 0);
+	copy = fs_mount_opts(copy_fname, FS_OPT_VERIFY);
+	ASSERT_NE(copy, nullptr);
+	fd = fs_open(copy, "/dir/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(copy, fd, check, file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(check, data, file_size), 0);
+	ASSERT_EQ(fs_close(copy, fd), 0);
+	fd = fs_open(copy, "/small");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(copy, fd, check, file_size), 7);
+	ASSERT_EQ(memcmp(check, "pending", 7), 0);
+	ASSERT_EQ(fs_close(copy, fd), 0);
+	ASSERT_EQ(fs_unmount(copy), 0);
+
+	// 2
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	fd = fs_open(fs, "/dir/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_seek(fs, fd, 30 * 1024, FS_SEEK_SET), 30 * 1024);
+	ASSERT_EQ(fs_write(fs, fd, "changed", 7), 7);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	memcpy(data + 30 * 1024, "changed", 7);
+	ssize_t delta_size = fs_export_delta(fs, delta_fname);
+	ASSERT_GT(delta_size, 0);
+	ASSERT_LT(delta_size, first_size - (ssize_t)file_size + 4 * 1024);
+	ssize_t second_size = delta_size;
+
+	// 3
+	delta_size = fs_export_delta(fs, "k_tests_delta_empty.img");
+	ASSERT_GT(delta_size, 0);
+	ASSERT_LT(delta_size, second_size - 1024);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_apply_delta("k_tests_delta_empty.img", copy_fname), 0);
+
+	ASSERT_EQ(fs_apply_delta(delta_fname, copy_fname), 0);
+	copy = fs_mount_opts(copy_fname, FS_OPT_VERIFY);
+	ASSERT_NE(copy, nullptr);
+	fd = fs_open(copy, "/dir/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(copy, fd, check, file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(check, data, file_size), 0);
+	ASSERT_EQ(fs_close(copy, fd), 0);
+	ASSERT_EQ(fs_unmount(copy), 0);
+	ASSERT_EQ(fs_check(copy_fname, false), 0);
+
+	// 4
+	fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_LT(fs_export_delta(fs, delta_fname), 0);
+	ASSERT_LT(fs_export_delta(NULL, delta_fname), 0);
+	ASSERT_LT(fs_export_delta(fs, NULL), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_LT(fs_apply_delta(NULL, copy_fname), 0);
+	ASSERT_LT(fs_apply_delta(delta_fname, NULL), 0);
+	ASSERT_LT(fs_apply_delta("k_tests_delta_missing.img", copy_fname), 0);
+	ASSERT_LT(fs_apply_delta(delta_fname, "k_tests_delta_missing.FS"), 0);
+	ASSERT_LT(fs_apply_delta(test_fname, copy_fname), 0);
+	ASSERT_EQ(fs_deserialize(delta_fname, "k_tests_delta_2.FS", FS_OPT_NONE), nullptr);
+	struct stat st;
+	ASSERT_NE(stat("k_tests_delta_2.FS", &st), 0);
+	ASSERT_EQ(truncate(delta_fname, second_size - 100), 0);
+	ASSERT_LT(fs_apply_delta(delta_fname, copy_fname), 0);
+	copy = fs_mount(copy_fname);
+	ASSERT_NE(copy, nullptr);
+	fd = fs_open(copy, "/dir/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_read(copy, fd, check, file_size), (ssize_t)file_size);
+	ASSERT_EQ(memcmp(check, data, file_size), 0);
+	ASSERT_EQ(fs_close(copy, fd), 0);
+	ASSERT_EQ(fs_unmount(copy), 0);
+	remove(delta_fname);
+	remove("k_tests_delta_empty.img");
+}
+
+/*
+   int fs_defrag(FS_t *fs, const char *path, size_t budget, fs_defrag_t *pass)
+   1. Normal, interleaved files (out to double indirect blocks, a compressed
+      one) end up contiguous, read back and check out
+   2. Normal, a small budget spreads a pass over several calls, which keep
+      the pass's files; fs_defrag_cancel ends a pass early
+   3. Normal, a single file or a directory's files, shared blocks stay put
+      and moved ones stay shareable
+   4. Error, bad arguments, a missing path
+   5. Normal, a file with a view from fs_mmap out stays put and the view
+      holds, it moves once the view is released
+ */
+TEST(k_tests, defrag) {
+	const char *test_fname = "k_tests_defrag.FS";
+	const size_t n_files = 3;
+	const char *paths[n_files] = {"/big", "/dir/small", "/dir/packed"};
+	const size_t sizes[n_files] = {600 * 1024, 40 * 1024 + 300, 50 * 1024};
+	vector<vector<uint8_t>> data(n_files);
+	for (size_t f = 0; f < n_files; ++f) {
+		data[f].resize(sizes[f]);
+		for (size_t i = 0; i < sizes[f]; ++i) {
+			data[f][i] = f == 2 ? (uint8_t)(i / 4096) : (uint8_t)(i * 7 + f * 31 + i / 1024);
+		}
+		// No two blocks alike, so dedup shares nothing but the twin's
+		for (size_t i = 0; f != 2 && i + 4 <= sizes[f]; i += 1024) {
+			uint32_t tag = (uint32_t)(i / 1024 + (f << 24));
+			memcpy(&data[f][i], &tag, sizeof(tag));
+		}
+	}
+	auto write_interleaved = [&](FS *fs) {
+		int fds[n_files];
+		for (size_t f = 0; f < n_files; ++f) {
+			ASSERT_EQ(fs_create(fs, paths[f], FS_REGULAR), 0);
+			if (f == 2) {
+				ASSERT_EQ(fs_set_compressed(fs, paths[f], true), 0);
+			}
+			fds[f] = fs_open(fs, paths[f]);
+			ASSERT_GE(fds[f], 0);
+		}
+		for (size_t off = 0; off < sizes[0]; off += 1024) {
+			for (size_t f = 0; f < n_files; ++f) {
+				if (off < sizes[f]) {
+					size_t len = std::min((size_t)1024, sizes[f] - off);
+					ASSERT_EQ(fs_write(fs, fds[f], data[f].data() + off, len), (ssize_t)len);
+				}
+			}
+		}
+		for (size_t f = 0; f < n_files; ++f) {
+			ASSERT_EQ(fs_close(fs, fds[f]), 0);
+		}
+	};
+	auto check_files = [&](FS *fs) {
+		vector<uint8_t> check(sizes[0]);
+		for (size_t f = 0; f < n_files; ++f) {
+			int fd = fs_open(fs, paths[f]);
+			ASSERT_GE(fd, 0);
+			ASSERT_EQ(fs_read(fs, fd, check.data(), sizes[0]), (ssize_t)sizes[f]);
+			ASSERT_EQ(memcmp(check.data(), data[f].data(), sizes[f]), 0);
+			ASSERT_EQ(fs_close(fs, fd), 0);
+		}
+	};
+
+	// 1
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	write_interleaved(fs);
+	fs_defrag_t pass = {};
+	ASSERT_EQ(fs_defrag(fs, NULL, 0, &pass), 0);
+	ASSERT_GT(pass.score_before, 0.1); // The tail of /big was written alone
+	ASSERT_EQ(pass.score_after, 0.0);
+	ASSERT_EQ(pass.files_moved, n_files);
+	ASSERT_GT(pass.blocks_moved, 600u + 40u);
+	ASSERT_EQ(pass.next_inum, 0u);
+	check_files(fs);
+	ASSERT_EQ(fs_defrag(fs, NULL, 0, &pass), 0);
+	ASSERT_EQ(pass.score_before, 0.0);
+	ASSERT_EQ(pass.files_moved, 0u);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 2
+	fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	write_interleaved(fs);
+	pass = {};
+	ASSERT_EQ(fs_defrag(fs, NULL, 1, &pass), 1);
+	ASSERT_EQ(pass.n_inums, n_files);
+	fs_defrag_cancel(&pass);
+	ASSERT_EQ(pass.inums, nullptr);
+	ASSERT_EQ(pass.next_inum, 0u);
+	ASSERT_EQ(pass.files_moved, 1u);
+	fs_defrag_cancel(NULL);
+	pass = {};
+	int calls = 0, ret;
+	while ((ret = fs_defrag(fs, NULL, 1, &pass)) == 1) {
+		ASSERT_NE(pass.next_inum, 0u);
+		ASSERT_EQ(pass.n_inums, n_files); // Not the file created mid-pass
+		if (calls++ == 0) {
+			ASSERT_EQ(fs_create(fs, "/late", FS_REGULAR), 0);
+		}
+	}
+	ASSERT_EQ(ret, 0);
+	ASSERT_EQ(calls, (int)n_files - 2); // The cancelled pass moved the first
+	ASSERT_EQ(pass.files_moved, n_files - 1);
+	ASSERT_EQ(pass.score_after, 0.0);
+	ASSERT_EQ(pass.inums, nullptr);
+	check_files(fs);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 3
+	fs = fs_format_opts(test_fname, FS_OPT_DEDUP);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/twin", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/dir/twin");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data[1].data(), 8 * 1024), 8 * 1024);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	write_interleaved(fs);
+	pass = {};
+	ASSERT_EQ(fs_defrag(fs, "/big", 0, &pass), 0);
+	ASSERT_EQ(pass.files_moved, 1u);
+	ASSERT_EQ(pass.score_after, 0.0);
+	fs_statvfs_t before, after;
+	ASSERT_EQ(fs_create(fs, "/copy", FS_REGULAR), 0);
+	ASSERT_EQ(fs_statvfs(fs, &before), 0);
+	fd = fs_open(fs, "/copy");
+	ASSERT_GE(fd, 0);
+	const size_t copy_size = FD_DIRECT_MAX_PTRS * BLOCK_SIZE_BYTES; // No pointer blocks
+	ASSERT_EQ(fs_write(fs, fd, data[0].data(), copy_size), (ssize_t)copy_size);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	ASSERT_EQ(fs_statvfs(fs, &after), 0);
+	ASSERT_EQ(after.free_blocks, before.free_blocks); // Shares the moved blocks
+	pass = {};
+	ASSERT_EQ(fs_defrag(fs, "/dir", 0, &pass), 0);
+	ASSERT_GT(pass.score_before, 0.5);
+	ASSERT_GT(pass.score_after, 0.0); // Around the blocks shared with the twin
+	ASSERT_LT(pass.score_after, 0.2);
+	check_files(fs);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 4
+	fs = fs_mount(test_fname);
+	ASSERT_NE(fs, nullptr);
+	pass = {};
+	ASSERT_LT(fs_defrag(NULL, NULL, 0, &pass), 0);
+	ASSERT_LT(fs_defrag(fs, NULL, 0, NULL), 0);
+	ASSERT_LT(fs_defrag(fs, "/nope", 0, &pass), 0);
+	ASSERT_LT(fs_defrag(fs, "relative", 0, &pass), 0);
+	ASSERT_EQ(fs_unmount(fs), 0);
+
+	// 5
+	fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	write_interleaved(fs);
+	fd = fs_open(fs, "/big");
+	ASSERT_GE(fd, 0);
+	const void *view;
+	ASSERT_EQ(fs_mmap(fs, fd, 0, 100 * 1024, &view), 100 * 1024);
+	pass = {};
+	ASSERT_EQ(fs_defrag(fs, NULL, 0, &pass), 0);
+	ASSERT_EQ(pass.files_moved, n_files - 1);
+	ASSERT_GT(pass.score_after, 0.0);
+	ASSERT_EQ(memcmp(view, data[0].data(), 100 * 1024), 0);
+	ASSERT_EQ(fs_munmap(fs, view, 100 * 1024), 0);
+	pass = {};
+	ASSERT_EQ(fs_defrag(fs, NULL, 0, &pass), 0);
+	ASSERT_EQ(pass.files_moved, 1u);
+	ASSERT_EQ(pass.score_after, 0.0);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	check_files(fs);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+}
+
+/*
+   FS_t *fs_format_striped(const char *const *paths, size_t n_paths, size_t chunk_blocks, int opts)
+   FS_t *fs_mount_striped(const char *const *paths, size_t n_paths, int opts)
+   1. Normal, a large write lands in every stripe and reads back
+   2. Normal, the volume remounts (verified) and serializes to a single file
+      volume holding the same files
+   3. Error, bad geometry, stripes out of order, missing or from another
+      volume, a stripe mounted as a single file volume
+ */
+TEST(k_tests, stripe) {
+	const char *stripes[4] = {"k_tests_stripe_0.FS", "k_tests_stripe_1.FS", "k_tests_stripe_2.FS", "k_tests_stripe_3.FS"};
+	const char *others[4] = {"k_tests_stripe_4.FS", "k_tests_stripe_5.FS", "k_tests_stripe_6.FS", "k_tests_stripe_7.FS"};
+	const char *image_fname = "k_tests_stripe.img";
+	const char *restored_fname = "k_tests_stripe_restored.FS";
+	const size_t file_size = 1024 * 1024;
+	std::vector<uint8_t> data(file_size), check(file_size);
+	for (size_t i = 0; i < file_size; ++i) {
+		data[i] = (uint8_t)(i * 13 + i / 4096);
+	}
+	auto check_files = [&](FS *fs) {
+		int fd = fs_open(fs, "/dir/big");
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_read(fs, fd, check.data(), file_size), (ssize_t)file_size);
+		ASSERT_EQ(memcmp(check.data(), data.data(), file_size), 0);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+		fd = fs_open(fs, "/small");
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_read(fs, fd, check.data(), file_size), 5);
+		ASSERT_EQ(memcmp(check.data(), "small", 5), 0);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	};
+
+	// 1
+	FS *fs = fs_format_striped(stripes, 4, 16, FS_OPT_NONE);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+	ASSERT_EQ(fs_create(fs, "/dir/big", FS_REGULAR), 0);
+	ASSERT_EQ(fs_create(fs, "/small", FS_REGULAR), 0);
+	int fd = fs_open(fs, "/dir/big");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, data.data(), file_size), (ssize_t)file_size);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	fd = fs_open(fs, "/small");
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(fs_write(fs, fd, "small", 5), 5);
+	ASSERT_EQ(fs_close(fs, fd), 0);
+	check_files(fs);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	for (int i = 0; i < 4; ++i) {
+		struct stat st;
+		ASSERT_EQ(stat(stripes[i], &st), 0);
+		ASSERT_LT(st.st_size, 32 * 1024 * 1024); // A quarter of the volume and a header, the tables on the first
+		ASSERT_GE((size_t)st.st_blocks * 512, file_size / 4);
+	}
+
+	// 2
+	fs = fs_mount_striped(stripes, 4, FS_OPT_VERIFY);
+	ASSERT_NE(fs, nullptr);
+	check_files(fs);
+	ASSERT_GT(fs_serialize(fs, image_fname), (ssize_t)file_size);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_deserialize(image_fname, restored_fname, FS_OPT_VERIFY);
+	ASSERT_NE(fs, nullptr);
+	check_files(fs);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(restored_fname, false), 0);
+
+	// 3
+	ASSERT_EQ(fs_format_striped(NULL, 4, 16, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_format_striped(others, 3, 16, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_format_striped(others, 16, 16, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_format_striped(others, 4, 12, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_format_striped(others, 4, 1, FS_OPT_NONE), nullptr); // Less than a page
+	const char *swapped[4] = {stripes[1], stripes[0], stripes[2], stripes[3]};
+	ASSERT_EQ(fs_mount_striped(swapped, 4, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_mount_striped(stripes, 2, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_mount_striped(stripes, 4, FS_OPT_CHECK), nullptr);
+	fs = fs_format_striped(others, 4, 16, FS_OPT_NONE);
+	ASSERT_NE(fs, nullptr);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	const char *mixed[4] = {stripes[0], others[1], stripes[2], stripes[3]};
+	ASSERT_EQ(fs_mount_striped(mixed, 4, FS_OPT_NONE), nullptr);
+	ASSERT_EQ(fs_mount(stripes[0]), nullptr);
+	fs = fs_mount_striped(stripes, 4, FS_OPT_NONE);
+	ASSERT_NE(fs, nullptr);
+	check_files(fs);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	for (int i = 0; i < 4; ++i) {
+		unlink(others[i]);
+	}
+}
+
+/*
+   Block pointer formats (consts.h), 16-bit by default, 32-bit with FS_OPT_WIDE
+   1. Normal, a file reaching into the double indirect blocks reads back after
+      a remount and the volume checks out
+   2. Normal, a wide volume starts with just the fixed metadata blocks, the
+      same file and files past block 65536 read back after a remount and the
+      volume checks out
+   3. Error, a volume file the size of neither format doesn't mount
+ */
+TEST(k_tests, block_ptrs) {
+	const char *test_fname = "k_tests_block_ptrs.FS";
+	const char *wide_fname = "k_tests_block_ptrs_wide.FS";
+	const char *other_fname = "k_tests_block_ptrs_other.FS";
+	// Tag every block so misplaced blocks show
+	auto fill = [](vector<uint8_t> &buf, uint32_t file) {
+		for (size_t i = 0; i < buf.size(); i += 1024) {
+			uint32_t tag = file << 24 | (uint32_t)(i / 1024);
+			memcpy(&buf[i], &tag, sizeof(tag));
+			memset(&buf[i + sizeof(tag)], (uint8_t)(file * 31 + i / 1024), std::min<size_t>(1024, buf.size() - i) - sizeof(tag));
+		}
+	};
+	const size_t big_size = FD_INDIRECT_MAX_OFF + 8 * 1024 + 100;
+	vector<uint8_t> data(big_size), check(big_size);
+	fill(data, 1);
+	auto write_file = [](FS *fs, const char *path, const vector<uint8_t> &buf) {
+		ASSERT_EQ(fs_create(fs, path, FS_REGULAR), 0);
+		int fd = fs_open(fs, path);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_write(fs, fd, buf.data(), buf.size()), (ssize_t)buf.size());
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	};
+	auto check_file = [](FS *fs, const char *path, const vector<uint8_t> &buf) {
+		vector<uint8_t> back(buf.size());
+		int fd = fs_open(fs, path);
+		ASSERT_GE(fd, 0);
+		ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t)back.size());
+		ASSERT_EQ(memcmp(back.data(), buf.data(), buf.size()), 0);
+		ASSERT_EQ(fs_close(fs, fd), 0);
+	};
+
+	// 1
+	FS *fs = fs_format(test_fname);
+	ASSERT_NE(fs, nullptr);
+	write_file(fs, "/big", data);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount_opts(test_fname, FS_OPT_VERIFY);
+	ASSERT_NE(fs, nullptr);
+	check_file(fs, "/big", data);
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(test_fname, false), 0);
+
+	// 2
+	fs = fs_format_opts(wide_fname, FS_OPT_WIDE);
+	ASSERT_NE(fs, nullptr);
+	fs_statvfs_t st;
+	ASSERT_EQ(fs_statvfs(fs, &st), 0);
+	ASSERT_EQ(st.blocks, (size_t)BLOCK_STORE_WIDE_AVAIL_BLOCKS);
+	ASSERT_EQ(st.free_blocks, (size_t)BLOCK_STORE_WIDE_AVAIL_BLOCKS - FS_META_BLOCKS);
+	write_file(fs, "/big", data);
+	const size_t part_size = 30 * 1024 * 1024;
+	vector<uint8_t> part(part_size);
+	const char *parts[3] = {"/part0", "/part1", "/part2"};
+	for (uint32_t f = 0; f < 3; ++f) {
+		fill(part, 2 + f);
+		write_file(fs, parts[f], part);
+	}
+	ASSERT_EQ(fs_unmount(fs), 0);
+	fs = fs_mount(wide_fname);
+	ASSERT_NE(fs, nullptr);
+	check_file(fs, "/big", data);
+	for (uint32_t f = 0; f < 3; ++f) {
+		fill(part, 2 + f);
+		check_file(fs, parts[f], part);
+	}
+	ASSERT_EQ(fs_unmount(fs), 0);
+	ASSERT_EQ(fs_check(wide_fname, false), 0);
+
+	// 3
+	FILE *other = fopen(other_fname, "w");
+	ASSERT_NE(other, nullptr);
+	fclose(other);
+	ASSERT_EQ(truncate(other_fname, (off_t)100 * 1024 * 1024), 0);
+	ASSERT_EQ(fs_mount(other_fname), nullptr);
+	unlink(other_fname);
+	unlink(wide_fname);
+	unlink(test_fname);
+}
+
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
 	::testing::AddGlobalTestEnvironment(new GradeEnvironment);